@@ -0,0 +1,444 @@
+#include "ColorSpace.hpp"
+
+/* One thread per 2x2 block, i.e. per chroma sample: each UV pair is read once and luma once */
+template <RgbLayout LAYOUT>
+__global__ void Nv12ToRgbKernel(const uint8_t *pY, const uint8_t *pUV, int nSrcPitch, uint8_t *pDst, int nDstPitch,
+                                int nWidth, int nHeight, YuvToRgbCoeff c)
+{
+    int x = (threadIdx.x + blockIdx.x * blockDim.x) * 2;
+    int y = (threadIdx.y + blockIdx.y * blockDim.y) * 2;
+    if (x >= nWidth || y >= nHeight) {
+        return;
+    }
+
+    const uint8_t *pChroma = pUV + (size_t)(y / 2) * nSrcPitch + x;
+    int u = pChroma[0] - 128;
+    int v = pChroma[1] - 128;
+
+    size_t nPlane = (size_t)nDstPitch * nHeight;
+    for (int dy = 0; dy < 2 && y + dy < nHeight; dy++) {
+        const uint8_t *pLuma = pY + (size_t)(y + dy) * nSrcPitch;
+        uint8_t *pRow = pDst + (size_t)(y + dy) * nDstPitch;
+        for (int dx = 0; dx < 2 && x + dx < nWidth; dx++) {
+            uint8_t r, g, b;
+            YuvToRgbPixel(c, pLuma[x + dx], u, v, r, g, b);
+            StoreRgbPixel<uint8_t>(pRow, nPlane, LAYOUT, x + dx, r, g, b, 0xff);
+        }
+    }
+}
+
+void Nv12ToRgb(const uint8_t *dpY, const uint8_t *dpUV, int nSrcPitch, uint8_t *dpDst, int nDstPitch,
+               int nWidth, int nHeight, RgbLayout eLayout, const YuvToRgbCoeff &coeff, CUstream stream)
+{
+    dim3 block(32, 2);
+    dim3 grid((nWidth + 63) / 64, (nHeight + 3) / 4);
+    cudaStream_t s = (cudaStream_t)stream;
+    switch (eLayout) {
+    case RGB_PLANAR:
+        Nv12ToRgbKernel<RGB_PLANAR><<<grid, block, 0, s>>>(dpY, dpUV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, coeff);
+        break;
+    case BGR_PLANAR:
+        Nv12ToRgbKernel<BGR_PLANAR><<<grid, block, 0, s>>>(dpY, dpUV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, coeff);
+        break;
+    case RGB_INTERLEAVED:
+        Nv12ToRgbKernel<RGB_INTERLEAVED><<<grid, block, 0, s>>>(dpY, dpUV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, coeff);
+        break;
+    case BGR_INTERLEAVED:
+        Nv12ToRgbKernel<BGR_INTERLEAVED><<<grid, block, 0, s>>>(dpY, dpUV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, coeff);
+        break;
+    default:
+        // 4-channel layouts go through YuvToRgb()
+        YuvToRgb(YUV_NV12, dpY, dpUV, NULL, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, eLayout, RGB_8U, coeff, stream);
+        break;
+    }
+}
+
+/* One thread per 2x2 block: four luma samples and the chroma pair they share */
+template <typename T>
+__global__ void Nv12ToI420Kernel(const uint8_t *pY, const uint8_t *pUV, int nSrcPitch, uint8_t *pDst, int nDstPitch,
+                                 int nWidth, int nHeight)
+{
+    int x = (threadIdx.x + blockIdx.x * blockDim.x) * 2;
+    int y = (threadIdx.y + blockIdx.y * blockDim.y) * 2;
+    if (x >= nWidth || y >= nHeight) {
+        return;
+    }
+
+    int nChromaPitch = nDstPitch / 2;
+    uint8_t *pU = pDst + (size_t)nDstPitch * nHeight;
+    uint8_t *pV = pU + (size_t)nChromaPitch * ((nHeight + 1) / 2);
+    const T *pChroma = (const T *)(pUV + (size_t)(y / 2) * nSrcPitch) + x;
+    ((T *)(pU + (size_t)(y / 2) * nChromaPitch))[x / 2] = pChroma[0];
+    ((T *)(pV + (size_t)(y / 2) * nChromaPitch))[x / 2] = pChroma[1];
+
+    for (int dy = 0; dy < 2 && y + dy < nHeight; dy++) {
+        const T *pSrc = (const T *)(pY + (size_t)(y + dy) * nSrcPitch);
+        T *pRow = (T *)(pDst + (size_t)(y + dy) * nDstPitch);
+        pRow[x] = pSrc[x];
+        if (x + 1 < nWidth) {
+            pRow[x + 1] = pSrc[x + 1];
+        }
+    }
+}
+
+void Nv12ToI420(const uint8_t *dpY, const uint8_t *dpUV, int nSrcPitch, uint8_t *dpDst, int nDstPitch,
+                int nWidth, int nHeight, int nBPP, CUstream stream)
+{
+    dim3 block(32, 2);
+    dim3 grid((nWidth + 63) / 64, (nHeight + 3) / 4);
+    cudaStream_t s = (cudaStream_t)stream;
+    if (nBPP == 2) {
+        Nv12ToI420Kernel<uint16_t><<<grid, block, 0, s>>>(dpY, dpUV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight);
+    } else {
+        Nv12ToI420Kernel<uint8_t><<<grid, block, 0, s>>>(dpY, dpUV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight);
+    }
+}
+
+/* One thread per destination pixel of one plane, all CHANNELS interleaved samples of it */
+template <typename T, int CHANNELS>
+__global__ void ResizePlaneKernel(const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+                                  uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight)
+{
+    int x = threadIdx.x + blockIdx.x * blockDim.x;
+    int y = threadIdx.y + blockIdx.y * blockDim.y;
+    if (x >= nDstWidth || y >= nDstHeight) {
+        return;
+    }
+
+    int x0, x1, wx, y0, y1, wy;
+    ResizeTap(x, nSrcWidth, nDstWidth, x0, x1, wx);
+    ResizeTap(y, nSrcHeight, nDstHeight, y0, y1, wy);
+    const uint8_t *pRow0 = pSrc + (size_t)y0 * nSrcPitch;
+    const uint8_t *pRow1 = pSrc + (size_t)y1 * nSrcPitch;
+    T *pRow = (T *)(pDst + (size_t)y * nDstPitch);
+    for (int c = 0; c < CHANNELS; c++) {
+        pRow[x * CHANNELS + c] = ResizeSample<T>(pRow0, pRow1, CHANNELS, c, x0, x1, wx, wy);
+    }
+}
+
+template <typename T, int CHANNELS>
+static void LaunchResizePlane(const uint8_t *dpSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+                              uint8_t *dpDst, int nDstPitch, int nDstWidth, int nDstHeight, cudaStream_t s)
+{
+    dim3 block(32, 8);
+    dim3 grid((nDstWidth + 31) / 32, (nDstHeight + 7) / 8);
+    ResizePlaneKernel<T, CHANNELS><<<grid, block, 0, s>>>(dpSrc, nSrcPitch, nSrcWidth, nSrcHeight,
+                                                          dpDst, nDstPitch, nDstWidth, nDstHeight);
+}
+
+void ResizeYuv(YuvFormat eFormat, const uint8_t *dpY, const uint8_t *dpU, const uint8_t *dpV, int nSrcPitch,
+               int nSrcWidth, int nSrcHeight, uint8_t *dpDst, int nDstPitch, int nDstWidth, int nDstHeight,
+               CUstream stream)
+{
+    cudaStream_t s = (cudaStream_t)stream;
+    uint8_t *dpDstU = dpDst + (size_t)nDstPitch * nDstHeight;
+    switch (eFormat) {
+    case YUV_NV12:
+        LaunchResizePlane<uint8_t, 1>(dpY, nSrcPitch, nSrcWidth, nSrcHeight, dpDst, nDstPitch, nDstWidth, nDstHeight, s);
+        LaunchResizePlane<uint8_t, 2>(dpU, nSrcPitch, (nSrcWidth + 1) / 2, (nSrcHeight + 1) / 2,
+                                      dpDstU, nDstPitch, (nDstWidth + 1) / 2, (nDstHeight + 1) / 2, s);
+        break;
+    case YUV_P016:
+        LaunchResizePlane<uint16_t, 1>(dpY, nSrcPitch, nSrcWidth, nSrcHeight, dpDst, nDstPitch, nDstWidth, nDstHeight, s);
+        LaunchResizePlane<uint16_t, 2>(dpU, nSrcPitch, (nSrcWidth + 1) / 2, (nSrcHeight + 1) / 2,
+                                       dpDstU, nDstPitch, (nDstWidth + 1) / 2, (nDstHeight + 1) / 2, s);
+        break;
+    case YUV_444:
+    case YUV_444P16: {
+        const uint8_t *apSrc[3] = { dpY, dpU, dpV };
+        for (int i = 0; i < 3; i++) {
+            uint8_t *dpPlane = dpDst + (size_t)nDstPitch * nDstHeight * i;
+            if (eFormat == YUV_444) {
+                LaunchResizePlane<uint8_t, 1>(apSrc[i], nSrcPitch, nSrcWidth, nSrcHeight,
+                                              dpPlane, nDstPitch, nDstWidth, nDstHeight, s);
+            } else {
+                LaunchResizePlane<uint16_t, 1>(apSrc[i], nSrcPitch, nSrcWidth, nSrcHeight,
+                                               dpPlane, nDstPitch, nDstWidth, nDstHeight, s);
+            }
+        }
+        break;
+    }
+    }
+}
+
+/* One thread per destination pixel */
+template <typename T, int CHANNELS>
+__global__ void Downsample2xKernel(const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+                                   uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight)
+{
+    int x = threadIdx.x + blockIdx.x * blockDim.x;
+    int y = threadIdx.y + blockIdx.y * blockDim.y;
+    if (x >= nDstWidth || y >= nDstHeight) {
+        return;
+    }
+
+    T *pRow = (T *)(pDst + (size_t)y * nDstPitch);
+    for (int c = 0; c < CHANNELS; c++) {
+        pRow[x * CHANNELS + c] = BoxSample2x<T>(pSrc, nSrcPitch, nSrcWidth, nSrcHeight, CHANNELS, c, x, y);
+    }
+}
+
+template <typename T>
+static void LaunchDownsample2x(const uint8_t *dpSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, uint8_t *dpDst,
+                               int nDstPitch, int nDstWidth, int nDstHeight, int nChannels, cudaStream_t s)
+{
+    dim3 block(32, 8);
+    dim3 grid((nDstWidth + 31) / 32, (nDstHeight + 7) / 8);
+    switch (nChannels) {
+    case 1:
+        Downsample2xKernel<T, 1><<<grid, block, 0, s>>>(dpSrc, nSrcPitch, nSrcWidth, nSrcHeight,
+                                                        dpDst, nDstPitch, nDstWidth, nDstHeight);
+        break;
+    case 2:
+        Downsample2xKernel<T, 2><<<grid, block, 0, s>>>(dpSrc, nSrcPitch, nSrcWidth, nSrcHeight,
+                                                        dpDst, nDstPitch, nDstWidth, nDstHeight);
+        break;
+    default:
+        Downsample2xKernel<T, 3><<<grid, block, 0, s>>>(dpSrc, nSrcPitch, nSrcWidth, nSrcHeight,
+                                                        dpDst, nDstPitch, nDstWidth, nDstHeight);
+        break;
+    }
+}
+
+void Downsample2x(const uint8_t *dpSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, uint8_t *dpDst, int nDstPitch,
+                  int nDstWidth, int nDstHeight, int nChannels, int nSampleBytes, CUstream stream)
+{
+    cudaStream_t s = (cudaStream_t)stream;
+    if (nSampleBytes == 2) {
+        LaunchDownsample2x<uint16_t>(dpSrc, nSrcPitch, nSrcWidth, nSrcHeight, dpDst, nDstPitch, nDstWidth, nDstHeight,
+                                     nChannels, s);
+    } else {
+        LaunchDownsample2x<uint8_t>(dpSrc, nSrcPitch, nSrcWidth, nSrcHeight, dpDst, nDstPitch, nDstWidth, nDstHeight,
+                                    nChannels, s);
+    }
+}
+
+/* One thread per 2x2 block. The layout is uniform across the grid, so branching on it costs nothing */
+template <YuvFormat FMT, RgbDepth DEPTH>
+__global__ void YuvToRgbKernel(const uint8_t *pY, const uint8_t *pU, const uint8_t *pV, int nSrcPitch,
+                               uint8_t *pDst, int nDstPitch, int nWidth, int nHeight, RgbLayout eLayout,
+                               YuvToRgbCoeff c)
+{
+    int x = (threadIdx.x + blockIdx.x * blockDim.x) * 2;
+    int y = (threadIdx.y + blockIdx.y * blockDim.y) * 2;
+    if (x >= nWidth || y >= nHeight) {
+        return;
+    }
+
+    size_t nPlane = (size_t)nDstPitch * nHeight;
+    for (int dy = 0; dy < 2 && y + dy < nHeight; dy++) {
+        uint8_t *pRow = pDst + (size_t)(y + dy) * nDstPitch;
+        for (int dx = 0; dx < 2 && x + dx < nWidth; dx++) {
+            int luma, u, v, r, g, b;
+            LoadYuv(FMT, pY, pU, pV, nSrcPitch, x + dx, y + dy, luma, u, v);
+            YuvToRgbPixel(c, luma, u, v, RgbShift(FMT, DEPTH), RgbMax(FMT, DEPTH), r, g, b);
+            if (DEPTH == RGB_8U) {
+                StoreRgbPixel<uint8_t>(pRow, nPlane, eLayout, x + dx, r, g, b, RgbAlpha(DEPTH));
+            } else {
+                StoreRgbPixel<uint16_t>(pRow, nPlane, eLayout, x + dx, RgbSample(r, FMT, DEPTH),
+                                        RgbSample(g, FMT, DEPTH), RgbSample(b, FMT, DEPTH), RgbAlpha(DEPTH));
+            }
+        }
+    }
+}
+
+template <YuvFormat FMT>
+static void LaunchYuvToRgb(const uint8_t *dpY, const uint8_t *dpU, const uint8_t *dpV, int nSrcPitch,
+                           uint8_t *dpDst, int nDstPitch, int nWidth, int nHeight, RgbLayout eLayout,
+                           RgbDepth eDepth, const YuvToRgbCoeff &coeff, cudaStream_t s)
+{
+    dim3 block(32, 2);
+    dim3 grid((nWidth + 63) / 64, (nHeight + 3) / 4);
+    switch (eDepth) {
+    case RGB_8U:
+        YuvToRgbKernel<FMT, RGB_8U><<<grid, block, 0, s>>>(dpY, dpU, dpV, nSrcPitch, dpDst, nDstPitch,
+                                                           nWidth, nHeight, eLayout, coeff);
+        break;
+    case RGB_16U:
+        YuvToRgbKernel<FMT, RGB_16U><<<grid, block, 0, s>>>(dpY, dpU, dpV, nSrcPitch, dpDst, nDstPitch,
+                                                            nWidth, nHeight, eLayout, coeff);
+        break;
+    case RGB_16F:
+        YuvToRgbKernel<FMT, RGB_16F><<<grid, block, 0, s>>>(dpY, dpU, dpV, nSrcPitch, dpDst, nDstPitch,
+                                                            nWidth, nHeight, eLayout, coeff);
+        break;
+    }
+}
+
+void YuvToRgb(YuvFormat eFormat, const uint8_t *dpY, const uint8_t *dpU, const uint8_t *dpV, int nSrcPitch,
+              uint8_t *dpDst, int nDstPitch, int nWidth, int nHeight, RgbLayout eLayout, RgbDepth eDepth,
+              const YuvToRgbCoeff &coeff, CUstream stream)
+{
+    if (eFormat == YUV_NV12 && eDepth == RGB_8U && RgbChannels(eLayout) == 3) {
+        Nv12ToRgb(dpY, dpU, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, eLayout, coeff, stream);
+        return;
+    }
+    cudaStream_t s = (cudaStream_t)stream;
+    switch (eFormat) {
+    case YUV_NV12:
+        LaunchYuvToRgb<YUV_NV12>(dpY, dpU, dpV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, eLayout, eDepth, coeff, s);
+        break;
+    case YUV_P016:
+        LaunchYuvToRgb<YUV_P016>(dpY, dpU, dpV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, eLayout, eDepth, coeff, s);
+        break;
+    case YUV_444:
+        LaunchYuvToRgb<YUV_444>(dpY, dpU, dpV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, eLayout, eDepth, coeff, s);
+        break;
+    case YUV_444P16:
+        LaunchYuvToRgb<YUV_444P16>(dpY, dpU, dpV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, eLayout, eDepth, coeff,
+                                   s);
+        break;
+    }
+}
+
+/* Channel order and sample type of the packed pixel types */
+template <class COLOR> struct ColorTraits;
+template <> struct ColorTraits<BGRA32> {
+    static const RgbLayout ePacked = BGRA_INTERLEAVED, ePlanar = BGR_PLANAR;
+    static const RgbDepth eDepth = RGB_8U;
+};
+template <> struct ColorTraits<RGBA32> {
+    static const RgbLayout ePacked = RGBA_INTERLEAVED, ePlanar = RGB_PLANAR;
+    static const RgbDepth eDepth = RGB_8U;
+};
+template <> struct ColorTraits<BGRA64> {
+    static const RgbLayout ePacked = BGRA_INTERLEAVED, ePlanar = BGR_PLANAR;
+    static const RgbDepth eDepth = RGB_16U;
+};
+template <> struct ColorTraits<RGBA64> {
+    static const RgbLayout ePacked = RGBA_INTERLEAVED, ePlanar = RGB_PLANAR;
+    static const RgbDepth eDepth = RGB_16U;
+};
+
+/* The FFmpegDemuxer.hpp conversions: contiguous surfaces of nHeight rows per plane, limited range,
+*  on the default stream.
+*/
+static void SurfaceToColor(YuvFormat eFormat, uint8_t *dpSrc, int nSrcPitch, uint8_t *dpDst, int nDstPitch,
+                           int nWidth, int nHeight, RgbLayout eLayout, RgbDepth eDepth, int iMatrix)
+{
+    uint8_t *dpU = dpSrc + (size_t)nSrcPitch * nHeight;
+    uint8_t *dpV = dpU + (size_t)nSrcPitch * nHeight;
+    YuvToRgbCoeff coeff = GetYuvToRgbCoeff(iMatrix, false, IsYuv16(eFormat) ? 16 : 8);
+    YuvToRgb(eFormat, dpSrc, dpU, dpV, nSrcPitch, dpDst, nDstPitch, nWidth, nHeight, eLayout, eDepth, coeff);
+}
+
+template <class COLOR32>
+void Nv12ToColor32(uint8_t *dpNv12, int nNv12Pitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                   int iMatrix)
+{
+    SurfaceToColor(YUV_NV12, dpNv12, nNv12Pitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePacked, ColorTraits<COLOR32>::eDepth, iMatrix);
+}
+
+template <class COLOR64>
+void Nv12ToColor64(uint8_t *dpNv12, int nNv12Pitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                   int iMatrix)
+{
+    SurfaceToColor(YUV_NV12, dpNv12, nNv12Pitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR64>::ePacked, ColorTraits<COLOR64>::eDepth, iMatrix);
+}
+
+template <class COLOR32>
+void P016ToColor32(uint8_t *dpP016, int nP016Pitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                   int iMatrix)
+{
+    SurfaceToColor(YUV_P016, dpP016, nP016Pitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePacked, ColorTraits<COLOR32>::eDepth, iMatrix);
+}
+
+template <class COLOR64>
+void P016ToColor64(uint8_t *dpP016, int nP016Pitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                   int iMatrix)
+{
+    SurfaceToColor(YUV_P016, dpP016, nP016Pitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR64>::ePacked, ColorTraits<COLOR64>::eDepth, iMatrix);
+}
+
+template <class COLOR32>
+void YUV444ToColor32(uint8_t *dpYUV444, int nPitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                     int iMatrix)
+{
+    SurfaceToColor(YUV_444, dpYUV444, nPitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePacked, ColorTraits<COLOR32>::eDepth, iMatrix);
+}
+
+template <class COLOR64>
+void YUV444ToColor64(uint8_t *dpYUV444, int nPitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                     int iMatrix)
+{
+    SurfaceToColor(YUV_444, dpYUV444, nPitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR64>::ePacked, ColorTraits<COLOR64>::eDepth, iMatrix);
+}
+
+template <class COLOR32>
+void YUV444P16ToColor32(uint8_t *dpYUV444, int nPitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                        int iMatrix)
+{
+    SurfaceToColor(YUV_444P16, dpYUV444, nPitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePacked, ColorTraits<COLOR32>::eDepth, iMatrix);
+}
+
+template <class COLOR64>
+void YUV444P16ToColor64(uint8_t *dpYUV444, int nPitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
+                        int iMatrix)
+{
+    SurfaceToColor(YUV_444P16, dpYUV444, nPitch, dpBgra, nBgraPitch, nWidth, nHeight,
+                   ColorTraits<COLOR64>::ePacked, ColorTraits<COLOR64>::eDepth, iMatrix);
+}
+
+template <class COLOR32>
+void Nv12ToColorPlanar(uint8_t *dpNv12, int nNv12Pitch, uint8_t *dpBgrp, int nBgrpPitch, int nWidth, int nHeight,
+                       int iMatrix)
+{
+    SurfaceToColor(YUV_NV12, dpNv12, nNv12Pitch, dpBgrp, nBgrpPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePlanar, RGB_8U, iMatrix);
+}
+
+template <class COLOR32>
+void P016ToColorPlanar(uint8_t *dpP016, int nP016Pitch, uint8_t *dpBgrp, int nBgrpPitch, int nWidth, int nHeight,
+                       int iMatrix)
+{
+    SurfaceToColor(YUV_P016, dpP016, nP016Pitch, dpBgrp, nBgrpPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePlanar, RGB_8U, iMatrix);
+}
+
+template <class COLOR32>
+void YUV444ToColorPlanar(uint8_t *dpYUV444, int nPitch, uint8_t *dpBgrp, int nBgrpPitch, int nWidth, int nHeight,
+                         int iMatrix)
+{
+    SurfaceToColor(YUV_444, dpYUV444, nPitch, dpBgrp, nBgrpPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePlanar, RGB_8U, iMatrix);
+}
+
+template <class COLOR32>
+void YUV444P16ToColorPlanar(uint8_t *dpYUV444, int nPitch, uint8_t *dpBgrp, int nBgrpPitch, int nWidth, int nHeight,
+                            int iMatrix)
+{
+    SurfaceToColor(YUV_444P16, dpYUV444, nPitch, dpBgrp, nBgrpPitch, nWidth, nHeight,
+                   ColorTraits<COLOR32>::ePlanar, RGB_8U, iMatrix);
+}
+
+template void Nv12ToColor32<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void Nv12ToColor32<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void Nv12ToColor64<BGRA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void Nv12ToColor64<RGBA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void P016ToColor32<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void P016ToColor32<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void P016ToColor64<BGRA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void P016ToColor64<RGBA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444ToColor32<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444ToColor32<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444ToColor64<BGRA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444ToColor64<RGBA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444P16ToColor32<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444P16ToColor32<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444P16ToColor64<BGRA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444P16ToColor64<RGBA64>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void Nv12ToColorPlanar<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void Nv12ToColorPlanar<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void P016ToColorPlanar<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void P016ToColorPlanar<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444ToColorPlanar<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444ToColorPlanar<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444P16ToColorPlanar<BGRA32>(uint8_t *, int, uint8_t *, int, int, int, int);
+template void YUV444P16ToColorPlanar<RGBA32>(uint8_t *, int, uint8_t *, int, int, int, int);
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <cuda.h>
+
+#ifdef __CUDACC__
+#define COLOR_HOST_DEVICE __host__ __device__
+#else
+#define COLOR_HOST_DEVICE
+#endif
+
+// iMatrix values, as in the matrix_coefficients of the bitstream VUI
+typedef enum ColorSpaceStandard {
+    ColorSpaceStandard_BT709       = 1,
+    ColorSpaceStandard_Unspecified = 2,
+    ColorSpaceStandard_Reserved    = 3,
+    ColorSpaceStandard_FCC         = 4,
+    ColorSpaceStandard_BT470       = 5,
+    ColorSpaceStandard_BT601       = 6,
+    ColorSpaceStandard_SMPTE240M   = 7,
+    ColorSpaceStandard_YCgCo       = 8,
+    ColorSpaceStandard_BT2020      = 9,
+    ColorSpaceStandard_BT2020C     = 10
+} ColorSpaceStandard;
+
+typedef enum RgbLayout {
+    RGB_PLANAR       = 0, // R, G and B planes of nHeight rows each, nDstPitch apart
+    BGR_PLANAR       = 1,
+    RGB_INTERLEAVED  = 2, // RGBRGB..., 3 samples per pixel
+    BGR_INTERLEAVED  = 3,
+    RGBA_INTERLEAVED = 4, // 4 samples per pixel, alpha is opaque
+    BGRA_INTERLEAVED = 5,
+} RgbLayout;
+
+// decoded surface layouts, as cudaVideoSurfaceFormat
+typedef enum YuvFormat {
+    YUV_NV12   = 0, // Y plane, interleaved UV plane of half height
+    YUV_P016   = 1, // NV12 with 16-bit samples, 10/12-bit data in the high bits
+    YUV_444    = 2, // Y, U and V planes
+    YUV_444P16 = 3,
+} YuvFormat;
+
+// RGB sample type
+typedef enum RgbDepth {
+    RGB_8U  = 0,
+    RGB_16U = 1,
+    RGB_16F = 2, // IEEE half, 0.0 .. 1.0
+} RgbDepth;
+
+/**
+* @brief Packed pixel types of the *ToColor32/64 and *ToColorPlanar templates declared in FFmpegDemuxer.hpp
+*/
+union BGRA32 {
+    uint32_t d;
+    struct { uint8_t b, g, r, a; } c;
+};
+
+union RGBA32 {
+    uint32_t d;
+    struct { uint8_t r, g, b, a; } c;
+};
+
+union BGRA64 {
+    uint64_t d;
+    struct { uint16_t b, g, r, a; } c;
+};
+
+union RGBA64 {
+    uint64_t d;
+    struct { uint16_t r, g, b, a; } c;
+};
+
+// fractional bits of the fixed-point YUV -> RGB coefficients
+#define YUV2RGB_SHIFT 13
+
+/**
+* @brief Fixed-point YUV -> RGB matrix. GPU kernels and CPU code evaluate the same integer expressions
+* with it, which is what makes their output bit-identical.
+*/
+struct YuvToRgbCoeff {
+    int yOffset;    // 16 for limited range (16 << 8 for 16-bit samples), 0 for full range
+    int cy;         // luma gain
+    int crv;        // R += crv * (V - 128)
+    int cgu, cgv;   // G -= cgu * (U - 128) + cgv * (V - 128)
+    int cbu;        // B += cbu * (U - 128)
+};
+
+/**
+*   @brief  Coefficients for matrix iMatrix (ColorSpaceStandard, anything unknown is BT.601) and range.
+*   nBitDepth 16 gives coefficients for 16-bit samples that map onto 0..65535.
+*/
+YuvToRgbCoeff GetYuvToRgbCoeff(int iMatrix, bool bFullRange, int nBitDepth = 8);
+
+COLOR_HOST_DEVICE inline uint8_t ClampToU8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* One pixel; u and v are already centered on 0 */
+COLOR_HOST_DEVICE inline void YuvToRgbPixel(const YuvToRgbCoeff &c, int y, int u, int v,
+                                            uint8_t &r, uint8_t &g, uint8_t &b)
+{
+    const int round = 1 << (YUV2RGB_SHIFT - 1);
+    int l = c.cy * (y - c.yOffset) + round;
+    r = ClampToU8((l + c.crv * v) >> YUV2RGB_SHIFT);
+    g = ClampToU8((l - c.cgu * u - c.cgv * v) >> YUV2RGB_SHIFT);
+    b = ClampToU8((l + c.cbu * u) >> YUV2RGB_SHIFT);
+}
+
+/* Any input depth: channels with nShift fractional bits dropped, clamped to [0, nMax] */
+COLOR_HOST_DEVICE inline void YuvToRgbPixel(const YuvToRgbCoeff &c, int y, int u, int v, int nShift, int nMax,
+                                            int &r, int &g, int &b)
+{
+    int l = c.cy * (y - c.yOffset) + (1 << (nShift - 1));
+    r = (l + c.crv * v) >> nShift;
+    g = (l - c.cgu * u - c.cgv * v) >> nShift;
+    b = (l + c.cbu * u) >> nShift;
+    r = r < 0 ? 0 : (r > nMax ? nMax : r);
+    g = g < 0 ? 0 : (g > nMax ? nMax : g);
+    b = b < 0 ? 0 : (b > nMax ? nMax : b);
+}
+
+COLOR_HOST_DEVICE inline bool IsYuv16(YuvFormat eFormat)
+{
+    return eFormat == YUV_P016 || eFormat == YUV_444P16;
+}
+
+COLOR_HOST_DEVICE inline int RgbChannels(RgbLayout eLayout)
+{
+    return eLayout >= RGBA_INTERLEAVED ? 4 : 3;
+}
+
+COLOR_HOST_DEVICE inline int RgbSampleSize(RgbDepth eDepth)
+{
+    return eDepth == RGB_8U ? 1 : 2;
+}
+
+/* 16-bit input is converted at 16-bit scale and only reduced for 8-bit output; 8-bit input at 8-bit scale */
+COLOR_HOST_DEVICE inline int RgbShift(YuvFormat eFormat, RgbDepth eDepth)
+{
+    return IsYuv16(eFormat) && eDepth == RGB_8U ? YUV2RGB_SHIFT + 8 : YUV2RGB_SHIFT;
+}
+
+COLOR_HOST_DEVICE inline int RgbMax(YuvFormat eFormat, RgbDepth eDepth)
+{
+    return IsYuv16(eFormat) && eDepth != RGB_8U ? 65535 : 255;
+}
+
+/* IEEE half of v / 65535, rounded to nearest even */
+COLOR_HOST_DEVICE inline uint16_t U16ToHalf(int v)
+{
+    float f = v * (1.0f / 65535.0f);
+    if (f < 6.103515625e-05f) {
+        // subnormal half, in units of 2^-24
+        return (uint16_t)rintf(f * 16777216.0f);
+    }
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t h = ((((x >> 23) & 0xff) - 127 + 15) << 10) | ((x & 0x7fffff) >> 13);
+    uint32_t rem = x & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+        h++;
+    }
+    return (uint16_t)h;
+}
+
+/* Output sample from a YuvToRgbPixel() channel: 8-bit results are widened for 16-bit output */
+COLOR_HOST_DEVICE inline int RgbSample(int v, YuvFormat eFormat, RgbDepth eDepth)
+{
+    if (eDepth != RGB_8U && !IsYuv16(eFormat)) {
+        v *= 257;
+    }
+    return eDepth == RGB_16F ? U16ToHalf(v) : v;
+}
+
+COLOR_HOST_DEVICE inline int RgbAlpha(RgbDepth eDepth)
+{
+    return eDepth == RGB_8U ? 0xff : (eDepth == RGB_16U ? 0xffff : 0x3c00);
+}
+
+/* Samples of pixel (x, y), chroma centered on 0. pV is unused for the semi-planar formats */
+COLOR_HOST_DEVICE inline void LoadYuv(YuvFormat eFormat, const uint8_t *pY, const uint8_t *pU, const uint8_t *pV,
+                                      int nPitch, int x, int y, int &luma, int &u, int &v)
+{
+    size_t nRow = (size_t)y * nPitch;
+    switch (eFormat) {
+    case YUV_NV12:
+        luma = pY[nRow + x];
+        u = pU[(size_t)(y / 2) * nPitch + (x & ~1)] - 128;
+        v = pU[(size_t)(y / 2) * nPitch + (x & ~1) + 1] - 128;
+        break;
+    case YUV_P016:
+        luma = ((const uint16_t *)(pY + nRow))[x];
+        u = ((const uint16_t *)(pU + (size_t)(y / 2) * nPitch))[x & ~1] - 32768;
+        v = ((const uint16_t *)(pU + (size_t)(y / 2) * nPitch))[(x & ~1) + 1] - 32768;
+        break;
+    case YUV_444:
+        luma = pY[nRow + x];
+        u = pU[nRow + x] - 128;
+        v = pV[nRow + x] - 128;
+        break;
+    case YUV_444P16:
+        luma = ((const uint16_t *)(pY + nRow))[x];
+        u = ((const uint16_t *)(pU + nRow))[x] - 32768;
+        v = ((const uint16_t *)(pV + nRow))[x] - 32768;
+        break;
+    }
+}
+
+/* Bilinear taps of destination sample i: source samples i0 and i1, and the weight of i1 in 1/256.
+*  Sample centers are aligned and edges clamped. Integer only, so GPU and CPU resize alike.
+*/
+COLOR_HOST_DEVICE inline void ResizeTap(int i, int nSrc, int nDst, int &i0, int &i1, int &w)
+{
+    int f = (int)(((int64_t)(2 * i + 1) * nSrc * 128) / nDst) - 128;
+    f = f < 0 ? 0 : (f > (nSrc - 1) * 256 ? (nSrc - 1) * 256 : f);
+    i0 = f >> 8;
+    i1 = i0 + 1 < nSrc ? i0 + 1 : i0;
+    w = f & 0xff;
+}
+
+/* Channel c of one destination pixel from rows pRow0/pRow1 of nChannels interleaved T samples.
+*  Both passes stay in uint32: 65535 * 256 * 256 plus rounding still fits.
+*/
+template <typename T>
+COLOR_HOST_DEVICE inline T ResizeSample(const uint8_t *pRow0, const uint8_t *pRow1, int nChannels, int c,
+                                        int x0, int x1, int wx, int wy)
+{
+    const T *p0 = (const T *)pRow0;
+    const T *p1 = (const T *)pRow1;
+    uint32_t t = p0[x0 * nChannels + c] * (uint32_t)(256 - wx) + p0[x1 * nChannels + c] * (uint32_t)wx;
+    uint32_t b = p1[x0 * nChannels + c] * (uint32_t)(256 - wx) + p1[x1 * nChannels + c] * (uint32_t)wx;
+    return (T)((t * (uint32_t)(256 - wy) + b * (uint32_t)wy + (1u << 15)) >> 16);
+}
+
+/* Channel c of 2x2 box pixel x, y from a plane of nChannels interleaved T samples, nSrcWidth x nSrcHeight.
+*  Odd edges repeat the last column or row.
+*/
+template <typename T>
+COLOR_HOST_DEVICE inline T BoxSample2x(const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+                                       int nChannels, int c, int x, int y)
+{
+    int x0 = 2 * x < nSrcWidth ? 2 * x : nSrcWidth - 1;
+    int x1 = x0 + 1 < nSrcWidth ? x0 + 1 : x0;
+    int y0 = 2 * y < nSrcHeight ? 2 * y : nSrcHeight - 1;
+    int y1 = y0 + 1 < nSrcHeight ? y0 + 1 : y0;
+    const T *p0 = (const T *)(pSrc + (size_t)y0 * nSrcPitch);
+    const T *p1 = (const T *)(pSrc + (size_t)y1 * nSrcPitch);
+    uint32_t s = (uint32_t)p0[x0 * nChannels + c] + p0[x1 * nChannels + c] + p1[x0 * nChannels + c] +
+                 p1[x1 * nChannels + c];
+    return (T)((s + 2) >> 2);
+}
+
+/* One output pixel; T is uint8_t for RGB_8U, uint16_t otherwise. Planes of planar layouts are nPlane bytes apart */
+template <typename T>
+COLOR_HOST_DEVICE inline void StoreRgbPixel(uint8_t *pRow, size_t nPlane, RgbLayout eLayout, int x,
+                                            int r, int g, int b, int a)
+{
+    T *p = (T *)pRow;
+    size_t n = nPlane / sizeof(T);
+    switch (eLayout) {
+    case RGB_PLANAR:
+        p[x] = r; p[x + n] = g; p[x + 2 * n] = b;
+        break;
+    case BGR_PLANAR:
+        p[x] = b; p[x + n] = g; p[x + 2 * n] = r;
+        break;
+    case RGB_INTERLEAVED:
+        p[3 * x] = r; p[3 * x + 1] = g; p[3 * x + 2] = b;
+        break;
+    case BGR_INTERLEAVED:
+        p[3 * x] = b; p[3 * x + 1] = g; p[3 * x + 2] = r;
+        break;
+    case RGBA_INTERLEAVED:
+        p[4 * x] = r; p[4 * x + 1] = g; p[4 * x + 2] = b; p[4 * x + 3] = a;
+        break;
+    case BGRA_INTERLEAVED:
+        p[4 * x] = b; p[4 * x + 1] = g; p[4 * x + 2] = r; p[4 * x + 3] = a;
+        break;
+    }
+}
+
+/**
+*   @brief  Fused NV12 -> RGB/BGR in one pass from the decoded surface into the destination layout.
+*   dpY/dpUV are the luma and interleaved chroma planes, both nSrcPitch wide. Runs on stream.
+*/
+void Nv12ToRgb(const uint8_t *dpY, const uint8_t *dpUV, int nSrcPitch, uint8_t *dpDst, int nDstPitch,
+               int nWidth, int nHeight, RgbLayout eLayout, const YuvToRgbCoeff &coeff, CUstream stream = 0);
+
+/**
+*   @brief  CPU twin of Nv12ToRgb(), SIMD where available; output is bit-identical to the GPU kernel
+*/
+void Nv12ToRgbCpu(const uint8_t *pY, const uint8_t *pUV, int nSrcPitch, uint8_t *pDst, int nDstPitch,
+                  int nWidth, int nHeight, RgbLayout eLayout, const YuvToRgbCoeff &coeff);
+
+/**
+*   @brief  Any decoded surface -> RGB of any layout and depth in one pass. pU is the interleaved UV plane
+*   of NV12/P016, pV the V plane of the 4:4:4 formats. All planes are nSrcPitch wide; nDstPitch is in bytes.
+*   NV12 to 8-bit 3-channel output takes the Nv12ToRgb() path.
+*/
+void YuvToRgb(YuvFormat eFormat, const uint8_t *dpY, const uint8_t *dpU, const uint8_t *dpV, int nSrcPitch,
+              uint8_t *dpDst, int nDstPitch, int nWidth, int nHeight, RgbLayout eLayout, RgbDepth eDepth,
+              const YuvToRgbCoeff &coeff, CUstream stream = 0);
+
+/**
+*   @brief  CPU twin of YuvToRgb(), SIMD where available; output is bit-identical to the GPU kernel
+*/
+void YuvToRgbCpu(YuvFormat eFormat, const uint8_t *pY, const uint8_t *pU, const uint8_t *pV, int nSrcPitch,
+                 uint8_t *pDst, int nDstPitch, int nWidth, int nHeight, RgbLayout eLayout, RgbDepth eDepth,
+                 const YuvToRgbCoeff &coeff);
+
+/**
+*   @brief  Bilinear resize of a decoded surface (or a crop of one) into the same layout: dpDst gets
+*   nDstHeight luma rows of nDstPitch bytes, then the chroma at nDstPitch * nDstHeight, i.e. the
+*   interleaved UV plane of (nDstHeight + 1) / 2 rows for NV12/P016, or the U and V planes of nDstHeight
+*   rows each for the 4:4:4 formats. 4:2:0 chroma is resized by its own plane size. Runs on stream.
+*/
+void ResizeYuv(YuvFormat eFormat, const uint8_t *dpY, const uint8_t *dpU, const uint8_t *dpV, int nSrcPitch,
+               int nSrcWidth, int nSrcHeight, uint8_t *dpDst, int nDstPitch, int nDstWidth, int nDstHeight,
+               CUstream stream = 0);
+
+/**
+*   @brief  CPU twin of ResizeYuv(); output is bit-identical to the GPU kernel
+*/
+void ResizeYuvCpu(YuvFormat eFormat, const uint8_t *pY, const uint8_t *pU, const uint8_t *pV, int nSrcPitch,
+                  int nSrcWidth, int nSrcHeight, uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight);
+
+/**
+*   @brief  One pyramid step: 2x2 box filter of a plane of nChannels (1..3) interleaved samples of
+*   nSampleBytes (1 or 2, unsigned integer) into nDstWidth x nDstHeight, normally half the source rounded
+*   up. Runs on stream.
+*/
+void Downsample2x(const uint8_t *dpSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, uint8_t *dpDst, int nDstPitch,
+                  int nDstWidth, int nDstHeight, int nChannels, int nSampleBytes, CUstream stream = 0);
+
+/**
+*   @brief  CPU twin of Downsample2x(), SIMD where available; output is bit-identical to the GPU kernel
+*/
+void Downsample2xCpu(const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, uint8_t *pDst, int nDstPitch,
+                     int nDstWidth, int nDstHeight, int nChannels, int nSampleBytes);
+
+/**
+*   @brief  NV12 -> I420 in one pass: luma is copied and the interleaved chroma split into U and V planes.
+*   nBPP is 1, or 2 for P016 surfaces. dpDst gets nHeight luma rows of nDstPitch bytes, then the U and the
+*   V plane, (nHeight + 1) / 2 rows each at nDstPitch / 2. nDstPitch must be a multiple of 2 * nBPP.
+*/
+void Nv12ToI420(const uint8_t *dpY, const uint8_t *dpUV, int nSrcPitch, uint8_t *dpDst, int nDstPitch,
+                int nWidth, int nHeight, int nBPP, CUstream stream = 0);
+
+/**
+*   @brief  CPU twin of Nv12ToI420(), SIMD where available
+*/
+void Nv12ToI420Cpu(const uint8_t *pY, const uint8_t *pUV, int nSrcPitch, uint8_t *pDst, int nDstPitch,
+                   int nWidth, int nHeight, int nBPP);
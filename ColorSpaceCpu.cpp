@@ -0,0 +1,447 @@
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "ColorSpace.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static void GetConstants(int iMatrix, float &wr, float &wb)
+{
+    switch (iMatrix) {
+    case ColorSpaceStandard_BT709:
+        wr = 0.2126f; wb = 0.0722f;
+        break;
+    case ColorSpaceStandard_FCC:
+        wr = 0.30f; wb = 0.11f;
+        break;
+    case ColorSpaceStandard_SMPTE240M:
+        wr = 0.212f; wb = 0.087f;
+        break;
+    case ColorSpaceStandard_BT2020:
+    case ColorSpaceStandard_BT2020C:
+        wr = 0.2627f; wb = 0.0593f;
+        break;
+    case ColorSpaceStandard_BT470:
+    case ColorSpaceStandard_BT601:
+    default:
+        wr = 0.2990f; wb = 0.1140f;
+        break;
+    }
+}
+
+YuvToRgbCoeff GetYuvToRgbCoeff(int iMatrix, bool bFullRange, int nBitDepth)
+{
+    float wr, wb;
+    GetConstants(iMatrix, wr, wb);
+    float wg = 1.0f - wr - wb;
+    // limited range maps luma 16..235 and chroma 16..240 onto 0..255, or those << 8 onto 0..65535
+    float fMax    = nBitDepth > 8 ? 65535.0f : 255.0f;
+    float fStep   = nBitDepth > 8 ? 256.0f : 1.0f;
+    float fLuma   = bFullRange ? 1.0f : fMax / (219.0f * fStep);
+    float fChroma = bFullRange ? 1.0f : fMax / (224.0f * fStep);
+    float fScale  = (float)(1 << YUV2RGB_SHIFT);
+
+    YuvToRgbCoeff c;
+    c.yOffset = bFullRange ? 0 : (int)(16 * fStep);
+    c.cy  = (int)lroundf(fLuma * fScale);
+    c.crv = (int)lroundf(2.0f * (1.0f - wr) * fChroma * fScale);
+    c.cbu = (int)lroundf(2.0f * (1.0f - wb) * fChroma * fScale);
+    c.cgu = (int)lroundf(2.0f * (1.0f - wb) * wb / wg * fChroma * fScale);
+    c.cgv = (int)lroundf(2.0f * (1.0f - wr) * wr / wg * fChroma * fScale);
+    return c;
+}
+
+#if defined(__SSE2__)
+/* 8 pixels of one row. Same integer expressions as YuvToRgbPixel(): _mm_madd_epi16 forms the 32-bit
+*  products and sums, packs/packus do the clamping.
+*/
+static inline void Nv12ToRgb8(const uint8_t *pY, const uint8_t *pUV, const YuvToRgbCoeff &c,
+                              __m128i &r8, __m128i &g8, __m128i &b8)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i y16  = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)pY), zero),
+                                 _mm_set1_epi16((short)c.yOffset));
+    __m128i uv16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)pUV), zero);
+    // u0 v0 u1 v1 ... -> u0 u0 u1 u1 ... and v0 v0 v1 v1 ...
+    __m128i u32 = _mm_and_si128(uv16, _mm_set1_epi32(0xffff));
+    __m128i v32 = _mm_srli_epi32(uv16, 16);
+    __m128i bias = _mm_set1_epi16(128);
+    __m128i u16 = _mm_sub_epi16(_mm_or_si128(u32, _mm_slli_epi32(u32, 16)), bias);
+    __m128i v16 = _mm_sub_epi16(_mm_or_si128(v32, _mm_slli_epi32(v32, 16)), bias);
+
+    const __m128i kY  = _mm_set_epi16(1 << (YUV2RGB_SHIFT - 1), c.cy, 1 << (YUV2RGB_SHIFT - 1), c.cy,
+                                      1 << (YUV2RGB_SHIFT - 1), c.cy, 1 << (YUV2RGB_SHIFT - 1), c.cy);
+    const __m128i kR  = _mm_set1_epi32(c.crv);
+    const __m128i kB  = _mm_set1_epi32(c.cbu);
+    const __m128i kG  = _mm_set1_epi32((int)(((uint32_t)(uint16_t)-c.cgv << 16) | (uint16_t)-c.cgu));
+    const __m128i one = _mm_set1_epi16(1);
+
+    __m128i l[2], r[2], g[2], b[2];
+    l[0] = _mm_madd_epi16(_mm_unpacklo_epi16(y16, one), kY);
+    l[1] = _mm_madd_epi16(_mm_unpackhi_epi16(y16, one), kY);
+    r[0] = _mm_add_epi32(l[0], _mm_madd_epi16(_mm_unpacklo_epi16(v16, zero), kR));
+    r[1] = _mm_add_epi32(l[1], _mm_madd_epi16(_mm_unpackhi_epi16(v16, zero), kR));
+    g[0] = _mm_add_epi32(l[0], _mm_madd_epi16(_mm_unpacklo_epi16(u16, v16), kG));
+    g[1] = _mm_add_epi32(l[1], _mm_madd_epi16(_mm_unpackhi_epi16(u16, v16), kG));
+    b[0] = _mm_add_epi32(l[0], _mm_madd_epi16(_mm_unpacklo_epi16(u16, zero), kB));
+    b[1] = _mm_add_epi32(l[1], _mm_madd_epi16(_mm_unpackhi_epi16(u16, zero), kB));
+
+    r8 = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(r[0], YUV2RGB_SHIFT), _mm_srai_epi32(r[1], YUV2RGB_SHIFT)), zero);
+    g8 = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(g[0], YUV2RGB_SHIFT), _mm_srai_epi32(g[1], YUV2RGB_SHIFT)), zero);
+    b8 = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(b[0], YUV2RGB_SHIFT), _mm_srai_epi32(b[1], YUV2RGB_SHIFT)), zero);
+}
+#endif
+
+void Nv12ToRgbCpu(const uint8_t *pY, const uint8_t *pUV, int nSrcPitch, uint8_t *pDst, int nDstPitch,
+                  int nWidth, int nHeight, RgbLayout eLayout, const YuvToRgbCoeff &coeff)
+{
+    if (RgbChannels(eLayout) == 4) {
+        YuvToRgbCpu(YUV_NV12, pY, pUV, NULL, nSrcPitch, pDst, nDstPitch, nWidth, nHeight, eLayout, RGB_8U, coeff);
+        return;
+    }
+    size_t nPlane = (size_t)nDstPitch * nHeight;
+    for (int y = 0; y < nHeight; y++) {
+        const uint8_t *pLuma = pY + (size_t)y * nSrcPitch;
+        const uint8_t *pChroma = pUV + (size_t)(y / 2) * nSrcPitch;
+        uint8_t *pRow = pDst + (size_t)y * nDstPitch;
+        int x = 0;
+#if defined(__SSE2__)
+        for (; x + 8 <= nWidth; x += 8) {
+            __m128i r8, g8, b8;
+            Nv12ToRgb8(pLuma + x, pChroma + x, coeff, r8, g8, b8);
+            if (eLayout == RGB_PLANAR || eLayout == BGR_PLANAR) {
+                __m128i *p0 = (__m128i *)(pRow + x);
+                __m128i *p2 = (__m128i *)(pRow + x + 2 * nPlane);
+                _mm_storel_epi64(p0, eLayout == RGB_PLANAR ? r8 : b8);
+                _mm_storel_epi64((__m128i *)(pRow + x + nPlane), g8);
+                _mm_storel_epi64(p2, eLayout == RGB_PLANAR ? b8 : r8);
+            } else {
+                alignas(16) uint8_t ar[16], ag[16], ab[16];
+                _mm_store_si128((__m128i *)ar, r8);
+                _mm_store_si128((__m128i *)ag, g8);
+                _mm_store_si128((__m128i *)ab, b8);
+                for (int i = 0; i < 8; i++) {
+                    StoreRgbPixel<uint8_t>(pRow, nPlane, eLayout, x + i, ar[i], ag[i], ab[i], 0xff);
+                }
+            }
+        }
+#endif
+        for (; x < nWidth; x++) {
+            uint8_t r, g, b;
+            YuvToRgbPixel(coeff, pLuma[x], pChroma[x & ~1] - 128, pChroma[(x & ~1) + 1] - 128, r, g, b);
+            StoreRgbPixel<uint8_t>(pRow, nPlane, eLayout, x, r, g, b, 0xff);
+        }
+    }
+}
+
+#if defined(__SSE2__)
+/* 8 pixels of staged samples into 16-bit channels, same integer expressions as YuvToRgbPixel(). Luma is
+*  staged as y - nBias so 16-bit samples fit in int16; cy * nBias is added back through the constant.
+*/
+static inline void YuvToRgbStaged8(const int16_t *pY, const int16_t *pU, const int16_t *pV, const YuvToRgbCoeff &c,
+                                   int nBias, int nShift, int nMax, uint16_t *pR, uint16_t *pG, uint16_t *pB)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i y16 = _mm_loadu_si128((const __m128i *)pY);
+    __m128i u16 = _mm_loadu_si128((const __m128i *)pU);
+    __m128i v16 = _mm_loadu_si128((const __m128i *)pV);
+
+    const __m128i kY = _mm_set1_epi32(c.cy);
+    const __m128i kL = _mm_set1_epi32(c.cy * (nBias - c.yOffset) + (1 << (nShift - 1)));
+    const __m128i kR = _mm_set1_epi32(c.crv);
+    const __m128i kB = _mm_set1_epi32(c.cbu);
+    const __m128i kG = _mm_set1_epi32((int)(((uint32_t)(uint16_t)-c.cgv << 16) | (uint16_t)-c.cgu));
+
+    __m128i l[2], ch[3][2];
+    l[0] = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y16, zero), kY), kL);
+    l[1] = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y16, zero), kY), kL);
+    ch[0][0] = _mm_add_epi32(l[0], _mm_madd_epi16(_mm_unpacklo_epi16(v16, zero), kR));
+    ch[0][1] = _mm_add_epi32(l[1], _mm_madd_epi16(_mm_unpackhi_epi16(v16, zero), kR));
+    ch[1][0] = _mm_add_epi32(l[0], _mm_madd_epi16(_mm_unpacklo_epi16(u16, v16), kG));
+    ch[1][1] = _mm_add_epi32(l[1], _mm_madd_epi16(_mm_unpackhi_epi16(u16, v16), kG));
+    ch[2][0] = _mm_add_epi32(l[0], _mm_madd_epi16(_mm_unpacklo_epi16(u16, zero), kB));
+    ch[2][1] = _mm_add_epi32(l[1], _mm_madd_epi16(_mm_unpackhi_epi16(u16, zero), kB));
+
+    uint16_t *apDst[3] = { pR, pG, pB };
+    const __m128i shift = _mm_cvtsi32_si128(nShift);
+    for (int i = 0; i < 3; i++) {
+        __m128i lo = _mm_sra_epi32(ch[i][0], shift);
+        __m128i hi = _mm_sra_epi32(ch[i][1], shift);
+        __m128i out;
+        if (nMax == 255) {
+            // saturation keeps the order, so clamping the packed values clamps the 32-bit ones
+            out = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(lo, hi), zero), _mm_set1_epi16(255));
+        } else {
+            // no unsigned 32 -> 16 pack in SSE2: shift into the signed range, pack, shift back
+            const __m128i k32768 = _mm_set1_epi32(32768);
+            out = _mm_packs_epi32(_mm_sub_epi32(lo, k32768), _mm_sub_epi32(hi, k32768));
+            out = _mm_xor_si128(out, _mm_set1_epi16((short)0x8000));
+        }
+        _mm_storeu_si128((__m128i *)apDst[i], out);
+    }
+}
+#endif
+
+void YuvToRgbCpu(YuvFormat eFormat, const uint8_t *pY, const uint8_t *pU, const uint8_t *pV, int nSrcPitch,
+                 uint8_t *pDst, int nDstPitch, int nWidth, int nHeight, RgbLayout eLayout, RgbDepth eDepth,
+                 const YuvToRgbCoeff &coeff)
+{
+    if (eFormat == YUV_NV12 && eDepth == RGB_8U && RgbChannels(eLayout) == 3) {
+        Nv12ToRgbCpu(pY, pU, nSrcPitch, pDst, nDstPitch, nWidth, nHeight, eLayout, coeff);
+        return;
+    }
+
+    bool b16 = IsYuv16(eFormat);
+    int nBias = b16 ? 32768 : 0;
+    int nShift = RgbShift(eFormat, eDepth);
+    int nMax = RgbMax(eFormat, eDepth);
+    int nAlpha = RgbAlpha(eDepth);
+    size_t nPlane = (size_t)nDstPitch * nHeight;
+    // one row at a time: samples staged as int16, then converted 8 at a time, then stored
+    std::vector<int16_t> vY(nWidth), vU(nWidth), vV(nWidth);
+    std::vector<uint16_t> vR(nWidth), vG(nWidth), vB(nWidth);
+    for (int y = 0; y < nHeight; y++) {
+        for (int x = 0; x < nWidth; x++) {
+            int luma, u, v;
+            LoadYuv(eFormat, pY, pU, pV, nSrcPitch, x, y, luma, u, v);
+            vY[x] = (int16_t)(luma - nBias);
+            vU[x] = (int16_t)u;
+            vV[x] = (int16_t)v;
+        }
+
+        int x = 0;
+#if defined(__SSE2__)
+        for (; x + 8 <= nWidth; x += 8) {
+            YuvToRgbStaged8(&vY[x], &vU[x], &vV[x], coeff, nBias, nShift, nMax, &vR[x], &vG[x], &vB[x]);
+        }
+#endif
+        for (; x < nWidth; x++) {
+            int r, g, b;
+            YuvToRgbPixel(coeff, vY[x] + nBias, vU[x], vV[x], nShift, nMax, r, g, b);
+            vR[x] = r; vG[x] = g; vB[x] = b;
+        }
+
+        uint8_t *pRow = pDst + (size_t)y * nDstPitch;
+        if (eDepth == RGB_8U) {
+            for (x = 0; x < nWidth; x++) {
+                StoreRgbPixel<uint8_t>(pRow, nPlane, eLayout, x, vR[x], vG[x], vB[x], nAlpha);
+            }
+        } else {
+            for (x = 0; x < nWidth; x++) {
+                StoreRgbPixel<uint16_t>(pRow, nPlane, eLayout, x, RgbSample(vR[x], eFormat, eDepth),
+                                        RgbSample(vG[x], eFormat, eDepth), RgbSample(vB[x], eFormat, eDepth), nAlpha);
+            }
+        }
+    }
+}
+
+/* Same taps as ResizePlaneKernel(); the horizontal ones are computed once per plane */
+template <typename T, int CHANNELS>
+static void ResizePlaneCpu(const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+                           uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight)
+{
+    std::vector<int> vX0(nDstWidth), vX1(nDstWidth), vWx(nDstWidth);
+    for (int x = 0; x < nDstWidth; x++) {
+        ResizeTap(x, nSrcWidth, nDstWidth, vX0[x], vX1[x], vWx[x]);
+    }
+    for (int y = 0; y < nDstHeight; y++) {
+        int y0, y1, wy;
+        ResizeTap(y, nSrcHeight, nDstHeight, y0, y1, wy);
+        const uint8_t *pRow0 = pSrc + (size_t)y0 * nSrcPitch;
+        const uint8_t *pRow1 = pSrc + (size_t)y1 * nSrcPitch;
+        T *pRow = (T *)(pDst + (size_t)y * nDstPitch);
+        for (int x = 0; x < nDstWidth; x++) {
+            for (int c = 0; c < CHANNELS; c++) {
+                pRow[x * CHANNELS + c] = ResizeSample<T>(pRow0, pRow1, CHANNELS, c, vX0[x], vX1[x], vWx[x], wy);
+            }
+        }
+    }
+}
+
+void ResizeYuvCpu(YuvFormat eFormat, const uint8_t *pY, const uint8_t *pU, const uint8_t *pV, int nSrcPitch,
+                  int nSrcWidth, int nSrcHeight, uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight)
+{
+    uint8_t *pDstU = pDst + (size_t)nDstPitch * nDstHeight;
+    switch (eFormat) {
+    case YUV_NV12:
+        ResizePlaneCpu<uint8_t, 1>(pY, nSrcPitch, nSrcWidth, nSrcHeight, pDst, nDstPitch, nDstWidth, nDstHeight);
+        ResizePlaneCpu<uint8_t, 2>(pU, nSrcPitch, (nSrcWidth + 1) / 2, (nSrcHeight + 1) / 2,
+                                   pDstU, nDstPitch, (nDstWidth + 1) / 2, (nDstHeight + 1) / 2);
+        break;
+    case YUV_P016:
+        ResizePlaneCpu<uint16_t, 1>(pY, nSrcPitch, nSrcWidth, nSrcHeight, pDst, nDstPitch, nDstWidth, nDstHeight);
+        ResizePlaneCpu<uint16_t, 2>(pU, nSrcPitch, (nSrcWidth + 1) / 2, (nSrcHeight + 1) / 2,
+                                    pDstU, nDstPitch, (nDstWidth + 1) / 2, (nDstHeight + 1) / 2);
+        break;
+    case YUV_444:
+    case YUV_444P16: {
+        const uint8_t *apSrc[3] = { pY, pU, pV };
+        for (int i = 0; i < 3; i++) {
+            uint8_t *pPlane = pDst + (size_t)nDstPitch * nDstHeight * i;
+            if (eFormat == YUV_444) {
+                ResizePlaneCpu<uint8_t, 1>(apSrc[i], nSrcPitch, nSrcWidth, nSrcHeight,
+                                           pPlane, nDstPitch, nDstWidth, nDstHeight);
+            } else {
+                ResizePlaneCpu<uint16_t, 1>(apSrc[i], nSrcPitch, nSrcWidth, nSrcHeight,
+                                            pPlane, nDstPitch, nDstWidth, nDstHeight);
+            }
+        }
+        break;
+    }
+    }
+}
+
+#if defined(__SSE2__)
+/* 8 destination samples of an 8-bit plane from 16 bytes of source rows p0 and p1, 1 or 2 channels */
+static inline __m128i Downsample2x8(const uint8_t *p0, const uint8_t *p1, int nChannels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((const __m128i *)p0);
+    __m128i b = _mm_loadu_si128((const __m128i *)p1);
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    __m128i s;
+    if (nChannels == 1) {
+        // neighbouring samples are the two halves of a 32-bit lane
+        const __m128i mask = _mm_set1_epi32(0xffff);
+        lo = _mm_add_epi32(_mm_and_si128(lo, mask), _mm_srli_epi32(lo, 16));
+        hi = _mm_add_epi32(_mm_and_si128(hi, mask), _mm_srli_epi32(hi, 16));
+        s = _mm_packs_epi32(lo, hi);
+    } else {
+        // one u/v pair per 32-bit lane: add the odd lanes to the even ones
+        lo = _mm_add_epi16(_mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 3, 1)));
+        hi = _mm_add_epi16(_mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        s = _mm_unpacklo_epi64(lo, hi);
+    }
+    s = _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(2)), 2);
+    return _mm_packus_epi16(s, zero);
+}
+
+/* 4 destination samples of a 1-channel 16-bit plane from 8 samples of source rows p0 and p1 */
+static inline __m128i Downsample2x16(const uint16_t *p0, const uint16_t *p1)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((const __m128i *)p0);
+    __m128i b = _mm_loadu_si128((const __m128i *)p1);
+    __m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(a, zero), _mm_unpacklo_epi16(b, zero));
+    __m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(a, zero), _mm_unpackhi_epi16(b, zero));
+    __m128i even = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 0, 2, 0)),
+                                      _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 3, 1)),
+                                     _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 3, 1)));
+    __m128i s = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(even, odd), _mm_set1_epi32(2)), 2);
+    // no unsigned 32 -> 16 pack in SSE2: shift into the signed range, pack, shift back
+    const __m128i k32768 = _mm_set1_epi32(32768);
+    s = _mm_packs_epi32(_mm_sub_epi32(s, k32768), zero);
+    return _mm_xor_si128(s, _mm_set1_epi16((short)0x8000));
+}
+#endif
+
+template <typename T>
+static void Downsample2xRowCpu(const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, uint8_t *pDst,
+                               int nDstWidth, int nChannels, int y, int x)
+{
+    T *pRow = (T *)pDst;
+    for (; x < nDstWidth; x++) {
+        for (int c = 0; c < nChannels; c++) {
+            pRow[x * nChannels + c] = BoxSample2x<T>(pSrc, nSrcPitch, nSrcWidth, nSrcHeight, nChannels, c, x, y);
+        }
+    }
+}
+
+void Downsample2xCpu(const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, uint8_t *pDst, int nDstPitch,
+                     int nDstWidth, int nDstHeight, int nChannels, int nSampleBytes)
+{
+    for (int y = 0; y < nDstHeight; y++) {
+        int y0 = 2 * y < nSrcHeight ? 2 * y : nSrcHeight - 1;
+        int y1 = y0 + 1 < nSrcHeight ? y0 + 1 : y0;
+        const uint8_t *p0 = pSrc + (size_t)y0 * nSrcPitch;
+        const uint8_t *p1 = pSrc + (size_t)y1 * nSrcPitch;
+        uint8_t *pRow = pDst + (size_t)y * nDstPitch;
+        int x = 0;
+#if defined(__SSE2__)
+        // whole blocks while both source columns exist, the right edge goes through BoxSample2x()
+        if (nSampleBytes == 1 && nChannels <= 2) {
+            int nStep = 8 / nChannels;
+            for (; 2 * (x + nStep) <= nSrcWidth && x + nStep <= nDstWidth; x += nStep) {
+                size_t nOffset = (size_t)2 * x * nChannels;
+                _mm_storel_epi64((__m128i *)(pRow + x * nChannels), Downsample2x8(p0 + nOffset, p1 + nOffset, nChannels));
+            }
+        } else if (nSampleBytes == 2 && nChannels == 1) {
+            for (; 2 * (x + 4) <= nSrcWidth && x + 4 <= nDstWidth; x += 4) {
+                _mm_storel_epi64((__m128i *)(pRow + 2 * x),
+                                 Downsample2x16((const uint16_t *)p0 + 2 * x, (const uint16_t *)p1 + 2 * x));
+            }
+        }
+#endif
+        if (nSampleBytes == 2) {
+            Downsample2xRowCpu<uint16_t>(pSrc, nSrcPitch, nSrcWidth, nSrcHeight, pRow, nDstWidth, nChannels, y, x);
+        } else {
+            Downsample2xRowCpu<uint8_t>(pSrc, nSrcPitch, nSrcWidth, nSrcHeight, pRow, nDstWidth, nChannels, y, x);
+        }
+    }
+}
+
+/* Split nPairs interleaved chroma pairs into pU and pV */
+static void DeinterleaveUV8(const uint8_t *pUV, uint8_t *pU, uint8_t *pV, int nPairs)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0xff);
+    for (; i + 16 <= nPairs; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(pUV + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(pUV + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(pU + i), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i *)(pV + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#endif
+    for (; i < nPairs; i++) {
+        pU[i] = pUV[2 * i];
+        pV[i] = pUV[2 * i + 1];
+    }
+}
+
+static void DeinterleaveUV16(const uint16_t *pUV, uint16_t *pU, uint16_t *pV, int nPairs)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    // sign-extending to 32 bits keeps packs_epi32 from saturating, so the 16-bit patterns pass unchanged
+    for (; i + 8 <= nPairs; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(pUV + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(pUV + 2 * i + 8));
+        __m128i u = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+        __m128i v = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+        _mm_storeu_si128((__m128i *)(pU + i), u);
+        _mm_storeu_si128((__m128i *)(pV + i), v);
+    }
+#endif
+    for (; i < nPairs; i++) {
+        pU[i] = pUV[2 * i];
+        pV[i] = pUV[2 * i + 1];
+    }
+}
+
+void Nv12ToI420Cpu(const uint8_t *pY, const uint8_t *pUV, int nSrcPitch, uint8_t *pDst, int nDstPitch,
+                   int nWidth, int nHeight, int nBPP)
+{
+    for (int y = 0; y < nHeight; y++) {
+        memcpy(pDst + (size_t)y * nDstPitch, pY + (size_t)y * nSrcPitch, (size_t)nWidth * nBPP);
+    }
+
+    int nChromaPitch = nDstPitch / 2;
+    int nChromaHeight = (nHeight + 1) / 2;
+    int nPairs = (nWidth + 1) / 2;
+    uint8_t *pU = pDst + (size_t)nDstPitch * nHeight;
+    uint8_t *pV = pU + (size_t)nChromaPitch * nChromaHeight;
+    for (int y = 0; y < nChromaHeight; y++) {
+        const uint8_t *pSrc = pUV + (size_t)y * nSrcPitch;
+        size_t nOffset = (size_t)y * nChromaPitch;
+        if (nBPP == 2) {
+            DeinterleaveUV16((const uint16_t *)pSrc, (uint16_t *)(pU + nOffset), (uint16_t *)(pV + nOffset), nPairs);
+        } else {
+            DeinterleaveUV8(pSrc, pU + nOffset, pV + nOffset, nPairs);
+        }
+    }
+}
@@ -1,4 +1,9 @@
 #include "lotus_demuxer.h"
+#include "NvPacketIndex.hpp"
+#include "NvAnnexB.hpp"
+#include "NvAnnexBReader.hpp"
+#include "NvSpsParser.hpp"
+#include "NvMetrics.hpp"
 //#pragma once
 #define __D(...) printf(__VA_ARGS__)
 #define __I(...) printf(__VA_ARGS__)
@@ -732,11 +737,14 @@ void av_packet_rescale_ts(AVPacket *pkt, AVRational tb_src, AVRational tb_dst);
 #include <thread>
 
 #include <time.h>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -1115,6 +1123,8 @@ inline void ValidateResolution(int nWidth, int nHeight) {
   }
 }
 
+// Defined in ColorSpace.cu for COLOR32 = BGRA32/RGBA32 and COLOR64 = BGRA64/RGBA64 (ColorSpace.hpp).
+// iMatrix is a ColorSpaceStandard, the input is limited range; they run on the default stream.
 template <class COLOR32>
 void Nv12ToColor32(uint8_t *dpNv12, int nNv12Pitch, uint8_t *dpBgra, int nBgraPitch, int nWidth, int nHeight,
                    int iMatrix = 0);
@@ -1184,6 +1194,130 @@ void ComputeCRC(uint8_t *pBuffer, uint32_t *crcValue, CUstream_st *outputCUStrea
 //! This header file is used by Decode/Transcode apps to demux input video clips before decoding frames from it.
 //---------------------------------------------------------------------------
 
+class FFmpegPacketPool;
+
+/**
+ * @brief Owned, reference-counted demuxed packet, see FFmpegDemuxer::demuxPacket(). Unlike the demux()
+ * pointer it stays valid across further demux calls, so packets can be queued to other threads without
+ * copying the payload. Move-only; on destruction the AVPacket goes back to its pool, which must outlive
+ * the handle.
+ */
+class FFmpegPacket {
+ public:
+  FFmpegPacket() {}
+  FFmpegPacket(const FFmpegPacket &) = delete;
+  FFmpegPacket &operator=(const FFmpegPacket &) = delete;
+  FFmpegPacket(FFmpegPacket &&other) : pkt(other.pkt), pool(other.pool), nPts(other.nPts) { other.pkt = NULL; }
+  FFmpegPacket &operator=(FFmpegPacket &&other) {
+    if (this != &other) {
+      reset();
+      std::swap(pkt, other.pkt);
+      pool = other.pool;
+      nPts = other.nPts;
+    }
+    return *this;
+  }
+  ~FFmpegPacket() { reset(); }
+
+  inline void reset();
+
+  explicit operator bool() const { return pkt != NULL; }
+  uint8_t *data() const { return pkt->data; }
+  uint32_t size() const { return (uint32_t)pkt->size; }
+  // ms, like the demux() pts
+  int64_t pts() const { return nPts; }
+  bool isKeyFrame() const { return (pkt->flags & AV_PKT_FLAG_KEY) != 0; }
+  AVPacket *get() const { return pkt; }
+
+ private:
+  friend class FFmpegPacketPool;
+  friend class FFmpegDemuxer;
+
+  AVPacket *pkt = NULL;
+  FFmpegPacketPool *pool = NULL;
+  int64_t nPts = 0;
+};
+
+/**
+ * @brief Recycles AVPacket structs (not their payload, which stays refcounted by libavcodec), so the
+ * steady state of demuxPacket() and the read-ahead ring allocates no packets. Thread-safe: handles may be
+ * released on any thread.
+ */
+class FFmpegPacketPool {
+ public:
+  struct Stats {
+    uint64_t nAcquire, nAlloc;
+    int nIdle;
+  };
+
+  FFmpegPacketPool() {}
+  FFmpegPacketPool(const FFmpegPacketPool &) = delete;
+  FFmpegPacketPool &operator=(const FFmpegPacketPool &) = delete;
+  ~FFmpegPacketPool() {
+    for (AVPacket *p : vFree) {
+      av_packet_free(&p);
+    }
+  }
+
+  /**
+   *   @brief  Blank packet, NULL if out of memory
+   */
+  AVPacket *get() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stats.nAcquire++;
+      if (!vFree.empty()) {
+        AVPacket *p = vFree.back();
+        vFree.pop_back();
+        return p;
+      }
+      stats.nAlloc++;
+    }
+    return av_packet_alloc();
+  }
+
+  /**
+   *   @brief  Drop the payload reference of p and keep p for the next get()
+   */
+  void put(AVPacket *p) {
+    if (!p) {
+      return;
+    }
+    av_packet_unref(p);
+    std::lock_guard<std::mutex> lock(mtx);
+    vFree.push_back(p);
+  }
+
+  /**
+   *   @brief  Handle of a blank packet, empty if out of memory
+   */
+  FFmpegPacket acquire() {
+    FFmpegPacket packet;
+    packet.pkt = get();
+    packet.pool = this;
+    return packet;
+  }
+
+  Stats getStats() {
+    std::lock_guard<std::mutex> lock(mtx);
+    Stats s = stats;
+    s.nIdle = (int)vFree.size();
+    return s;
+  }
+
+ private:
+  std::mutex mtx;
+  std::vector<AVPacket *> vFree;
+  Stats stats = {};
+};
+
+inline void FFmpegPacket::reset() {
+  if (pkt) {
+    pool->put(pkt);
+    pkt = NULL;
+  }
+}
+
 /**
  * @brief libavformat wrapper class. Retrieves the elementary encoded stream from the container format.
  */
@@ -1194,6 +1328,8 @@ class FFmpegDemuxer {
   AVPacket pkt, pktFiltered; /*!< AVPacket stores compressed data typically exported by demuxers and then passed as
                                 input to decoders */
   AVBSFContext *bsfc = NULL;
+  NvAnnexBConverter annexb;
+  bool bAnnexBInPlace = false; /*!< mp4 H.264/HEVC with 4-byte NAL lengths: annexb instead of bsfc */
 
   int v_idx;
   bool bMp4H264, bMp4HEVC, bMp4MPEG4;
@@ -1202,23 +1338,73 @@ class FFmpegDemuxer {
   int nWidth, nHeight, nBitDepth, nBPP, nChromaHeight;
   double timeBase = 0.0;
 
-  uint8_t *pDataWithHeader = NULL;
-
   unsigned int frameCount = 0;
+  bool bKeyFrame = false;
+
+  const NvPacketIndex *pIndex = NULL;
+  int nTraceStream = -1;
+
+  NvStreamInfo streamInfo = {};
+  bool bStreamInfo = false;     /*!< streamInfo was parsed from an SPS */
+  bool bPendingPacket = false;  /*!< pkt holds the first video packet, read for its SPS */
+
+ public:
+  /**
+   *   @brief  Read-ahead counters since construction, see startPrefetch()
+   */
+  struct PrefetchStats {
+    uint64_t nPackets;          // handed out by demux() from the ring
+    uint64_t nBytes;
+    uint64_t nConsumerStalls;   // demux() found the ring empty and waited for the reader
+    uint64_t nConsumerStallNs;
+    uint64_t nProducerStalls;   // the reader found the ring full and waited for demux()
+    uint64_t nProducerStallNs;
+    int nMaxDepth;              // most packets queued at once
+    size_t nMaxDepthBytes;
+  };
+
+ private:
+  // AVPackets of the ring and of demuxPacket(). ~FFmpegDemuxer() stops the reader and hands the ring's back
+  // with flushPrefetch() in its body, before any member is destroyed; handles from demuxPacket() must not
+  // outlive the demuxer.
+  FFmpegPacketPool packetPool;
+
+  // read-ahead: the reader thread owns av, pkt and bsfc while it runs; everything else below is under mtxPrefetch
+  std::thread prefetchThread;
+  std::mutex mtxPrefetch;
+  std::condition_variable cvPrefetchData, cvPrefetchSpace;
+  std::deque<AVPacket *> qPrefetch;
+  size_t nPrefetchBytes = 0;
+  int nPrefetchMaxPackets = 0;
+  size_t nPrefetchMaxBytes = 0;
+  bool bPrefetchStop = false;
+  bool bPrefetchEnd = false;
+  PrefetchStats prefetchStats = {};
 
  public:
   class DataProvider {
    public:
     virtual ~DataProvider() {}
     virtual int GetData(uint8_t *pBuf, int nBuf) = 0;
+    /**
+     *   @brief  Providers that can reposition return true and implement Seek(), which enables
+     *   FFmpegDemuxer::seek() on them
+     */
+    virtual bool IsSeekable() { return false; }
+    /**
+     *   @brief  Reposition like fseek() and return the new offset; for whence == AVSEEK_SIZE return the
+     *   total size. Negative on failure.
+     */
+    virtual int64_t Seek(int64_t nOffset, int whence) { return -1; }
   };
 
  private:
   /**
    *   @brief  Private constructor to initialize libavformat resources.
    *   @param  av - Pointer to AVFormatContext allocated inside avformat_open_input()
+   *   @param  pPacketIndex - index of the same input, replaces stream probing and serves seek queries
    */
-  FFmpegDemuxer(AVFormatContext *avCtx) : av(avCtx) {
+  FFmpegDemuxer(AVFormatContext *avCtx, const NvPacketIndex *pPacketIndex = NULL) : av(avCtx), pIndex(pPacketIndex) {
     if (!av) {
       __E("No AVFormatContext provided. \n");
       return;
@@ -1226,24 +1412,57 @@ class FFmpegDemuxer {
 
     __I("Media format: %s (%s) \n", av->iformat->long_name, av->iformat->name);
 
-    ck(avformat_find_stream_info(av, NULL));
-    v_idx = av_find_best_stream(av, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-    if (v_idx < 0) {
-      char err[64] = {0};
-      av_strerror(v_idx, err, sizeof(err));
-
-      __E("Demuxer error at %s:%d av_find_best_stream: Could not find stream in input, %s \n", __FILE__, __LINE__, err);
+    // Initialize packet fields with default values
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    av_init_packet(&pktFiltered);
+    pktFiltered.data = NULL;
+    pktFiltered.size = 0;
 
-      if (v_idx == AVERROR_DECODER_NOT_FOUND) {
-        __E("FFmpeg: av_find_best_stream.ff_find_decoder() CANNOT found ANY Decoder match this input, "
-            "avformat.c::av_find_best_stream function should fix it\n");
-        sleep(1);
+    if (pIndex && pIndex->getStreamIndex() < (int)av->nb_streams) {
+      // avformat_find_stream_info() reads into the file to learn what the index already holds
+      v_idx = pIndex->getStreamIndex();
+      AVCodecParameters *par = av->streams[v_idx]->codecpar;
+      if (par->codec_id == AV_CODEC_ID_NONE) {
+        par->codec_id = (AVCodecID)pIndex->getCodecId();
+      }
+      if (!par->width || !par->height) {
+        par->width = pIndex->getWidth();
+        par->height = pIndex->getHeight();
+      }
+      if (par->format < 0) {
+        par->format = pIndex->getPixelFormat();
+      }
+    } else {
+      pIndex = NULL;
+      // full probing decodes frames; H.264/HEVC tell the same in their SPS
+      if (!probeParameterSets()) {
+        ck(avformat_find_stream_info(av, NULL));
       }
+      v_idx = av_find_best_stream(av, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+      if (v_idx < 0) {
+        char err[64] = {0};
+        av_strerror(v_idx, err, sizeof(err));
 
-      return;
+        __E("Demuxer error at %s:%d av_find_best_stream: Could not find stream in input, %s \n", __FILE__, __LINE__, err);
+
+        if (v_idx == AVERROR_DECODER_NOT_FOUND) {
+          __E("FFmpeg: av_find_best_stream.ff_find_decoder() CANNOT found ANY Decoder match this input, "
+              "avformat.c::av_find_best_stream function should fix it\n");
+          sleep(1);
+        }
+
+        return;
+      }
     }
 
     // av->streams[v_idx]->need_parsing = AVSTREAM_PARSE_NONE;
+    if (!bStreamInfo) {
+      AVCodecParameters *par = av->streams[v_idx]->codecpar;
+      bStreamInfo = par->extradata_size > 0 &&
+                    NvSpsParser::parseExtradata(par->codec_id, par->extradata, (size_t)par->extradata_size, &streamInfo);
+    }
     codec_id = av->streams[v_idx]->codecpar->codec_id;
     nWidth = av->streams[v_idx]->codecpar->width;
     nHeight = av->streams[v_idx]->codecpar->height;
@@ -1304,16 +1523,15 @@ class FFmpegDemuxer {
                                                   !strcmp(av->iformat->long_name, "FLV (Flash Video)") ||
                                                   !strcmp(av->iformat->long_name, "Matroska / WebM"));
 
-    // Initialize packet fields with default values
-    av_init_packet(&pkt);
-    pkt.data = NULL;
-    pkt.size = 0;
-    av_init_packet(&pktFiltered);
-    pktFiltered.data = NULL;
-    pktFiltered.size = 0;
+    // 4-byte NAL lengths are rewritten in place by annexb, other layouts go through the bitstream filter
+    if (bMp4H264 || bMp4HEVC) {
+      AVCodecParameters *par = av->streams[v_idx]->codecpar;
+      size_t nExtradata = par->extradata_size > 0 ? (size_t)par->extradata_size : 0;
+      bAnnexBInPlace = annexb.init(codec_id, par->extradata, nExtradata) && annexb.isInPlace();
+    }
 
     // Initialize bitstream filter and its required resources
-    if (bMp4H264) {
+    if (bMp4H264 && !bAnnexBInPlace) {
       const AVBitStreamFilter *bsf = av_bsf_get_by_name("h264_mp4toannexb");
       if (!bsf) {
         __E("FFmpeg error: av_bsf_get_by_name failed \n");
@@ -1323,7 +1541,7 @@ class FFmpegDemuxer {
       avcodec_parameters_copy(bsfc->par_in, av->streams[v_idx]->codecpar);
       ck(av_bsf_init(bsfc));
     }
-    if (bMp4HEVC) {
+    if (bMp4HEVC && !bAnnexBInPlace) {
       const AVBitStreamFilter *bsf = av_bsf_get_by_name("hevc_mp4toannexb");
       if (!bsf) {
         __E("FFmpeg error: av_bsf_get_by_name failed \n");
@@ -1360,7 +1578,7 @@ class FFmpegDemuxer {
                                0,  // write_flag
                                pDataProvider, &dataProviderRead,
                                NULL,   // write_packet
-                               NULL);  // seek
+                               pDataProvider->IsSeekable() ? &dataProviderSeek : NULL);
     if (!avioc) {
       __E("FFmpeg error: avio_alloc_context failed\n");
       return NULL;
@@ -1373,12 +1591,21 @@ class FFmpegDemuxer {
 
  public:
   FFmpegDemuxer(const char *szFilePath) : FFmpegDemuxer(createAv(szFilePath)) {}
+  /**
+   *   @brief  Open with the packet index of szFilePath (see NvPacketIndex::open()); pPacketIndex must outlive
+   *   the demuxer
+   */
+  FFmpegDemuxer(const char *szFilePath, const NvPacketIndex *pPacketIndex)
+      : FFmpegDemuxer(createAv(szFilePath), pPacketIndex) {}
   FFmpegDemuxer(DataProvider *pDataProvider) : FFmpegDemuxer(createAv(pDataProvider)) { avioc = av->pb; }
   ~FFmpegDemuxer() {
     if (!av) {
       return;
     }
 
+    stopPrefetch();
+    flushPrefetch();
+
     if (pkt.data) {
       av_packet_unref(&pkt);
     }
@@ -1397,10 +1624,6 @@ class FFmpegDemuxer {
       av_freep(&avioc);
       avioc = NULL;
     }
-
-    if (pDataWithHeader) {
-      av_free(pDataWithHeader);
-    }
   }
 
   AVCodecID getVideoCodec() { return codec_id; }
@@ -1409,86 +1632,541 @@ class FFmpegDemuxer {
   int getHeight() { return nHeight; }
   int getBitDepth() { return nBitDepth; }
   int getFrameSize() { return nWidth * (nHeight + nChromaHeight) * nBPP; }
+  /**
+   *   @brief  H.264/HEVC format from the SPS of the extradata or the first packet, e.g. for
+   *   NvDecoder::prepareSession(). False for other codecs and when no SPS could be parsed.
+   */
+  bool getStreamInfo(NvStreamInfo *pInfo) {
+    if (bStreamInfo) {
+      *pInfo = streamInfo;
+    }
+    return bStreamInfo;
+  }
+  /**
+   *   @brief  Whether the packet returned by the last demux() is a key frame, see NvDecoder::PKT_KEYFRAME
+   */
+  bool isKeyFrame() { return bKeyFrame; }
+  /**
+   *   @brief  Stream id the demux NvTrace events are tagged with, usually NvDecoder::getTraceStreamId()
+   */
+  void setTraceStreamId(int nStream) { nTraceStream = nStream; }
   bool demux(uint8_t **ppVideo, uint32_t *pnVideoBytes, int64_t *pts = NULL) {
     if (!av) {
       return false;
     }
+    NvStageTimer timer(NV_STAGE_DEMUX, nTraceStream);
 
     *pnVideoBytes = 0;
 
+    // pktFiltered holds the packet handed out until the next call, whichever path produced it
+    if (pktFiltered.data) {
+      av_packet_unref(&pktFiltered);
+    }
+    if (!nextPacket(&pktFiltered) || !prependHeader(&pktFiltered)) {
+      return false;
+    }
+
+    bKeyFrame = (pktFiltered.flags & AV_PKT_FLAG_KEY) != 0;
+    *ppVideo      = pktFiltered.data;
+    *pnVideoBytes = static_cast<uint32_t>(pktFiltered.size);
+
+    if (pts) {
+        *pts = getTimestamp(&pktFiltered);
+    }
+
+    frameCount++;
+
+    return true;
+  }
+
+  /**
+   *   @brief  Like demux(), but the packet is moved out into an owned handle that stays valid across
+   *   further calls (zero-copy; the payload is refcounted). Empty handle at the end of the input.
+   *   Handles must be released before the demuxer is destroyed.
+   */
+  FFmpegPacket demuxPacket() {
+    FFmpegPacket packet;
+    if (!av) {
+      return packet;
+    }
+    NvStageTimer timer(NV_STAGE_DEMUX, nTraceStream);
+
+    packet = packetPool.acquire();
+    if (!packet || !nextPacket(packet.get()) || !prependHeader(packet.get())) {
+      packet.reset();
+      return packet;
+    }
+    bKeyFrame = packet.isKeyFrame();
+    packet.nPts = getTimestamp(packet.get());
+    frameCount++;
+    return packet;
+  }
+
+  FFmpegPacketPool::Stats getPacketPoolStats() { return packetPool.getStats(); }
+
+  /**
+   *   @brief  Position on the key frame at or before nTimestamp (ms, like the demux() pts), so the next
+   *   demux() starts a decodable GOP. False when the input can't seek.
+   */
+  bool seek(int64_t nTimestamp) {
+    if (!av) {
+      return false;
+    }
+    // the reader must be off av while it moves; on failure it resumes where it was, ring intact
+    bool bPrefetch = isPrefetching();
+    stopPrefetch();
+    bool bSeeked = seekInput(nTimestamp);
+    if (bSeeked) {
+      flushPrefetch();
+    }
+    if (bPrefetch) {
+      startPrefetch(nPrefetchMaxPackets, nPrefetchMaxBytes);
+    }
+    return bSeeked;
+  }
+
+  /**
+   *   @brief  Move demuxing to a background thread that reads ahead into a ring of up to nMaxPackets
+   *   packets and nMaxBytes of payload (a single larger packet is still admitted into an empty ring).
+   *   demux() then pops from the ring and only waits when the reader fell behind, which getPrefetchStats()
+   *   counts. False if the input isn't open or read-ahead is already on.
+   */
+  bool startPrefetch(int nMaxPackets = 32, size_t nMaxBytes = 32 << 20) {
+    if (!av || isPrefetching() || nMaxPackets < 1) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mtxPrefetch);
+    nPrefetchMaxPackets = nMaxPackets;
+    nPrefetchMaxBytes = nMaxBytes;
+    bPrefetchStop = false;
+    bPrefetchEnd = false;
+    prefetchThread = std::thread(&FFmpegDemuxer::prefetchLoop, this);
+    return true;
+  }
+
+  /**
+   *   @brief  Join the reader after the read it is in. Packets already in the ring are still returned
+   *   by demux() before it reads on synchronously.
+   */
+  void stopPrefetch() {
+    if (!prefetchThread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mtxPrefetch);
+      bPrefetchStop = true;
+    }
+    cvPrefetchSpace.notify_all();
+    prefetchThread.join();
+  }
+
+  bool isPrefetching() const { return prefetchThread.joinable(); }
+
+  PrefetchStats getPrefetchStats() {
+    std::lock_guard<std::mutex> lock(mtxPrefetch);
+    return prefetchStats;
+  }
+
+ private:
+  /**
+   *   @brief  Fill in the codec parameters avformat_find_stream_info() would from the SPS, of the extradata
+   *   or else of the first video packet, which is then kept for demux(). False when that isn't enough:
+   *   another codec, no SPS, or a format the decoder doesn't take as is (4:2:2, monochrome, > 12 bits).
+   */
+  bool probeParameterSets() {
+    int idx = av_find_best_stream(av, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0) {
+      return false;
+    }
+    AVStream *st = av->streams[idx];
+    AVCodecParameters *par = st->codecpar;
+    if (par->codec_id != AV_CODEC_ID_H264 && par->codec_id != AV_CODEC_ID_HEVC) {
+      return false;
+    }
+    NvStreamInfo info;
+    if (par->extradata_size > 0) {
+      if (!NvSpsParser::parseExtradata(par->codec_id, par->extradata, (size_t)par->extradata_size, &info)) {
+        return false;
+      }
+    } else {
+      // raw and transport streams carry the parameter sets in-band, in front of the first key frame
+      int e = 0;
+      while ((e = av_read_frame(av, &pkt)) >= 0 && pkt.stream_index != idx) {
+        av_packet_unref(&pkt);
+      }
+      if (e < 0) {
+        return false;
+      }
+      // probing or not, demux() starts with it
+      bPendingPacket = true;
+      if (!NvSpsParser::parseAnnexB(par->codec_id, pkt.data, (size_t)pkt.size, &info)) {
+        return false;
+      }
+    }
+
+    AVPixelFormat eFormat = AV_PIX_FMT_NONE;
+    if (info.nBitDepthLuma == info.nBitDepthChroma && info.nChromaFormat == 1) {
+      eFormat = info.nBitDepthLuma == 8    ? AV_PIX_FMT_YUV420P
+                : info.nBitDepthLuma == 10 ? AV_PIX_FMT_YUV420P10LE
+                : info.nBitDepthLuma == 12 ? AV_PIX_FMT_YUV420P12LE
+                                           : AV_PIX_FMT_NONE;
+    } else if (info.nBitDepthLuma == info.nBitDepthChroma && info.nChromaFormat == 3) {
+      eFormat = info.nBitDepthLuma == 8    ? AV_PIX_FMT_YUV444P
+                : info.nBitDepthLuma == 10 ? AV_PIX_FMT_YUV444P10LE
+                : info.nBitDepthLuma == 12 ? AV_PIX_FMT_YUV444P12LE
+                                           : AV_PIX_FMT_NONE;
+    }
+    if (eFormat == AV_PIX_FMT_NONE) {
+      return false;
+    }
+
+    if (!par->width || !par->height) {
+      par->width = info.nWidth;
+      par->height = info.nHeight;
+    }
+    if (par->format < 0) {
+      par->format = eFormat;
+    }
+    if (par->profile < 0) {
+      par->profile = info.nProfile;
+    }
+    if (par->level < 0) {
+      par->level = info.nLevel;
+    }
+    if (!par->sample_aspect_ratio.num && info.nSarNum && info.nSarDen) {
+      par->sample_aspect_ratio = AVRational{info.nSarNum, info.nSarDen};
+    }
+    if (par->color_range == AVCOL_RANGE_UNSPECIFIED) {
+      par->color_range = info.bFullRange ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    }
+    if (info.bColorDescription && par->color_primaries == AVCOL_PRI_UNSPECIFIED &&
+        par->color_trc == AVCOL_TRC_UNSPECIFIED && par->color_space == AVCOL_SPC_UNSPECIFIED) {
+      par->color_primaries = (AVColorPrimaries)info.colorPrimaries;
+      par->color_trc = (AVColorTransferCharacteristic)info.transferCharacteristics;
+      par->color_space = (AVColorSpace)info.matrixCoefficients;
+    }
+    if (info.nFrameRateNum && info.nFrameRateDen) {
+      if (!st->avg_frame_rate.num) {
+        st->avg_frame_rate = AVRational{info.nFrameRateNum, info.nFrameRateDen};
+      }
+      if (!st->r_frame_rate.num) {
+        st->r_frame_rate = AVRational{info.nFrameRateNum, info.nFrameRateDen};
+      }
+    }
+    streamInfo = info;
+    bStreamInfo = true;
+    return true;
+  }
+
+  // 1sec * 1000: millisec
+  int64_t getTimestamp(const AVPacket *p) { return static_cast<int64_t>(timeBase * (double)p->pts * 1000); }
+
+  /**
+   *   @brief  mp4 MPEG-4 part 2: the first packet gets the extradata in front, in place of its start code
+   */
+  bool prependHeader(AVPacket *p) {
+    size_t extraDataSize = (size_t)av->streams[v_idx]->codecpar->extradata_size;
+    if (!bMp4MPEG4 || frameCount != 0 || extraDataSize == 0) {
+      return true;
+    }
+    // extradata contains start codes 00 00 01. Subtract its size
+    size_t dataWithHeaderSize = extraDataSize + (size_t)p->size - 3 * sizeof(uint8_t);
+    AVPacket *pWithHeader = packetPool.get();
+    if (!pWithHeader || av_new_packet(pWithHeader, (int)dataWithHeaderSize) < 0) {
+      __E("FFmpeg error: av_new_packet failed\n");
+      packetPool.put(pWithHeader);
+      return false;
+    }
+    memcpy(pWithHeader->data, av->streams[v_idx]->codecpar->extradata, extraDataSize);
+    memcpy(pWithHeader->data + extraDataSize, p->data + 3, (size_t)p->size - 3 * sizeof(uint8_t));
+    av_packet_copy_props(pWithHeader, p);
+    av_packet_unref(p);
+    av_packet_move_ref(p, pWithHeader);
+    packetPool.put(pWithHeader);
+    return true;
+  }
+
+  // the index turned out damaged: go on with the container's
+  void dropIndex() {
+    __E("FFmpegDemuxer: damaged packet index, using the container index \n");
+    pIndex = NULL;
+  }
+
+  bool seekInput(int64_t nTimestamp) {
+    if (pIndex) {
+      // straight to the indexed key frame; by byte offset for inputs that can't seek by time
+      if (!pIndex->getKeyFrameCount()) {
+        return false;
+      }
+      int64_t k = pIndex->findKeyFrame(nTimestamp);
+      if (k == NV_PACKET_INDEX_DAMAGED) {
+        dropIndex();
+        return seekInput(nTimestamp);
+      }
+      const NvPacketIndexEntry &e = pIndex->getKeyFrame(k < 0 ? 0 : (uint64_t)k);
+      int64_t ts = e.pts != AV_NOPTS_VALUE ? e.pts : e.dts;
+      if (av_seek_frame(av, v_idx, ts, AVSEEK_FLAG_BACKWARD) < 0 &&
+          (e.pos < 0 || av_seek_frame(av, v_idx, e.pos, AVSEEK_FLAG_BYTE) < 0)) {
+        return false;
+      }
+    } else {
+      int64_t ts = (int64_t)(nTimestamp / 1000.0 / timeBase);
+      if (av_seek_frame(av, v_idx, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        return false;
+      }
+    }
     if (pkt.data) {
       av_packet_unref(&pkt);
     }
+    bPendingPacket = false;
+    if (pktFiltered.data) {
+      av_packet_unref(&pktFiltered);
+    }
+    if (bsfc) {
+      av_bsf_flush(bsfc);
+    }
+    return true;
+  }
 
-    int e = 0;
+  /**
+   *   @brief  Next packet of the video stream into pkt, av_read_frame() error at the end of the input
+   */
+  int readVideoPacket() {
+    int e;
     while ((e = av_read_frame(av, &pkt)) >= 0 && pkt.stream_index != v_idx) {
       av_packet_unref(&pkt);
     }
+    return e;
+  }
+
+  /**
+   *   @brief  Next video packet of the input, Annex-B filtered for mp4 H.264/HEVC, moved into pOut.
+   *   Negative av_read_frame() error at the end of the input. Length-prefixed packets whose NAL lengths
+   *   run past their end are dropped, the decoder would only get the half converted bytes.
+   */
+  int readPacket(AVPacket *pOut) {
+    int e = 0;
+    // the packet probeParameterSets() read, unless probing then chose another stream
+    bool bRead = !bPendingPacket || pkt.stream_index != v_idx;
+    if (bPendingPacket && bRead) {
+      av_packet_unref(&pkt);
+    }
+    bPendingPacket = false;
+    if (bRead) {
+      e = readVideoPacket();
+    }
+    while (e >= 0 && bAnnexBInPlace) {
+      av_packet_move_ref(pOut, &pkt);
+      if (annexb.convert(pOut)) {
+        return 0;
+      }
+      __E("Demuxer error: dropped malformed length-prefixed packet at pts %lld \n", (long long)pOut->pts);
+      av_packet_unref(pOut);
+      e = readVideoPacket();
+    }
     if (e < 0) {
-      return false;
+      return e;
     }
-
     if (bMp4H264 || bMp4HEVC) {
-      if (pktFiltered.data) {
-        av_packet_unref(&pktFiltered);
-      }
       ck(av_bsf_send_packet(bsfc, &pkt));
-      ck(av_bsf_receive_packet(bsfc, &pktFiltered));
-      *ppVideo = pktFiltered.data;
-      *pnVideoBytes = (uint32_t)pktFiltered.size;
-      if (pts) {
-          // 1sec * 1000: millisec
-          auto cur_pts = (timeBase * (double)pktFiltered.pts * 1000);
-          *pts = static_cast<int64_t>(cur_pts);
-      }
+      ck(av_bsf_receive_packet(bsfc, pOut));
+    } else {
+      av_packet_move_ref(pOut, &pkt);
     }
-    else
+    return 0;
+  }
+
+  /**
+   *   @brief  demux() source: the ring while it has packets or the reader runs, then the input itself
+   */
+  bool nextPacket(AVPacket *pOut) {
     {
-        if (bMp4MPEG4 && (frameCount == 0))
-        {
-            size_t extraDataSize = (size_t)av->streams[v_idx]->codecpar->extradata_size;
-
-            if (extraDataSize > 0) {
-                auto dataWithHeadersize = extraDataSize + (size_t)pkt.size - 3 * sizeof(uint8_t);
-                // extradata contains start codes 00 00 01. Subtract its size
-                pDataWithHeader = (uint8_t *)av_malloc(dataWithHeadersize);
-
-                if (!pDataWithHeader) {
-                    __E("FFmpeg error: av_malloc failed\n");
-                    return false;
-                }
-
-                memcpy(pDataWithHeader, av->streams[v_idx]->codecpar->extradata,
-                       extraDataSize);
-                memcpy(pDataWithHeader + extraDataSize,
-                       pkt.data + 3,
-                       (size_t)pkt.size - 3 * sizeof(uint8_t));
-
-                *ppVideo = pDataWithHeader;
-                *pnVideoBytes = static_cast<uint32_t>(dataWithHeadersize);
-            }
+      std::unique_lock<std::mutex> lock(mtxPrefetch);
+      if (prefetchThread.joinable() && qPrefetch.empty() && !bPrefetchEnd && !bPrefetchStop) {
+        uint64_t nStart = NvMetrics::now();
+        cvPrefetchData.wait(lock, [this] { return !qPrefetch.empty() || bPrefetchEnd || bPrefetchStop; });
+        prefetchStats.nConsumerStalls++;
+        prefetchStats.nConsumerStallNs += NvMetrics::now() - nStart;
+      }
+      if (!qPrefetch.empty()) {
+        AVPacket *p = qPrefetch.front();
+        qPrefetch.pop_front();
+        nPrefetchBytes -= (size_t)p->size;
+        prefetchStats.nPackets++;
+        prefetchStats.nBytes += (uint64_t)p->size;
+        lock.unlock();
+        cvPrefetchSpace.notify_one();
+        av_packet_move_ref(pOut, p);
+        packetPool.put(p);
+        return true;
+      }
+      if (prefetchThread.joinable()) {
+        return false;
+      }
+    }
+    return readPacket(pOut) >= 0;
+  }
 
-        }
-        else
-        {
-            *ppVideo      = pkt.data;
-            *pnVideoBytes = static_cast<uint32_t>(pkt.size);
-        }
+  void prefetchLoop() {
+    NvTrace::setThreadName("demux read-ahead");
+    for (;;) {
+      AVPacket *p = packetPool.get();
+      int e = AVERROR(ENOMEM);
+      if (p) {
+        NvTraceScope scope("read-ahead", nTraceStream);
+        e = readPacket(p);
+      }
 
-        if (pts) {
-            auto cur_pts = (timeBase * (double)pkt.pts * 1000);
-            *pts = static_cast<int64_t>(cur_pts);
-        }
+      std::unique_lock<std::mutex> lock(mtxPrefetch);
+      if (e < 0) {
+        packetPool.put(p);
+        bPrefetchEnd = true;
+        lock.unlock();
+        cvPrefetchData.notify_all();
+        return;
+      }
+      auto hasRoom = [&] {
+        return qPrefetch.empty() || ((int)qPrefetch.size() < nPrefetchMaxPackets &&
+                                     nPrefetchBytes + (size_t)p->size <= nPrefetchMaxBytes);
+      };
+      if (!hasRoom() && !bPrefetchStop) {
+        uint64_t nStart = NvMetrics::now();
+        cvPrefetchSpace.wait(lock, [&] { return bPrefetchStop || hasRoom(); });
+        prefetchStats.nProducerStalls++;
+        prefetchStats.nProducerStallNs += NvMetrics::now() - nStart;
+      }
+      // on stop the packet read last is kept, it is the next one of the input
+      qPrefetch.push_back(p);
+      nPrefetchBytes += (size_t)p->size;
+      prefetchStats.nMaxDepth = std::max(prefetchStats.nMaxDepth, (int)qPrefetch.size());
+      prefetchStats.nMaxDepthBytes = std::max(prefetchStats.nMaxDepthBytes, nPrefetchBytes);
+      bool bStop = bPrefetchStop;
+      lock.unlock();
+      cvPrefetchData.notify_one();
+      if (bStop) {
+        return;
+      }
     }
+  }
 
-    frameCount++;
+  void flushPrefetch() {
+    std::lock_guard<std::mutex> lock(mtxPrefetch);
+    for (AVPacket *p : qPrefetch) {
+      packetPool.put(p);
+    }
+    qPrefetch.clear();
+    nPrefetchBytes = 0;
+  }
 
-    return true;
+ public:
+
+  /**
+   *   @brief  Timestamp (ms) of the key frame seek(nTimestamp) lands on, from the container index.
+   *   -1 when the container has no index entry for it.
+   */
+  int64_t getKeyFrameBefore(int64_t nTimestamp) {
+    if (!av) {
+      return -1;
+    }
+    if (pIndex) {
+      int64_t k = pIndex->findKeyFrame(nTimestamp);
+      if (k != NV_PACKET_INDEX_DAMAGED) {
+        return k < 0 ? -1 : pIndex->getTimestamp(pIndex->getKeyFrame((uint64_t)k));
+      }
+      dropIndex();
+    }
+    AVStream *st = av->streams[v_idx];
+    int i = av_index_search_timestamp(st, (int64_t)(nTimestamp / 1000.0 / timeBase), AVSEEK_FLAG_BACKWARD);
+    if (i < 0) {
+      return -1;
+    }
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    const AVIndexEntry *e = avformat_index_get_entry(st, i);
+#else
+    const AVIndexEntry *e = &st->index_entries[i];
+#endif
+    return e ? (int64_t)(timeBase * (double)e->timestamp * 1000) : -1;
+  }
+
+  /**
+   *   @brief  Average frame rate of the video stream, 0 if unknown
+   */
+  double getFrameRate() {
+    if (pIndex) {
+      return pIndex->getFrameRate();
+    }
+    if (!av) {
+      return 0;
+    }
+    AVRational r = av->streams[v_idx]->avg_frame_rate;
+    if (!r.num || !r.den) {
+      r = av->streams[v_idx]->r_frame_rate;
+    }
+    return (r.num && r.den) ? av_q2d(r) : 0;
+  }
+
+  /**
+   *   @brief  demux() pts (ms) of the first frame
+   */
+  int64_t getStartTimestamp() {
+    if (pIndex) {
+      return pIndex->getStartTimestamp();
+    }
+    if (!av || av->streams[v_idx]->start_time == AV_NOPTS_VALUE) {
+      return 0;
+    }
+    return (int64_t)(timeBase * (double)av->streams[v_idx]->start_time * 1000);
+  }
+
+  /**
+   *   @brief  Duration (ms) of the video stream, 0 if unknown
+   */
+  int64_t getDuration() {
+    if (pIndex) {
+      return pIndex->getDuration();
+    }
+    if (!av) {
+      return 0;
+    }
+    if (av->streams[v_idx]->duration != AV_NOPTS_VALUE) {
+      return (int64_t)(timeBase * (double)av->streams[v_idx]->duration * 1000);
+    }
+    return av->duration != AV_NOPTS_VALUE ? av->duration / (AV_TIME_BASE / 1000) : 0;
+  }
+
+  /**
+   *   @brief  Number of video packets (frames), 0 if the container doesn't tell
+   */
+  int64_t getFrameCount() {
+    if (pIndex) {
+      return (int64_t)pIndex->getPacketCount();
+    }
+    return av ? av->streams[v_idx]->nb_frames : 0;
   }
 
   static int dataProviderRead(void *opaque, uint8_t *pBuf, int nBuf) {
     return ((DataProvider *)opaque)->GetData(pBuf, nBuf);
   }
+
+  static int64_t dataProviderSeek(void *opaque, int64_t nOffset, int whence) {
+    return ((DataProvider *)opaque)->Seek(nOffset, whence);
+  }
+};
+
+/**
+ * @brief  The bytes of an NvAnnexBReader's mapping as a seekable FFmpegDemuxer::DataProvider, for code paths
+ * that still want libavformat on a raw stream. pReader is not owned and must outlive the demuxer.
+ */
+class NvAnnexBDataProvider : public FFmpegDemuxer::DataProvider {
+ public:
+  NvAnnexBDataProvider(NvAnnexBReader *pReader) : pReader(pReader) {}
+
+  int GetData(uint8_t *pBuf, int nBuf) { return pReader->GetData(pBuf, nBuf); }
+  bool IsSeekable() { return true; }
+  int64_t Seek(int64_t nOffset, int whence) { return pReader->Seek(nOffset, whence); }
+
+ private:
+  NvAnnexBReader *pReader;
 };
 
 inline uint32_t FFmpeg2NvCodecId(AVCodecID id) {
@@ -0,0 +1,335 @@
+#include <string.h>
+#include "NvAnnexB.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define NV_ANNEXB_AVX2 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+typedef const uint8_t *(*FindStartCodeFn)(const uint8_t *p, const uint8_t *pEnd);
+
+/* Looks at every third byte while it is above 1, which no start code can contain */
+static const uint8_t *findStartCodeScalar(const uint8_t *p, const uint8_t *pEnd)
+{
+    if (pEnd - p < 3) {
+        return pEnd;
+    }
+    for (const uint8_t *q = p + 2; q < pEnd; ) {
+        if (*q > 1) {
+            q += 3;
+        } else if (q[-1]) {
+            q += 2;
+        } else if (q[-2] || *q != 1) {
+            q++;
+        } else {
+            return q - 2;
+        }
+    }
+    return pEnd;
+}
+
+/* The SIMD scanners compare three overlapping loads, at p, p + 1 and p + 2, for 0, 0 and 1: the lowest set
+   bit of the mask is the first start code of the block. The tail goes to the scalar scanner. */
+#if defined(__SSE2__)
+static const uint8_t *findStartCodeSse2(const uint8_t *p, const uint8_t *pEnd)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; pEnd - p >= 18; p += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)),
+                                                   _mm_cmpeq_epi8(c, one)));
+        if (mask) {
+            return p + __builtin_ctz((unsigned)mask);
+        }
+    }
+    return findStartCodeScalar(p, pEnd);
+}
+#endif
+
+#if defined(NV_ANNEXB_AVX2)
+__attribute__((target("avx2")))
+static const uint8_t *findStartCodeAvx2(const uint8_t *p, const uint8_t *pEnd)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    for (; pEnd - p >= 34; p += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + 2));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)),
+                             _mm256_cmpeq_epi8(c, one)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return findStartCodeScalar(p, pEnd);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static const uint8_t *findStartCodeNeon(const uint8_t *p, const uint8_t *pEnd)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    for (; pEnd - p >= 18; p += 16) {
+        uint8x16_t m = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero), vceqq_u8(vld1q_u8(p + 1), zero)),
+                                vceqq_u8(vld1q_u8(p + 2), one));
+        if (vmaxvq_u8(m)) {
+            // no movemask on NEON; the block holds a match, the scalar scanner finds the first
+            return findStartCodeScalar(p, p + 18);
+        }
+    }
+    return findStartCodeScalar(p, pEnd);
+}
+#endif
+
+static FindStartCodeFn getFindStartCode(NvStartCodeScanner eScanner)
+{
+    switch (eScanner) {
+    case NV_SCANNER_AUTO:
+        for (int e = NV_SCANNER_COUNT - 1; e > NV_SCANNER_AUTO; e--) {
+            if (NvIsStartCodeScannerSupported((NvStartCodeScanner)e)) {
+                return getFindStartCode((NvStartCodeScanner)e);
+            }
+        }
+        break;
+#if defined(__SSE2__)
+    case NV_SCANNER_SSE2:
+        return findStartCodeSse2;
+#endif
+#if defined(NV_ANNEXB_AVX2)
+    case NV_SCANNER_AVX2:
+        return NvIsStartCodeScannerSupported(NV_SCANNER_AVX2) ? findStartCodeAvx2 : findStartCodeScalar;
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    case NV_SCANNER_NEON:
+        return findStartCodeNeon;
+#endif
+    default:
+        break;
+    }
+    return findStartCodeScalar;
+}
+
+bool NvIsStartCodeScannerSupported(NvStartCodeScanner eScanner)
+{
+    switch (eScanner) {
+    case NV_SCANNER_AUTO:
+    case NV_SCANNER_SCALAR:
+        return true;
+#if defined(__SSE2__)
+    case NV_SCANNER_SSE2:
+        return true;
+#endif
+#if defined(NV_ANNEXB_AVX2)
+    case NV_SCANNER_AVX2: {
+        static const bool bAvx2 = __builtin_cpu_supports("avx2");
+        return bAvx2;
+    }
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    case NV_SCANNER_NEON:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *NvGetStartCodeScannerName(NvStartCodeScanner eScanner)
+{
+    static const char *aszName[NV_SCANNER_COUNT] = { "auto", "scalar", "sse2", "avx2", "neon" };
+    return eScanner >= 0 && eScanner < NV_SCANNER_COUNT ? aszName[eScanner] : "";
+}
+
+const uint8_t *NvFindStartCodeWith(NvStartCodeScanner eScanner, const uint8_t *p, const uint8_t *pEnd)
+{
+    return getFindStartCode(eScanner)(p, pEnd);
+}
+
+const uint8_t *NvFindStartCode(const uint8_t *p, const uint8_t *pEnd)
+{
+    static const FindStartCodeFn fnFind = getFindStartCode(NV_SCANNER_AUTO);
+    return fnFind(p, pEnd);
+}
+
+static uint32_t readBe16(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+static uint32_t readBe32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+bool NvAnnexBConverter::appendUnits(const uint8_t *p, size_t n, size_t *pnOffset, int nUnits)
+{
+    static const uint8_t aStartCode[4] = { 0, 0, 0, 1 };
+    size_t off = *pnOffset;
+    for (int i = 0; i < nUnits; i++) {
+        if (n - off < 2) {
+            return false;
+        }
+        size_t nUnit = readBe16(p + off);
+        off += 2;
+        if (n - off < nUnit) {
+            return false;
+        }
+        m_vParameterSets.insert(m_vParameterSets.end(), aStartCode, aStartCode + sizeof(aStartCode));
+        m_vParameterSets.insert(m_vParameterSets.end(), p + off, p + off + nUnit);
+        off += nUnit;
+    }
+    *pnOffset = off;
+    return true;
+}
+
+bool NvAnnexBConverter::init(int codecId, const uint8_t *pExtradata, size_t nExtradata)
+{
+    m_nLengthSize = 0;
+    m_vParameterSets.clear();
+    if (codecId != AV_CODEC_ID_H264 && codecId != AV_CODEC_ID_HEVC) {
+        return false;
+    }
+    m_bHevc = codecId == AV_CODEC_ID_HEVC;
+    const uint8_t *p = pExtradata;
+    size_t n = nExtradata;
+    if (!p || n < 7 || (p[0] == 0 && p[1] == 0 && (p[2] == 1 || (p[2] == 0 && p[3] == 1)))) {
+        // missing, or starts with a start code
+        return false;
+    }
+
+    int nLengthSize = 0;
+    size_t off = 0;
+    bool bOk = true;
+    if (!m_bHevc) {
+        // avcC: version, profile, compatibility, level, 6 bits reserved + lengthSizeMinusOne, then
+        // 3 bits reserved + SPS count, the SPS, PPS count, the PPS; each unit 16-bit size first
+        nLengthSize = (p[4] & 3) + 1;
+        off = 6;
+        bOk = appendUnits(p, n, &off, p[5] & 0x1f) && off < n;
+        if (bOk) {
+            int nPps = p[off++];
+            bOk = appendUnits(p, n, &off, nPps);
+        }
+    } else if (n < 23) {
+        bOk = false;
+    } else {
+        // hvcC: 21 bytes of profile/tier/level and format fields, lengthSizeMinusOne, array count; each
+        // array a NAL type byte, 16-bit unit count and the units
+        nLengthSize = (p[21] & 3) + 1;
+        int nArrays = p[22];
+        off = 23;
+        for (int i = 0; bOk && i < nArrays; i++) {
+            bOk = n - off >= 3;
+            if (bOk) {
+                int nUnits = (int)readBe16(p + off + 1);
+                off += 3;
+                bOk = appendUnits(p, n, &off, nUnits);
+            }
+        }
+    }
+    if (!bOk || nLengthSize == 3) {
+        m_vParameterSets.clear();
+        return false;
+    }
+    m_nLengthSize = nLengthSize;
+    return true;
+}
+
+bool NvAnnexBConverter::isParameterSet(uint8_t nalHeader) const
+{
+    if (m_bHevc) {
+        int type = (nalHeader >> 1) & 0x3f;
+        return type >= 32 && type <= 34;    // VPS, SPS, PPS
+    }
+    int type = nalHeader & 0x1f;
+    return type == 7 || type == 8;          // SPS, PPS
+}
+
+bool NvAnnexBConverter::isIrap(uint8_t nalHeader) const
+{
+    if (m_bHevc) {
+        int type = (nalHeader >> 1) & 0x3f;
+        return type >= 16 && type <= 23;    // BLA, IDR, CRA and reserved IRAP
+    }
+    return (nalHeader & 0x1f) == 5;         // IDR slice
+}
+
+bool NvAnnexBConverter::convertInPlace(uint8_t *pData, size_t nBytes, int64_t *pnInsert) const
+{
+    *pnInsert = -1;
+    bool bParameterSets = false;
+    int64_t iIrap = -1;
+    size_t off = 0;
+    while (off < nBytes) {
+        if (nBytes - off < 4) {
+            return false;
+        }
+        uint32_t nUnit = readBe32(pData + off);
+        if (nUnit > nBytes - off - 4) {
+            return false;
+        }
+        if (nUnit) {
+            uint8_t nalHeader = pData[off + 4];
+            if (isParameterSet(nalHeader)) {
+                bParameterSets = true;
+            } else if (iIrap < 0 && isIrap(nalHeader)) {
+                iIrap = (int64_t)off;
+            }
+        }
+        pData[off] = 0;
+        pData[off + 1] = 0;
+        pData[off + 2] = 0;
+        pData[off + 3] = 1;
+        off += 4 + (size_t)nUnit;
+    }
+    if (iIrap >= 0 && !bParameterSets && !m_vParameterSets.empty()) {
+        *pnInsert = iIrap;
+    }
+    return true;
+}
+
+bool NvAnnexBConverter::convert(AVPacket *pkt) const
+{
+    if (!isInPlace() || av_packet_make_writable(pkt) < 0) {
+        return false;
+    }
+    int64_t nInsert = -1;
+    if (!convertInPlace(pkt->data, (size_t)pkt->size, &nInsert)) {
+        return false;
+    }
+    if (nInsert < 0) {
+        return true;
+    }
+
+    size_t nHeader = m_vParameterSets.size();
+    size_t nBytes = (size_t)pkt->size + nHeader;
+    AVBufferRef *buf = av_buffer_alloc(nBytes + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf) {
+        return false;
+    }
+    memcpy(buf->data, pkt->data, (size_t)nInsert);
+    memcpy(buf->data + nInsert, m_vParameterSets.data(), nHeader);
+    memcpy(buf->data + nInsert + nHeader, pkt->data + nInsert, (size_t)pkt->size - (size_t)nInsert);
+    memset(buf->data + nBytes, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size = (int)nBytes;
+    return true;
+}
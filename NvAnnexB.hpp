@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+struct AVPacket;
+
+enum NvStartCodeScanner {
+    NV_SCANNER_AUTO,        // the fastest one the CPU supports
+    NV_SCANNER_SCALAR,
+    NV_SCANNER_SSE2,
+    NV_SCANNER_AVX2,        // runtime-detected, the build needs no -mavx2
+    NV_SCANNER_NEON,        // AArch64
+    NV_SCANNER_COUNT
+};
+
+/**
+*   @brief  First 00 00 01 start code at or after p that ends before pEnd, pEnd if there is none.
+*   A 4-byte start code is found at its second byte.
+*/
+const uint8_t *NvFindStartCode(const uint8_t *p, const uint8_t *pEnd);
+/**
+*   @brief  NvFindStartCode() with a given implementation, e.g. to benchmark them; scanners the build or
+*   the CPU lacks fall back to the scalar one, see NvIsStartCodeScannerSupported()
+*/
+const uint8_t *NvFindStartCodeWith(NvStartCodeScanner eScanner, const uint8_t *p, const uint8_t *pEnd);
+bool NvIsStartCodeScannerSupported(NvStartCodeScanner eScanner);
+const char *NvGetStartCodeScannerName(NvStartCodeScanner eScanner);
+
+/**
+* @brief Length-prefixed (mp4/mkv/flv, avcC/hvcC) H.264 and HEVC to Annex-B, in place of the
+* h264_mp4toannexb and hevc_mp4toannexb bitstream filters. The parameter sets are parsed once from the
+* extradata. With 4-byte NAL lengths each prefix is overwritten with a start code of the same size, so a
+* packet is only reallocated when the parameter sets have to go in front of an IDR/IRAP picture that
+* doesn't carry its own.
+*/
+class NvAnnexBConverter {
+public:
+    /**
+    *   @brief  Parse avcC (AV_CODEC_ID_H264) or hvcC (AV_CODEC_ID_HEVC) extradata. False for other codecs,
+    *   damaged extradata and extradata that already is Annex-B (the packets then are too).
+    */
+    bool init(int codecId, const uint8_t *pExtradata, size_t nExtradata);
+
+    bool isInitialized() const { return m_nLengthSize != 0; }
+    // NAL length prefix size in bytes: 1, 2 or 4
+    int getLengthSize() const { return m_nLengthSize; }
+    // only 4-byte prefixes are rewritten in place, see convert()
+    bool isInPlace() const { return m_nLengthSize == 4; }
+    // Annex-B VPS/SPS/PPS (and SEI) from the extradata, 4-byte start codes
+    const std::vector<uint8_t> &getParameterSets() const { return m_vParameterSets; }
+
+    /**
+    *   @brief  Replace the 4-byte length prefixes of pData with start codes.
+    *   @param  pnInsert - offset of the first IDR/IRAP NAL where the parameter sets must be inserted,
+    *   -1 if they needn't be (no such picture, or the packet has them in-band)
+    *   @return false if a length runs past the end; the prefixes before it are converted
+    */
+    bool convertInPlace(uint8_t *pData, size_t nBytes, int64_t *pnInsert) const;
+
+    /**
+    *   @brief  Convert a demuxed packet: in place when its buffer is writable (a packet of its own from
+    *   av_read_frame() is), one allocation when the parameter sets are inserted. Requires isInPlace().
+    */
+    bool convert(AVPacket *pkt) const;
+
+private:
+    bool isParameterSet(uint8_t nalHeader) const;
+    bool isIrap(uint8_t nalHeader) const;
+    bool appendUnits(const uint8_t *p, size_t n, size_t *pnOffset, int nUnits);
+
+    bool m_bHevc = false;
+    int m_nLengthSize = 0;
+    std::vector<uint8_t> m_vParameterSets;
+};
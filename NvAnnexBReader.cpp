@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "NvAnnexBReader.hpp"
+#include "NvAnnexB.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
+}
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+static int getCodecFromExtension(const char *szFilePath)
+{
+    const char *szExt = strrchr(szFilePath, '.');
+    if (!szExt) {
+        return 0;
+    }
+    szExt++;
+    if (!strcasecmp(szExt, "h264") || !strcasecmp(szExt, "264") || !strcasecmp(szExt, "avc") ||
+        !strcasecmp(szExt, "jsv")) {
+        return AV_CODEC_ID_H264;
+    }
+    if (!strcasecmp(szExt, "h265") || !strcasecmp(szExt, "265") || !strcasecmp(szExt, "hevc")) {
+        return AV_CODEC_ID_HEVC;
+    }
+    return 0;
+}
+
+NvAnnexBReader *NvAnnexBReader::open(const char *szFilePath, int codecId)
+{
+    if (!codecId) {
+        codecId = getCodecFromExtension(szFilePath);
+    }
+    if (codecId != AV_CODEC_ID_H264 && codecId != AV_CODEC_ID_HEVC) {
+        __E("NvAnnexBReader: %s is not a raw H.264 or HEVC stream \n", szFilePath);
+        return NULL;
+    }
+
+    int fd = ::open(szFilePath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *pMap = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        pMap = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    // the mapping keeps the file referenced
+    close(fd);
+    if (pMap == MAP_FAILED) {
+        return NULL;
+    }
+    // read front to back, once
+    madvise(pMap, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    NvAnnexBReader *pReader = new NvAnnexBReader();
+    pReader->m_pMap = pMap;
+    pReader->m_pData = (const uint8_t *)pMap;
+    pReader->m_nBytes = (size_t)st.st_size;
+    pReader->m_codecId = codecId;
+    pReader->m_bHevc = codecId == AV_CODEC_ID_HEVC;
+    pReader->rewind();
+    return pReader;
+}
+
+NvAnnexBReader::~NvAnnexBReader()
+{
+    if (m_pMap) {
+        munmap(m_pMap, m_nBytes);
+    }
+}
+
+void NvAnnexBReader::rewind()
+{
+    // anything before the first start code is not part of the stream
+    const uint8_t *pEnd = m_pData + m_nBytes;
+    const uint8_t *p = NvFindStartCode(m_pData, pEnd);
+    m_nPos = p < pEnd && p > m_pData && p[-1] == 0 ? p - 1 - m_pData : p - m_pData;
+    m_pNal = m_pNalEnd = NULL;
+    m_bKeyFrame = false;
+}
+
+bool NvAnnexBReader::isVcl(const uint8_t *pNal) const
+{
+    if (m_bHevc) {
+        return ((pNal[0] >> 1) & 0x3f) < 32;
+    }
+    int type = pNal[0] & 0x1f;
+    return type >= 1 && type <= 5;
+}
+
+bool NvAnnexBReader::isIrap(const uint8_t *pNal) const
+{
+    if (m_bHevc) {
+        int type = (pNal[0] >> 1) & 0x3f;
+        return type >= 16 && type <= 23;
+    }
+    return (pNal[0] & 0x1f) == 5;
+}
+
+/* H.264 7.4.1.2.3 and HEVC 7.4.2.4.4, for an access unit that already has a picture (bVcl) */
+bool NvAnnexBReader::startsAccessUnit(const uint8_t *pNal, const uint8_t *pEnd, bool bVcl) const
+{
+    if (!bVcl) {
+        return false;
+    }
+    if (m_bHevc) {
+        int type = (pNal[0] >> 1) & 0x3f;
+        if (type < 32) {
+            // first_slice_segment_in_pic_flag, the first bit after the 2-byte NAL header
+            return pEnd - pNal > 2 && (pNal[2] & 0x80);
+        }
+        // VPS, SPS, PPS, AUD, prefix SEI, reserved 41..44 and 48..55
+        return (type >= 32 && type <= 35) || type == 39 || (type >= 41 && type <= 44) ||
+               (type >= 48 && type <= 55);
+    }
+    int type = pNal[0] & 0x1f;
+    if (type >= 1 && type <= 5) {
+        // first_mb_in_slice == 0: its ue(v) code is a single 1 bit
+        return pEnd - pNal > 1 && (pNal[1] & 0x80);
+    }
+    // SEI, SPS, PPS, AUD, 14..18
+    return (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+}
+
+bool NvAnnexBReader::demux(uint8_t **ppVideo, uint32_t *pnVideoBytes, int64_t *pts)
+{
+    *pnVideoBytes = 0;
+    const uint8_t *pEnd = m_pData + m_nBytes;
+    const uint8_t *pUnit = m_pData + m_nPos;
+    if (pUnit >= pEnd) {
+        return false;
+    }
+
+    bool bVcl = false, bKeyFrame = false;
+    const uint8_t *pNext = pEnd;
+    // the unit begins with a start code, 00 00 01 may follow the leading 0 of a 4-byte one. The NAL that
+    // ended the previous unit was scanned already, which saves a second pass over a whole slice.
+    const uint8_t *p = m_pNal ? m_pNal : NvFindStartCode(pUnit, pEnd);
+    const uint8_t *q = m_pNalEnd;
+    m_pNal = m_pNalEnd = NULL;
+    while (p < pEnd) {
+        const uint8_t *pNal = p + 3;
+        if (!q) {
+            q = NvFindStartCode(pNal, pEnd);
+        }
+        if (pNal < q) {
+            if (startsAccessUnit(pNal, q, bVcl)) {
+                pNext = p > pUnit && p[-1] == 0 ? p - 1 : p;
+                m_pNal = p;
+                m_pNalEnd = q;
+                break;
+            }
+            if (isVcl(pNal)) {
+                bVcl = true;
+                bKeyFrame = bKeyFrame || isIrap(pNal);
+            }
+        }
+        p = q;
+        q = NULL;
+    }
+
+    *ppVideo = (uint8_t *)pUnit;
+    *pnVideoBytes = (uint32_t)(pNext - pUnit);
+    if (pts) {
+        *pts = AV_NOPTS_VALUE;
+    }
+    m_nPos = pNext - m_pData;
+    m_bKeyFrame = bKeyFrame;
+    return true;
+}
+
+bool NvAnnexBReader::getStreamInfo(NvStreamInfo *pInfo) const
+{
+    return NvSpsParser::parseAnnexB(m_codecId, m_pData, m_nBytes, pInfo);
+}
+
+int NvAnnexBReader::GetData(uint8_t *pBuf, int nBuf)
+{
+    size_t n = std::min((size_t)std::max(nBuf, 0), m_nBytes - m_nReadPos);
+    if (!n) {
+        return AVERROR_EOF;
+    }
+    memcpy(pBuf, m_pData + m_nReadPos, n);
+    m_nReadPos += n;
+    return (int)n;
+}
+
+int64_t NvAnnexBReader::Seek(int64_t nOffset, int whence)
+{
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        return (int64_t)m_nBytes;
+    }
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+        return -1;
+    }
+    int64_t nBase = whence == SEEK_CUR ? (int64_t)m_nReadPos : whence == SEEK_END ? (int64_t)m_nBytes : 0;
+    int64_t nPos = nBase + nOffset;
+    if (nPos < 0 || nPos > (int64_t)m_nBytes) {
+        return -1;
+    }
+    m_nReadPos = (size_t)nPos;
+    return nPos;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "NvSpsParser.hpp"
+
+/**
+* @brief Raw H.264/HEVC elementary stream (.h264, .264, .h265, .265, .hevc) without libavformat: the file
+* is memory-mapped and split into access units with NvFindStartCode(). demux() has the signature of
+* FFmpegDemuxer::demux() and returns pointers into the mapping, so the units go to NvDecoder::decode()
+* without a copy and stay valid as long as the reader. GetData()/Seek() serve the same bytes to
+* libavformat through NvAnnexBDataProvider (FFmpegDemuxer.hpp).
+*/
+class NvAnnexBReader {
+public:
+    /**
+    *   @brief  Map szFilePath. codecId is AV_CODEC_ID_H264 or AV_CODEC_ID_HEVC, 0 guesses it from the
+    *   file extension. NULL if the file can't be mapped or the codec is unknown.
+    */
+    static NvAnnexBReader *open(const char *szFilePath, int codecId = 0);
+
+    ~NvAnnexBReader();
+
+    /**
+    *   @brief  Next access unit, split at AUD, parameter set and prefix SEI NALs and at slices that
+    *   start a picture (first_mb_in_slice / first_slice_segment_in_pic_flag). Units come in decode
+    *   order and a raw stream carries no timing, so pts is AV_NOPTS_VALUE, as from libavformat.
+    */
+    bool demux(uint8_t **ppVideo, uint32_t *pnVideoBytes, int64_t *pts = NULL);
+    /**
+    *   @brief  Whether the unit returned by the last demux() has an IDR (H.264) or IRAP (HEVC) picture
+    */
+    bool isKeyFrame() const { return m_bKeyFrame; }
+    // back to the first access unit
+    void rewind();
+
+    int getVideoCodec() const { return m_codecId; }
+    /**
+    *   @brief  Format from the first SPS of the stream, see NvDecoder::prepareSession()
+    */
+    bool getStreamInfo(NvStreamInfo *pInfo) const;
+    const uint8_t *getData() const { return m_pData; }
+    size_t getSize() const { return m_nBytes; }
+
+    // the file's bytes from a position of their own, for NvAnnexBDataProvider
+    int GetData(uint8_t *pBuf, int nBuf);
+    bool IsSeekable() { return true; }
+    int64_t Seek(int64_t nOffset, int whence);
+
+private:
+    NvAnnexBReader() {}
+    bool startsAccessUnit(const uint8_t *pNal, const uint8_t *pEnd, bool bVcl) const;
+    bool isVcl(const uint8_t *pNal) const;
+    bool isIrap(const uint8_t *pNal) const;
+
+    void *m_pMap = NULL;
+    const uint8_t *m_pData = NULL;
+    size_t m_nBytes = 0;
+    int m_codecId = 0;
+    bool m_bHevc = false;
+
+    size_t m_nPos = 0;          // start of the next access unit
+    // its first start code and the one after, when demux() already scanned them
+    const uint8_t *m_pNal = NULL, *m_pNalEnd = NULL;
+    size_t m_nReadPos = 0;      // GetData() position
+    bool m_bKeyFrame = false;
+};
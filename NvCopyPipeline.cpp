@@ -0,0 +1,227 @@
+#include <math.h>
+#include "NvCopyPipeline.hpp"
+#include "NvDecoderBackend.hpp"
+#include "NvMetrics.hpp"
+
+NvBackendCopyEngine::~NvBackendCopyEngine()
+{
+    m_pBackend->ctxPushCurrent(m_cuContext);
+    for (CUevent event : m_vEvent) {
+        m_pBackend->eventDestroy(event);
+    }
+    if (m_stream) {
+        m_pBackend->streamDestroy(m_stream);
+    }
+    m_pBackend->ctxPopCurrent();
+}
+
+void NvBackendCopyEngine::init(int nStages)
+{
+    m_vEvent.resize(nStages, NULL);
+    NVDEC_API_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    NVDEC_API_CALL(m_pBackend->streamCreate(&m_stream, CU_STREAM_NON_BLOCKING));
+    for (auto &event : m_vEvent) {
+        NVDEC_API_CALL(m_pBackend->eventCreate(&event, CU_EVENT_DISABLE_TIMING));
+    }
+    NVDEC_API_CALL(m_pBackend->ctxPopCurrent());
+}
+
+uint8_t *NvBackendCopyEngine::allocStage(size_t nBytes)
+{
+    CUdeviceptr dpStage = 0;
+    NVDEC_API_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    NVDEC_API_CALL(m_pBackend->memAlloc(&dpStage, nBytes));
+    NVDEC_API_CALL(m_pBackend->ctxPopCurrent());
+    return (uint8_t *)dpStage;
+}
+
+void NvBackendCopyEngine::freeStage(uint8_t *pStage)
+{
+    m_pBackend->ctxPushCurrent(m_cuContext);
+    m_pBackend->memFree((CUdeviceptr)pStage);
+    m_pBackend->ctxPopCurrent();
+}
+
+void NvBackendCopyEngine::copyAsync(int iStage, uint8_t *pDst, const uint8_t *pSrc, int nPitch, int nRows)
+{
+    CUDA_MEMCPY2D m = { 0 };
+    m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    m.srcDevice     = (CUdeviceptr)pSrc;
+    m.srcPitch      = nPitch;
+    m.dstMemoryType = CU_MEMORYTYPE_HOST;
+    m.dstHost       = pDst;
+    m.dstPitch      = nPitch;
+    m.WidthInBytes  = nPitch;
+    m.Height        = nRows;
+
+    NVDEC_API_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    NVDEC_API_CALL(m_pBackend->memcpy2DAsync(&m, m_stream));
+    NVDEC_API_CALL(m_pBackend->eventRecord(m_vEvent[iStage], m_stream));
+    NVDEC_API_CALL(m_pBackend->ctxPopCurrent());
+}
+
+bool NvBackendCopyEngine::isDone(int iStage)
+{
+    NVDEC_API_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    CUresult result = m_pBackend->eventQuery(m_vEvent[iStage]);
+    NVDEC_API_CALL(m_pBackend->ctxPopCurrent());
+    if (result == CUDA_ERROR_NOT_READY) {
+        return false;
+    }
+    NVDEC_API_CALL(result);
+    return true;
+}
+
+void NvBackendCopyEngine::wait(int iStage)
+{
+    NVDEC_API_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    NVDEC_API_CALL(m_pBackend->eventSynchronize(m_vEvent[iStage]));
+    NVDEC_API_CALL(m_pBackend->ctxPopCurrent());
+}
+
+void NvCpuCopyEngine::copyAsync(int iStage, uint8_t *pDst, const uint8_t *pSrc, int nPitch, int nRows)
+{
+    Pending &pending = m_vPending[iStage];
+    pending.pDst       = pDst;
+    pending.pSrc       = pSrc;
+    pending.nBytes     = (size_t)nPitch * nRows;
+    pending.nPollsLeft = m_nLatency;
+}
+
+bool NvCpuCopyEngine::isDone(int iStage)
+{
+    Pending &pending = m_vPending[iStage];
+    if (pending.pDst && pending.nPollsLeft > 0) {
+        pending.nPollsLeft--;
+        return false;
+    }
+    wait(iStage);
+    return true;
+}
+
+void NvCpuCopyEngine::wait(int iStage)
+{
+    Pending &pending = m_vPending[iStage];
+    if (pending.pDst) {
+        memcpy(pending.pDst, pending.pSrc, pending.nBytes);
+        m_nCopies++;
+    }
+    pending = Pending();
+}
+
+NvCopyPipeline::NvCopyPipeline(NvCopyEngine *pEngine, int nStages) : m_pEngine(pEngine)
+{
+    nStages = std::max(nStages, 1);
+    m_pEngine->init(nStages);
+    m_vStage.resize(nStages);
+    for (int i = 0; i < nStages; i++) {
+        m_vStage[i].index     = i;
+        m_vStage[i].state     = STAGE_FREE;
+        m_vStage[i].pData     = NULL;
+        m_vStage[i].nCapacity = 0;
+        m_vStage[i].nSubmitNs = 0;
+        m_vStage[i].nTraceStream  = -1;
+        m_vStage[i].nTracePicture = -1;
+    }
+}
+
+NvCopyPipeline::~NvCopyPipeline()
+{
+    // copies still in flight write into frames and read stage buffers, let them land first
+    for (int iStage : m_qInFlight) {
+        m_pEngine->wait(iStage);
+    }
+    for (auto &stage : m_vStage) {
+        if (stage.pData) {
+            m_pEngine->freeStage(stage.pData);
+        }
+    }
+    delete m_pEngine;
+}
+
+void NvCopyPipeline::retire(Stage *pStage, std::vector<NvFrame> &vDone)
+{
+    if (pStage->nSubmitNs) {
+        uint64_t nDoneNs = NvMetrics::now();
+        NvMetrics::record(NV_STAGE_COPY, nDoneNs - pStage->nSubmitNs);
+        NvTrace::record(NvMetrics::getStageName(NV_STAGE_COPY), pStage->nSubmitNs, nDoneNs,
+                        pStage->nTraceStream, pStage->nTracePicture);
+    }
+    vDone.push_back(std::move(pStage->frame));
+    pStage->frame.reset();
+    pStage->state = STAGE_FREE;
+}
+
+NvCopyPipeline::Stage *NvCopyPipeline::acquireStage(size_t nBytes, std::vector<NvFrame> &vDone)
+{
+    Stage *pStage = NULL;
+    for (auto &stage : m_vStage) {
+        if (stage.state == STAGE_FREE) {
+            pStage = &stage;
+            break;
+        }
+    }
+    if (!pStage) {
+        // every stage is copying: the oldest one is the first to be reused
+        if (m_qInFlight.empty()) {
+            NVDEC_THROW_ERROR("No copy stage free and none in flight", CUDA_ERROR_INVALID_VALUE);
+        }
+        pStage = &m_vStage[m_qInFlight.front()];
+        m_qInFlight.pop_front();
+        m_pEngine->wait(pStage->index);
+        retire(pStage, vDone);
+    }
+
+    if (pStage->nCapacity < nBytes) {
+        if (pStage->pData) {
+            m_pEngine->freeStage(pStage->pData);
+            pStage->pData = NULL;
+            pStage->nCapacity = 0;
+        }
+        pStage->pData = m_pEngine->allocStage(nBytes);
+        pStage->nCapacity = nBytes;
+    }
+    pStage->state = STAGE_FILLING;
+    return pStage;
+}
+
+void NvCopyPipeline::submit(Stage *pStage, NvFrame frame, int nPitch, int nRows, int nTraceStream, int nTracePicture)
+{
+    if (pStage->state != STAGE_FILLING) {
+        NVDEC_THROW_ERROR("Copy stage submitted twice", CUDA_ERROR_INVALID_VALUE);
+    }
+    pStage->frame = std::move(frame);
+    pStage->nSubmitNs = NvMetrics::isEnabled() || NvTrace::isEnabled() ? NvMetrics::now() : 0;
+    pStage->nTraceStream  = nTraceStream;
+    pStage->nTracePicture = nTracePicture;
+    m_pEngine->copyAsync(pStage->index, pStage->frame.data(), pStage->pData, nPitch, nRows);
+    pStage->state = STAGE_COPYING;
+    m_qInFlight.push_back(pStage->index);
+}
+
+void NvCopyPipeline::poll(std::vector<NvFrame> &vDone)
+{
+    // completions are only taken in submission order, so frames keep display order
+    while (!m_qInFlight.empty() && m_pEngine->isDone(m_qInFlight.front())) {
+        retire(&m_vStage[m_qInFlight.front()], vDone);
+        m_qInFlight.pop_front();
+    }
+}
+
+void NvCopyPipeline::flush(std::vector<NvFrame> &vDone)
+{
+    while (!m_qInFlight.empty()) {
+        m_pEngine->wait(m_qInFlight.front());
+        retire(&m_vStage[m_qInFlight.front()], vDone);
+        m_qInFlight.pop_front();
+    }
+}
+
+int NvCopyPipeline::getNumStagesFor(double fCopyMs, double fFrameMs, int nMaxStages)
+{
+    int nStages = 2;
+    if (fFrameMs > 0) {
+        nStages = 1 + (int)ceil(fCopyMs / fFrameMs);
+    }
+    return std::min(std::max(nStages, 2), std::max(nMaxStages, 2));
+}
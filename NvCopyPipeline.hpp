@@ -0,0 +1,145 @@
+#pragma once
+
+#include <deque>
+#include "NvDecoder.hpp"
+
+class NvDecoderBackend;
+
+/**
+* @brief Where staged frames live and how they reach host memory. Stage buffers are written by the
+* post-processing kernels; copyAsync() moves one to its host frame without blocking, and the per-stage
+* completion is then polled with isDone() or waited for with wait().
+*/
+class NvCopyEngine {
+public:
+    virtual ~NvCopyEngine() {}
+
+    virtual void init(int nStages) = 0;
+    virtual uint8_t *allocStage(size_t nBytes) = 0;
+    virtual void freeStage(uint8_t *pStage) = 0;
+    virtual void copyAsync(int iStage, uint8_t *pDst, const uint8_t *pSrc, int nPitch, int nRows) = 0;
+    virtual bool isDone(int iStage) = 0;
+    virtual void wait(int iStage) = 0;
+};
+
+/**
+* @brief Device-to-host copies through an NvDecoderBackend, on a copy stream of their own so they run
+* while the parser decodes the next pictures. One event per stage marks completion.
+*/
+class NvBackendCopyEngine : public NvCopyEngine {
+public:
+    NvBackendCopyEngine(NvDecoderBackend *pBackend, CUcontext cuContext)
+        : m_pBackend(pBackend), m_cuContext(cuContext) {}
+    ~NvBackendCopyEngine();
+
+    void init(int nStages);
+    uint8_t *allocStage(size_t nBytes);
+    void freeStage(uint8_t *pStage);
+    void copyAsync(int iStage, uint8_t *pDst, const uint8_t *pSrc, int nPitch, int nRows);
+    bool isDone(int iStage);
+    void wait(int iStage);
+
+private:
+    NvDecoderBackend *m_pBackend = NULL;
+    CUcontext m_cuContext = NULL;
+    CUstream m_stream = 0;
+    std::vector<CUevent> m_vEvent;
+};
+
+/**
+* @brief memcpy stand-in for NvBackendCopyEngine, so stage sizing and the copy state machine run without
+* a GPU. A copy is carried out, and reported done, only after nLatency isDone() polls or on wait(),
+* which models a transfer still in flight when the next picture arrives.
+*/
+class NvCpuCopyEngine : public NvCopyEngine {
+public:
+    NvCpuCopyEngine(int nLatency = 0) : m_nLatency(nLatency) {}
+
+    void init(int nStages) { m_vPending.assign(nStages, Pending()); }
+    uint8_t *allocStage(size_t nBytes) { return new uint8_t[nBytes]; }
+    void freeStage(uint8_t *pStage) { delete[] pStage; }
+    void copyAsync(int iStage, uint8_t *pDst, const uint8_t *pSrc, int nPitch, int nRows);
+    bool isDone(int iStage);
+    void wait(int iStage);
+
+    uint64_t getNumCopies() { return m_nCopies; }
+
+private:
+    struct Pending {
+        uint8_t *pDst = NULL;
+        const uint8_t *pSrc = NULL;
+        size_t nBytes = 0;
+        int nPollsLeft = 0;
+    };
+
+    int m_nLatency = 0;
+    std::vector<Pending> m_vPending;
+    uint64_t m_nCopies = 0;
+};
+
+/**
+* @brief Double/triple buffering of host output. While the copy of picture N is in flight, picture N+1
+* is post-processed into the next stage. Each stage cycles FREE -> FILLING -> COPYING -> FREE; frames are
+* handed out in submission order once their copy completed. When no stage is free, the oldest copy is
+* waited for, which bounds the work in flight to the number of stages.
+* Single threaded: the parser callbacks and decode() drive it from the same thread.
+*/
+class NvCopyPipeline {
+public:
+    enum StageState {
+        STAGE_FREE,
+        STAGE_FILLING,
+        STAGE_COPYING,
+    };
+
+    struct Stage {
+        int index;
+        StageState state;
+        uint8_t *pData;
+        size_t nCapacity;
+        NvFrame frame;
+        uint64_t nSubmitNs;     // NvMetrics::now() at submit(), for the copy stage latency
+        int nTraceStream;       // NvTrace tags of the frame being copied
+        int nTracePicture;
+    };
+
+    /**
+    *   @param  pEngine - owned by the pipeline
+    *   @param  nStages - 2 for double, 3 for triple buffering
+    */
+    NvCopyPipeline(NvCopyEngine *pEngine, int nStages = 2);
+    ~NvCopyPipeline();
+
+    /**
+    *   @brief  FREE -> FILLING. Stage buffer holds at least nBytes. Frames retired to make room go to vDone.
+    */
+    Stage *acquireStage(size_t nBytes, std::vector<NvFrame> &vDone);
+
+    /**
+    *   @brief  FILLING -> COPYING: copy nRows of nPitch bytes from the stage into frame. The copy is
+    *   traced from submit to completion with nTraceStream and nTracePicture.
+    */
+    void submit(Stage *pStage, NvFrame frame, int nPitch, int nRows, int nTraceStream = -1, int nTracePicture = -1);
+
+    /**
+    *   @brief  COPYING -> FREE for the leading copies that completed, their frames are appended to vDone
+    */
+    void poll(std::vector<NvFrame> &vDone);
+    void flush(std::vector<NvFrame> &vDone);
+
+    int getNumStages() { return (int)m_vStage.size(); }
+    int getNumInFlight() { return (int)m_qInFlight.size(); }
+
+    /**
+    *   @brief  Stages needed so copies never stall decoding: one being filled, plus enough in flight
+    *   to cover a copy of fCopyMs at one picture every fFrameMs. Clamped to [2, nMaxStages].
+    */
+    static int getNumStagesFor(double fCopyMs, double fFrameMs, int nMaxStages = 3);
+
+private:
+    void retire(Stage *pStage, std::vector<NvFrame> &vDone);
+
+    NvCopyEngine *m_pEngine = NULL;
+    std::vector<Stage> m_vStage;
+    std::deque<int> m_qInFlight;
+};
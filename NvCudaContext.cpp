@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+#include "NvCudaContext.hpp"
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+static std::once_flag s_initOnce;
+static int s_nGpu = 0;
+static std::mutex s_mtxCtx;
+static std::vector<CUcontext> s_vCtx;
+
+int NvCudaContextRegistry::getDeviceCount()
+{
+    std::call_once(s_initOnce, [] {
+        if (cuInit(0) != CUDA_SUCCESS || cuDeviceGetCount(&s_nGpu) != CUDA_SUCCESS) {
+            __E("No CUDA driver, no GPU available \n");
+            s_nGpu = 0;
+        }
+        s_vCtx.resize(s_nGpu, NULL);
+    });
+    return s_nGpu;
+}
+
+CUcontext NvCudaContextRegistry::get(int iGpu)
+{
+    if (iGpu < 0 || iGpu >= getDeviceCount()) {
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(s_mtxCtx);
+    if (!s_vCtx[iGpu]) {
+        CUdevice cuDevice = 0;
+        if (cuDeviceGet(&cuDevice, iGpu) != CUDA_SUCCESS ||
+            cuDevicePrimaryCtxRetain(&s_vCtx[iGpu], cuDevice) != CUDA_SUCCESS) {
+            __E("Cannot retain the primary context of GPU %d \n", iGpu);
+            s_vCtx[iGpu] = NULL;
+        }
+    }
+    return s_vCtx[iGpu];
+}
+
+namespace {
+
+struct ThreadBinding {
+    CUcontext ctx = NULL;       // bound context, current while nRealPush is 0
+    bool bOwnPush = false;      // bind() pushed it, unbind() pops it
+    int nRealPush = 0;          // contexts really pushed on top of it
+    int nDepth = 0;
+    uint64_t elided = 0;        // per push depth below 64: 1 if push() skipped the driver call
+};
+
+thread_local ThreadBinding t_binding;
+thread_local std::vector<ThreadBinding> t_vOuter;
+
+}
+
+CUresult NvCudaContextBinding::bind(CUcontext ctx)
+{
+    ThreadBinding &b = t_binding;
+    // nested binding of what is already current costs nothing
+    bool bCurrent = b.ctx == ctx && b.nRealPush == 0;
+    if (!bCurrent) {
+        CUresult result = cuCtxPushCurrent(ctx);
+        if (result != CUDA_SUCCESS) {
+            return result;
+        }
+    }
+    t_vOuter.push_back(b);
+    b = ThreadBinding();
+    b.ctx = ctx;
+    b.bOwnPush = !bCurrent;
+    return CUDA_SUCCESS;
+}
+
+CUresult NvCudaContextBinding::unbind()
+{
+    if (t_vOuter.empty()) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+    bool bOwnPush = t_binding.bOwnPush;
+    t_binding = t_vOuter.back();
+    t_vOuter.pop_back();
+    return bOwnPush ? cuCtxPopCurrent(NULL) : CUDA_SUCCESS;
+}
+
+CUresult NvCudaContextBinding::push(CUcontext ctx)
+{
+    ThreadBinding &b = t_binding;
+    bool bElide = b.ctx && ctx == b.ctx && b.nRealPush == 0 && b.nDepth < 64;
+    if (!bElide) {
+        CUresult result = cuCtxPushCurrent(ctx);
+        if (result != CUDA_SUCCESS) {
+            return result;
+        }
+        b.nRealPush++;
+    }
+    if (b.nDepth < 64) {
+        b.elided = bElide ? (b.elided | (1ull << b.nDepth)) : (b.elided & ~(1ull << b.nDepth));
+    }
+    b.nDepth++;
+    return CUDA_SUCCESS;
+}
+
+CUresult NvCudaContextBinding::pop()
+{
+    ThreadBinding &b = t_binding;
+    if (b.nDepth == 0) {
+        return cuCtxPopCurrent(NULL);
+    }
+    b.nDepth--;
+    if (b.nDepth < 64 && (b.elided & (1ull << b.nDepth))) {
+        return CUDA_SUCCESS;
+    }
+    b.nRealPush--;
+    return cuCtxPopCurrent(NULL);
+}
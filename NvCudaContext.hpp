@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cuda.h>
+
+/**
+* @brief One CUDA context per GPU for the whole process. The device's primary context is retained on
+* first use and shared by every decoder, pool and capacity query on that device, so N streams cost one
+* context instead of N and never switch between contexts of the same GPU. The contexts stay retained
+* until the process exits.
+*/
+class NvCudaContextRegistry {
+public:
+    /**
+    *   @brief  Number of CUDA devices, 0 without a usable driver. Runs cuInit once.
+    */
+    static int getDeviceCount();
+
+    /**
+    *   @brief  Primary context of GPU iGpu, NULL if it can't be had. Thread-safe.
+    */
+    static CUcontext get(int iGpu);
+};
+
+/**
+* @brief Per-thread context binding with cheap nested push/pop. While a binding is active on a thread,
+* push(ctx) and pop() of the bound context are bookkeeping only; any other context still gets a real
+* cuCtxPushCurrent. Worker threads bind once for their lifetime and the per-frame push/pop pairs on
+* the decode path go away.
+*/
+class NvCudaContextBinding {
+public:
+    static CUresult bind(CUcontext ctx);
+    static CUresult unbind();
+
+    static CUresult push(CUcontext ctx);
+    static CUresult pop();
+};
+
+/**
+* @brief NvCudaContextBinding::bind() for the lifetime of the scope. A NULL context binds nothing.
+*/
+class NvCudaContextScope {
+public:
+    explicit NvCudaContextScope(CUcontext ctx) : m_bBound(ctx && NvCudaContextBinding::bind(ctx) == CUDA_SUCCESS) {}
+    ~NvCudaContextScope() {
+        if (m_bBound) NvCudaContextBinding::unbind();
+    }
+
+    NvCudaContextScope(const NvCudaContextScope &) = delete;
+    NvCudaContextScope &operator=(const NvCudaContextScope &) = delete;
+
+private:
+    bool m_bBound;
+};
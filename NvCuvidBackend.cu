@@ -0,0 +1,251 @@
+#include <dlfcn.h>
+#include "NvDecoderBackend.hpp"
+#include "NvCudaContext.hpp"
+
+/* The library links neither libcuda nor libnvcuvid, so that it loads on hosts without the NVIDIA driver and
+*  SwCuvidBackend can run there. Every driver entry point the library calls is defined below, hidden, and
+*  forwards to the real one, looked up in the driver library at the first call. Without the driver the calls
+*  fail with CUDA_ERROR_NO_DEVICE, which NvCudaContextRegistry reports as no GPU.
+*/
+static void *getCudaLibrary()
+{
+    static void *hLib = dlopen("libcuda.so.1", RTLD_NOW | RTLD_LOCAL);
+    return hLib;
+}
+
+static void *getNvcuvidLibrary()
+{
+    static void *hLib = dlopen("libnvcuvid.so.1", RTLD_NOW | RTLD_LOCAL);
+    return hLib;
+}
+
+static void *getDriverSymbol(void *hLib, const char *szName)
+{
+    return hLib ? dlsym(hLib, szName) : NULL;
+}
+
+bool NvCuvidBackend::isAvailable()
+{
+    return getCudaLibrary() && getNvcuvidLibrary();
+}
+
+#define NV_DRIVER_NAME_(fn) #fn
+// the name after macro expansion: cuda.h maps most entry points to versioned ones, e.g. cuMemAlloc_v2
+#define NV_DRIVER_NAME(fn) NV_DRIVER_NAME_(fn)
+
+#define NV_DRIVER_ENTRY(getLibrary, fn, params, args)                                                   \
+    extern "C" __attribute__((visibility("hidden"))) CUresult CUDAAPI fn params                         \
+    {                                                                                                   \
+        static decltype(&fn) pfn = (decltype(&fn))getDriverSymbol(getLibrary(), NV_DRIVER_NAME(fn));    \
+        return pfn ? pfn args : CUDA_ERROR_NO_DEVICE;                                                   \
+    }
+
+NV_DRIVER_ENTRY(getCudaLibrary, cuInit, (unsigned int flags), (flags))
+NV_DRIVER_ENTRY(getCudaLibrary, cuGetErrorName, (CUresult error, const char **pStr), (error, pStr))
+NV_DRIVER_ENTRY(getCudaLibrary, cuDeviceGetCount, (int *pCount), (pCount))
+NV_DRIVER_ENTRY(getCudaLibrary, cuDeviceGet, (CUdevice *pDevice, int ordinal), (pDevice, ordinal))
+NV_DRIVER_ENTRY(getCudaLibrary, cuDeviceGetName, (char *szName, int len, CUdevice dev), (szName, len, dev))
+NV_DRIVER_ENTRY(getCudaLibrary, cuDevicePrimaryCtxRetain, (CUcontext *pCtx, CUdevice dev), (pCtx, dev))
+NV_DRIVER_ENTRY(getCudaLibrary, cuCtxCreate, (CUcontext *pCtx, unsigned int flags, CUdevice dev), (pCtx, flags, dev))
+NV_DRIVER_ENTRY(getCudaLibrary, cuCtxDestroy, (CUcontext ctx), (ctx))
+NV_DRIVER_ENTRY(getCudaLibrary, cuCtxPushCurrent, (CUcontext ctx), (ctx))
+NV_DRIVER_ENTRY(getCudaLibrary, cuCtxPopCurrent, (CUcontext *pCtx), (pCtx))
+NV_DRIVER_ENTRY(getCudaLibrary, cuMemAlloc, (CUdeviceptr *pDptr, size_t nBytes), (pDptr, nBytes))
+NV_DRIVER_ENTRY(getCudaLibrary, cuMemAllocPitch,
+                (CUdeviceptr *pDptr, size_t *pPitch, size_t nWidthInBytes, size_t nHeight, unsigned int nElementSize),
+                (pDptr, pPitch, nWidthInBytes, nHeight, nElementSize))
+NV_DRIVER_ENTRY(getCudaLibrary, cuMemFree, (CUdeviceptr dptr), (dptr))
+NV_DRIVER_ENTRY(getCudaLibrary, cuMemcpy2DAsync, (const CUDA_MEMCPY2D *pCopy, CUstream stream), (pCopy, stream))
+NV_DRIVER_ENTRY(getCudaLibrary, cuMemAllocHost, (void **pp, size_t nBytes), (pp, nBytes))
+NV_DRIVER_ENTRY(getCudaLibrary, cuMemFreeHost, (void *p), (p))
+NV_DRIVER_ENTRY(getCudaLibrary, cuStreamCreate, (CUstream *pStream, unsigned int flags), (pStream, flags))
+NV_DRIVER_ENTRY(getCudaLibrary, cuStreamDestroy, (CUstream stream), (stream))
+NV_DRIVER_ENTRY(getCudaLibrary, cuStreamSynchronize, (CUstream stream), (stream))
+NV_DRIVER_ENTRY(getCudaLibrary, cuEventCreate, (CUevent *pEvent, unsigned int flags), (pEvent, flags))
+NV_DRIVER_ENTRY(getCudaLibrary, cuEventDestroy, (CUevent event), (event))
+NV_DRIVER_ENTRY(getCudaLibrary, cuEventRecord, (CUevent event, CUstream stream), (event, stream))
+NV_DRIVER_ENTRY(getCudaLibrary, cuEventSynchronize, (CUevent event), (event))
+NV_DRIVER_ENTRY(getCudaLibrary, cuEventQuery, (CUevent event), (event))
+
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidCreateVideoParser, (CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams),
+                (pObj, pParams))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidParseVideoData, (CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket),
+                (obj, pPacket))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidDestroyVideoParser, (CUvideoparser obj), (obj))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidGetDecoderCaps, (CUVIDDECODECAPS *pdc), (pdc))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidCreateDecoder, (CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci),
+                (phDecoder, pdci))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidReconfigureDecoder,
+                (CUvideodecoder hDecoder, CUVIDRECONFIGUREDECODERINFO *pDecReconfigParams),
+                (hDecoder, pDecReconfigParams))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidDestroyDecoder, (CUvideodecoder hDecoder), (hDecoder))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidDecodePicture, (CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams),
+                (hDecoder, pPicParams))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidGetDecodeStatus,
+                (CUvideodecoder hDecoder, int nPicIdx, CUVIDGETDECODESTATUS *pDecodeStatus),
+                (hDecoder, nPicIdx, pDecodeStatus))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidMapVideoFrame,
+                (CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr, unsigned int *pPitch,
+                 CUVIDPROCPARAMS *pVPP),
+                (hDecoder, nPicIdx, pDevPtr, pPitch, pVPP))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidUnmapVideoFrame, (CUvideodecoder hDecoder, CUdeviceptr devPtr),
+                (hDecoder, devPtr))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidCtxLockCreate, (CUvideoctxlock *pLock, CUcontext ctx), (pLock, ctx))
+NV_DRIVER_ENTRY(getNvcuvidLibrary, cuvidCtxLockDestroy, (CUvideoctxlock lck), (lck))
+
+CUresult NvCuvidBackend::createVideoParser(CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams)
+{
+    return cuvidCreateVideoParser(pObj, pParams);
+}
+
+CUresult NvCuvidBackend::parseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket)
+{
+    return cuvidParseVideoData(obj, pPacket);
+}
+
+CUresult NvCuvidBackend::destroyVideoParser(CUvideoparser obj)
+{
+    return cuvidDestroyVideoParser(obj);
+}
+
+CUresult NvCuvidBackend::getDecoderCaps(CUVIDDECODECAPS *pdc)
+{
+    return cuvidGetDecoderCaps(pdc);
+}
+
+CUresult NvCuvidBackend::createDecoder(CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci)
+{
+    return cuvidCreateDecoder(phDecoder, pdci);
+}
+
+CUresult NvCuvidBackend::reconfigureDecoder(CUvideodecoder hDecoder, CUVIDRECONFIGUREDECODERINFO *pDecReconfigParams)
+{
+    return cuvidReconfigureDecoder(hDecoder, pDecReconfigParams);
+}
+
+CUresult NvCuvidBackend::destroyDecoder(CUvideodecoder hDecoder)
+{
+    return cuvidDestroyDecoder(hDecoder);
+}
+
+CUresult NvCuvidBackend::decodePicture(CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams)
+{
+    return cuvidDecodePicture(hDecoder, pPicParams);
+}
+
+CUresult NvCuvidBackend::getDecodeStatus(CUvideodecoder hDecoder, int nPicIdx, CUVIDGETDECODESTATUS *pDecodeStatus)
+{
+    return cuvidGetDecodeStatus(hDecoder, nPicIdx, pDecodeStatus);
+}
+
+CUresult NvCuvidBackend::mapVideoFrame(CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr,
+                                       unsigned int *pPitch, CUVIDPROCPARAMS *pVPP)
+{
+    return cuvidMapVideoFrame(hDecoder, nPicIdx, pDevPtr, pPitch, pVPP);
+}
+
+CUresult NvCuvidBackend::unmapVideoFrame(CUvideodecoder hDecoder, CUdeviceptr devPtr)
+{
+    return cuvidUnmapVideoFrame(hDecoder, devPtr);
+}
+
+CUresult NvCuvidBackend::ctxLockCreate(CUvideoctxlock *pLock, CUcontext ctx)
+{
+    return cuvidCtxLockCreate(pLock, ctx);
+}
+
+CUresult NvCuvidBackend::ctxLockDestroy(CUvideoctxlock lck)
+{
+    return cuvidCtxLockDestroy(lck);
+}
+
+CUresult NvCuvidBackend::ctxPushCurrent(CUcontext ctx)
+{
+    return NvCudaContextBinding::push(ctx);
+}
+
+CUresult NvCuvidBackend::ctxPopCurrent()
+{
+    return NvCudaContextBinding::pop();
+}
+
+CUresult NvCuvidBackend::ctxBind(CUcontext ctx)
+{
+    return NvCudaContextBinding::bind(ctx);
+}
+
+CUresult NvCuvidBackend::ctxUnbind()
+{
+    return NvCudaContextBinding::unbind();
+}
+
+CUresult NvCuvidBackend::memAlloc(CUdeviceptr *pDptr, size_t nBytes)
+{
+    return cuMemAlloc(pDptr, nBytes);
+}
+
+CUresult NvCuvidBackend::memAllocPitch(CUdeviceptr *pDptr, size_t *pPitch, size_t nWidthInBytes, size_t nHeight,
+                                       unsigned int nElementSizeBytes)
+{
+    return cuMemAllocPitch(pDptr, pPitch, nWidthInBytes, nHeight, nElementSizeBytes);
+}
+
+CUresult NvCuvidBackend::memFree(CUdeviceptr dptr)
+{
+    return cuMemFree(dptr);
+}
+
+CUresult NvCuvidBackend::memcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream stream)
+{
+    return cuMemcpy2DAsync(pCopy, stream);
+}
+
+CUresult NvCuvidBackend::memAllocHost(void **pp, size_t nBytes)
+{
+    return cuMemAllocHost(pp, nBytes);
+}
+
+CUresult NvCuvidBackend::memFreeHost(void *p)
+{
+    return cuMemFreeHost(p);
+}
+
+CUresult NvCuvidBackend::streamCreate(CUstream *pStream, unsigned int flags)
+{
+    return cuStreamCreate(pStream, flags);
+}
+
+CUresult NvCuvidBackend::streamDestroy(CUstream stream)
+{
+    return cuStreamDestroy(stream);
+}
+
+CUresult NvCuvidBackend::streamSynchronize(CUstream stream)
+{
+    return cuStreamSynchronize(stream);
+}
+
+CUresult NvCuvidBackend::eventCreate(CUevent *pEvent, unsigned int flags)
+{
+    return cuEventCreate(pEvent, flags);
+}
+
+CUresult NvCuvidBackend::eventDestroy(CUevent event)
+{
+    return cuEventDestroy(event);
+}
+
+CUresult NvCuvidBackend::eventRecord(CUevent event, CUstream stream)
+{
+    return cuEventRecord(event, stream);
+}
+
+CUresult NvCuvidBackend::eventSynchronize(CUevent event)
+{
+    return cuEventSynchronize(event);
+}
+
+CUresult NvCuvidBackend::eventQuery(CUevent event)
+{
+    return cuEventQuery(event);
+}
@@ -1,8 +1,11 @@
 #include <iostream>
 #include <algorithm>
 #include <chrono>
-#include <npp.h>
 #include "NvDecoder.hpp"
+#include "NvDecoderBackend.hpp"
+#include "NvCopyPipeline.hpp"
+#include "NvCudaContext.hpp"
+#include "NvMetrics.hpp"
 
 
 
@@ -27,12 +30,6 @@ void check(T result, char const *const func, const char *const file,
 #endif
 
 
-#define START_TIMER auto start = std::chrono::high_resolution_clock::now();
-#define STOP_TIMER(print_message) std::cout << print_message << \
-    std::chrono::duration_cast<std::chrono::milliseconds>( \
-    std::chrono::high_resolution_clock::now() - start).count() \
-    << " ms " << std::endl;
-
 #define CUDA_DRVAPI_CALL( call )                                                                                                 \
     do                                                                                                                           \
     {                                                                                                                            \
@@ -42,7 +39,7 @@ void check(T result, char const *const func, const char *const file,
             const char *szErrName = NULL;                                                                                        \
             cuGetErrorName(err__, &szErrName);                                                                                   \
             std::ostringstream errorLog;                                                                                         \
-            errorLog << "CUDA driver API error " << szErrName ;                                                                  \
+            errorLog << "CUDA driver API error " << (szErrName ? szErrName : "") << " (" << err__ << ")";                        \
             throw NVDECException::makeNVDECException(errorLog.str(), err__, __FUNCTION__, __FILE__, __LINE__);                   \
         }                                                                                                                        \
     }                                                                                                                            \
@@ -52,12 +49,54 @@ void check(T result, char const *const func, const char *const file,
 
 
 
+/* The decoder's context bound to the calling thread for a scope; the push/pop pairs on the per-frame path
+*  inside it cost nothing */
+class ContextScope {
+public:
+    ContextScope(NvDecoderBackend *pBackend, CUcontext ctx) : m_pBackend(pBackend) {
+        m_bBound = m_pBackend->ctxBind(ctx) == CUDA_SUCCESS;
+    }
+    ~ContextScope() {
+        if (m_bBound) m_pBackend->ctxUnbind();
+    }
+
+private:
+    NvDecoderBackend *m_pBackend;
+    bool m_bBound;
+};
+
+/* A surface mapped by mapFrame(), unmapped when the scope is left early by an exception; the regular path
+*  calls unmap() to get the error checked */
+class MappedSurface {
+public:
+    MappedSurface(NvDecoderBackend *pBackend, CUvideodecoder hDecoder) : m_pBackend(pBackend), m_hDecoder(hDecoder) {}
+    ~MappedSurface() {
+        if (dptr) m_pBackend->unmapVideoFrame(m_hDecoder, dptr);
+    }
+    CUresult unmap() {
+        CUdeviceptr d = dptr;
+        dptr = 0;
+        return m_pBackend->unmapVideoFrame(m_hDecoder, d);
+    }
+
+    CUdeviceptr  dptr = 0;
+    unsigned int nPitch = 0;
+
+private:
+    NvDecoderBackend *m_pBackend;
+    CUvideodecoder m_hDecoder;
+};
+
 /* Return value from HandleVideoSequence() are interpreted as   :
 *  0: fail, 1: succeeded, > 1: override dpb size of parser (set by CUVIDPARSERPARAMS::ulMaxNumDecodeSurfaces while creating parser)
 */
 int NvDecoder::handleNvSequence(CUVIDEOFORMAT *pVideoFormat)
 {
-    START_TIMER
+    NvTraceScope trace("sequence_callback", m_nTraceStream);
+    uint64_t nStart = NvMetrics::now();
+    // a new parser starts with a DPB of 1 and only learns its size from what this callback returns
+    bool bParserFresh = m_bParserFresh;
+    m_bParserFresh = false;
     m_videoInfo.str("");
     m_videoInfo.clear();
     m_videoInfo << "Video Input Information" << std::endl
@@ -73,7 +112,7 @@ int NvDecoder::handleNvSequence(CUVIDEOFORMAT *pVideoFormat)
     ;
     m_videoInfo << std::endl;
 
-    nDecodeSurface = pVideoFormat->min_num_decode_surfaces;
+    nDecodeSurface = getNumDecodeSurfaces(pVideoFormat);
 
     CUVIDDECODECAPS decodecaps = {
         .eCodecType      = pVideoFormat->codec,
@@ -81,15 +120,21 @@ int NvDecoder::handleNvSequence(CUVIDEOFORMAT *pVideoFormat)
         .nBitDepthMinus8 = pVideoFormat->bit_depth_luma_minus8
     };
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-    NVDEC_API_CALL(cuvidGetDecoderCaps(&decodecaps));
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    NVDEC_API_CALL(m_pBackend->getDecoderCaps(&decodecaps));
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
 
     if(!decodecaps.bIsSupported) {
         NVDEC_THROW_ERROR("Codec not supported on this GPU", CUDA_ERROR_NOT_SUPPORTED);
         return nDecodeSurface;
     }
 
+    if (pVideoFormat->chroma_format == cudaVideoChromaFormat_422) {
+        // no output surface format to map it to: the frame layout and the kernels know 4:2:0 and 4:4:4 only
+        NVDEC_THROW_ERROR("4:2:2 chroma is not supported", CUDA_ERROR_NOT_SUPPORTED);
+        return nDecodeSurface;
+    }
+
     if ((pVideoFormat->coded_width > decodecaps.nMaxWidth) ||
         (pVideoFormat->coded_height > decodecaps.nMaxHeight)){
 
@@ -117,15 +162,40 @@ int NvDecoder::handleNvSequence(CUVIDEOFORMAT *pVideoFormat)
         return nDecodeSurface;
     }
 
+    if (m_bNewStream) {
+        // first sequence header after reset() or prepareSession(): keep the decoder if it fits
+        m_bNewStream = false;
+        bool bPrepared = m_bSessionPrepared;
+        m_bSessionPrepared = false;
+        if (m_hDecoder && !isSessionCompatible(pVideoFormat)) {
+            m_bReconfigExternal = false;
+            destroySession();
+        } else if (m_hDecoder) {
+            int nRet = nvReconfigureDecoder(pVideoFormat);
+            // set for this one reconfiguration; later ones are the stream's own, e.g. VP9 size changes
+            m_bReconfigExternal = false;
+            m_videoFormat = *pVideoFormat;
+            if (!bPrepared) {
+                m_sessionStats.nReused++;
+                NvMetrics::add(NV_COUNTER_SESSIONS_REUSED);
+            }
+            return bParserFresh ? std::max(nRet, nDecodeSurface) : nRet;
+        }
+    }
+
     if (m_nWidth && m_nLumaHeight && m_nChromaHeight) {
 
-        // cuvidCreateDecoder() has been called before, and now there's possible config change
-        return nvReconfigureDecoder(pVideoFormat);
+        // m_pBackend->createDecoder() has been called before, and now there's possible config change.
+        // Pictures still queued for post-processing were sized for the old config
+        drainPostProc();
+        int nRet = nvReconfigureDecoder(pVideoFormat);
+        return bParserFresh ? std::max(nRet, nDecodeSurface) : nRet;
     }
 
     nvCreateDecoder(pVideoFormat);
+    m_sessionStats.nCreated++;
 
-    STOP_TIMER("Session Initialization Time: ");
+    NvMetrics::record(NV_STAGE_SESSION_CREATE, NvMetrics::now() - nStart);
     return nDecodeSurface;
 }
 
@@ -137,7 +207,8 @@ int NvDecoder::nvCreateDecoder(CUVIDEOFORMAT *pVideoFormat)
     m_nBitDepthMinus8 = pVideoFormat->bit_depth_luma_minus8;
     m_nBPP            = m_nBitDepthMinus8 > 0 ? 2 : 1;
 
-    if (m_eChromaFormat == cudaVideoChromaFormat_420) {
+    // monochrome comes as 4:2:0 with neutral chroma, 4:2:2 was turned down by handleVideoSequence()
+    if (m_eChromaFormat == cudaVideoChromaFormat_420 || m_eChromaFormat == cudaVideoChromaFormat_Monochrome) {
         m_eOutputFormat = pVideoFormat->bit_depth_luma_minus8 ? cudaVideoSurfaceFormat_P016 : cudaVideoSurfaceFormat_NV12;
     } else if (m_eChromaFormat == cudaVideoChromaFormat_444) {
         m_eOutputFormat = pVideoFormat->bit_depth_luma_minus8 ? cudaVideoSurfaceFormat_YUV444_16Bit : cudaVideoSurfaceFormat_YUV444;
@@ -153,10 +224,12 @@ int NvDecoder::nvCreateDecoder(CUVIDEOFORMAT *pVideoFormat)
         nvI.DeinterlaceMode = cudaVideoDeinterlaceMode_Weave;
     else
         nvI.DeinterlaceMode = cudaVideoDeinterlaceMode_Adaptive;
-    nvI.ulNumOutputSurfaces = 2;
+    // every async worker may hold one mapped surface at a time
+    nvI.ulNumOutputSurfaces = std::max(2, (int)m_vPostProcCtx.size());
     // With PreferCUVID, JPEG is still decoded by CUDA while video is decoded by NVDEC hardware
     nvI.ulCreationFlags     = cudaVideoCreate_PreferCUVID;
     nvI.ulNumDecodeSurfaces = nDecodeSurface;
+    m_nSessionSurfaces = nDecodeSurface;
     nvI.vidLock  = m_ctxLock;
     nvI.ulWidth  = pVideoFormat->coded_width;
     nvI.ulHeight = pVideoFormat->coded_height;
@@ -228,9 +301,9 @@ int NvDecoder::nvCreateDecoder(CUVIDEOFORMAT *pVideoFormat)
     ;
     m_videoInfo << std::endl;
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-    NVDEC_API_CALL(cuvidCreateDecoder(&m_hDecoder, &nvI));
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    NVDEC_API_CALL(m_pBackend->createDecoder(&m_hDecoder, &nvI));
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
     return 0;
 }
 
@@ -254,7 +327,7 @@ int NvDecoder::nvReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
                                 pVideoFormat->display_area.left   == m_videoFormat.display_area.left &&
                                 pVideoFormat->display_area.right  == m_videoFormat.display_area.right);
 
-    nDecodeSurface = pVideoFormat->min_num_decode_surfaces;
+    nDecodeSurface = getNumDecodeSurfaces(pVideoFormat);
 
     if ((pVideoFormat->coded_width > m_nMaxWidth) ||
         (pVideoFormat->coded_height > m_nMaxHeight))
@@ -347,11 +420,12 @@ int NvDecoder::nvReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
 
     nvC.ulNumDecodeSurfaces = nDecodeSurface;
 
-    START_TIMER
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-    NVDEC_API_CALL(cuvidReconfigureDecoder(m_hDecoder, &nvC));
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
-    STOP_TIMER("Session Reconfigure Time: ");
+    NvStageTimer timer(NV_STAGE_SESSION_RECONFIGURE);
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    NVDEC_API_CALL(m_pBackend->reconfigureDecoder(m_hDecoder, &nvC));
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+    timer.stop();
+    NvMetrics::add(NV_COUNTER_RECONFIGURATIONS);
 
     return nDecodeSurface;
 }
@@ -381,27 +455,7 @@ int NvDecoder::setReconfigParams(const Rect *pCropRect, const Dim *pResizeDim)
         }
     }
 
-    // Clear existing output buffers of different size
-    uint8_t *pFrame = NULL;
-    while (!m_vpFrame.empty())
-    {
-        pFrame = m_vpFrame.back();
-        m_vpFrame.pop_back();
-        if (m_bUseDeviceFrame)
-        {
-            // d_frame
-            CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-            CUDA_DRVAPI_CALL(cuMemFree((CUdeviceptr)pFrame));
-            CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
-        }
-        else
-        {
-            // h_frame
-            delete pFrame;
-        }
-    }
-    m_vpFrameRet.clear();
-
+    // Output buffers are kept: the frame pool reuses those big enough for the new size and reallocates the rest
     return 0;
 }
 
@@ -409,208 +463,926 @@ int NvDecoder::setReconfigParams(const Rect *pCropRect, const Dim *pResizeDim)
 *  0: fail, >=1: succeeded
 */
 int NvDecoder::handleNvDecode(CUVIDPICPARAMS *pPicParams) {
+    NvTraceScope trace("decode_callback", m_nTraceStream, pPicParams->CurrPicIdx);
     if (!m_hDecoder)
     {
         NVDEC_THROW_ERROR("Decoder not initialized.", CUDA_ERROR_NOT_INITIALIZED);
         return 0;
     }
     m_nPicNumInDecodeOrder[pPicParams->CurrPicIdx] = m_nDecodePicCnt++;
-    NVDEC_API_CALL(cuvidDecodePicture(m_hDecoder, pPicParams));
+    // the parser still displays a skipped picture, handleNvPostProc() drops it
+    bool bSkip = (m_eDecodeMode == DECODE_KEY_FRAMES && !pPicParams->intra_pic_flag) ||
+                 (m_eDecodeMode == DECODE_REFERENCE && !pPicParams->ref_pic_flag);
+    m_abPicSkipped[pPicParams->CurrPicIdx] = bSkip;
+    if (bSkip) {
+        m_skipStats.nPictures++;
+        NvMetrics::add(NV_COUNTER_FRAMES_DROPPED);
+        return 1;
+    }
+    if (m_bAsyncPostProc) {
+        waitPicIdle(pPicParams->CurrPicIdx);
+    }
+    {
+        NvStageTimer timer(NV_STAGE_DECODE, m_nTraceStream, pPicParams->CurrPicIdx);
+        NVDEC_API_CALL(m_pBackend->decodePicture(m_hDecoder, pPicParams));
+    }
+    NvMetrics::add(NV_COUNTER_PICTURES_DECODED);
     return 1;
 }
 
-/* Return value from HandlePictureDisplay() are interpreted as:
-*  0: fail, >=1: succeeded
-*/
-int NvDecoder::handleNvPostProc(CUVIDPARSERDISPINFO *pDispInfo) {
+void NvDecoder::mapFrame(CUVIDPARSERDISPINFO *pDispInfo, CUstream stream,
+                         CUdeviceptr *pSrcFrame, unsigned int *pSrcPitch)
+{
     CUVIDPROCPARAMS nvPr = {};
     nvPr.progressive_frame = pDispInfo->progressive_frame;
     nvPr.second_field      = pDispInfo->repeat_first_field + 1;
     nvPr.top_field_first   = pDispInfo->top_field_first;
     nvPr.unpaired_field    = pDispInfo->repeat_first_field < 0;
-    nvPr.output_stream     = m_cuvidStream;
+    nvPr.output_stream     = stream;
 
-    CUdeviceptr  d_srcFrame = 0;
-    unsigned int d_srcPitch = 0;
-
-    NVDEC_API_CALL(cuvidMapVideoFrame(m_hDecoder,
+    NvStageTimer timer(NV_STAGE_MAP, m_nTraceStream, pDispInfo->picture_index);
+    NVDEC_API_CALL(m_pBackend->mapVideoFrame(m_hDecoder,
                                       pDispInfo->picture_index,
-                                      &d_srcFrame,
-                                      &d_srcPitch,
+                                      pSrcFrame,
+                                      pSrcPitch,
                                       &nvPr));
 
     CUVIDGETDECODESTATUS nvS = {};
-    CUresult result = cuvidGetDecodeStatus(m_hDecoder,
+    CUresult result = m_pBackend->getDecodeStatus(m_hDecoder,
                                            pDispInfo->picture_index,
                                            &nvS);
     if (result == CUDA_SUCCESS &&
         (nvS.decodeStatus == cuvidDecodeStatus_Error ||
          nvS.decodeStatus == cuvidDecodeStatus_Error_Concealed))
     {
+        NvMetrics::add(NV_COUNTER_DECODE_ERRORS);
         printf("Decode Error occurred for picture %d\n", m_nPicNumInDecodeOrder[pDispInfo->picture_index]);
     }
+}
 
-    uint8_t *pDecodedFrame = nullptr;
-    int frameSize; // = getFrameSize(); // NV12
-    frameSize = d_srcPitch*m_nLumaHeight*3; // RGBI
-    /* if (oformat == IMAGE_RGBI) { */
-    /*     frameSize = d_srcPitch*m_nLumaHeight*3; */
-    /* } */
+/* Allocator of the frame pool. *pnFrameSize is the pitch times the rows of a frame, see acquireFrame(). A pitched
+*  allocation returns its pitch and its real size, both stay with the buffer in its pool slot.
+*/
+uint8_t *NvDecoder::allocFrameBuffer(size_t *pnFrameSize, size_t *pnPitch)
+{
+    size_t frameSize = *pnFrameSize;
+    uint8_t *pFrame = NULL;
+    if (m_bUseDeviceFrame)
+    {
+        // GPU DEVICE memory if m_bUseDeviceFrame:1
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+        if (m_bDeviceFramePitched && !m_pOutputs)
+        {
+            // enough rows for frameSize: the pool hands the buffer to any request of its size class
+            int nRowBytes = getOutputRowBytes();
+            size_t nRows = (frameSize + nRowBytes - 1) / nRowBytes;
+            CUDA_DRVAPI_CALL(m_pBackend->memAllocPitch((CUdeviceptr *)&pFrame,
+                                             pnPitch,
+                                             nRowBytes,
+                                             nRows,
+                                             16));
+            *pnFrameSize = *pnPitch * nRows;
+        }
+        else
+        {
+            CUDA_DRVAPI_CALL(m_pBackend->memAlloc((CUdeviceptr *)&pFrame, frameSize));
+        }
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+    }
+    else
+    {
+        // CPU HOST memory if m_bUseDeviceFrame:0
+        if (m_bPinnedHostFrame) {
+            CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+            CUDA_DRVAPI_CALL(m_pBackend->memAllocHost((void **)&pFrame, frameSize));
+            CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+        } else {
+            pFrame = new uint8_t[frameSize];
+        }
+    }
+    return pFrame;
+}
 
+void NvDecoder::freeFrameBuffer(uint8_t *pFrame)
+{
+    if (m_bUseDeviceFrame)
     {
+        // d_frame
+        if (m_pMutex) m_pMutex->lock();
+        m_pBackend->ctxPushCurrent(m_cuContext);
+        m_pBackend->memFree((CUdeviceptr)pFrame);
+        m_pBackend->ctxPopCurrent();
+        if (m_pMutex) m_pMutex->unlock();
+    }
+    else
+    {
+        // h_frame
+        if (m_bPinnedHostFrame) {
+            m_pBackend->ctxPushCurrent(m_cuContext);
+            m_pBackend->memFreeHost(pFrame);
+            m_pBackend->ctxPopCurrent();
+        } else {
+            delete[] pFrame;
+        }
+    }
+}
 
-        std::lock_guard<std::mutex> lock(m_mtxVPFrame);
-        if ((unsigned)++m_nDecodedFrame > m_vpFrame.size())
-        {
-            // Not enough frames in stock
-            m_nFrameAlloc++;
-            uint8_t *pFrame = NULL;
-            if (m_bUseDeviceFrame)
-            {
-                // GPU DEVICE memory if m_bUseDeviceFrame:1
-                CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-                if (m_bDeviceFramePitched)
-                {
-                    CUDA_DRVAPI_CALL(cuMemAllocPitch((CUdeviceptr *)&pFrame,
-                                                     &m_nDeviceFramePitch,
-                                                     d_srcPitch*3, //m_nWidth * m_nBPP,
-                                                     m_nLumaHeight*3, //m_nLumaHeight + (m_nChromaHeight * m_nNumChromaPlanes),
-                                                     16));
-                }
-                else
-                {
-                    CUDA_DRVAPI_CALL(cuMemAlloc((CUdeviceptr *)&pFrame, frameSize));
-                }
-                CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
-            }
-            else
-            {
-                // CPU HOST memory if m_bUseDeviceFrame:0
-                pFrame = new uint8_t[frameSize];
+/* Bytes of payload per output row of eFormat, nWidth pixels wide */
+int NvDecoder::getOutputRowBytes(ImageFormat_t eFormat, RgbDepth eRgbDepth, int nWidth)
+{
+    switch (eFormat) {
+    case IMAGE_RGBI:
+    case IMAGE_BGRI:
+        return nWidth * 3 * RgbSampleSize(eRgbDepth);
+    case IMAGE_RGB:
+    case IMAGE_BGR:
+        return nWidth * RgbSampleSize(eRgbDepth);
+    case IMAGE_YUV:
+        // I420 chroma planes are half as wide, keep the halved pitch whole
+        return m_nNumChromaPlanes == 1 ? ((nWidth + 1) & ~1) * m_nBPP : nWidth * m_nBPP;
+    default:
+        return nWidth * m_nBPP;
+    }
+}
+
+/* Output rows of eFormat, nHeight pixels high; planar formats count every plane */
+int NvDecoder::getOutputRows(ImageFormat_t eFormat, int nHeight)
+{
+    switch (eFormat) {
+    case IMAGE_RGBI:
+    case IMAGE_BGRI:
+    case IMAGE_Y:
+        return nHeight;
+    case IMAGE_RGB:
+    case IMAGE_BGR:
+        return nHeight * 3;
+    case IMAGE_YUV:
+        if (m_nNumChromaPlanes == 1) {
+            // U and V at half pitch, (h + 1) / 2 rows each
+            return nHeight + (nHeight + 1) / 2;
+        }
+        // fall through
+    default:
+        return nHeight + getChromaRows(nHeight) * m_nNumChromaPlanes;
+    }
+}
+
+/* Take an output buffer from the pool, blocks while the consumer holds the maximum number of frames.
+*  Sized for the whole picture in the format of settings without pSpec, otherwise for output iOutput.
+*/
+NvFrame NvDecoder::acquireFrame(const OutputSettings &settings, int64_t timestamp, uint64_t nInputNs,
+                                const OutputSpec *pSpec, int iOutput)
+{
+    ImageFormat_t eFormat = pSpec ? pSpec->eFormat : settings.eFormat;
+    int nLevels = std::max(pSpec ? pSpec->nLevels : settings.nLevels, 1);
+    Dim dim = { (int)m_nWidth, (int)m_nLumaHeight };
+    if (pSpec) {
+        Rect crop;
+        getOutputGeometry(*pSpec, crop, dim);
+    }
+    int nPitch = getOutputRowBytes(eFormat, settings.eRgbDepth, dim.w);
+    NvFrameLevel aLevel[NV_FRAME_MAX_LEVELS];
+    int nRows = getFrameLayout(eFormat, settings.eRgbDepth, dim.w, dim.h, nPitch, nLevels, aLevel);
+    NvFrame frame = m_pFramePool->acquire((size_t)nPitch * nRows);
+    size_t nAllocPitch = frame.allocPitch();
+    if (!pSpec && nAllocPitch > (size_t)nPitch) {
+        // a pitched buffer, possibly allocated before a resolution or format change: use its own pitch when the
+        // frame still fits at it, else the packed layout requested above, which always does
+        NvFrameLevel aPitched[NV_FRAME_MAX_LEVELS];
+        int nPitchedRows = getFrameLayout(eFormat, settings.eRgbDepth, dim.w, dim.h, (int)nAllocPitch, nLevels,
+                                          aPitched);
+        if (nAllocPitch * nPitchedRows <= frame.capacity()) {
+            nPitch = (int)nAllocPitch;
+            nRows = nPitchedRows;
+            std::copy(aPitched, aPitched + nLevels, aLevel);
+        }
+    }
+    assert((size_t)nPitch * nRows <= frame.capacity());
+    if (!pSpec) {
+        m_nDeviceFramePitch.store(nPitch, std::memory_order_relaxed);
+    }
+    frame.setLayout(dim.w, dim.h, aLevel[0].nPitch, eFormat);
+    frame.setLevels(nLevels, aLevel);
+    frame.setTimestamp(timestamp);
+    frame.setInputNs(nInputNs);
+    frame.setOutput(iOutput);
+    return frame;
+}
+
+/* Device buffer of at least nBytes in *pBuf, e.g. what the kernels write into when the destination is
+*  host memory. Grows, never shrinks.
+*/
+uint8_t *NvDecoder::getScratch(CUdeviceptr *pBuf, size_t *pnBufBytes, size_t nBytes)
+{
+    if (*pnBufBytes < nBytes) {
+        if (*pBuf) {
+            CUDA_DRVAPI_CALL(m_pBackend->memFree(*pBuf));
+            *pBuf = 0;
+            *pnBufBytes = 0;
+        }
+        CUDA_DRVAPI_CALL(m_pBackend->memAlloc(pBuf, nBytes));
+        *pnBufBytes = nBytes;
+    }
+    return (uint8_t *)*pBuf;
+}
+
+/* Matrix and range of the RGB output: explicit ones from setColorSpace(), otherwise the stream's VUI */
+YuvToRgbCoeff NvDecoder::getColorCoeff()
+{
+    int nBitDepth = m_nBPP > 1 ? 16 : 8;
+    if (m_iColorMatrix >= 0) {
+        return GetYuvToRgbCoeff(m_iColorMatrix, m_bColorFullRange, nBitDepth);
+    }
+    int iMatrix = m_videoFormat.video_signal_description.matrix_coefficients;
+    bool bFullRange = m_videoFormat.video_signal_description.video_full_range_flag;
+    if (iMatrix == ColorSpaceStandard_Unspecified || iMatrix == 0) {
+        // nothing signalled: BT.601 video range, what the output has always been
+        iMatrix = ColorSpaceStandard_BT601;
+        bFullRange = false;
+    }
+    return GetYuvToRgbCoeff(iMatrix, bFullRange, nBitDepth);
+}
+
+/* Output settings as of now, for the picture being displayed */
+NvDecoder::OutputSettings NvDecoder::getOutputSettings()
+{
+    OutputSettings settings;
+    settings.eFormat   = oformat;
+    settings.nLevels   = m_nPyramidLevels;
+    settings.eRgbDepth = m_eRgbDepth;
+    settings.coeff     = getColorCoeff();
+    return settings;
+}
+
+static YuvFormat getYuvFormat(cudaVideoSurfaceFormat eSurfaceFormat)
+{
+    switch (eSurfaceFormat) {
+    case cudaVideoSurfaceFormat_P016:         return YUV_P016;
+    case cudaVideoSurfaceFormat_YUV444:       return YUV_444;
+    case cudaVideoSurfaceFormat_YUV444_16Bit: return YUV_444P16;
+    default:                                  return YUV_NV12;
+    }
+}
+
+static RgbLayout getRgbLayout(NvDecoder::ImageFormat_t eFormat)
+{
+    switch (eFormat) {
+    case NvDecoder::IMAGE_BGR:  return BGR_PLANAR;
+    case NvDecoder::IMAGE_RGBI: return RGB_INTERLEAVED;
+    case NvDecoder::IMAGE_BGRI: return BGR_INTERLEAVED;
+    default:                    return RGB_PLANAR;
+    }
+}
+
+/* Crop rectangle in the decoder output and size of one output, checked against the current picture */
+void NvDecoder::getOutputGeometry(const OutputSpec &spec, Rect &crop, Dim &dim)
+{
+    crop = spec.crop;
+    if (!crop.l && !crop.t && !crop.r && !crop.b) {
+        crop.r = m_nWidth;
+        crop.b = m_nLumaHeight;
+    }
+    crop.l = std::max(crop.l, 0);
+    crop.t = std::max(crop.t, 0);
+    crop.r = std::min(crop.r, (int)m_nWidth);
+    crop.b = std::min(crop.b, (int)m_nLumaHeight);
+    if (m_nNumChromaPlanes == 1) {
+        // a 4:2:0 crop must start on a chroma sample
+        crop.l &= ~1;
+        crop.t &= ~1;
+    }
+    if (crop.r <= crop.l || crop.b <= crop.t) {
+        NVDEC_THROW_ERROR("Output crop is outside the picture", CUDA_ERROR_INVALID_VALUE);
+    }
+    dim = spec.resize;
+    if (dim.w <= 0 || dim.h <= 0) {
+        dim.w = crop.r - crop.l;
+        dim.h = crop.b - crop.t;
+    }
+}
+
+/* Issue the conversion and copy of one mapped surface into pDecodedFrame (frame's buffer or a stage of it) on
+*  pCtx->stream: the whole picture without pSpec, otherwise the crop and resize of that output, in the format
+*  and with the pyramid levels frame was laid out for. Caller synchronizes the stream before unmapping.
+*/
+void NvDecoder::convertFrame(PostProcCtx *pCtx, const OutputSettings &settings, CUdeviceptr d_srcFrame,
+                             unsigned int d_srcPitch, const OutputSpec *pSpec, const NvFrame &frame,
+                             uint8_t *pDecodedFrame, bool bDeviceDst)
+{
+    bool bPlanarSurface = m_nNumChromaPlanes == 2;
+    SurfaceView view;
+    view.pY = (const uint8_t *)d_srcFrame;
+    view.pU = view.pY + (size_t)d_srcPitch * m_nSurfaceHeight;
+    view.pV = bPlanarSurface ? view.pU + (size_t)d_srcPitch * m_nSurfaceHeight : NULL;
+    view.nPitch  = d_srcPitch;
+    view.nWidth  = m_nWidth;
+    view.nHeight = m_nLumaHeight;
+    if (pSpec) {
+        cropAndResize(pCtx, *pSpec, view);
+    }
+
+    ImageFormat_t eFormat = (ImageFormat_t)frame.format();
+    if (frame.levels() == 1) {
+        convertSurface(pCtx, settings, view, eFormat, pDecodedFrame, frame.pitch(), bDeviceDst);
+        return;
+    }
+
+    // the levels are built from level 0 where it was converted to: in place in device (or host surface)
+    // memory, otherwise in the scratch buffer, from which the whole pyramid is copied out at once
+    bool bHostSurface = m_pBackend->isHostSurface();
+    int nRows = (int)(frame.size() / frame.pitch());
+    uint8_t *pPyramid = pDecodedFrame;
+    if (!bHostSurface && !bDeviceDst) {
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+        pPyramid = getScratch(&pCtx->d_scratch, &pCtx->nScratchBytes, frame.size());
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+    }
+    convertSurface(pCtx, settings, view, eFormat, pPyramid, frame.pitch(), bDeviceDst || pPyramid != pDecodedFrame);
+    buildPyramid(pCtx, settings.eRgbDepth, frame, pPyramid, bHostSurface);
+
+    if (pPyramid != pDecodedFrame) {
+        CUDA_MEMCPY2D m = { 0 };
+        m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+        m.srcDevice     = (CUdeviceptr)pPyramid;
+        m.srcPitch      = frame.pitch();
+        m.dstMemoryType = CU_MEMORYTYPE_HOST;
+        m.dstHost       = pDecodedFrame;
+        m.dstPitch      = frame.pitch();
+        m.WidthInBytes  = frame.pitch();
+        m.Height        = nRows;
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+        CUDA_DRVAPI_CALL(m_pBackend->memcpy2DAsync(&m, pCtx->stream));
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+    }
+}
+
+/* Narrow view down to the crop of spec, and resize it into pCtx->d_resize if spec asks for another size */
+void NvDecoder::cropAndResize(PostProcCtx *pCtx, const OutputSpec &spec, SurfaceView &view)
+{
+    bool bPlanarSurface = m_nNumChromaPlanes == 2;
+    Rect crop;
+    Dim dim;
+    getOutputGeometry(spec, crop, dim);
+    size_t nLumaOffset = (size_t)crop.t * view.nPitch + (size_t)crop.l * m_nBPP;
+    // 4:2:0 chroma has half the rows, and one interleaved pair per two luma columns
+    size_t nChromaOffset = bPlanarSurface ? nLumaOffset : (size_t)(crop.t / 2) * view.nPitch + (size_t)crop.l * m_nBPP;
+    view.pY += nLumaOffset;
+    view.pU += nChromaOffset;
+    view.pV = bPlanarSurface ? view.pV + nChromaOffset : NULL;
+    view.nWidth  = crop.r - crop.l;
+    view.nHeight = crop.b - crop.t;
+
+    if (dim.w != view.nWidth || dim.h != view.nHeight) {
+        // resize into a surface of the same layout, then convert that like a decoded one
+        int nPitch = ((dim.w + 1) & ~1) * m_nBPP;
+        int nChromaRows = bPlanarSurface ? 2 * dim.h : (dim.h + 1) / 2;
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+        uint8_t *pResized = getScratch(&pCtx->d_resize, &pCtx->nResizeBytes, (size_t)nPitch * (dim.h + nChromaRows));
+        if (m_pBackend->isHostSurface()) {
+            ResizeYuvCpu(getYuvFormat(m_eOutputFormat), view.pY, view.pU, view.pV, view.nPitch, view.nWidth,
+                         view.nHeight, pResized, nPitch, dim.w, dim.h);
+        } else {
+            ResizeYuv(getYuvFormat(m_eOutputFormat), view.pY, view.pU, view.pV, view.nPitch, view.nWidth,
+                      view.nHeight, pResized, nPitch, dim.w, dim.h, pCtx->stream);
+        }
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+        view.pY = pResized;
+        view.pU = pResized + (size_t)nPitch * dim.h;
+        view.pV = bPlanarSurface ? view.pU + (size_t)nPitch * dim.h : NULL;
+        view.nPitch  = nPitch;
+        view.nWidth  = dim.w;
+        view.nHeight = dim.h;
+    }
+}
+
+/* Planes of one image of eFormat as laid out by getFrameLayout(), pBase being the frame buffer */
+int NvDecoder::getOutputPlanes(ImageFormat_t eFormat, RgbDepth eRgbDepth, const NvFrameLevel &level, uint8_t *pBase,
+                               ImagePlane *aPlane)
+{
+    uint8_t *p = pBase + level.nOffset;
+    int w = level.nWidth, h = level.nHeight, nPitch = level.nPitch;
+    int nRgbSample = RgbSampleSize(eRgbDepth);
+    switch (eFormat) {
+    case IMAGE_Y:
+        aPlane[0] = { p, nPitch, w, h, 1, m_nBPP };
+        return 1;
+    case IMAGE_RGBI:
+    case IMAGE_BGRI:
+        aPlane[0] = { p, nPitch, w, h, 3, nRgbSample };
+        return 1;
+    case IMAGE_RGB:
+    case IMAGE_BGR:
+        for (int i = 0; i < 3; i++) {
+            aPlane[i] = { p + (size_t)nPitch * h * i, nPitch, w, h, 1, nRgbSample };
+        }
+        return 3;
+    case IMAGE_YUV:
+        if (m_nNumChromaPlanes == 1) {
+            // I420: chroma planes at half pitch, see Nv12ToI420()
+            int nChromaPitch = nPitch / 2;
+            aPlane[0] = { p, nPitch, w, h, 1, m_nBPP };
+            aPlane[1] = { p + (size_t)nPitch * h, nChromaPitch, (w + 1) / 2, (h + 1) / 2, 1, m_nBPP };
+            aPlane[2] = { aPlane[1].pData + (size_t)nChromaPitch * ((h + 1) / 2), nChromaPitch, (w + 1) / 2,
+                          (h + 1) / 2, 1, m_nBPP };
+            return 3;
+        }
+        // fall through
+    default:
+        // copies of the surface: NV12/P016 with an interleaved chroma plane, or three 4:4:4 planes
+        aPlane[0] = { p, nPitch, w, h, 1, m_nBPP };
+        if (m_nNumChromaPlanes == 1) {
+            aPlane[1] = { p + (size_t)nPitch * h, nPitch, (w + 1) / 2, getChromaRows(h), 2, m_nBPP };
+            return 2;
+        }
+        for (int i = 1; i < 3; i++) {
+            aPlane[i] = { p + (size_t)nPitch * (h + getChromaRows(h) * (i - 1)), nPitch, w, getChromaRows(h), 1, m_nBPP };
+        }
+        return 3;
+    }
+}
+
+/* Images of an eFormat frame with nLevels pyramid levels: level 0 nWidth x nHeight at nPitch, each further
+*  one half the size of the one before (rounded up) and packed. Every level starts on a whole row of nPitch,
+*  so the frame copies as one block. Returns the rows of nPitch the frame takes.
+*/
+int NvDecoder::getFrameLayout(ImageFormat_t eFormat, RgbDepth eRgbDepth, int nWidth, int nHeight, int nPitch,
+                              int nLevels, NvFrameLevel *aLevel)
+{
+    bool bRgb = eFormat >= IMAGE_RGB && eFormat <= IMAGE_BGRI;
+    if (nLevels > 1 && bRgb && eRgbDepth == RGB_16F) {
+        NVDEC_THROW_ERROR("Pyramid levels of half float RGB are not supported", CUDA_ERROR_NOT_SUPPORTED);
+    }
+    aLevel[0] = { 0, nWidth, nHeight, nPitch };
+    int nRows = getOutputRows(eFormat, nHeight);
+    for (int i = 1; i < nLevels; i++) {
+        NvFrameLevel &level = aLevel[i];
+        level.nWidth  = (aLevel[i - 1].nWidth + 1) / 2;
+        level.nHeight = (aLevel[i - 1].nHeight + 1) / 2;
+        level.nPitch  = getOutputRowBytes(eFormat, eRgbDepth, level.nWidth);
+        level.nOffset = (size_t)nPitch * nRows;
+        nRows += (int)(((size_t)level.nPitch * getOutputRows(eFormat, level.nHeight) + nPitch - 1) / nPitch);
+    }
+    return nRows;
+}
+
+/* Levels 1.. of frame from level 0 in pFrame, each from the one before, on pCtx->stream or on the CPU */
+void NvDecoder::buildPyramid(PostProcCtx *pCtx, RgbDepth eRgbDepth, const NvFrame &frame, uint8_t *pFrame, bool bHost)
+{
+    ImageFormat_t eFormat = (ImageFormat_t)frame.format();
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    for (int i = 1; i < frame.levels(); i++) {
+        ImagePlane aSrc[3], aDst[3];
+        int nPlanes = getOutputPlanes(eFormat, eRgbDepth, frame.level(i - 1), pFrame, aSrc);
+        getOutputPlanes(eFormat, eRgbDepth, frame.level(i), pFrame, aDst);
+        for (int p = 0; p < nPlanes; p++) {
+            const ImagePlane &s = aSrc[p], &d = aDst[p];
+            if (bHost) {
+                Downsample2xCpu(s.pData, s.nPitch, s.nWidth, s.nHeight, d.pData, d.nPitch, d.nWidth, d.nHeight,
+                                s.nChannels, s.nSampleBytes);
+            } else {
+                Downsample2x(s.pData, s.nPitch, s.nWidth, s.nHeight, d.pData, d.nPitch, d.nWidth, d.nHeight,
+                             s.nChannels, s.nSampleBytes, pCtx->stream);
             }
-            m_vpFrame.push_back(pFrame);
         }
-        pDecodedFrame = m_vpFrame[m_nDecodedFrame - 1];
     }
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+}
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
+/* Issue the eFormat conversion and copy of src on pCtx->stream */
+void NvDecoder::convertSurface(PostProcCtx *pCtx, const OutputSettings &settings, const SurfaceView &src,
+                               ImageFormat_t eFormat, uint8_t *pDecodedFrame, int nDstPitch, bool bDeviceDst)
+{
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
     // TODO start
 
-    if (oformat == IMAGE_NV12) {
+    bool bPlanarSurface = m_nNumChromaPlanes == 2;
+    int nChromaRows = getChromaRows(src.nHeight);
+    if (eFormat == IMAGE_NV12 || eFormat == IMAGE_UNCHANGED || eFormat == IMAGE_Y ||
+        (eFormat == IMAGE_YUV && bPlanarSurface)) {
+        // plain plane copies; IMAGE_Y stops after luma, a 444 surface already is planar YUV
         CUDA_MEMCPY2D m = { 0 };
         m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
-        m.srcDevice     = d_srcFrame;
-        m.srcPitch      = d_srcPitch;
-        m.Height        = m_nLumaHeight;
+        m.srcDevice     = (CUdeviceptr)src.pY;
+        m.srcPitch      = src.nPitch;
+        m.Height        = src.nHeight;
 
         m.dstDevice     = (CUdeviceptr)(m.dstHost = pDecodedFrame);
-        m.dstMemoryType = m_bUseDeviceFrame ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
-        m.dstPitch      = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth * m_nBPP;
-        m.WidthInBytes  = m_nWidth * m_nBPP;
-        CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, m_cuvidStream));
-
-        m.srcDevice = (CUdeviceptr)((uint8_t *)d_srcFrame + m.srcPitch * m_nSurfaceHeight);
-        m.dstDevice = (CUdeviceptr)(m.dstHost = pDecodedFrame + m.dstPitch * m_nLumaHeight);
-        m.Height = m_nChromaHeight; // TODO: (size_t)(m_nSurfaceHeight * m_chromaHeight_factor)
-        CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, m_cuvidStream));
+        m.dstMemoryType = bDeviceDst ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
+        m.dstPitch      = nDstPitch;
+        m.WidthInBytes  = src.nWidth * m_nBPP;
+        CUDA_DRVAPI_CALL(m_pBackend->memcpy2DAsync(&m, pCtx->stream));
+
+        if (eFormat != IMAGE_Y) {
+            m.srcDevice = (CUdeviceptr)src.pU;
+            m.dstDevice = (CUdeviceptr)(m.dstHost = pDecodedFrame + m.dstPitch * src.nHeight);
+            m.Height = nChromaRows;
+            CUDA_DRVAPI_CALL(m_pBackend->memcpy2DAsync(&m, pCtx->stream));
+
+            if (bPlanarSurface)
+            {
+                m.srcDevice = (CUdeviceptr)src.pV;
+                m.dstDevice = (CUdeviceptr)(m.dstHost = pDecodedFrame + m.dstPitch * (src.nHeight + nChromaRows));
+                m.Height = nChromaRows;
+                CUDA_DRVAPI_CALL(m_pBackend->memcpy2DAsync(&m, pCtx->stream));
+            }
+        }
+    } else if (eFormat == IMAGE_YUV || eFormat == IMAGE_RGB || eFormat == IMAGE_BGR ||
+               eFormat == IMAGE_RGBI || eFormat == IMAGE_BGRI) {
+        // one fused pass from the decoded surface into the requested layout
+        int nRows = getOutputRows(eFormat, src.nHeight);
+        bool bHostSurface = m_pBackend->isHostSurface();
+        // software backend: the mapped surface is host memory and so is the destination.
+        // Otherwise kernels can't write pageable host memory, they go through the scratch buffer.
+        uint8_t *pDst = (bHostSurface || bDeviceDst) ? pDecodedFrame
+                                                     : getScratch(&pCtx->d_scratch, &pCtx->nScratchBytes,
+                                                                  (size_t)nDstPitch * nRows);
+
+        if (eFormat == IMAGE_YUV) {
+            if (bHostSurface) {
+                Nv12ToI420Cpu(src.pY, src.pU, src.nPitch, pDst, nDstPitch, src.nWidth, src.nHeight, m_nBPP);
+            } else {
+                Nv12ToI420(src.pY, src.pU, src.nPitch, pDst, nDstPitch, src.nWidth, src.nHeight, m_nBPP,
+                           pCtx->stream);
+            }
+        } else {
+            YuvFormat eYuvFormat = getYuvFormat(m_eOutputFormat);
+            RgbLayout eLayout = getRgbLayout(eFormat);
+            if (bHostSurface) {
+                YuvToRgbCpu(eYuvFormat, src.pY, src.pU, src.pV, src.nPitch, pDst, nDstPitch, src.nWidth,
+                            src.nHeight, eLayout, settings.eRgbDepth, settings.coeff);
+            } else {
+                YuvToRgb(eYuvFormat, src.pY, src.pU, src.pV, src.nPitch, pDst, nDstPitch, src.nWidth,
+                         src.nHeight, eLayout, settings.eRgbDepth, settings.coeff, pCtx->stream);
+            }
+        }
 
-        if (m_nNumChromaPlanes == 2)
-        {
-            m.srcDevice = (CUdeviceptr)((uint8_t *)d_srcFrame + m.srcPitch * m_nSurfaceHeight * 2); // TODO
-            m.dstDevice = (CUdeviceptr)(m.dstHost = pDecodedFrame + m.dstPitch * m_nLumaHeight * 2); // TODO
-            m.Height = m_nChromaHeight; // TODO
-            CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, m_cuvidStream));
+        if (pDst != pDecodedFrame) {
+            CUDA_MEMCPY2D m = { 0 };
+            m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+            m.srcDevice     = (CUdeviceptr)pDst;
+            m.srcPitch      = nDstPitch;
+            m.dstMemoryType = CU_MEMORYTYPE_HOST;
+            m.dstHost       = pDecodedFrame;
+            m.dstPitch      = nDstPitch;
+            m.WidthInBytes  = nDstPitch;
+            m.Height        = nRows;
+            CUDA_DRVAPI_CALL(m_pBackend->memcpy2DAsync(&m, pCtx->stream));
         }
-        CUDA_DRVAPI_CALL(cuStreamSynchronize(m_cuvidStream));
     } else {
-        // 2RGBi
-        if (m_d_RGBi_frame == NULL) {
-            cudaMalloc(&m_d_RGBi_frame, d_srcPitch*m_nLumaHeight*3*sizeof(float));
+        m_pBackend->ctxPopCurrent();
+        NVDEC_THROW_ERROR("Output format not supported", CUDA_ERROR_NOT_SUPPORTED);
+    }
+
+    // TODO end
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+}
+
+void NvDecoder::setPyramidLevels(int nLevels)
+{
+    if (nLevels < 1 || nLevels > NV_FRAME_MAX_LEVELS) {
+        NVDEC_THROW_ERROR("Invalid number of pyramid levels", CUDA_ERROR_INVALID_VALUE);
+    }
+    m_nPyramidLevels = nLevels;
+}
+
+void NvDecoder::setOutputs(const std::vector<OutputSpec> &vOutput)
+{
+    for (const OutputSpec &spec : vOutput) {
+        if (spec.eFormat < 0 || spec.eFormat > IMAGE_FORMAT_MAX || spec.resize.w < 0 || spec.resize.h < 0 ||
+            spec.nLevels < 0 || spec.nLevels > NV_FRAME_MAX_LEVELS) {
+            NVDEC_THROW_ERROR("Invalid output spec", CUDA_ERROR_INVALID_VALUE);
         }
+    }
+    // pictures already queued for async post-processing keep the list they were displayed with
+    m_pOutputs = vOutput.empty() ? NULL : std::make_shared<const std::vector<OutputSpec>>(vOutput);
+}
 
+void NvDecoder::setDecodeMode(DecodeMode_t eMode, double fTargetFps, int64_t nTimestampPerSec)
+{
+    if (eMode == DECODE_TARGET_RATE && fTargetFps <= 0) {
+        NVDEC_THROW_ERROR("Target rate must be positive", CUDA_ERROR_INVALID_VALUE);
+    }
+    m_eDecodeMode = eMode;
+    m_pBackend->setSkipPictures(eMode == DECODE_KEY_FRAMES, eMode == DECODE_REFERENCE);
+    m_nOutputInterval = eMode == DECODE_TARGET_RATE ? std::max((int64_t)(nTimestampPerSec / fTargetFps), (int64_t)1) : 0;
+    m_bOutputTimestampValid = false;
+}
 
-        NppiSize d_size = {(int)d_srcPitch, (int)m_nLumaHeight};
-        Npp8u* y_plane = (Npp8u*)d_srcFrame;
-        Npp8u* uv_plane = y_plane + d_srcPitch * m_nLumaHeight;
-        Npp8u* src_planes[2] = {y_plane,uv_plane};
-        nppiNV12ToRGB_8u_P2C3R(src_planes,
-                               d_srcPitch,
-                               (Npp8u*)m_d_RGBi_frame,
-                               d_srcPitch*3,
-                               d_size);
+/* Decides in the display callback whether a picture is mapped and converted at all */
+bool NvDecoder::isWantedForDisplay(CUVIDPARSERDISPINFO *pDispInfo)
+{
+    if (m_abPicSkipped[pDispInfo->picture_index]) {
+        // never decoded
+        return false;
+    }
+    if (pDispInfo->timestamp < m_nDisplayFrom) {
+        m_skipStats.nDisplays++;
+        NvMetrics::add(NV_COUNTER_FRAMES_DROPPED);
+        return false;
+    }
+    if (m_eDecodeMode != DECODE_TARGET_RATE) {
+        return true;
+    }
 
-        if (oformat == IMAGE_RGBI)
-        {
-            CUDA_MEMCPY2D m = { 0 };
-            m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
-            m.srcDevice     = (CUdeviceptr)m_d_RGBi_frame;
-            m.srcPitch      = d_srcPitch*3;
-            m.Height        = m_nLumaHeight;
-
-            m.dstDevice     = (CUdeviceptr)(m.dstHost = pDecodedFrame);
-            m.dstMemoryType = m_bUseDeviceFrame ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
-            //m.dstPitch      = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth * m_nBPP; //TODO: m_nDeviceFramePitch should be rgbi
-            m.dstPitch      = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth * 3;
-            m.WidthInBytes  = m_nWidth * 3;
-            CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, m_cuvidStream));
-            CUDA_DRVAPI_CALL(cuStreamSynchronize(m_cuvidStream));
-        }
-        else if (oformat == IMAGE_RGB)
-        {
-            // 2RGBp
-            if (m_d_RGBp_frame == NULL) {
-                cudaMalloc(&m_d_RGBp_frame, d_srcPitch*m_nLumaHeight*3*sizeof(float));
-            }
+    int64_t timestamp = pDispInfo->timestamp;
+    if (m_bOutputTimestampValid && timestamp < m_nNextOutputTimestamp &&
+        timestamp >= m_nNextOutputTimestamp - m_nOutputInterval) {
+        m_skipStats.nDisplays++;
+        NvMetrics::add(NV_COUNTER_FRAMES_DROPPED);
+        return false;
+    }
+    // next slot one interval on, or re-anchored after a gap or a jump back (seek, wrap)
+    if (m_bOutputTimestampValid && timestamp < m_nNextOutputTimestamp + m_nOutputInterval &&
+        timestamp >= m_nNextOutputTimestamp) {
+        m_nNextOutputTimestamp += m_nOutputInterval;
+    } else {
+        m_nNextOutputTimestamp = timestamp + m_nOutputInterval;
+    }
+    m_bOutputTimestampValid = true;
+    return true;
+}
 
-            Npp8u* r_plane = (Npp8u*)m_d_RGBp_frame;
-            Npp8u* g_plane = r_plane + d_srcPitch*m_nLumaHeight;
-            Npp8u* b_plane = r_plane + d_srcPitch*m_nLumaHeight*2;
-            Npp8u* rgb_planes[3] = {r_plane,g_plane,b_plane};
-            nppiCopy_8u_C3P3R((Npp8u*)m_d_RGBi_frame,
-                              d_srcPitch*3,
-                              rgb_planes,
-                              d_srcPitch,
-                              d_size);
+/* Put the caller's timestamp back into pDispInfo, the parser carried the packet sequence number of decode().
+*  Returns when decode() received the packet, 0 when its entry has been reused since: the picture came out
+*  more than NUM_INPUT_PACKETS packets after it went in, its timestamp is unknown then.
+*/
+uint64_t NvDecoder::resolveInput(CUVIDPARSERDISPINFO *pDispInfo)
+{
+    uint64_t nSeq = (uint64_t)pDispInfo->timestamp;
+    const InputPacket &input = m_aInputPacket[nSeq % NUM_INPUT_PACKETS];
+    if (input.seq != nSeq) {
+        pDispInfo->timestamp = 0;
+        return 0;
+    }
+    pDispInfo->timestamp = input.timestamp;
+    return input.nInputNs;
+}
 
-            CUDA_MEMCPY2D m = { 0 };
-            m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
-            m.srcDevice     = (CUdeviceptr)m_d_RGBp_frame;
-            m.srcPitch      = d_srcPitch;
-            m.Height        = m_nLumaHeight*3;
+/* Return value from HandlePictureDisplay() are interpreted as:
+*  0: fail, >=1: succeeded
+*/
+int NvDecoder::handleNvPostProc(CUVIDPARSERDISPINFO *pDispInfo) {
+    NvTraceScope trace("display_callback", m_nTraceStream, pDispInfo->picture_index);
+    uint64_t nInputNs = resolveInput(pDispInfo);
+    if (!isWantedForDisplay(pDispInfo)) {
+        return 1;
+    }
+    if (m_bAsyncPostProc) {
+        return submitPostProc(pDispInfo, nInputNs);
+    }
 
-            m.dstDevice     = (CUdeviceptr)(m.dstHost = pDecodedFrame);
-            m.dstMemoryType = m_bUseDeviceFrame ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
-            m.dstPitch      = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth;
-            m.WidthInBytes  = m_nWidth;
-            CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, m_cuvidStream));
-            CUDA_DRVAPI_CALL(cuStreamSynchronize(m_cuvidStream));
+    MappedSurface src(m_pBackend, m_hDecoder);
+    mapFrame(pDispInfo, m_cuvidStream, &src.dptr, &src.nPitch);
+
+    // one frame per output, all from the surface mapped once
+    OutputSettings settings = getOutputSettings();
+    int nOutputs = getNumOutputs();
+    m_syncPostProc.stream = m_cuvidStream;
+    if (m_bPinnedHostFrame) {
+        // convert into a device stage, then copy it out on the copy stream while the next picture decodes
+        if (!m_pCopyPipeline) {
+            m_pCopyPipeline = new NvCopyPipeline(new NvBackendCopyEngine(m_pBackend, m_cuContext), m_nCopyStages);
+        }
+        for (int i = 0; i < nOutputs; i++) {
+            const OutputSpec *pSpec = m_pOutputs ? &(*m_pOutputs)[i] : NULL;
+            NvFrame frame = acquireFrame(settings, pDispInfo->timestamp, nInputNs, pSpec, i);
+            NvCopyPipeline::Stage *pStage = m_pCopyPipeline->acquireStage(frame.size(), m_vFrameDecoded);
+            NvStageTimer timer(NV_STAGE_CONVERT, m_nTraceStream, pDispInfo->picture_index);
+            convertFrame(&m_syncPostProc, settings, src.dptr, src.nPitch, pSpec, frame, pStage->pData, true);
+            CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+            CUDA_DRVAPI_CALL(m_pBackend->streamSynchronize(m_cuvidStream));
+            CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+            timer.stop();
+            // pyramid levels included
+            int nPitch = frame.pitch();
+            int nRows = (int)(frame.size() / nPitch);
+            m_pCopyPipeline->submit(pStage, std::move(frame), nPitch, nRows, m_nTraceStream, pDispInfo->picture_index);
+        }
+    } else {
+        NvStageTimer timer(NV_STAGE_CONVERT, m_nTraceStream, pDispInfo->picture_index);
+        std::vector<NvFrame> vFrame(nOutputs);
+        for (int i = 0; i < nOutputs; i++) {
+            const OutputSpec *pSpec = m_pOutputs ? &(*m_pOutputs)[i] : NULL;
+            vFrame[i] = acquireFrame(settings, pDispInfo->timestamp, nInputNs, pSpec, i);
+            convertFrame(&m_syncPostProc, settings, src.dptr, src.nPitch, pSpec, vFrame[i], vFrame[i].data(),
+                         m_bUseDeviceFrame);
         }
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+        CUDA_DRVAPI_CALL(m_pBackend->streamSynchronize(m_cuvidStream));
+        CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+        timer.stop();
 
+        for (auto &frame : vFrame) {
+            m_vFrameDecoded.push_back(std::move(frame));
+        }
+    }
 
+    NvStageTimer timer(NV_STAGE_UNMAP, m_nTraceStream, pDispInfo->picture_index);
+    NVDEC_API_CALL(src.unmap());
+    return 1;
+}
 
+void NvDecoder::enableAsyncPostProc(int nWorkers, int nMaxInFlight)
+{
+    if (m_bAsyncPostProc || m_hDecoder) {
+        NVDEC_THROW_ERROR("Async post-processing must be enabled before decoding starts", CUDA_ERROR_INVALID_VALUE);
     }
+    // each worker holds at most one mapped surface, the parser may only run ahead by the in-flight depth
+    nWorkers = std::max(nWorkers, 1);
+    m_nMaxInFlight = std::max(nMaxInFlight, nWorkers);
+
+    m_vPostProcCtx.resize(nWorkers);
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+    for (auto &ctx : m_vPostProcCtx) {
+        CUDA_DRVAPI_CALL(m_pBackend->streamCreate(&ctx.stream, CU_STREAM_NON_BLOCKING));
+        CUDA_DRVAPI_CALL(m_pBackend->eventCreate(&ctx.event, CU_EVENT_DISABLE_TIMING));
+    }
+    CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
 
+    m_bAsyncPostProc = true;
+    m_bPostProcExit  = false;
+    for (int i = 0; i < nWorkers; i++) {
+        m_vPostProcThread.emplace_back(&NvDecoder::postProcWorker, this, i);
+    }
+}
 
-    // TODO end
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+void NvDecoder::enablePinnedHostOutput(int nStages)
+{
+    if (m_bUseDeviceFrame || m_hDecoder) {
+        NVDEC_THROW_ERROR("Pinned host output needs host frames and must be enabled before decoding starts", CUDA_ERROR_INVALID_VALUE);
+    }
+    // async workers already overlap copies with decoding, they only get the page-locked frames
+    m_bPinnedHostFrame = true;
+    m_nCopyStages = std::max(nStages, 2);
+}
 
-    if ((int)m_vTimestamp.size() < m_nDecodedFrame) {
-        m_vTimestamp.resize(m_vpFrame.size());
+/* Display callback in async mode: only record the picture and hand it to a worker.
+*  Blocks while m_nMaxInFlight pictures are queued or being post-processed.
+*/
+int NvDecoder::submitPostProc(CUVIDPARSERDISPINFO *pDispInfo, uint64_t nInputNs)
+{
+    NvTraceScope trace("postproc_backpressure", m_nTraceStream, pDispInfo->picture_index);
+    std::unique_lock<std::mutex> lock(m_mtxPostProc);
+    m_cvPostProc.wait(lock, [&] {
+        return m_nPostProcInFlight < m_nMaxInFlight || m_postProcError;
+    });
+    trace.stop();
+    if (m_postProcError) {
+        return 0;
     }
-    m_vTimestamp[m_nDecodedFrame - 1] = pDispInfo->timestamp;
 
-    NVDEC_API_CALL(cuvidUnmapVideoFrame(m_hDecoder, d_srcFrame));
+    PostProcJob job = {};
+    job.dispInfo   = *pDispInfo;
+    job.nInputNs   = nInputNs;
+    job.seq        = m_nPostProcSubmitted++;
+    job.pOutputs   = m_pOutputs;
+    job.settings   = getOutputSettings();
+    m_qPostProcJob.push_back(job);
+    m_nPostProcInFlight++;
+    m_anPicInFlight[pDispInfo->picture_index]++;
+    m_cvPostProc.notify_all();
     return 1;
 }
 
+void NvDecoder::postProcWorker(int iWorker)
+{
+    PostProcCtx *pCtx = &m_vPostProcCtx[iWorker];
+    ContextScope ctxScope(m_pBackend, m_cuContext);
+    char szThreadName[32];
+    snprintf(szThreadName, sizeof(szThreadName), "postproc %d.%d", m_nTraceStream, iWorker);
+    NvTrace::setThreadName(szThreadName);
+
+    while (true) {
+        PostProcJob job;
+        {
+            std::unique_lock<std::mutex> lock(m_mtxPostProc);
+            m_cvPostProc.wait(lock, [&] { return m_bPostProcExit || !m_qPostProcJob.empty(); });
+            if (m_qPostProcJob.empty()) {
+                return;
+            }
+            job = m_qPostProcJob.front();
+            m_qPostProcJob.pop_front();
+        }
+
+        try {
+            // a failed conversion must not keep the surface mapped, the decoder would run out of them
+            MappedSurface src(m_pBackend, m_hDecoder);
+            mapFrame(&job.dispInfo, pCtx->stream, &src.dptr, &src.nPitch);
+
+            int nOutputs = job.pOutputs ? (int)job.pOutputs->size() : 1;
+            job.vFrame.resize(nOutputs);
+            int nPicture = job.dispInfo.picture_index;
+            NvStageTimer convertTimer(NV_STAGE_CONVERT, m_nTraceStream, nPicture);
+            for (int i = 0; i < nOutputs; i++) {
+                const OutputSpec *pSpec = job.pOutputs ? &(*job.pOutputs)[i] : NULL;
+                job.vFrame[i] = acquireFrame(job.settings, job.dispInfo.timestamp, job.nInputNs, pSpec, i);
+                convertFrame(pCtx, job.settings, src.dptr, src.nPitch, pSpec, job.vFrame[i], job.vFrame[i].data(),
+                             m_bUseDeviceFrame);
+            }
+            CUDA_DRVAPI_CALL(m_pBackend->ctxPushCurrent(m_cuContext));
+            CUDA_DRVAPI_CALL(m_pBackend->eventRecord(pCtx->event, pCtx->stream));
+            CUDA_DRVAPI_CALL(m_pBackend->eventSynchronize(pCtx->event));
+            CUDA_DRVAPI_CALL(m_pBackend->ctxPopCurrent());
+            convertTimer.stop();
+            NvStageTimer unmapTimer(NV_STAGE_UNMAP, m_nTraceStream, nPicture);
+            NVDEC_API_CALL(src.unmap());
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mtxPostProc);
+            if (!m_postProcError) {
+                m_postProcError = std::current_exception();
+            }
+            job.vFrame.clear();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mtxPostProc);
+        m_anPicInFlight[job.dispInfo.picture_index]--;
+        m_nPostProcInFlight--;
+        m_mPostProcDone[job.seq] = std::move(job);
+        // release finished frames strictly in display order
+        for (auto it = m_mPostProcDone.begin();
+             it != m_mPostProcDone.end() && it->first == m_nPostProcRetired;
+             it = m_mPostProcDone.erase(it), m_nPostProcRetired++) {
+            if (!it->second.vFrame.empty()) {
+                m_vPostProcReady.push_back(std::move(it->second));
+            }
+        }
+        m_cvPostProc.notify_all();
+    }
+}
+
+/* The parser must not decode into a surface that a worker has not mapped and copied yet */
+void NvDecoder::waitPicIdle(int nPicIdx)
+{
+    std::unique_lock<std::mutex> lock(m_mtxPostProc);
+    m_cvPostProc.wait(lock, [&] { return m_anPicInFlight[nPicIdx] == 0 || m_postProcError; });
+}
+
+void NvDecoder::drainPostProc()
+{
+    if (!m_bAsyncPostProc) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m_mtxPostProc);
+    m_cvPostProc.wait(lock, [&] { return m_nPostProcInFlight == 0; });
+}
+
+/* Hand the frames finished so far, in display order, to the current decode() call */
+void NvDecoder::collectPostProc()
+{
+    std::vector<PostProcJob> vReady;
+    {
+        std::lock_guard<std::mutex> lock(m_mtxPostProc);
+        vReady.swap(m_vPostProcReady);
+    }
+    for (auto &job : vReady) {
+        for (auto &frame : job.vFrame) {
+            m_vFrameDecoded.push_back(std::move(frame));
+        }
+    }
+}
+
+void NvDecoder::stopPostProc()
+{
+    if (!m_bAsyncPostProc) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mtxPostProc);
+        m_bPostProcExit = true;
+    }
+    m_cvPostProc.notify_all();
+    for (auto &t : m_vPostProcThread) {
+        t.join();
+    }
+    m_vPostProcThread.clear();
+
+    m_pBackend->ctxPushCurrent(m_cuContext);
+    for (auto &ctx : m_vPostProcCtx) {
+        if (ctx.d_scratch) {
+            m_pBackend->memFree(ctx.d_scratch);
+        }
+        if (ctx.d_resize) {
+            m_pBackend->memFree(ctx.d_resize);
+        }
+        m_pBackend->eventDestroy(ctx.event);
+        m_pBackend->streamDestroy(ctx.stream);
+    }
+    m_pBackend->ctxPopCurrent();
+    m_vPostProcCtx.clear();
+
+    // frames finished but never returned go back to the pool
+    m_vPostProcReady.clear();
+    m_mPostProcDone.clear();
+    m_bAsyncPostProc = false;
+}
+
 NvDecoder::NvDecoder(uint16_t instanceId, Rect *pCropRect, Dim  *pResizeDim, CUcontext cuContext)
 {
+    m_pBackend = new NvCuvidBackend();
 
     iGpu = (int)instanceId;
 
-    ck(cuInit(0));
-
-    ck(cuDeviceGetCount(&nGpu));
+    nGpu = NvCudaContextRegistry::getDeviceCount();
     if (iGpu < 0 || iGpu >= nGpu) {
         __E("GPU Decoder instance out of range. Should be within[0, %d] \n",
             nGpu-1);
@@ -623,8 +1395,8 @@ NvDecoder::NvDecoder(uint16_t instanceId, Rect *pCropRect, Dim  *pResizeDim, CUc
         iGpu, m_deviceName);
 
     if (cuContext == NULL) {
-        ck(cuCtxCreate(&m_selfCtx, 0, cuDevice));
-        cuContext = m_selfCtx;
+        // shared with every other decoder on this GPU
+        cuContext = NvCudaContextRegistry::get(iGpu);
     }
     nvCreateParser(cuContext,
                    false, // m_bUseDeviceFrame
@@ -633,6 +1405,18 @@ NvDecoder::NvDecoder(uint16_t instanceId, Rect *pCropRect, Dim  *pResizeDim, CUc
                    pCropRect, pResizeDim);
 }
 
+NvDecoder::NvDecoder(NvDecoderBackend *pBackend, Rect *pCropRect, Dim *pResizeDim, CUcontext cuContext)
+{
+    m_pBackend = pBackend;
+    __I("Decoder backend in use: %s \n", m_pBackend->getName());
+
+    nvCreateParser(cuContext,
+                   false, // m_bUseDeviceFrame
+                   cudaVideoCodec_H264,
+                   NULL, false, false,
+                   pCropRect, pResizeDim);
+}
+
 void NvDecoder::nvCreateParser(CUcontext cuContext,
                                bool bUseDeviceFrame,
                                cudaVideoCodec eCodec,
@@ -655,65 +1439,230 @@ void NvDecoder::nvCreateParser(CUcontext cuContext,
     if (pCropRect) m_cropRect = *pCropRect;
     if (pResizeDim) m_resizeDim = *pResizeDim;
 
-    NVDEC_API_CALL(cuvidCtxLockCreate(&m_ctxLock, cuContext));
+    m_pFramePool = new NvFramePool(
+        [this](size_t *pnBytes, size_t *pnPitch) { return allocFrameBuffer(pnBytes, pnPitch); },
+        [this](uint8_t *pFrame) { freeFrameBuffer(pFrame); });
+
+    NVDEC_API_CALL(m_pBackend->ctxLockCreate(&m_ctxLock, cuContext));
+
+    m_bLowLatency = bLowLatency;
+    createParser(eCodec);
+}
 
+void NvDecoder::createParser(cudaVideoCodec eCodec)
+{
     CUVIDPARSERPARAMS nvPa = {};
     nvPa.CodecType              = eCodec;
     nvPa.ulMaxNumDecodeSurfaces = 1;
-    nvPa.ulMaxDisplayDelay      = bLowLatency ? 0 : 1;
+    nvPa.ulMaxDisplayDelay      = m_bLowLatency ? 0 : 1;
     nvPa.pUserData           = this;
     nvPa.pfnSequenceCallback = handleNvSequenceIsr;
     nvPa.pfnDecodePicture    = handleNvDecodeIsr;
     nvPa.pfnDisplayPicture   = handleNvPostProcIsr;
 
     if (m_pMutex) m_pMutex->lock();
-    NVDEC_API_CALL(cuvidCreateVideoParser(&m_hParser, &nvPa));
+    NVDEC_API_CALL(m_pBackend->createVideoParser(&m_hParser, &nvPa));
     if (m_pMutex) m_pMutex->unlock();
+    m_bParserFresh = true;
 }
 
-NvDecoder::~NvDecoder() {
+void NvDecoder::prepareSession(cudaVideoCodec eCodec, int nMaxWidth, int nMaxHeight,
+                               cudaVideoChromaFormat eChromaFormat, int nBitDepthMinus8)
+{
+    // stands in for the first sequence header; the real one reconfigures the decoder to its size
+    CUVIDEOFORMAT format = {};
+    format.codec                    = eCodec;
+    format.frame_rate.numerator     = 30;
+    format.frame_rate.denominator   = 1;
+    format.progressive_sequence     = 1;
+    format.bit_depth_luma_minus8    = (unsigned char)nBitDepthMinus8;
+    format.bit_depth_chroma_minus8  = (unsigned char)nBitDepthMinus8;
+    // the deepest DPB any of the codecs asks for
+    format.min_num_decode_surfaces  = 20;
+    format.coded_width              = (unsigned int)nMaxWidth;
+    format.coded_height             = (unsigned int)nMaxHeight;
+    format.display_area.right       = nMaxWidth;
+    format.display_area.bottom      = nMaxHeight;
+    format.chroma_format            = eChromaFormat;
+    prepareSession(&format);
+}
+
+void NvDecoder::prepareSession(cudaVideoCodec eCodec, const NvStreamInfo &info)
+{
+    static const cudaVideoChromaFormat aeChromaFormat[] = {
+        cudaVideoChromaFormat_Monochrome, cudaVideoChromaFormat_420, cudaVideoChromaFormat_422,
+        cudaVideoChromaFormat_444,
+    };
 
-    START_TIMER
-    cuCtxPushCurrent(m_cuContext);
-    cuCtxPopCurrent(NULL);
+    CUVIDEOFORMAT format = {};
+    format.codec                    = eCodec;
+    // without VUI timing the parser reports 30 too
+    format.frame_rate.numerator     = info.nFrameRateNum && info.nFrameRateDen ? info.nFrameRateNum : 30;
+    format.frame_rate.denominator   = info.nFrameRateNum && info.nFrameRateDen ? info.nFrameRateDen : 1;
+    format.progressive_sequence     = info.bProgressive;
+    format.bit_depth_luma_minus8    = (unsigned char)(info.nBitDepthLuma - 8);
+    format.bit_depth_chroma_minus8  = (unsigned char)(info.nBitDepthChroma - 8);
+    format.min_num_decode_surfaces  = 20;
+    format.coded_width              = (unsigned int)info.nCodedWidth;
+    format.coded_height             = (unsigned int)info.nCodedHeight;
+    format.display_area.left        = info.nCropLeft;
+    format.display_area.top         = info.nCropTop;
+    format.display_area.right       = info.nCropLeft + info.nWidth;
+    format.display_area.bottom      = info.nCropTop + info.nHeight;
+    format.chroma_format            = aeChromaFormat[info.nChromaFormat & 3];
+    format.video_signal_description.video_format             = (unsigned char)info.videoFormat;
+    format.video_signal_description.video_full_range_flag    = info.bFullRange;
+    format.video_signal_description.color_primaries          = (unsigned char)info.colorPrimaries;
+    format.video_signal_description.transfer_characteristics = (unsigned char)info.transferCharacteristics;
+    format.video_signal_description.matrix_coefficients      = (unsigned char)info.matrixCoefficients;
+    prepareSession(&format);
+}
+
+void NvDecoder::prepareSession(CUVIDEOFORMAT *pVideoFormat)
+{
+    if (m_hDecoder) {
+        return;
+    }
+    if (pVideoFormat->codec != m_eCodec) {
+        reset(pVideoFormat->codec);
+    }
+    handleNvSequence(pVideoFormat);
+
+    // the parser hasn't seen a sequence header yet, the first real one still has to size its DPB
+    m_bParserFresh = true;
+    m_bNewStream = true;
+    m_bSessionPrepared = true;
+    m_bReconfigExternal = true;
+}
+
+void NvDecoder::reset(cudaVideoCodec eCodec)
+{
+    // what the old stream still has in flight is of no use to anyone
+    drainPostProc();
+    if (m_bAsyncPostProc) {
+        collectPostProc();
+        std::lock_guard<std::mutex> lock(m_mtxPostProc);
+        m_mPostProcDone.clear();
+        m_postProcError = nullptr;
+    }
+    if (m_pCopyPipeline) {
+        m_pCopyPipeline->flush(m_vFrameDecoded);
+    }
+    m_vFrameDecoded.clear();
+    m_vFrameRet.clear();
+    m_vpFrameRet.clear();
+    m_vTimestamp.clear();
 
+    // a fresh parser instead of flushing the old one, which would decode and display its tail first
     if (m_hParser) {
-        cuvidDestroyVideoParser(m_hParser);
+        if (m_pMutex) m_pMutex->lock();
+        m_pBackend->destroyVideoParser(m_hParser);
+        if (m_pMutex) m_pMutex->unlock();
+        m_hParser = NULL;
     }
+    m_eCodec = eCodec;
+    createParser(eCodec);
+
+    m_eDecodeMode = DECODE_ALL;
+    m_nOutputInterval = 0;
+    m_bOutputTimestampValid = false;
+    memset(m_abPicSkipped, 0, sizeof(m_abPicSkipped));
+    m_nDisplayFrom = INT64_MIN;
+    m_skipStats = {};
+    m_nDecodedFrame = 0;
+    m_nDecodedFrameReturned = 0;
+    m_nDecodePicCnt = 0;
+    m_bEndDecodeDone = false;
+    m_pBackend->setSkipPictures(false, false);
 
     if (m_hDecoder) {
+        // the decoder stays, the next sequence header reconfigures it for the new stream
+        m_bNewStream = true;
+        m_bReconfigExternal = true;
+    }
+}
+
+void NvDecoder::setLowLatency(bool bLowLatency)
+{
+    if (bLowLatency == m_bLowLatency) {
+        return;
+    }
+    m_bLowLatency = bLowLatency;
+    // the display delay is fixed when the parser is created
+    if (m_hParser) {
         if (m_pMutex) m_pMutex->lock();
-        cuvidDestroyDecoder(m_hDecoder);
+        m_pBackend->destroyVideoParser(m_hParser);
         if (m_pMutex) m_pMutex->unlock();
+        m_hParser = NULL;
     }
+    createParser(m_eCodec);
+}
 
-    std::lock_guard<std::mutex> lock(m_mtxVPFrame);
-    if (m_vpFrame.size() != m_nFrameAlloc)
-    {
-        //LOG(WARNING) << "nFrameAlloc(" << m_nFrameAlloc << ") != m_vpFrame.size()(" << m_vpFrame.size() << ")";
+/* A decoder kept across streams can be reconfigured to the new one unless the codec or surface format differs
+   or it has fewer decode surfaces than the new stream's DPB takes */
+bool NvDecoder::isSessionCompatible(CUVIDEOFORMAT *pVideoFormat)
+{
+    return pVideoFormat->codec == m_videoFormat.codec &&
+           pVideoFormat->chroma_format == m_videoFormat.chroma_format &&
+           pVideoFormat->bit_depth_luma_minus8 == m_videoFormat.bit_depth_luma_minus8 &&
+           pVideoFormat->bit_depth_chroma_minus8 == m_videoFormat.bit_depth_chroma_minus8 &&
+           pVideoFormat->coded_width <= m_nMaxWidth && pVideoFormat->coded_height <= m_nMaxHeight &&
+           getNumDecodeSurfaces(pVideoFormat) <= m_nSessionSurfaces;
+}
+
+void NvDecoder::destroySession()
+{
+    if (m_pMutex) m_pMutex->lock();
+    m_pBackend->destroyDecoder(m_hDecoder);
+    if (m_pMutex) m_pMutex->unlock();
+    m_hDecoder = NULL;
+    m_nWidth = m_nLumaHeight = m_nChromaHeight = 0;
+    m_nDeviceFramePitch.store(0, std::memory_order_relaxed);
+    m_videoFormat = {};
+}
+
+NvDecoder::~NvDecoder() {
+
+    NvStageTimer timer(NV_STAGE_SESSION_DESTROY);
+    m_pBackend->ctxPushCurrent(m_cuContext);
+    m_pBackend->ctxPopCurrent();
+
+    // workers still need the decoder to unmap their surfaces
+    drainPostProc();
+    stopPostProc();
+
+    if (m_hParser) {
+        m_pBackend->destroyVideoParser(m_hParser);
     }
-    for (uint8_t *pFrame : m_vpFrame)
-    {
-        if (m_bUseDeviceFrame)
-        {
-            if (m_pMutex) m_pMutex->lock();
-            cuCtxPushCurrent(m_cuContext);
-            cuMemFree((CUdeviceptr)pFrame);
-            cuCtxPopCurrent(NULL);
-            if (m_pMutex) m_pMutex->unlock();
+
+    if (m_hDecoder) {
+        destroySession();
+    }
+
+    // waits for copies in flight, their frames go back to the pool
+    delete m_pCopyPipeline;
+    // frames the caller still holds stay valid and are freed on release; device and pinned buffers need
+    // this decoder's backend to be freed, so theirs are leaked then
+    m_vFrameDecoded.clear();
+    m_vFrameRet.clear();
+    if (!m_bUseDeviceFrame && !m_bPinnedHostFrame) {
+        m_pFramePool->setOrphanFree([](uint8_t *pFrame) { delete[] pFrame; });
+    }
+    delete m_pFramePool;
+    if (m_syncPostProc.d_scratch || m_syncPostProc.d_resize) {
+        m_pBackend->ctxPushCurrent(m_cuContext);
+        if (m_syncPostProc.d_scratch) {
+            m_pBackend->memFree(m_syncPostProc.d_scratch);
         }
-        else
-        {
-            delete[] pFrame;
+        if (m_syncPostProc.d_resize) {
+            m_pBackend->memFree(m_syncPostProc.d_resize);
         }
+        m_pBackend->ctxPopCurrent();
     }
-    cuvidCtxLockDestroy(m_ctxLock);
-    STOP_TIMER("Session Deinitialization Time: ");
+    m_pBackend->ctxLockDestroy(m_ctxLock);
+    timer.stop();
 
-    if (m_selfCtx) {
-        cuCtxDestroy(m_selfCtx);
-        m_selfCtx = NULL;
-    }
+    delete m_pBackend;
 
 }
 
@@ -730,28 +1679,92 @@ int NvDecoder::decode(const uint8_t *bitstream, int bitstreamBytes,
     CUVIDSOURCEDATAPACKET packet = {0};
     packet.payload      = bitstream;
     packet.payload_size = bitstreamBytes;
-    packet.flags        = flags | CUVID_PKT_TIMESTAMP;
+    packet.flags        = (flags & ~PKT_KEYFRAME) | CUVID_PKT_TIMESTAMP;
     packet.timestamp    = timestamp;
     if (!bitstream || bitstreamBytes == 0) {
         packet.flags |= CUVID_PKT_ENDOFSTREAM;
+    } else {
+        if (m_bLowLatency) {
+            // one whole access unit per packet: decode and display it now, not when the next one starts
+            packet.flags |= CUVID_PKT_ENDOFPICTURE;
+        }
     }
+    // key frames only: everything else is dropped before it costs any parsing
+    bool bDropPacket = m_eDecodeMode == DECODE_KEY_FRAMES && !(packet.flags & CUVID_PKT_ENDOFSTREAM) &&
+                       !(flags & PKT_KEYFRAME);
+    if (bDropPacket) {
+        m_skipStats.nPackets++;
+        NvMetrics::add(NV_COUNTER_FRAMES_DROPPED);
+    }
+
+    // covers the parser callbacks, post-processing and copies of this call
+    ContextScope ctxScope(m_pBackend, m_cuContext);
 
     m_nDecodedFrame = 0;
+    // the previous batch goes back to the pool, except frames the caller kept handles to
+    m_vFrameRet.clear();
+    m_vFrameDecoded.clear();
     m_cuvidStream = stream;
-    if (m_pMutex) m_pMutex->lock();
-    NVDEC_API_CALL(cuvidParseVideoData(m_hParser, &packet));
-    if (m_pMutex) m_pMutex->unlock();
+    if (!bDropPacket) {
+        // the parser hands its timestamp through to the display callback: a sequence number there, unlike the
+        // caller's timestamps it is unique per packet, see resolveInput()
+        uint64_t nSeq = m_nInputSeq++;
+        m_aInputPacket[nSeq % NUM_INPUT_PACKETS] = { nSeq, timestamp, NvMetrics::now() };
+        packet.timestamp = (int64_t)nSeq;
+        NvStageTimer timer(NV_STAGE_PARSE, m_nTraceStream);
+        if (m_pMutex) m_pMutex->lock();
+        NVDEC_API_CALL(m_pBackend->parseVideoData(m_hParser, &packet));
+        if (m_pMutex) m_pMutex->unlock();
+    }
     m_cuvidStream = 0;
 
+    if (m_bAsyncPostProc)
+    {
+        if (packet.flags & CUVID_PKT_ENDOFSTREAM) {
+            drainPostProc();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mtxPostProc);
+            if (m_postProcError) {
+                std::rethrow_exception(m_postProcError);
+            }
+        }
+        collectPostProc();
+    }
+    else if (m_pCopyPipeline)
+    {
+        if (packet.flags & CUVID_PKT_ENDOFSTREAM) {
+            m_pCopyPipeline->flush(m_vFrameDecoded);
+        } else {
+            m_pCopyPipeline->poll(m_vFrameDecoded);
+        }
+    }
+
+    m_vFrameRet.swap(m_vFrameDecoded);
+    m_nDecodedFrame = (int)m_vFrameRet.size();
+    if (m_nDecodedFrame > 0) {
+        uint64_t nNow = NvMetrics::now();
+        for (auto &frame : m_vFrameRet) {
+            if (frame.inputNs()) {
+                frame.setLatencyNs(nNow - frame.inputNs());
+                // once per picture, every output of it carries the same input time
+                if (frame.output() == 0) {
+                    NvMetrics::record(NV_STAGE_FRAME_LATENCY, nNow - frame.inputNs());
+                }
+            }
+        }
+    }
+    NvMetrics::add(NV_COUNTER_FRAMES_OUTPUT, m_nDecodedFrame);
+    m_vpFrameRet.clear();
+    m_vTimestamp.clear();
+    for (auto &frame : m_vFrameRet) {
+        m_vpFrameRet.push_back(frame.data());
+        m_vTimestamp.push_back(frame.timestamp());
+    }
     if (m_nDecodedFrame > 0)
     {
         if (pppFrame)
         {
-            m_vpFrameRet.clear();
-            std::lock_guard<std::mutex> lock(m_mtxVPFrame);
-            m_vpFrameRet.insert(m_vpFrameRet.begin(),
-                                m_vpFrame.begin(),
-                                m_vpFrame.begin() + m_nDecodedFrame);
             *pppFrame = &m_vpFrameRet[0];
         }
         if (ppTimestamp)
@@ -766,24 +1779,14 @@ int NvDecoder::decode(const uint8_t *bitstream, int bitstreamBytes,
     return 0;
 }
 
-int NvDecoder::decode_lockFrame(const uint8_t *bitstream, int bitstreamBytes, uint8_t ***pppFrame, int *pnFrameReturned, uint32_t flags, int64_t **ppTimestamp, int64_t timestamp, CUstream stream)
+int NvDecoder::decode(const uint8_t *bitstream, int bitstreamBytes, std::vector<NvFrame> &vFrame,
+                      uint32_t flags, int64_t timestamp, CUstream stream)
 {
-    auto ret = decode(bitstream, bitstreamBytes, pppFrame, pnFrameReturned, flags, ppTimestamp, timestamp, stream);
-    if (ret) {
-        return ret;
-    }
-
-    std::lock_guard<std::mutex> lock(m_mtxVPFrame);
-    m_vpFrame.erase(m_vpFrame.begin(), m_vpFrame.begin() + m_nDecodedFrame);
+    int ret = decode(bitstream, bitstreamBytes, NULL, NULL, flags, NULL, timestamp, stream);
+    vFrame.insert(vFrame.end(), m_vFrameRet.begin(), m_vFrameRet.end());
     return ret;
 }
 
-void NvDecoder::unlockFrame(uint8_t **ppFrame, int nFrame)
-{
-    std::lock_guard<std::mutex> lock(m_mtxVPFrame);
-    m_vpFrame.insert(m_vpFrame.end(), &ppFrame[0], &ppFrame[nFrame]);
-}
-
 #if 0
 extern "C"
 void *
@@ -2,12 +2,24 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <map>
+#include <memory>
+#include <exception>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <sstream>
 #include <string.h>
+#include "NvFramePool.hpp"
+#include "ColorSpace.hpp"
+#include "NvTrace.hpp"
+#include "NvSpsParser.hpp"
 //#include "nvcuvid.h"
 
 /********************************************************************************************************************/
@@ -433,6 +445,9 @@ struct Dim {
     int w, h;
 };
 
+class NvDecoderBackend;
+class NvCopyPipeline;
+
 /**
 * @brief Base class for decoder interface.
 */
@@ -463,12 +478,54 @@ public:
     } ImageFormat_t;
     ImageFormat_t oformat = IMAGE_NV12;
 
+    typedef enum
+    {
+        // decode and return every picture
+        DECODE_ALL         = 0,
+        // only packets flagged PKT_KEYFRAME reach the parser, non-intra pictures are not decoded
+        DECODE_KEY_FRAMES  = 1,
+        // non-reference pictures are neither decoded nor post-processed
+        DECODE_REFERENCE   = 2,
+        // every picture is decoded, only those at the target rate are mapped and converted
+        DECODE_TARGET_RATE = 3,
+    } DecodeMode_t;
+
+    // decode() flag on top of CUvideopacketflags: the packet holds a key frame (FFmpegDemuxer::isKeyFrame())
+    static const uint32_t PKT_KEYFRAME = 0x80000000;
+
+    struct SkipStats {
+        uint64_t nPackets;      // dropped before the parser
+        uint64_t nPictures;     // parsed, not decoded
+        uint64_t nDisplays;     // decoded, not post-processed
+    };
+
+    struct SessionStats {
+        uint64_t nCreated;      // hardware decoders created
+        uint64_t nReused;       // streams started on the decoder of a previous one
+    };
+
+    /**
+    * @brief One frame produced from every displayed picture, see setOutputs()
+    */
+    struct OutputSpec {
+        Rect crop;              // of the decoder output (after the crop/resize of the session), all 0: whole picture
+        Dim resize;             // bilinear, 0 x 0 keeps the crop size
+        ImageFormat_t eFormat;
+        int nLevels;            // pyramid images in the frame, itself included; 0 is the same as 1
+    };
+
     /**
     *  @brief This function is used to initialize the decoder session.
     *  Application must call this function to initialize the decoder, before
     *  starting to decode any frames.
     */
     NvDecoder(uint16_t instanceId, Rect *pCropRect = NULL, Dim  *pResizeDim = NULL, CUcontext cuContext = NULL);
+
+    /**
+    *  @brief  Decoder session on an explicit backend (e.g. SwCuvidBackend on hosts without a GPU).
+    *  NvDecoder takes ownership of pBackend. cuContext may be NULL for host-surface backends.
+    */
+    NvDecoder(NvDecoderBackend *pBackend, Rect *pCropRect = NULL, Dim *pResizeDim = NULL, CUcontext cuContext = NULL);
     ~NvDecoder();
 
     void nvCreateParser(CUcontext cuContext, bool bUseDeviceFrame,
@@ -480,6 +537,8 @@ public:
                         int maxWidth = 0, int maxHeight = 0);
 
     CUcontext getContext() { return m_cuContext; }
+    NvDecoderBackend *getBackend() { return m_pBackend; }
+    cudaVideoCodec getCodec() { return m_eCodec; }
 
     /**
     *  @brief  This function is used to get the current decode width.
@@ -504,11 +563,13 @@ public:
     }
 
     /**
-    *  @brief  This function is used to get the pitch(stride) of the device buffer holding the decoded frame.
+    *  @brief  This function is used to get the pitch(stride) of the latest decoded frame; every frame carries its
+    *  own, see NvFrame::pitch(), which can differ between pooled buffers.
     */
     int getDeviceFramePitch() {
         assert(m_nWidth);
-        return m_nDeviceFramePitch ? (int)m_nDeviceFramePitch : m_nWidth * m_nBPP; }
+        int nPitch = m_nDeviceFramePitch.load(std::memory_order_relaxed);
+        return nPitch ? nPitch : m_nWidth * m_nBPP; }
 
     /**
     *   @brief  This function is used to get the bit depth associated with the pixel format.
@@ -546,12 +607,139 @@ public:
     int decode(const uint8_t *bitstream, int bitstreamBytes,
                uint8_t ***pppFrame, int *pnFrameReturned, uint32_t flags = 0, int64_t **ppTimestamp = NULL, int64_t timestamp = 0, CUstream stream = 0);
 
-    int decode_lockFrame(const uint8_t *pData, int nSize, uint8_t ***pppFrame, int *pnFrameReturned, uint32_t flags = 0, int64_t **ppTimestamp = NULL, int64_t timestamp = 0, CUstream stream = 0);
+    /**
+    *   @brief  Same as above, but appends reference-counted handles to vFrame. A frame stays valid for as
+    *   long as a handle to it is held, and goes back to the frame pool when the last one is released.
+    *   Each handle carries the frame's size, pitch, format and timestamp.
+    */
+    int decode(const uint8_t *bitstream, int bitstreamBytes, std::vector<NvFrame> &vFrame,
+               uint32_t flags = 0, int64_t timestamp = 0, CUstream stream = 0);
 
-    void unlockFrame(uint8_t **ppFrame, int nFrame);
+    /**
+    *   @brief  Limit the output frames held at once (returned and not yet released, plus those being
+    *   filled). Decoding blocks at the limit until the consumer releases a frame, so a consumer that
+    *   holds frames on the decoding thread itself must stay below it. 0 removes the limit.
+    */
+    void setMaxOutputFrames(int nMaxFrames) { m_pFramePool->setMaxFrames(nMaxFrames); }
+    NvFramePool::Stats getFramePoolStats() { return m_pFramePool->getStats(); }
 
     int setReconfigParams(const Rect * pCropRect, const Dim * pResizeDim);
 
+    /**
+    *   @brief  Move map/convert/copy of displayed pictures out of the parser callback onto worker threads.
+    *   The display callback then only queues the picture index; frames come back from later decode() calls
+    *   in display order. Must be called before the first decode().
+    *   @param  nWorkers - number of post-processing threads, each with its own CUstream
+    *   @param  nMaxInFlight - max pictures queued or being post-processed; the parser blocks beyond it
+    */
+    void enableAsyncPostProc(int nWorkers = 1, int nMaxInFlight = 2);
+    bool isAsyncPostProc() { return m_bAsyncPostProc; }
+
+    /**
+    *   @brief  Host output frames in page-locked memory, so device-to-host copies are real DMA transfers.
+    *   Without async post-processing, pictures are converted into one of nStages device stages and copied
+    *   out on a separate stream while the next picture decodes; such a frame is returned by the decode()
+    *   call after its copy completed. Must be called before the first decode().
+    *   @param  nStages - 2 for double, 3 for triple buffering, see NvCopyPipeline::getNumStagesFor()
+    */
+    void enablePinnedHostOutput(int nStages = 2);
+
+    /**
+    *   @brief  Live mode: no display delay in the parser, and every decode() packet is flagged as one
+    *   complete access unit (CUVID_PKT_ENDOFPICTURE, as FFmpegDemuxer::demux() delivers them), so a picture
+    *   is displayed by the decode() call that carries it instead of waiting for the next packet. Streams
+    *   without B-frames then come out one frame in, one frame out; with B-frames the parser still holds
+    *   pictures until their display order is known. The parser is recreated, so call this between
+    *   streams: before the first decode() or right after reset().
+    *   Frame-in to frame-out latency is reported per frame in either mode, see NvFrame::latencyNs().
+    */
+    void setLowLatency(bool bLowLatency);
+    bool isLowLatency() { return m_bLowLatency; }
+
+    /**
+    *   @brief  YUV -> RGB matrix and range for the RGB/BGR output formats.
+    *   @param  iMatrix - ColorSpaceStandard (1: BT.709, 6: BT.601, 9: BT.2020, ...), -1 follows the
+    *   stream's VUI, with BT.601 when the stream leaves it unspecified
+    *   @param  bFullRange - 0..255 luma instead of 16..235; ignored when iMatrix is -1
+    */
+    void setColorSpace(int iMatrix = -1, bool bFullRange = false) {
+        m_iColorMatrix = iMatrix;
+        m_bColorFullRange = bFullRange;
+    }
+
+    /**
+    *   @brief  Skip work for pictures that are not wanted. Can be changed between decode() calls.
+    *   @param  fTargetFps - DECODE_TARGET_RATE only: pictures returned per second of timestamps
+    *   @param  nTimestampPerSec - timestamp units per second, 1000 for FFmpegDemuxer::demux() pts
+    */
+    void setDecodeMode(DecodeMode_t eMode, double fTargetFps = 1.0, int64_t nTimestampPerSec = 1000);
+    DecodeMode_t getDecodeMode() { return m_eDecodeMode; }
+
+    /**
+    *   @brief  Pictures with a timestamp below this are decoded but not mapped or converted, e.g. the
+    *   lead-in from a key frame up to a seek target. INT64_MIN (default) displays everything.
+    */
+    void setDisplayFrom(int64_t timestamp) { m_nDisplayFrom = timestamp; }
+    SkipStats getSkipStats() { return m_skipStats; }
+
+    /**
+    *   @brief  Create the hardware decoder ahead of the first sequence header, for streams of eCodec up to
+    *   nMaxWidth x nMaxHeight. The first sequence header then only reconfigures it. No-op once created.
+    */
+    void prepareSession(cudaVideoCodec eCodec, int nMaxWidth, int nMaxHeight,
+                        cudaVideoChromaFormat eChromaFormat = cudaVideoChromaFormat_420, int nBitDepthMinus8 = 0);
+    /**
+    *   @brief  prepareSession() with the format of the stream's SPS (FFmpegDemuxer::getStreamInfo()): size,
+    *   cropping, chroma format, bit depths, frame rate and colour description, so that a matching first
+    *   sequence header changes nothing.
+    */
+    void prepareSession(cudaVideoCodec eCodec, const NvStreamInfo &info);
+
+    /**
+    *   @brief  Start over with a new stream of eCodec without tearing down the session: pictures in flight
+    *   are dropped, the parser is recreated and decode mode, display-from and skip stats return to their
+    *   defaults. Output format, crop/resize and post-processing setup stay. The hardware decoder is kept
+    *   and reconfigured by the next sequence header if codec, chroma format and bit depth match and the
+    *   size is within its maximum, and recreated otherwise.
+    */
+    void reset(cudaVideoCodec eCodec);
+    SessionStats getSessionStats() { return m_sessionStats; }
+
+    /**
+    *   @brief  Sample type of the RGB/BGR output formats: 8-bit (default), 16-bit or half float in 0..1.
+    *   10/12-bit surfaces are converted at 16-bit precision. Must be called before the first decode().
+    */
+    void setRgbDepth(RgbDepth eDepth) { m_eRgbDepth = eDepth; }
+
+    /**
+    *   @brief  Fan every displayed picture out into several frames, e.g. the full picture, a few regions of
+    *   interest and a small preview. The surface is mapped once and each spec is cropped, resized and
+    *   converted from it on the same stream; decode() then returns one frame per spec per picture, in spec
+    *   order, and NvFrame::output() tells which spec a frame belongs to. Crops of 4:2:0 surfaces start on
+    *   even coordinates. Output frames are never pitched, and each of them counts against
+    *   setMaxOutputFrames(). An empty list goes back to one oformat frame per picture.
+    *   Can be changed between decode() calls.
+    */
+    void setOutputs(const std::vector<OutputSpec> &vOutput);
+    int getNumOutputs() { return m_pOutputs ? (int)m_pOutputs->size() : 1; }
+
+    /**
+    *   @brief  Multi-scale output for detectors: every frame carries nLevels images (1, 1/2, 1/4, ...) in
+    *   its one buffer, see NvFrame::levels()/level()/levelData(). Level 0 is the frame as without levels;
+    *   each further level is the 2x2 box filtered one before it, half the size rounded up, in the same
+    *   format, packed, and starting on a whole row of the frame's pitch. The levels are computed where the
+    *   frame is converted, before any device-to-host copy. Applies to the oformat frame; outputs of
+    *   setOutputs() take OutputSpec::nLevels. Not for half float RGB. Can be changed between decode() calls.
+    *   @param  nLevels - 1 (no pyramid) .. NV_FRAME_MAX_LEVELS
+    */
+    void setPyramidLevels(int nLevels);
+    int getPyramidLevels() { return m_nPyramidLevels; }
+
+    /**
+    *   @brief  Id the NvTrace events of this decoder are tagged with, unique per decoder by default
+    */
+    int getTraceStreamId() { return m_nTraceStream; }
+    void setTraceStreamId(int nStream) { m_nTraceStream = nStream; }
 
     /**
     *   @brief  ISR when decoding of sequence starts
@@ -560,6 +748,7 @@ public:
         return ((NvDecoder *)self)->handleNvSequence(pVideoFormat);
     }
     int handleNvSequence(CUVIDEOFORMAT *pVideoFormat);
+    void prepareSession(CUVIDEOFORMAT *pVideoFormat);
 
     /**
     *   @brief  Callback function to be registered for getting a callback when a decoded frame is ready to be decoded
@@ -577,12 +766,112 @@ public:
         return ((NvDecoder *)pUserData)->handleNvPostProc(pDispInfo);
     }
     int handleNvPostProc(CUVIDPARSERDISPINFO *pDispInfo);
+    bool isWantedForDisplay(CUVIDPARSERDISPINFO *pDispInfo);
+
+    /**
+    *   @brief  Per-stream post-processing state. The synchronous path uses m_syncPostProc on the caller's
+    *   stream, every async worker owns one on its own stream.
+    */
+    struct PostProcCtx {
+        CUstream stream = 0;
+        CUevent  event = NULL;
+        CUdeviceptr d_scratch = 0;   // conversion target when the destination is host memory
+        size_t   nScratchBytes = 0;
+        CUdeviceptr d_resize = 0;    // resized surface of one output, see setOutputs()
+        size_t   nResizeBytes = 0;
+    };
+
+    typedef std::shared_ptr<const std::vector<OutputSpec>> OutputList;
+
+    /**
+    *   @brief  What a picture is converted to, taken in the display callback: the async workers read these
+    *   instead of the members that oformat, setRgbDepth(), setColorSpace() and setPyramidLevels() write.
+    */
+    struct OutputSettings {
+        ImageFormat_t eFormat;          // oformat
+        int nLevels;                    // of the oformat frame
+        RgbDepth eRgbDepth;
+        YuvToRgbCoeff coeff;
+    };
+
+    struct PostProcJob {
+        CUVIDPARSERDISPINFO dispInfo;
+        uint64_t nInputNs;              // see resolveInput()
+        uint64_t seq;
+        OutputList pOutputs;            // as of the display callback
+        OutputSettings settings;        // likewise
+        std::vector<NvFrame> vFrame;
+    };
+
+    /**
+    *   @brief  Planes of a mapped surface, a crop of one or a resized copy, all nPitch wide.
+    *   pU is the interleaved chroma plane of NV12/P016, pV the second chroma plane of 4:4:4 surfaces.
+    */
+    struct SurfaceView {
+        const uint8_t *pY, *pU, *pV;
+        int nPitch;
+        int nWidth, nHeight;
+    };
+
+    /**
+    *   @brief  One plane of an output image: nChannels interleaved samples of nSampleBytes per pixel
+    */
+    struct ImagePlane {
+        uint8_t *pData;
+        int nPitch;
+        int nWidth, nHeight;
+        int nChannels, nSampleBytes;
+    };
+
+    void mapFrame(CUVIDPARSERDISPINFO *pDispInfo, CUstream stream, CUdeviceptr *pSrcFrame, unsigned int *pSrcPitch);
+    void convertFrame(PostProcCtx *pCtx, const OutputSettings &settings, CUdeviceptr d_srcFrame,
+                      unsigned int d_srcPitch, const OutputSpec *pSpec, const NvFrame &frame, uint8_t *pDecodedFrame,
+                      bool bDeviceDst);
+    void cropAndResize(PostProcCtx *pCtx, const OutputSpec &spec, SurfaceView &view);
+    void convertSurface(PostProcCtx *pCtx, const OutputSettings &settings, const SurfaceView &src,
+                        ImageFormat_t eFormat, uint8_t *pDecodedFrame, int nDstPitch, bool bDeviceDst);
+    void getOutputGeometry(const OutputSpec &spec, Rect &crop, Dim &dim);
+    int getOutputPlanes(ImageFormat_t eFormat, RgbDepth eRgbDepth, const NvFrameLevel &level, uint8_t *pBase,
+                        ImagePlane *aPlane);
+    int getFrameLayout(ImageFormat_t eFormat, RgbDepth eRgbDepth, int nWidth, int nHeight, int nPitch, int nLevels,
+                       NvFrameLevel *aLevel);
+    void buildPyramid(PostProcCtx *pCtx, RgbDepth eRgbDepth, const NvFrame &frame, uint8_t *pFrame, bool bHost);
+    uint8_t *allocFrameBuffer(size_t *pnFrameSize, size_t *pnPitch);
+    void freeFrameBuffer(uint8_t *pFrame);
+    int getChromaRows(int nHeight) { return (int)(nHeight * m_chromaHeight_factor); }
+    int getOutputRowBytes(ImageFormat_t eFormat, RgbDepth eRgbDepth, int nWidth);
+    int getOutputRows(ImageFormat_t eFormat, int nHeight);
+    int getOutputRowBytes() { return getOutputRowBytes(oformat, m_eRgbDepth, m_nWidth); }
+    int getOutputRows() { return getOutputRows(oformat, m_nLumaHeight); }
+    YuvToRgbCoeff getColorCoeff();
+    OutputSettings getOutputSettings();
+    NvFrame acquireFrame(const OutputSettings &settings, int64_t timestamp, uint64_t nInputNs,
+                         const OutputSpec *pSpec = NULL, int iOutput = 0);
+    uint8_t *getScratch(CUdeviceptr *pBuf, size_t *pnBufBytes, size_t nBytes);
+    uint64_t resolveInput(CUVIDPARSERDISPINFO *pDispInfo);
+    int submitPostProc(CUVIDPARSERDISPINFO *pDispInfo, uint64_t nInputNs);
+    void postProcWorker(int iWorker);
+    void waitPicIdle(int nPicIdx);
+    void drainPostProc();
+    void collectPostProc();
+    void stopPostProc();
 
     /**
     *   @brief  This function reconfigure decoder if there is a change in sequence params.
     */
     int nvCreateDecoder(CUVIDEOFORMAT *pVideoFormat);
     int nvReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat);
+    void createParser(cudaVideoCodec eCodec);
+    bool isSessionCompatible(CUVIDEOFORMAT *pVideoFormat);
+    void destroySession();
+    int getNumDecodeSurfaces(CUVIDEOFORMAT *pVideoFormat) {
+        int nSurface = pVideoFormat->min_num_decode_surfaces;
+        if (m_bAsyncPostProc) {
+            // keep surfaces queued for post-processing out of the parser's reuse cycle
+            nSurface = std::min(nSurface + m_nMaxInFlight, 32);
+        }
+        return nSurface;
+    }
     std::string getCodecString(cudaVideoCodec eCodec) {
         static struct {
             cudaVideoCodec eCodec;
@@ -674,12 +963,12 @@ public:
         return numPlane;
     }
 
+    NvDecoderBackend *m_pBackend = NULL;
     int nDecodeSurface = 0;
     int iGpu = 0;
     CUdevice cuDevice = 0;
     int nGpu = 0;
     char m_deviceName[80];
-    CUcontext m_selfCtx = NULL;
     CUcontext m_cuContext = NULL;
     CUvideoctxlock m_ctxLock;
     std::mutex *m_pMutex;
@@ -703,21 +992,47 @@ public:
     Rect m_displayRect = {};
 
 
-    void* m_d_RGBi_frame = NULL;
-    void* m_d_RGBp_frame = NULL;
+    PostProcCtx m_syncPostProc;
 
-    std::mutex               m_mtxVPFrame;
-    std::vector<uint8_t *>   m_vpFrame; // post processed frame ptrs
-    std::vector<int64_t>     m_vTimestamp;
+    NvFramePool             *m_pFramePool = NULL;
+    std::vector<NvFrame>     m_vFrameDecoded; // post processed during the current decode()
+    std::vector<NvFrame>     m_vFrameRet; // returned by the last decode(), held until the next one
     std::vector<uint8_t *>   m_vpFrameRet; // returned frame ptrs
+    std::vector<int64_t>     m_vTimestamp;
+    bool                     m_bPinnedHostFrame = false;
+    int                      m_nCopyStages = 0;
+    NvCopyPipeline          *m_pCopyPipeline = NULL;
+    int                      m_iColorMatrix = -1;
+    bool                     m_bColorFullRange = false;
+    RgbDepth                 m_eRgbDepth = RGB_8U;
+    OutputList               m_pOutputs;     // NULL: one oformat frame of the whole picture
+    int                      m_nPyramidLevels = 1;
+    int                      m_nTraceStream = NvTrace::newStreamId();
+
+    DecodeMode_t m_eDecodeMode = DECODE_ALL;
+    int64_t m_nOutputInterval = 0;      // DECODE_TARGET_RATE, in timestamp units
+    int64_t m_nNextOutputTimestamp = 0;
+    bool m_bOutputTimestampValid = false;
+    bool m_abPicSkipped[32] = {};
+    int64_t m_nDisplayFrom = INT64_MIN;
+    // decode() gives the parser a packet sequence number as the timestamp, the display callback finds the
+    // caller's timestamp and the time decode() received the packet here, at that number modulo the size
+    struct InputPacket {
+        uint64_t seq;
+        int64_t timestamp;
+        uint64_t nInputNs;
+    };
+    static const int NUM_INPUT_PACKETS = 1024;
+    InputPacket m_aInputPacket[NUM_INPUT_PACKETS] = {};
+    uint64_t m_nInputSeq = 0;
+    SkipStats m_skipStats = {};
 
     int m_nDecodedFrame = 0, m_nDecodedFrameReturned = 0;
     int m_nDecodePicCnt = 0, m_nPicNumInDecodeOrder[32];
     bool m_bEndDecodeDone = false;
-    int m_nFrameAlloc = 0;
     CUstream m_cuvidStream = 0;
     bool m_bDeviceFramePitched = false;
-    size_t m_nDeviceFramePitch = 0;
+    std::atomic<int> m_nDeviceFramePitch{0};       // of the latest whole-picture frame, for getDeviceFramePitch()
     Rect m_cropRect = {};
     Dim m_resizeDim = {};
 
@@ -725,4 +1040,26 @@ public:
     unsigned int m_nMaxWidth = 0, m_nMaxHeight = 0;
     bool m_bReconfigExternal = false;
     bool m_bReconfigExtPPChange = false;
+    bool m_bLowLatency = false;
+    bool m_bNewStream = false;          // reset() since the last sequence header
+    bool m_bSessionPrepared = false;    // m_hDecoder is prepareSession()'s, not a previous stream's
+    bool m_bParserFresh = false;        // m_hParser hasn't had its DPB size from a sequence callback yet
+    int m_nSessionSurfaces = 0;         // decode surfaces m_hDecoder was created with
+    SessionStats m_sessionStats = {};
+
+    // async post-processing, see enableAsyncPostProc()
+    bool m_bAsyncPostProc = false;
+    int m_nMaxInFlight = 0;
+    std::vector<PostProcCtx>  m_vPostProcCtx;
+    std::vector<std::thread>  m_vPostProcThread;
+    std::mutex                m_mtxPostProc;
+    std::condition_variable   m_cvPostProc;
+    std::deque<PostProcJob>   m_qPostProcJob;  // waiting for a worker
+    std::map<uint64_t, PostProcJob> m_mPostProcDone;  // finished out of order
+    std::vector<PostProcJob>  m_vPostProcReady; // finished, in display order
+    uint64_t m_nPostProcSubmitted = 0, m_nPostProcRetired = 0;
+    int m_nPostProcInFlight = 0;
+    int m_anPicInFlight[32] = {};
+    bool m_bPostProcExit = false;
+    std::exception_ptr m_postProcError;
 };
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "NvDecoder.hpp"
+
+/**
+* @brief Everything NvDecoder needs from the driver: the cuvid parser/decoder entry points plus the
+* handful of CUDA context, memory, stream and event calls used on the post-processing path.
+* Signatures and return codes mirror the cuvid/cu* functions they replace, so NvDecoder keeps
+* driving the same sequence -> decode -> display callback flow whichever backend is plugged in.
+*/
+class NvDecoderBackend {
+public:
+    virtual ~NvDecoderBackend() {}
+
+    virtual const char *getName() = 0;
+
+    /**
+    *   @brief  true when mapped surfaces are host memory, so post-processing must run on the CPU
+    */
+    virtual bool isHostSurface() = 0;
+
+    /**
+    *   @brief  Pictures the decode callback is going to skip anyway: non-intra, or non-reference ones.
+    *   A backend that decodes before running the callbacks can drop them itself. Ignored by default.
+    */
+    virtual void setSkipPictures(bool bNonIntra, bool bNonRef) {}
+
+    virtual CUresult createVideoParser(CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams) = 0;
+    virtual CUresult parseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket) = 0;
+    virtual CUresult destroyVideoParser(CUvideoparser obj) = 0;
+
+    virtual CUresult getDecoderCaps(CUVIDDECODECAPS *pdc) = 0;
+    virtual CUresult createDecoder(CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci) = 0;
+    virtual CUresult reconfigureDecoder(CUvideodecoder hDecoder, CUVIDRECONFIGUREDECODERINFO *pDecReconfigParams) = 0;
+    virtual CUresult destroyDecoder(CUvideodecoder hDecoder) = 0;
+    virtual CUresult decodePicture(CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams) = 0;
+    virtual CUresult getDecodeStatus(CUvideodecoder hDecoder, int nPicIdx, CUVIDGETDECODESTATUS *pDecodeStatus) = 0;
+    virtual CUresult mapVideoFrame(CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr,
+                                   unsigned int *pPitch, CUVIDPROCPARAMS *pVPP) = 0;
+    virtual CUresult unmapVideoFrame(CUvideodecoder hDecoder, CUdeviceptr devPtr) = 0;
+
+    virtual CUresult ctxLockCreate(CUvideoctxlock *pLock, CUcontext ctx) = 0;
+    virtual CUresult ctxLockDestroy(CUvideoctxlock lck) = 0;
+    virtual CUresult ctxPushCurrent(CUcontext ctx) = 0;
+    virtual CUresult ctxPopCurrent() = 0;
+    /**
+    *   @brief  Keep ctx current on the calling thread until ctxUnbind(); ctxPushCurrent(ctx)/ctxPopCurrent()
+    *   pairs in between are free. Calls nest.
+    */
+    virtual CUresult ctxBind(CUcontext ctx) = 0;
+    virtual CUresult ctxUnbind() = 0;
+
+    virtual CUresult memAlloc(CUdeviceptr *pDptr, size_t nBytes) = 0;
+    virtual CUresult memAllocPitch(CUdeviceptr *pDptr, size_t *pPitch, size_t nWidthInBytes, size_t nHeight,
+                                   unsigned int nElementSizeBytes) = 0;
+    virtual CUresult memFree(CUdeviceptr dptr) = 0;
+    virtual CUresult memcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream stream) = 0;
+    virtual CUresult memAllocHost(void **pp, size_t nBytes) = 0;
+    virtual CUresult memFreeHost(void *p) = 0;
+
+    virtual CUresult streamCreate(CUstream *pStream, unsigned int flags) = 0;
+    virtual CUresult streamDestroy(CUstream stream) = 0;
+    virtual CUresult streamSynchronize(CUstream stream) = 0;
+    virtual CUresult eventCreate(CUevent *pEvent, unsigned int flags) = 0;
+    virtual CUresult eventDestroy(CUevent event) = 0;
+    virtual CUresult eventRecord(CUevent event, CUstream stream) = 0;
+    virtual CUresult eventSynchronize(CUevent event) = 0;
+    virtual CUresult eventQuery(CUevent event) = 0;
+};
+
+/**
+* @brief NVDEC backend, a thin pass-through to libnvcuvid and the CUDA driver API, both loaded at run time.
+*/
+class NvCuvidBackend : public NvDecoderBackend {
+public:
+    /**
+    *   @brief  true when libcuda and libnvcuvid load, i.e. the NVIDIA driver is installed; SwCuvidBackend otherwise
+    */
+    static bool isAvailable();
+
+    const char *getName() { return "nvcuvid"; }
+    bool isHostSurface() { return false; }
+
+    CUresult createVideoParser(CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams);
+    CUresult parseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket);
+    CUresult destroyVideoParser(CUvideoparser obj);
+
+    CUresult getDecoderCaps(CUVIDDECODECAPS *pdc);
+    CUresult createDecoder(CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci);
+    CUresult reconfigureDecoder(CUvideodecoder hDecoder, CUVIDRECONFIGUREDECODERINFO *pDecReconfigParams);
+    CUresult destroyDecoder(CUvideodecoder hDecoder);
+    CUresult decodePicture(CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams);
+    CUresult getDecodeStatus(CUvideodecoder hDecoder, int nPicIdx, CUVIDGETDECODESTATUS *pDecodeStatus);
+    CUresult mapVideoFrame(CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr,
+                           unsigned int *pPitch, CUVIDPROCPARAMS *pVPP);
+    CUresult unmapVideoFrame(CUvideodecoder hDecoder, CUdeviceptr devPtr);
+
+    CUresult ctxLockCreate(CUvideoctxlock *pLock, CUcontext ctx);
+    CUresult ctxLockDestroy(CUvideoctxlock lck);
+    CUresult ctxPushCurrent(CUcontext ctx);
+    CUresult ctxPopCurrent();
+    CUresult ctxBind(CUcontext ctx);
+    CUresult ctxUnbind();
+
+    CUresult memAlloc(CUdeviceptr *pDptr, size_t nBytes);
+    CUresult memAllocPitch(CUdeviceptr *pDptr, size_t *pPitch, size_t nWidthInBytes, size_t nHeight,
+                           unsigned int nElementSizeBytes);
+    CUresult memFree(CUdeviceptr dptr);
+    CUresult memcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream stream);
+    CUresult memAllocHost(void **pp, size_t nBytes);
+    CUresult memFreeHost(void *p);
+
+    CUresult streamCreate(CUstream *pStream, unsigned int flags);
+    CUresult streamDestroy(CUstream stream);
+    CUresult streamSynchronize(CUstream stream);
+    CUresult eventCreate(CUevent *pEvent, unsigned int flags);
+    CUresult eventDestroy(CUevent event);
+    CUresult eventRecord(CUevent event, CUstream stream);
+    CUresult eventSynchronize(CUevent event);
+    CUresult eventQuery(CUevent event);
+};
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include "NvDecoderPool.hpp"
+#include "NvCudaContext.hpp"
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+NvDecoderPool::NvDecoderPool(int iGpu, int nSessions, cudaVideoCodec eCodec, int nMaxWidth, int nMaxHeight)
+    : m_iGpu(iGpu), m_nMaxWidth(nMaxWidth), m_nMaxHeight(nMaxHeight)
+{
+    m_cuContext = NvCudaContextRegistry::get(iGpu);
+    if (!m_cuContext) {
+        NVDEC_THROW_ERROR("No CUDA context for the decoder pool's GPU", CUDA_ERROR_NO_DEVICE);
+    }
+
+    try {
+        for (int i = 0; i < nSessions; i++) {
+            NvDecoder *pDecoder = createSession(eCodec);
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_vIdle.push_back(pDecoder);
+        }
+    } catch (...) {
+        // the destructor does not run for a pool that failed to construct
+        for (auto &session : m_vSession) {
+            delete session.pDecoder;
+        }
+        throw;
+    }
+}
+
+NvDecoderPool::~NvDecoderPool()
+{
+    if (m_vIdle.size() != m_vSession.size()) {
+        __E("NvDecoderPool destroyed with %d session(s) still acquired \n", (int)(m_vSession.size() - m_vIdle.size()));
+    }
+    for (auto &session : m_vSession) {
+        delete session.pDecoder;
+    }
+}
+
+NvDecoder *NvDecoderPool::createSession(cudaVideoCodec eCodec)
+{
+    std::unique_ptr<NvDecoder> pDecoder(new NvDecoder((uint16_t)m_iGpu, NULL, NULL, m_cuContext));
+    pDecoder->prepareSession(eCodec, m_nMaxWidth, m_nMaxHeight);
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_vSession.push_back({pDecoder.get(), pDecoder->getSessionStats()});
+    m_stats.nDecoderCreated += pDecoder->getSessionStats().nCreated;
+    return pDecoder.release();
+}
+
+NvDecoder *NvDecoderPool::acquire(cudaVideoCodec eCodec)
+{
+    NvDecoder *pDecoder = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_stats.nAcquire++;
+        if (!m_vIdle.empty()) {
+            // one already parsing this codec saves recreating its parser, any other still keeps the context
+            auto it = std::find_if(m_vIdle.begin(), m_vIdle.end(),
+                                   [&](NvDecoder *p) { return p->getCodec() == eCodec; });
+            if (it == m_vIdle.end()) {
+                it = m_vIdle.end() - 1;
+            }
+            pDecoder = *it;
+            m_vIdle.erase(it);
+            m_stats.nHits++;
+        } else {
+            m_stats.nMisses++;
+        }
+    }
+
+    if (!pDecoder) {
+        return createSession(eCodec);
+    }
+    pDecoder->reset(eCodec);
+    return pDecoder;
+}
+
+void NvDecoderPool::release(NvDecoder *pDecoder)
+{
+    NvDecoder::SessionStats stats = pDecoder->getSessionStats();
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    for (auto &session : m_vSession) {
+        if (session.pDecoder == pDecoder) {
+            m_stats.nDecoderReused += stats.nReused - session.lastStats.nReused;
+            m_stats.nDecoderCreated += stats.nCreated - session.lastStats.nCreated;
+            session.lastStats = stats;
+            m_vIdle.push_back(pDecoder);
+            return;
+        }
+    }
+    __E("NvDecoderPool: released a decoder it does not own \n");
+}
+
+NvDecoderPool::Stats NvDecoderPool::getStats()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    Stats stats = m_stats;
+    stats.nSessions = (int)m_vSession.size();
+    stats.nIdle = (int)m_vIdle.size();
+    return stats;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include "NvDecoder.hpp"
+
+/**
+* @brief Decoder sessions kept across streams, for workloads of many short clips where session setup
+* (context, lock, parser and above all cuvidCreateDecoder) costs more than decoding. Sessions share the
+* GPU's shared context (NvCudaContextRegistry) and their hardware decoders are created for the pool's
+* maximum size, so a new stream usually just reconfigures one (see NvDecoder::reset()).
+*/
+class NvDecoderPool {
+public:
+    struct Stats {
+        uint64_t nAcquire;
+        uint64_t nHits;             // served by an idle session
+        uint64_t nMisses;           // a session had to be created
+        uint64_t nDecoderReused;    // released streams that ran on a kept hardware decoder
+        uint64_t nDecoderCreated;   // hardware decoders created, including the up-front ones
+        int nSessions, nIdle;
+
+        double getHitRate() const { return nAcquire ? (double)nHits / nAcquire : 0; }
+        double getMissRate() const { return nAcquire ? (double)nMisses / nAcquire : 0; }
+    };
+
+    /**
+    *   @param  nSessions - sessions created up front with their hardware decoder for eCodec
+    *   @param  nMaxWidth, nMaxHeight - largest stream a kept decoder takes without being recreated
+    */
+    NvDecoderPool(int iGpu, int nSessions, cudaVideoCodec eCodec = cudaVideoCodec_H264,
+                  int nMaxWidth = 3840, int nMaxHeight = 2160);
+    ~NvDecoderPool();
+
+    /**
+    *   @brief  A session ready for a new stream of eCodec, idle ones first. Creates one when none is idle.
+    */
+    NvDecoder *acquire(cudaVideoCodec eCodec = cudaVideoCodec_H264);
+
+    /**
+    *   @brief  Return a session from acquire(). Frames it handed out stay valid until released.
+    */
+    void release(NvDecoder *pDecoder);
+
+    Stats getStats();
+
+private:
+    struct Session {
+        NvDecoder *pDecoder;
+        NvDecoder::SessionStats lastStats;
+    };
+
+    NvDecoder *createSession(cudaVideoCodec eCodec);
+
+    int m_iGpu = 0;
+    int m_nMaxWidth = 0, m_nMaxHeight = 0;
+    CUcontext m_cuContext = NULL;
+
+    std::mutex m_mtx;
+    std::vector<Session> m_vSession;
+    std::vector<NvDecoder *> m_vIdle;
+    Stats m_stats = {};
+};
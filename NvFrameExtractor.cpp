@@ -0,0 +1,98 @@
+#include <math.h>
+#include "NvFrameExtractor.hpp"
+#include "FFmpegDemuxer.hpp"
+
+NvFrameExtractor::NvFrameExtractor(FFmpegDemuxer *pDemuxer, NvDecoder *pDecoder, int nCacheFrames)
+    : m_pDemuxer(pDemuxer), m_pDecoder(pDecoder), m_nCacheFrames((size_t)std::max(nCacheFrames, 1))
+{
+    m_fFrameRate = m_pDemuxer->getFrameRate();
+    m_nHalfFrame = m_fFrameRate > 0 ? (int64_t)(500.0 / m_fFrameRate) : 0;
+}
+
+/* Seek unless the target is still ahead and no key frame lies between the decode position and it */
+bool NvFrameExtractor::needsSeek(int64_t nTimestamp)
+{
+    if (m_bEndOfStream || nTimestamp <= m_nLastReturned) {
+        return true;
+    }
+    int64_t nKeyFrame = m_pDemuxer->getKeyFrameBefore(nTimestamp);
+    return nKeyFrame >= 0 && nKeyFrame > m_nDemuxTimestamp;
+}
+
+NvFrame NvFrameExtractor::getFrameAt(int64_t nTimestamp)
+{
+    m_stats.nRequests++;
+    for (auto &frame : m_qCache) {
+        if (llabs(frame.timestamp() - nTimestamp) <= m_nHalfFrame) {
+            m_stats.nCacheHits++;
+            return frame;
+        }
+    }
+
+    if (needsSeek(nTimestamp)) {
+        if (m_pDemuxer->seek(nTimestamp)) {
+            // pictures the decoder still holds belong to the old position
+            std::vector<NvFrame> vStale;
+            m_pDecoder->decode(NULL, 0, vStale);
+            m_qCache.clear();
+            m_nLastReturned = INT64_MIN;
+            m_nDemuxTimestamp = INT64_MIN;
+            m_bEndOfStream = false;
+            m_bDiscontinuity = true;
+            m_stats.nSeeks++;
+        } else if (m_bEndOfStream || nTimestamp <= m_nLastReturned) {
+            return NvFrame();
+        }
+    }
+
+    // everything before the target is only decoded, never mapped or converted
+    m_pDecoder->setDisplayFrom(nTimestamp - m_nHalfFrame);
+    NvFrame result;
+    std::vector<NvFrame> vFrame;
+    while (!result.data() && !m_bEndOfStream) {
+        uint8_t *pVideo = NULL;
+        uint32_t nVideoBytes = 0;
+        int64_t pts = 0;
+        uint32_t flags = 0;
+        if (m_pDemuxer->demux(&pVideo, &nVideoBytes, &pts)) {
+            m_nDemuxTimestamp = pts;
+            m_stats.nPackets++;
+            if (m_pDemuxer->isKeyFrame()) {
+                flags |= NvDecoder::PKT_KEYFRAME;
+            }
+        } else {
+            // end of stream: the empty packet flushes the pictures still held for reordering
+            m_bEndOfStream = true;
+            pVideo = NULL;
+            nVideoBytes = 0;
+        }
+        if (m_bDiscontinuity) {
+            flags |= CUVID_PKT_DISCONTINUITY;
+            m_bDiscontinuity = false;
+        }
+
+        vFrame.clear();
+        m_pDecoder->decode(pVideo, (int)nVideoBytes, vFrame, flags, pts);
+        for (auto &frame : vFrame) {
+            m_nLastReturned = std::max(m_nLastReturned, frame.timestamp());
+            if (!result.data() && frame.timestamp() >= nTimestamp - m_nHalfFrame) {
+                result = frame;
+            }
+            // later frames of the batch serve the next nearby requests
+            m_qCache.push_back(frame);
+            if (m_qCache.size() > m_nCacheFrames) {
+                m_qCache.pop_front();
+            }
+        }
+    }
+    m_pDecoder->setDisplayFrom(INT64_MIN);
+    return result;
+}
+
+NvFrame NvFrameExtractor::getFrameByIndex(int64_t iFrame)
+{
+    if (m_fFrameRate <= 0) {
+        return NvFrame();
+    }
+    return getFrameAt(m_pDemuxer->getStartTimestamp() + llround(iFrame * 1000.0 / m_fFrameRate));
+}
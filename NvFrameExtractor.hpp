@@ -0,0 +1,60 @@
+#pragma once
+
+#include <deque>
+#include "NvDecoder.hpp"
+
+class FFmpegDemuxer;
+
+/**
+* @brief Random access to the decoded frames of a seekable input. A request seeks to the key frame at or
+* before its target and decodes forward from there; lead-in pictures are decoded but never converted.
+* The session stays warm between requests: one ahead of the decode position continues decoding unless
+* the container index has a key frame in between, and recent frames are kept for requests landing on
+* them again.
+*/
+class NvFrameExtractor {
+public:
+    struct Stats {
+        uint64_t nRequests;
+        uint64_t nCacheHits;
+        uint64_t nSeeks;
+        uint64_t nPackets;      // demuxed and decoded to serve the requests
+    };
+
+    /**
+    *   @param  pDemuxer, pDecoder - not owned. The decoder's parser is created for the demuxer's codec and
+    *   nothing else feeds it while the extractor is in use.
+    *   @param  nCacheFrames - recent frames kept, they count against NvDecoder::setMaxOutputFrames()
+    */
+    NvFrameExtractor(FFmpegDemuxer *pDemuxer, NvDecoder *pDecoder, int nCacheFrames = 8);
+
+    /**
+    *   @brief  Frame displayed at nTimestamp (ms, like FFmpegDemuxer::demux() pts): the first one no more
+    *   than half a frame before it. Empty past the end of the stream, or behind the decode position of
+    *   an input that can't seek.
+    */
+    NvFrame getFrameAt(int64_t nTimestamp);
+
+    /**
+    *   @brief  Frame iFrame counted from the first one at the stream's average frame rate. Empty when
+    *   the stream has no frame rate.
+    */
+    NvFrame getFrameByIndex(int64_t iFrame);
+
+    Stats getStats() { return m_stats; }
+
+private:
+    bool needsSeek(int64_t nTimestamp);
+
+    FFmpegDemuxer *m_pDemuxer = NULL;
+    NvDecoder *m_pDecoder = NULL;
+    size_t m_nCacheFrames = 0;
+    double m_fFrameRate = 0;
+    int64_t m_nHalfFrame = 0;
+    std::deque<NvFrame> m_qCache;               // display order
+    int64_t m_nLastReturned = INT64_MIN;        // latest frame out of the decoder
+    int64_t m_nDemuxTimestamp = INT64_MIN;      // pts of the last packet fed
+    bool m_bEndOfStream = false;
+    bool m_bDiscontinuity = false;
+    Stats m_stats = {};
+};
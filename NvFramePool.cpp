@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "NvFramePool.hpp"
+#include "NvMetrics.hpp"
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+NvFramePool::NvFramePool(AllocFn fnAlloc, FreeFn fnFree, int nMaxFrames)
+    : m_fnAlloc(fnAlloc), m_fnFree(fnFree)
+{
+    setMaxFrames(nMaxFrames);
+}
+
+NvFramePool::~NvFramePool()
+{
+    // slots still held are orphaned: they no longer point back here, the last NvFrame::reset() frees them
+    std::vector<NvFrameSlot *> vpIdle;
+    int nHeld = 0;
+    for (int i = 0; i < m_nSlots.load(); i++) {
+        NvFrameSlot *pSlot = m_apSlot[i];
+        pSlot->fnOrphanFree = m_fnOrphanFree;
+        if (pSlot->nRef.fetch_add(NV_FRAME_ORPHANED, std::memory_order_acq_rel)) {
+            nHeld++;
+        } else {
+            vpIdle.push_back(pSlot);
+        }
+    }
+    // a frame released just before it was marked may still be on its way through release()
+    while (m_nInUse.load() > nHeld || m_nReleasing.load()) {
+        std::this_thread::yield();
+    }
+    if (nHeld && !m_fnOrphanFree) {
+        __E("NvFramePool destroyed with %d frame(s) still held, their buffers are leaked on release \n", nHeld);
+    }
+    for (NvFrameSlot *pSlot : vpIdle) {
+        if (pSlot->pData) {
+            m_fnFree(pSlot->pData);
+        }
+        delete pSlot;
+    }
+}
+
+void NvFramePool::freeOrphan(NvFrameSlot *pSlot)
+{
+    if (pSlot->pData && pSlot->fnOrphanFree) {
+        pSlot->fnOrphanFree(pSlot->pData);
+    }
+    delete pSlot;
+}
+
+void NvFramePool::setMaxFrames(int nMaxFrames)
+{
+    if (nMaxFrames <= 0 || nMaxFrames > NV_FRAME_POOL_MAX_SLOTS) {
+        nMaxFrames = NV_FRAME_POOL_MAX_SLOTS;
+    }
+    m_nMaxFrames.store(nMaxFrames);
+    // a raised cap may unblock waiters
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_cv.notify_all();
+}
+
+int NvFramePool::getSizeClass(size_t nBytes)
+{
+    if (nBytes <= 4096) {
+        return 0;
+    }
+    // 2^e < nBytes <= 2^(e+1), then quarters of 2^e
+    int e = 63 - __builtin_clzll((unsigned long long)(nBytes - 1));
+    size_t base = (size_t)1 << e;
+    int iSub = (int)(((nBytes - base) * 4 + base - 1) / base);
+    return std::min((e - 12) * 4 + iSub, NV_FRAME_POOL_CLASSES - 1);
+}
+
+size_t NvFramePool::getClassBytes(int iClass)
+{
+    return (size_t)(4 + iClass % 4) << (10 + iClass / 4);
+}
+
+NvFrameSlot *NvFramePool::popFree(int iList)
+{
+    std::atomic<uint64_t> &freeHead = m_aFreeHead[iList];
+    uint64_t head = freeHead.load(std::memory_order_acquire);
+    while (head & 0xffffffff) {
+        NvFrameSlot *pSlot = m_apSlot[(head & 0xffffffff) - 1];
+        // the tag makes the CAS fail if the slot was popped and pushed back meanwhile (ABA)
+        uint64_t next = (((head >> 32) + 1) << 32) | pSlot->iNextFree.load(std::memory_order_relaxed);
+        if (freeHead.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+            return pSlot;
+        }
+    }
+    return NULL;
+}
+
+void NvFramePool::pushFree(NvFrameSlot *pSlot)
+{
+    std::atomic<uint64_t> &freeHead = m_aFreeHead[pSlot->iClass];
+    uint64_t head = freeHead.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        pSlot->iNextFree.store((uint32_t)head, std::memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | (pSlot->iSlot + 1);
+    } while (!freeHead.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+/* An idle buffer of iClass, or of a larger class that is still close enough */
+NvFrameSlot *NvFramePool::popFit(int iClass)
+{
+    int iLast = std::min(iClass + NV_FRAME_POOL_REUSE_CLASSES, NV_FRAME_POOL_CLASSES - 1);
+    for (int i = iClass; i <= iLast; i++) {
+        NvFrameSlot *pSlot = popFree(i);
+        if (pSlot) {
+            return pSlot;
+        }
+    }
+    return NULL;
+}
+
+/* Whether none of the requests that buffers of class iList could serve was made lately */
+bool NvFramePool::isStale(int iList, uint64_t nSeq)
+{
+    for (int i = std::max(iList - NV_FRAME_POOL_REUSE_CLASSES, 0); i <= iList; i++) {
+        uint64_t nUse = m_anClassUse[i].load(std::memory_order_relaxed);
+        if (nUse && nSeq - nUse < NV_FRAME_POOL_STALE_ACQUIRES) {
+            return false;
+        }
+    }
+    return true;
+}
+
+NvFrameSlot *NvFramePool::popStale(uint64_t nSeq)
+{
+    for (int i = 0; i < NV_FRAME_POOL_CLASSES; i++) {
+        if ((m_aFreeHead[i].load(std::memory_order_relaxed) & 0xffffffff) && isStale(i, nSeq)) {
+            NvFrameSlot *pSlot = popFree(i);
+            if (pSlot) {
+                return pSlot;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Last resort when no slot can be added: an idle buffer of another size that is still in use */
+NvFrameSlot *NvFramePool::popOther(int iClass)
+{
+    for (int i = 0; i < NV_FRAME_POOL_CLASSES; i++) {
+        NvFrameSlot *pSlot = (i < iClass || i > iClass + NV_FRAME_POOL_REUSE_CLASSES) ? popFree(i) : NULL;
+        if (pSlot) {
+            return pSlot;
+        }
+    }
+    return NULL;
+}
+
+/* Free the buffer of at most one idle stale slot; the slot itself stays for the next request */
+void NvFramePool::retireStale(uint64_t nSeq)
+{
+    NvFrameSlot *pSlot = popStale(nSeq);
+    if (!pSlot) {
+        return;
+    }
+    m_fnFree(pSlot->pData);
+    pSlot->pData = NULL;
+    pSlot->nCapacity = 0;
+    pSlot->nAllocPitch = 0;
+    pSlot->iClass = NV_FRAME_POOL_CLASSES;
+    pushFree(pSlot);
+    m_nRetired.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Count one more frame as held, unless the cap is reached */
+bool NvFramePool::reserve()
+{
+    int nInUse = m_nInUse.load();
+    do {
+        if (nInUse >= m_nMaxFrames.load(std::memory_order_relaxed)) {
+            return false;
+        }
+    } while (!m_nInUse.compare_exchange_weak(nInUse, nInUse + 1));
+    return true;
+}
+
+/* Called with m_mtx held */
+NvFrameSlot *NvFramePool::createSlot()
+{
+    int iSlot = m_nSlots.load(std::memory_order_relaxed);
+    if (iSlot >= NV_FRAME_POOL_MAX_SLOTS) {
+        return NULL;
+    }
+    NvFrameSlot *pSlot = new NvFrameSlot();
+    pSlot->iSlot = iSlot;
+    pSlot->pPool = this;
+    m_apSlot[iSlot] = pSlot;
+    m_nSlots.store(iSlot + 1, std::memory_order_release);
+    return pSlot;
+}
+
+NvFrame NvFramePool::acquire(size_t nBytes, int timeoutMs)
+{
+    uint64_t nSeq = m_nAcquire.fetch_add(1, std::memory_order_relaxed) + 1;
+    int iClass = getSizeClass(nBytes);
+    m_anClassUse[iClass].store(nSeq, std::memory_order_relaxed);
+
+    bool bReserved = reserve();
+    NvFrameSlot *pSlot = bReserved ? popFit(iClass) : NULL;
+    if (!pSlot) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        std::unique_lock<std::mutex> lock(m_mtx);
+        bool bWaited = false;
+        while (!bReserved) {
+            // announce the waiter before re-checking, release() notifies whenever it sees one
+            m_nWaiters.fetch_add(1);
+            bReserved = reserve();
+            if (!bReserved) {
+                if (!bWaited) {
+                    m_nWait.fetch_add(1, std::memory_order_relaxed);
+                    bWaited = true;
+                }
+                if (timeoutMs < 0) {
+                    m_cv.wait(lock);
+                } else if (m_cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+                    bReserved = reserve();
+                    m_nWaiters.fetch_sub(1);
+                    if (!bReserved) {
+                        return NvFrame();
+                    }
+                    break;
+                }
+            }
+            m_nWaiters.fetch_sub(1);
+        }
+        // nothing idle fits: an emptied or stale slot, else a new one, else an idle buffer of another size
+        // in use; at NV_FRAME_POOL_MAX_SLOTS a held slot is on its way back
+        while (!(pSlot = popFit(iClass)) && !(pSlot = popFree(NV_FRAME_POOL_CLASSES)) &&
+               !(pSlot = popStale(nSeq)) && !(pSlot = createSlot()) && !(pSlot = popOther(iClass))) {
+            std::this_thread::yield();
+        }
+    }
+
+    if (pSlot->nCapacity < nBytes) {
+        if (pSlot->pData) {
+            m_fnFree(pSlot->pData);
+            pSlot->pData = NULL;
+            pSlot->nCapacity = 0;
+            pSlot->nAllocPitch = 0;
+            pSlot->iClass = NV_FRAME_POOL_CLASSES;
+        }
+        size_t nAlloc = std::max(getClassBytes(iClass), nBytes);
+        size_t nAllocPitch = 0;
+        try {
+            pSlot->pData = m_fnAlloc(&nAlloc, &nAllocPitch);
+        } catch (...) {
+            release(pSlot);
+            throw;
+        }
+        pSlot->nCapacity = nAlloc;
+        pSlot->nAllocPitch = nAllocPitch;
+        pSlot->iClass = iClass;
+        m_nAlloc.fetch_add(1, std::memory_order_relaxed);
+        NvMetrics::add(NV_COUNTER_POOL_ALLOCATIONS);
+    }
+    pSlot->nBytes = nBytes;
+    pSlot->nWidth = pSlot->nHeight = pSlot->nPitch = 0;
+    pSlot->format = 0;
+    pSlot->timestamp = 0;
+    pSlot->nLatencyNs = 0;
+    pSlot->nInputNs = 0;
+    pSlot->iOutput = 0;
+    pSlot->nLevels = 1;
+    pSlot->aLevel[0] = {};
+    pSlot->nRef.store(1, std::memory_order_relaxed);
+    if (nSeq % 16 == 0) {
+        retireStale(nSeq);
+    }
+    return NvFrame(pSlot);
+}
+
+void NvFramePool::release(NvFrameSlot *pSlot)
+{
+    m_nReleasing.fetch_add(1);
+    pushFree(pSlot);
+    m_nInUse.fetch_sub(1);
+    if (m_nWaiters.load()) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_cv.notify_all();
+    }
+    // the last access to the pool, ~NvFramePool() waits for it
+    m_nReleasing.fetch_sub(1);
+}
+
+void NvFramePool::trim()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    std::vector<NvFrameSlot *> vpIdle;
+    NvFrameSlot *pSlot;
+    for (int i = 0; i < NV_FRAME_POOL_CLASSES; i++) {
+        while ((pSlot = popFree(i)) != NULL) {
+            vpIdle.push_back(pSlot);
+        }
+    }
+    for (NvFrameSlot *p : vpIdle) {
+        m_fnFree(p->pData);
+        p->pData = NULL;
+        p->nCapacity = 0;
+        p->nAllocPitch = 0;
+        p->iClass = NV_FRAME_POOL_CLASSES;
+        pushFree(p);
+    }
+}
+
+NvFramePool::Stats NvFramePool::getStats()
+{
+    Stats stats = {};
+    stats.nSlots   = m_nSlots.load();
+    stats.nInUse   = m_nInUse.load();
+    stats.nAcquire = m_nAcquire.load();
+    stats.nAlloc   = m_nAlloc.load();
+    stats.nWait    = m_nWait.load();
+    stats.nRetired = m_nRetired.load();
+    return stats;
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <utility>
+
+// upper bound of frames one pool hands out at the same time
+#define NV_FRAME_POOL_MAX_SLOTS 1024
+// pyramid levels one frame can carry, the frame itself included
+#define NV_FRAME_MAX_LEVELS 8
+// buffer size classes: four per power of two, starting at 4 KiB, see NvFramePool::getSizeClass()
+#define NV_FRAME_POOL_CLASSES 96
+// an idle buffer also serves requests up to this many classes smaller (4x)
+#define NV_FRAME_POOL_REUSE_CLASSES 8
+// buffers no request could use during this many acquire() calls are stale
+#define NV_FRAME_POOL_STALE_ACQUIRES 256
+// added to the reference count of the slots still held when their pool is destroyed
+#define NV_FRAME_ORPHANED (1 << 30)
+
+class NvFramePool;
+
+/**
+* @brief One image of a frame's pyramid, nOffset bytes into the frame buffer
+*/
+struct NvFrameLevel {
+    size_t nOffset;
+    int nWidth, nHeight, nPitch;
+};
+
+/**
+* @brief One pooled buffer and the description of the frame the producer wrote into it.
+* Slots live as long as their pool, or as their last frame when that is released later (orphaned slots);
+* only pData is (re)allocated.
+*/
+struct NvFrameSlot {
+    uint8_t *pData = NULL;
+    size_t nCapacity = 0;
+    size_t nAllocPitch = 0;             // row pitch pData was allocated with, 0 if it has none
+
+    size_t nBytes = 0;
+    int nWidth = 0, nHeight = 0, nPitch = 0;
+    int format = 0;
+    int64_t timestamp = 0;
+    uint64_t nLatencyNs = 0;
+    uint64_t nInputNs = 0;
+    int iOutput = 0;
+    int nLevels = 1;
+    NvFrameLevel aLevel[NV_FRAME_MAX_LEVELS] = {};
+
+    std::atomic<int> nRef{0};
+    std::atomic<uint32_t> iNextFree{0}; // free list link: slot index + 1, 0 ends the list
+    uint32_t iSlot = 0;
+    int iClass = NV_FRAME_POOL_CLASSES;     // size class of pData, NV_FRAME_POOL_CLASSES without one
+    NvFramePool *pPool = NULL;
+    std::function<void(uint8_t *pData)> fnOrphanFree;  // set by ~NvFramePool(), see setOrphanFree()
+};
+
+/**
+* @brief Reference-counted handle to a pooled frame. Copies share the buffer; when the last handle goes
+* away the buffer returns to its pool. Handles may outlive the pool: the frame stays valid and the last
+* one disposes of the orphaned slot, see NvFramePool::setOrphanFree().
+*/
+class NvFrame {
+public:
+    NvFrame() {}
+    NvFrame(const NvFrame &other) : m_pSlot(other.m_pSlot) {
+        if (m_pSlot) m_pSlot->nRef.fetch_add(1, std::memory_order_relaxed);
+    }
+    NvFrame(NvFrame &&other) : m_pSlot(other.m_pSlot) { other.m_pSlot = NULL; }
+    NvFrame &operator=(const NvFrame &other) {
+        NvFrame tmp(other);
+        std::swap(m_pSlot, tmp.m_pSlot);
+        return *this;
+    }
+    NvFrame &operator=(NvFrame &&other) {
+        if (this != &other) {
+            reset();
+            std::swap(m_pSlot, other.m_pSlot);
+        }
+        return *this;
+    }
+    ~NvFrame() { reset(); }
+
+    void reset();
+
+    explicit operator bool() const { return m_pSlot != NULL; }
+    uint8_t *data() const { return m_pSlot->pData; }
+    size_t size() const { return m_pSlot->nBytes; }
+    // bytes the buffer holds, at least size()
+    size_t capacity() const { return m_pSlot->nCapacity; }
+    // row pitch of a pitched allocation (see NvFramePool::AllocFn), 0 otherwise; kept across reuse
+    size_t allocPitch() const { return m_pSlot->nAllocPitch; }
+    int width() const { return m_pSlot->nWidth; }
+    int height() const { return m_pSlot->nHeight; }
+    int pitch() const { return m_pSlot->nPitch; }
+    // NvDecoder::ImageFormat_t for frames from NvDecoder
+    int format() const { return m_pSlot->format; }
+    int64_t timestamp() const { return m_pSlot->timestamp; }
+    // NvDecoder: from decode() receiving the packet to returning the frame, 0 if unknown
+    uint64_t latencyNs() const { return m_pSlot->nLatencyNs; }
+    // NvDecoder: NvMetrics::now() when decode() received the packet, 0 if unknown
+    uint64_t inputNs() const { return m_pSlot->nInputNs; }
+    // NvDecoder: index of the NvDecoder::OutputSpec the frame was produced for, 0 without any
+    int output() const { return m_pSlot->iOutput; }
+    // pyramid levels in the same buffer, level 0 is the frame itself
+    int levels() const { return m_pSlot->nLevels; }
+    const NvFrameLevel &level(int i) const { return m_pSlot->aLevel[i]; }
+    uint8_t *levelData(int i) const { return m_pSlot->pData + m_pSlot->aLevel[i].nOffset; }
+    int useCount() const {
+        return m_pSlot ? m_pSlot->nRef.load(std::memory_order_relaxed) & (NV_FRAME_ORPHANED - 1) : 0;
+    }
+
+    /**
+    *   @brief  Producer side: describe what was written into the buffer
+    */
+    void setLayout(int nWidth, int nHeight, int nPitch, int format) {
+        m_pSlot->nWidth = nWidth;
+        m_pSlot->nHeight = nHeight;
+        m_pSlot->nPitch = nPitch;
+        m_pSlot->format = format;
+        m_pSlot->nLevels = 1;
+        m_pSlot->aLevel[0] = { 0, nWidth, nHeight, nPitch };
+    }
+    void setLevels(int nLevels, const NvFrameLevel *aLevel) {
+        m_pSlot->nLevels = nLevels;
+        for (int i = 0; i < nLevels; i++) {
+            m_pSlot->aLevel[i] = aLevel[i];
+        }
+    }
+    void setTimestamp(int64_t timestamp) { m_pSlot->timestamp = timestamp; }
+    void setLatencyNs(uint64_t nLatencyNs) { m_pSlot->nLatencyNs = nLatencyNs; }
+    void setInputNs(uint64_t nInputNs) { m_pSlot->nInputNs = nInputNs; }
+    void setOutput(int iOutput) { m_pSlot->iOutput = iOutput; }
+
+private:
+    friend class NvFramePool;
+    explicit NvFrame(NvFrameSlot *pSlot) : m_pSlot(pSlot) {}
+
+    NvFrameSlot *m_pSlot = NULL;
+};
+
+/**
+* @brief Recycles frame buffers. Idle slots sit on lock-free (tagged Treiber) free lists, so the steady
+* state acquire/release takes no lock and allocates nothing; a mutex is only taken to create a slot or to
+* wait. With a cap, acquire() blocks while that many frames are held, which pushes back on the producer
+* instead of growing the pool.
+* Buffers are allocated at the size of their class and kept on one free list per class. A request takes
+* a buffer of its own class or one up to NV_FRAME_POOL_REUSE_CLASSES larger, so crop, resize and
+* resolution changes reuse what is big enough. A class no recent request fits is retired lazily: every
+* 16th acquire() frees at most one of its idle buffers, and a request that finds nothing to reuse takes
+* over an emptied or stale slot before creating one. Several sizes can be in use at once (one pool for
+* more outputs) without evicting each other, and a size switch causes no burst of frees and allocations.
+*/
+class NvFramePool {
+public:
+    // *pnBytes is the size to allocate, the allocator may raise it to what it did allocate; a pitched allocation
+    // sets *pnPitch to its row pitch, it stays 0 otherwise
+    typedef std::function<uint8_t *(size_t *pnBytes, size_t *pnPitch)> AllocFn;
+    typedef std::function<void(uint8_t *pData)> FreeFn;
+
+    struct Stats {
+        int nSlots, nInUse;
+        uint64_t nAcquire, nAlloc, nWait;
+        uint64_t nRetired;      // stale buffers freed after a size class change
+    };
+
+    /**
+    *   @param  nMaxFrames - frames that may be held at once, 0 is NV_FRAME_POOL_MAX_SLOTS
+    */
+    NvFramePool(AllocFn fnAlloc, FreeFn fnFree, int nMaxFrames = 0);
+    ~NvFramePool();
+
+    /**
+    *   @brief  Get a frame of at least nBytes. Waits up to timeoutMs (-1: forever) while the cap is reached.
+    *   @return empty handle on timeout
+    */
+    NvFrame acquire(size_t nBytes, int timeoutMs = -1);
+
+    void setMaxFrames(int nMaxFrames);
+    int getMaxFrames() { return m_nMaxFrames.load(std::memory_order_relaxed); }
+
+    /**
+    *   @brief  How buffers of frames still held when the pool is destroyed are freed once released. The
+    *   pool's own FreeFn may depend on its owner, which is gone by then; without this they are leaked.
+    */
+    void setOrphanFree(FreeFn fnFree) { m_fnOrphanFree = fnFree; }
+
+    /**
+    *   @brief  Free the buffers of all idle frames, e.g. after a switch to smaller frames
+    */
+    void trim();
+
+    Stats getStats();
+
+    /**
+    *   @brief  Smallest class whose buffers hold nBytes, and the buffer size of a class
+    */
+    static int getSizeClass(size_t nBytes);
+    static size_t getClassBytes(int iClass);
+
+private:
+    friend class NvFrame;
+
+    bool reserve();
+    void release(NvFrameSlot *pSlot);
+    static void freeOrphan(NvFrameSlot *pSlot);
+    NvFrameSlot *popFree(int iList);
+    void pushFree(NvFrameSlot *pSlot);
+    NvFrameSlot *popFit(int iClass);
+    NvFrameSlot *popStale(uint64_t nSeq);
+    NvFrameSlot *popOther(int iClass);
+    NvFrameSlot *createSlot();
+    bool isStale(int iList, uint64_t nSeq);
+    void retireStale(uint64_t nSeq);
+
+    AllocFn m_fnAlloc;
+    FreeFn m_fnFree;
+    FreeFn m_fnOrphanFree;
+
+    // per size class, then one of slots without a buffer; each (tag << 32) | (slot index + 1)
+    std::atomic<uint64_t> m_aFreeHead[NV_FRAME_POOL_CLASSES + 1] = {};
+    std::atomic<uint64_t> m_anClassUse[NV_FRAME_POOL_CLASSES] = {}; // m_nAcquire at the latest request, 0: none
+    NvFrameSlot *m_apSlot[NV_FRAME_POOL_MAX_SLOTS] = {};
+    std::atomic<int> m_nSlots{0};
+    std::atomic<int> m_nInUse{0};
+    std::atomic<int> m_nMaxFrames{0};
+
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::atomic<int> m_nWaiters{0};
+    std::atomic<int> m_nReleasing{0};   // release() calls still touching the pool
+
+    std::atomic<uint64_t> m_nAcquire{0}, m_nAlloc{0}, m_nWait{0}, m_nRetired{0};
+};
+
+inline void NvFrame::reset()
+{
+    if (m_pSlot) {
+        int nRef = m_pSlot->nRef.fetch_sub(1, std::memory_order_acq_rel);
+        if (nRef == 1) {
+            m_pSlot->pPool->release(m_pSlot);
+        } else if (nRef == NV_FRAME_ORPHANED + 1) {
+            NvFramePool::freeOrphan(m_pSlot);
+        }
+    }
+    m_pSlot = NULL;
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include "NvMetrics.hpp"
+
+namespace {
+
+struct MetricsSlot {
+    std::atomic<uint64_t> anBucket[NV_STAGE_COUNT][NV_METRICS_BUCKETS];
+    std::atomic<uint64_t> anSumNs[NV_STAGE_COUNT];
+    std::atomic<uint64_t> anCounter[NV_COUNTER_COUNT];
+
+    MetricsSlot() {
+        for (auto &stage : anBucket) for (auto &n : stage) n.store(0, std::memory_order_relaxed);
+        for (auto &n : anSumNs) n.store(0, std::memory_order_relaxed);
+        for (auto &n : anCounter) n.store(0, std::memory_order_relaxed);
+    }
+};
+
+std::atomic<bool> s_bEnabled{true};
+std::mutex s_mtxSlots;
+std::vector<MetricsSlot *> s_vSlot;     // never freed, a thread's totals outlive it
+std::vector<MetricsSlot *> s_vFreeSlot;
+
+/* Owner side of a slot: only this thread writes it, so a load and a store do instead of an atomic add */
+inline void bump(std::atomic<uint64_t> &n, uint64_t d) {
+    n.store(n.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+}
+
+struct ThreadSlot {
+    MetricsSlot *pSlot = NULL;
+
+    MetricsSlot *get() {
+        if (!pSlot) {
+            std::lock_guard<std::mutex> lock(s_mtxSlots);
+            if (!s_vFreeSlot.empty()) {
+                pSlot = s_vFreeSlot.back();
+                s_vFreeSlot.pop_back();
+            } else {
+                pSlot = new MetricsSlot();
+                s_vSlot.push_back(pSlot);
+            }
+        }
+        return pSlot;
+    }
+    ~ThreadSlot() {
+        if (pSlot) {
+            std::lock_guard<std::mutex> lock(s_mtxSlots);
+            s_vFreeSlot.push_back(pSlot);
+        }
+    }
+};
+
+thread_local ThreadSlot t_slot;
+
+inline int getBucket(uint64_t nNs) {
+    uint64_t nUs = (nNs + 999) / 1000;
+    int i = 0;
+    while (i < NV_METRICS_BUCKETS - 1 && nUs > (1ull << i)) {
+        i++;
+    }
+    return i;
+}
+
+inline double getBucketBoundUs(int i) {
+    return (double)(1ull << i);
+}
+
+const char *s_aszStage[NV_STAGE_COUNT] = {
+    "demux", "parse", "decode", "map", "convert", "copy", "unmap", "frame_latency",
+    "session_create", "session_reconfigure", "session_destroy",
+};
+
+const char *s_aszCounter[NV_COUNTER_COUNT] = {
+    "pictures_decoded", "frames_output", "frames_dropped", "decode_errors",
+    "reconfigurations", "sessions_reused", "pool_allocations",
+};
+
+}
+
+void NvMetrics::record(NvMetricStage eStage, uint64_t nNs)
+{
+    if (!s_bEnabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    MetricsSlot *pSlot = t_slot.get();
+    bump(pSlot->anBucket[eStage][getBucket(nNs)], 1);
+    bump(pSlot->anSumNs[eStage], nNs);
+}
+
+void NvMetrics::add(NvMetricCounter eCounter, uint64_t n)
+{
+    if (!s_bEnabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    bump(t_slot.get()->anCounter[eCounter], n);
+}
+
+void NvMetrics::setEnabled(bool bEnabled)
+{
+    s_bEnabled.store(bEnabled, std::memory_order_relaxed);
+}
+
+bool NvMetrics::isEnabled()
+{
+    return s_bEnabled.load(std::memory_order_relaxed);
+}
+
+const char *NvMetrics::getStageName(NvMetricStage eStage)
+{
+    return s_aszStage[eStage];
+}
+
+const char *NvMetrics::getCounterName(NvMetricCounter eCounter)
+{
+    return s_aszCounter[eCounter];
+}
+
+NvMetricsSnapshot NvMetrics::snapshot()
+{
+    NvMetricsSnapshot snap = {};
+    std::lock_guard<std::mutex> lock(s_mtxSlots);
+    for (MetricsSlot *pSlot : s_vSlot) {
+        for (int s = 0; s < NV_STAGE_COUNT; s++) {
+            NvMetricsSnapshot::Histogram &h = snap.aStage[s];
+            for (int i = 0; i < NV_METRICS_BUCKETS; i++) {
+                uint64_t n = pSlot->anBucket[s][i].load(std::memory_order_relaxed);
+                h.anBucket[i] += n;
+                h.nCount += n;
+            }
+            h.nSumNs += pSlot->anSumNs[s].load(std::memory_order_relaxed);
+        }
+        for (int c = 0; c < NV_COUNTER_COUNT; c++) {
+            snap.anCounter[c] += pSlot->anCounter[c].load(std::memory_order_relaxed);
+        }
+    }
+    return snap;
+}
+
+double NvMetricsSnapshot::Histogram::getQuantileUs(double fQuantile) const
+{
+    if (!nCount) {
+        return 0;
+    }
+    uint64_t nRank = (uint64_t)(fQuantile * (nCount - 1)) + 1;
+    uint64_t nSeen = 0;
+    for (int i = 0; i < NV_METRICS_BUCKETS - 1; i++) {
+        nSeen += anBucket[i];
+        if (nSeen >= nRank) {
+            return getBucketBoundUs(i);
+        }
+    }
+    // open-ended last bucket, the mean is the best bound there is
+    return (double)nSumNs / nCount / 1000;
+}
+
+std::string NvMetricsSnapshot::toJson() const
+{
+    std::ostringstream os;
+    os << "{\"stages\":{";
+    for (int s = 0; s < NV_STAGE_COUNT; s++) {
+        const Histogram &h = aStage[s];
+        os << (s ? "," : "") << "\"" << NvMetrics::getStageName((NvMetricStage)s) << "\":{"
+           << "\"count\":" << h.nCount
+           << ",\"sum_us\":" << h.nSumNs / 1000.0
+           << ",\"mean_us\":" << (h.nCount ? h.nSumNs / 1000.0 / h.nCount : 0.0)
+           << ",\"p50_us\":" << h.getQuantileUs(0.5)
+           << ",\"p99_us\":" << h.getQuantileUs(0.99)
+           << ",\"buckets\":[";
+        for (int i = 0; i < NV_METRICS_BUCKETS; i++) {
+            os << (i ? "," : "") << "{\"le_us\":";
+            if (i < NV_METRICS_BUCKETS - 1) {
+                os << getBucketBoundUs(i);
+            } else {
+                os << "\"inf\"";
+            }
+            os << ",\"count\":" << h.anBucket[i] << "}";
+        }
+        os << "]}";
+    }
+    os << "},\"counters\":{";
+    for (int c = 0; c < NV_COUNTER_COUNT; c++) {
+        os << (c ? "," : "") << "\"" << NvMetrics::getCounterName((NvMetricCounter)c) << "\":" << anCounter[c];
+    }
+    os << "}}";
+    return os.str();
+}
+
+std::string NvMetricsSnapshot::toPrometheus() const
+{
+    std::ostringstream os;
+    os << "# HELP nvdec_stage_latency_seconds Latency of the decode pipeline stages\n"
+       << "# TYPE nvdec_stage_latency_seconds histogram\n";
+    for (int s = 0; s < NV_STAGE_COUNT; s++) {
+        const Histogram &h = aStage[s];
+        const char *szStage = NvMetrics::getStageName((NvMetricStage)s);
+        uint64_t nCumulative = 0;
+        for (int i = 0; i < NV_METRICS_BUCKETS - 1; i++) {
+            nCumulative += h.anBucket[i];
+            os << "nvdec_stage_latency_seconds_bucket{stage=\"" << szStage << "\",le=\""
+               << getBucketBoundUs(i) / 1e6 << "\"} " << nCumulative << "\n";
+        }
+        os << "nvdec_stage_latency_seconds_bucket{stage=\"" << szStage << "\",le=\"+Inf\"} " << h.nCount << "\n"
+           << "nvdec_stage_latency_seconds_sum{stage=\"" << szStage << "\"} " << h.nSumNs / 1e9 << "\n"
+           << "nvdec_stage_latency_seconds_count{stage=\"" << szStage << "\"} " << h.nCount << "\n";
+    }
+    for (int c = 0; c < NV_COUNTER_COUNT; c++) {
+        const char *szCounter = NvMetrics::getCounterName((NvMetricCounter)c);
+        os << "# TYPE nvdec_" << szCounter << "_total counter\n"
+           << "nvdec_" << szCounter << "_total " << anCounter[c] << "\n";
+    }
+    return os.str();
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include "NvTrace.hpp"
+
+// latency histogram buckets: upper bounds of 1us, 2us, 4us ... 2^(N-2)us, then everything above
+#define NV_METRICS_BUCKETS 26
+
+enum NvMetricStage {
+    NV_STAGE_DEMUX,             // FFmpegDemuxer::demux()
+    NV_STAGE_PARSE,             // cuvidParseVideoData, including the callbacks it runs
+    NV_STAGE_DECODE,            // cuvidDecodePicture
+    NV_STAGE_MAP,               // cuvidMapVideoFrame and the decode status query
+    NV_STAGE_CONVERT,           // format conversion and copy out of the surface, until the stream is idle
+    NV_STAGE_COPY,              // pinned-host output: copy submitted to completion seen
+    NV_STAGE_UNMAP,             // cuvidUnmapVideoFrame
+    NV_STAGE_FRAME_LATENCY,     // NvDecoder::decode(): packet in to frame out, see NvFrame::latencyNs()
+    NV_STAGE_SESSION_CREATE,
+    NV_STAGE_SESSION_RECONFIGURE,
+    NV_STAGE_SESSION_DESTROY,
+    NV_STAGE_COUNT
+};
+
+enum NvMetricCounter {
+    NV_COUNTER_PICTURES_DECODED,
+    NV_COUNTER_FRAMES_OUTPUT,
+    NV_COUNTER_FRAMES_DROPPED,      // skipped by the decode mode, see NvDecoder::SkipStats
+    NV_COUNTER_DECODE_ERRORS,       // cuvidGetDecodeStatus reported an error or concealment
+    NV_COUNTER_RECONFIGURATIONS,
+    NV_COUNTER_SESSIONS_REUSED,
+    NV_COUNTER_POOL_ALLOCATIONS,    // frame buffers allocated by NvFramePool
+    NV_COUNTER_COUNT
+};
+
+struct NvMetricsSnapshot {
+    struct Histogram {
+        uint64_t anBucket[NV_METRICS_BUCKETS];
+        uint64_t nCount;
+        uint64_t nSumNs;
+
+        /**
+        *   @brief  Upper bound (us) of the bucket holding the fQuantile (0..1) sample, 0 if empty
+        */
+        double getQuantileUs(double fQuantile) const;
+    };
+
+    Histogram aStage[NV_STAGE_COUNT];
+    uint64_t anCounter[NV_COUNTER_COUNT];
+
+    std::string toJson() const;
+    std::string toPrometheus() const;
+};
+
+/**
+* @brief Process-wide latency histograms and counters. Each thread accumulates into a slot of its own
+* with plain relaxed atomic stores, so recording takes no lock and no contended cache line; snapshot()
+* sums all slots. Slots of finished threads are kept (and reused), so totals never go backwards.
+*/
+class NvMetrics {
+public:
+    static uint64_t now() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static void record(NvMetricStage eStage, uint64_t nNs);
+    static void add(NvMetricCounter eCounter, uint64_t n = 1);
+
+    /**
+    *   @brief  Recording on or off (default on). Off, timers don't read the clock.
+    */
+    static void setEnabled(bool bEnabled);
+    static bool isEnabled();
+
+    static NvMetricsSnapshot snapshot();
+
+    static const char *getStageName(NvMetricStage eStage);
+    static const char *getCounterName(NvMetricCounter eCounter);
+};
+
+/**
+* @brief Records the time from construction to stop() or destruction into one stage, and as an NvTrace event
+* named after the stage, tagged with nStream and nPicture, while tracing
+*/
+class NvStageTimer {
+public:
+    explicit NvStageTimer(NvMetricStage eStage, int nStream = -1, int nPicture = -1)
+        : m_eStage(eStage), m_nStream(nStream), m_nPicture(nPicture),
+          m_nStart(NvMetrics::isEnabled() || NvTrace::isEnabled() ? NvMetrics::now() : 0) {}
+    ~NvStageTimer() { stop(); }
+
+    void stop() {
+        if (m_nStart) {
+            uint64_t nEnd = NvMetrics::now();
+            NvMetrics::record(m_eStage, nEnd - m_nStart);
+            NvTrace::record(NvMetrics::getStageName(m_eStage), m_nStart, nEnd, m_nStream, m_nPicture);
+            m_nStart = 0;
+        }
+    }
+
+private:
+    NvMetricStage m_eStage;
+    int m_nStream;
+    int m_nPicture;
+    uint64_t m_nStart;
+};
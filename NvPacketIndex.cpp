@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include "NvPacketIndex.hpp"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+static bool statSource(const char *szMediaPath, uint64_t *pnBytes, int64_t *pnMtimeNs)
+{
+    struct stat st;
+    if (stat(szMediaPath, &st) != 0) {
+        return false;
+    }
+    *pnBytes = (uint64_t)st.st_size;
+    *pnMtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static bool writeAll(FILE *fp, const void *pData, size_t nBytes)
+{
+    return !nBytes || fwrite(pData, nBytes, 1, fp) == 1;
+}
+
+bool NvPacketIndex::build(const char *szMediaPath, const char *szIndexPath)
+{
+    std::string sIndexPath = szIndexPath ? szIndexPath : getDefaultPath(szMediaPath);
+
+    NvPacketIndexHeader header = {};
+    memcpy(header.magic, NV_PACKET_INDEX_MAGIC, sizeof(header.magic));
+    header.version = NV_PACKET_INDEX_VERSION;
+    header.headerBytes = sizeof(header);
+    if (!statSource(szMediaPath, &header.sourceBytes, &header.sourceMtimeNs)) {
+        __E("NvPacketIndex: cannot stat %s \n", szMediaPath);
+        return false;
+    }
+
+    AVFormatContext *av = NULL;
+    if (avformat_open_input(&av, szMediaPath, NULL, NULL) < 0) {
+        __E("NvPacketIndex: cannot open %s \n", szMediaPath);
+        return false;
+    }
+    int v_idx = avformat_find_stream_info(av, NULL) < 0 ? -1
+              : av_find_best_stream(av, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (v_idx < 0) {
+        __E("NvPacketIndex: no video stream in %s \n", szMediaPath);
+        avformat_close_input(&av);
+        return false;
+    }
+    for (unsigned int i = 0; i < av->nb_streams; i++) {
+        if ((int)i != v_idx) {
+            av->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    AVStream *st = av->streams[v_idx];
+    AVRational rFrameRate = st->avg_frame_rate.num && st->avg_frame_rate.den ? st->avg_frame_rate : st->r_frame_rate;
+    header.streamIndex = v_idx;
+    header.codecId = st->codecpar->codec_id;
+    header.pixelFormat = st->codecpar->format;
+    header.width = st->codecpar->width;
+    header.height = st->codecpar->height;
+    header.timeBaseNum = st->time_base.num;
+    header.timeBaseDen = st->time_base.den;
+    header.frameRateNum = rFrameRate.num;
+    header.frameRateDen = rFrameRate.den;
+    header.startPts = INT64_MAX;
+    header.endPts = INT64_MIN;
+
+    std::vector<NvPacketIndexEntry> vPacket;
+    std::vector<uint64_t> vKeyFrame;
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    while (av_read_frame(av, &pkt) >= 0) {
+        if (pkt.stream_index == v_idx) {
+            NvPacketIndexEntry entry = {};
+            entry.pos = pkt.pos;
+            entry.pts = pkt.pts;
+            entry.dts = pkt.dts;
+            entry.size = pkt.size;
+            entry.flags = (pkt.flags & AV_PKT_FLAG_KEY) ? NV_PACKET_INDEX_KEY : 0;
+            int64_t ts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+            if (ts != AV_NOPTS_VALUE) {
+                header.startPts = std::min(header.startPts, ts);
+                header.endPts = std::max(header.endPts, ts + std::max(pkt.duration, (int64_t)0));
+                if (entry.flags & NV_PACKET_INDEX_KEY) {
+                    vKeyFrame.push_back(vPacket.size());
+                }
+            }
+            vPacket.push_back(entry);
+        }
+        av_packet_unref(&pkt);
+    }
+    avformat_close_input(&av);
+    if (header.startPts > header.endPts) {
+        header.startPts = header.endPts = 0;
+    }
+
+    // packets come in decode order; lookups go by presentation time
+    auto keyTs = [&](uint64_t i) {
+        return vPacket[i].pts != AV_NOPTS_VALUE ? vPacket[i].pts : vPacket[i].dts;
+    };
+    std::stable_sort(vKeyFrame.begin(), vKeyFrame.end(), [&](uint64_t a, uint64_t b) { return keyTs(a) < keyTs(b); });
+
+    header.nPackets = vPacket.size();
+    header.nKeyFrames = vKeyFrame.size();
+    header.packetsOffset = sizeof(header);
+    header.keyFramesOffset = header.packetsOffset + header.nPackets * sizeof(NvPacketIndexEntry);
+
+    std::string sTmpPath = sIndexPath + ".tmp." + std::to_string(getpid());
+    FILE *fp = fopen(sTmpPath.c_str(), "wb");
+    if (!fp) {
+        __E("NvPacketIndex: cannot create %s \n", sTmpPath.c_str());
+        return false;
+    }
+    bool bOk = writeAll(fp, &header, sizeof(header))
+            && writeAll(fp, vPacket.data(), vPacket.size() * sizeof(NvPacketIndexEntry))
+            && writeAll(fp, vKeyFrame.data(), vKeyFrame.size() * sizeof(uint64_t));
+    bOk = (fclose(fp) == 0) && bOk;
+    if (!bOk || rename(sTmpPath.c_str(), sIndexPath.c_str()) != 0) {
+        __E("NvPacketIndex: cannot write %s \n", sIndexPath.c_str());
+        unlink(sTmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+NvPacketIndex *NvPacketIndex::open(const char *szMediaPath, const char *szIndexPath)
+{
+    std::string sIndexPath = szIndexPath ? szIndexPath : getDefaultPath(szMediaPath);
+    uint64_t nSourceBytes = 0;
+    int64_t nSourceMtimeNs = 0;
+    if (!statSource(szMediaPath, &nSourceBytes, &nSourceMtimeNs)) {
+        return NULL;
+    }
+
+    int fd = ::open(sIndexPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *pMap = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(NvPacketIndexHeader)) {
+        pMap = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    // the mapping keeps the file referenced
+    close(fd);
+    if (pMap == MAP_FAILED) {
+        return NULL;
+    }
+
+    NvPacketIndex *pIndex = new NvPacketIndex();
+    pIndex->m_pMap = pMap;
+    pIndex->m_nMapBytes = (size_t)st.st_size;
+
+    const NvPacketIndexHeader *h = (const NvPacketIndexHeader *)pMap;
+    uint64_t nBytes = pIndex->m_nMapBytes;
+    bool bValid = !memcmp(h->magic, NV_PACKET_INDEX_MAGIC, sizeof(h->magic))
+        && h->version == NV_PACKET_INDEX_VERSION
+        && h->headerBytes == sizeof(NvPacketIndexHeader)
+        && h->timeBaseNum > 0 && h->timeBaseDen > 0
+        && h->packetsOffset == sizeof(NvPacketIndexHeader)
+        && h->nPackets <= (nBytes - h->packetsOffset) / sizeof(NvPacketIndexEntry)
+        && h->keyFramesOffset == h->packetsOffset + h->nPackets * sizeof(NvPacketIndexEntry)
+        && h->nKeyFrames <= (nBytes - h->keyFramesOffset) / sizeof(uint64_t);
+    if (!bValid) {
+        __E("NvPacketIndex: %s is not a valid index \n", sIndexPath.c_str());
+        delete pIndex;
+        return NULL;
+    }
+    if (h->sourceBytes != nSourceBytes || h->sourceMtimeNs != nSourceMtimeNs) {
+        delete pIndex;
+        return NULL;
+    }
+
+    pIndex->m_pHeader = h;
+    pIndex->m_pPackets = (const NvPacketIndexEntry *)((const uint8_t *)pMap + h->packetsOffset);
+    pIndex->m_pKeyFrames = (const uint64_t *)((const uint8_t *)pMap + h->keyFramesOffset);
+    // lookups binary-search the key frames and then jump around the packets
+    madvise(pMap, pIndex->m_nMapBytes, MADV_RANDOM);
+    return pIndex;
+}
+
+NvPacketIndex *NvPacketIndex::openOrBuild(const char *szMediaPath, const char *szIndexPath)
+{
+    NvPacketIndex *pIndex = open(szMediaPath, szIndexPath);
+    if (!pIndex && build(szMediaPath, szIndexPath)) {
+        pIndex = open(szMediaPath, szIndexPath);
+    }
+    return pIndex;
+}
+
+NvPacketIndex::~NvPacketIndex()
+{
+    if (m_pMap) {
+        munmap(m_pMap, m_nMapBytes);
+    }
+}
+
+int64_t NvPacketIndex::getTimestamp(const NvPacketIndexEntry &entry) const
+{
+    return toMs(entry.pts != AV_NOPTS_VALUE ? entry.pts : entry.dts);
+}
+
+int64_t NvPacketIndex::findKeyFrame(int64_t nTimestamp) const
+{
+    // open() reads none of the table, so check the entries the search reads. Out of order entries need no
+    // check: whatever the order, the search ends on a key frame at or before nTimestamp, if not the last one.
+    uint64_t nPackets = m_pHeader->nPackets;
+    if (m_pHeader->nKeyFrames && m_pKeyFrames[0] >= nPackets) {
+        return NV_PACKET_INDEX_DAMAGED;
+    }
+    // first key frame after nTimestamp, the one before it is the answer
+    uint64_t lo = 0, hi = m_pHeader->nKeyFrames;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (m_pKeyFrames[mid] >= nPackets) {
+            return NV_PACKET_INDEX_DAMAGED;
+        }
+        if (getTimestamp(getKeyFrame(mid)) <= nTimestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (int64_t)lo - 1;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#define NV_PACKET_INDEX_MAGIC "NVPKTIDX"
+#define NV_PACKET_INDEX_VERSION 1
+#define NV_PACKET_INDEX_SUFFIX ".nvidx"
+
+// NvPacketIndexEntry::flags
+#define NV_PACKET_INDEX_KEY 0x1
+// NvPacketIndex::findKeyFrame() on a damaged key frame table
+#define NV_PACKET_INDEX_DAMAGED (-2)
+
+/**
+* @brief Sidecar header. The file is this header, nPackets entries in demux order, then nKeyFrames packet
+* numbers sorted by timestamp; fixed-width fields in host byte order, mapped as is.
+*/
+struct NvPacketIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    // source file the index was built from, a mismatch makes the index stale
+    uint64_t sourceBytes;
+    int64_t sourceMtimeNs;
+
+    int32_t streamIndex;
+    int32_t codecId;            // AVCodecID
+    int32_t pixelFormat;        // AVPixelFormat
+    int32_t width, height;
+    int32_t timeBaseNum, timeBaseDen;
+    int32_t frameRateNum, frameRateDen;
+    int32_t reserved;
+    int64_t startPts, endPts;   // stream time base, endPts includes the duration of the last frame
+    uint64_t nPackets;
+    uint64_t nKeyFrames;
+    uint64_t packetsOffset;
+    uint64_t keyFramesOffset;
+};
+
+struct NvPacketIndexEntry {
+    int64_t pos;                // byte offset in the source, -1 when the demuxer doesn't know
+    int64_t pts, dts;           // stream time base, AV_NOPTS_VALUE when missing
+    int32_t size;
+    uint32_t flags;
+};
+
+/**
+* @brief Read-only packet index of one media file, memory-mapped from a sidecar written once by build().
+* Opening maps the file without reading it, so open, duration and frame count are O(1) and a key frame
+* lookup is a binary search over pages touched on demand. Timestamps are in ms like FFmpegDemuxer::demux().
+*/
+class NvPacketIndex {
+public:
+    /**
+    *   @brief  Scan szMediaPath once and write its sidecar (default: szMediaPath + NV_PACKET_INDEX_SUFFIX).
+    *   The file is written next to the target and renamed into place, so readers never see a partial one.
+    */
+    static bool build(const char *szMediaPath, const char *szIndexPath = NULL);
+
+    /**
+    *   @brief  Map the sidecar of szMediaPath. NULL when it is missing, damaged or older than the media.
+    *   Only the header is checked, findKeyFrame() checks the key frame entries it reads.
+    */
+    static NvPacketIndex *open(const char *szMediaPath, const char *szIndexPath = NULL);
+
+    /**
+    *   @brief  open(), and build() first when that fails
+    */
+    static NvPacketIndex *openOrBuild(const char *szMediaPath, const char *szIndexPath = NULL);
+
+    static std::string getDefaultPath(const char *szMediaPath) {
+        return std::string(szMediaPath) + NV_PACKET_INDEX_SUFFIX;
+    }
+
+    ~NvPacketIndex();
+
+    const NvPacketIndexHeader &getHeader() const { return *m_pHeader; }
+    int getStreamIndex() const { return m_pHeader->streamIndex; }
+    int getCodecId() const { return m_pHeader->codecId; }
+    int getPixelFormat() const { return m_pHeader->pixelFormat; }
+    int getWidth() const { return m_pHeader->width; }
+    int getHeight() const { return m_pHeader->height; }
+    double getTimeBase() const { return (double)m_pHeader->timeBaseNum / m_pHeader->timeBaseDen; }
+    double getFrameRate() const {
+        return m_pHeader->frameRateDen ? (double)m_pHeader->frameRateNum / m_pHeader->frameRateDen : 0;
+    }
+
+    uint64_t getPacketCount() const { return m_pHeader->nPackets; }
+    uint64_t getKeyFrameCount() const { return m_pHeader->nKeyFrames; }
+    int64_t getStartTimestamp() const { return toMs(m_pHeader->startPts); }
+    int64_t getDuration() const { return toMs(m_pHeader->endPts) - toMs(m_pHeader->startPts); }
+
+    const NvPacketIndexEntry &getPacket(uint64_t i) const { return m_pPackets[i]; }
+    const NvPacketIndexEntry &getKeyFrame(uint64_t i) const { return m_pPackets[m_pKeyFrames[i]]; }
+
+    /**
+    *   @brief  Key frame (number into getKeyFrame()) to start decoding from to display nTimestamp: the
+    *   last one at or before it. -1 when nTimestamp is before the first key frame, getKeyFrame(0) is valid then.
+    *   NV_PACKET_INDEX_DAMAGED when an entry the search read points past the packets.
+    */
+    int64_t findKeyFrame(int64_t nTimestamp) const;
+
+    /**
+    *   @brief  pts of an entry, dts when the demuxer gave none, in ms
+    */
+    int64_t getTimestamp(const NvPacketIndexEntry &entry) const;
+
+private:
+    NvPacketIndex() {}
+    int64_t toMs(int64_t ts) const { return (int64_t)(getTimeBase() * (double)ts * 1000); }
+
+    void *m_pMap = NULL;
+    size_t m_nMapBytes = 0;
+    const NvPacketIndexHeader *m_pHeader = NULL;
+    const NvPacketIndexEntry *m_pPackets = NULL;
+    const uint64_t *m_pKeyFrames = NULL;
+};
@@ -0,0 +1,502 @@
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "NvSpsParser.hpp"
+#include "NvAnnexB.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace {
+
+/* MSB-first reader over the RBSP of a NAL unit: the emulation prevention bytes (00 00 03) are dropped on
+   construction. Reads past the end return zeros and clear ok(). */
+class BitReader {
+public:
+    BitReader(const uint8_t *p, size_t n) {
+        m_vData.reserve(n);
+        int nZeros = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (nZeros >= 2 && p[i] == 3) {
+                nZeros = 0;
+                continue;
+            }
+            nZeros = p[i] ? 0 : nZeros + 1;
+            m_vData.push_back(p[i]);
+        }
+    }
+
+    uint32_t u(int nBits) {
+        uint32_t v = 0;
+        for (int i = 0; i < nBits; i++) {
+            v = v << 1 | bit();
+        }
+        return v;
+    }
+    void skip(int nBits) {
+        for (; nBits > 32; nBits -= 32) {
+            u(32);
+        }
+        u(nBits);
+    }
+    uint32_t ue() {
+        int nLeadingZeros = 0;
+        while (!bit()) {
+            if (++nLeadingZeros > 31) {
+                m_bOk = false;
+                return 0;
+            }
+        }
+        return (uint32_t)(((uint64_t)1 << nLeadingZeros) - 1 + u(nLeadingZeros));
+    }
+    int32_t se() {
+        uint32_t v = ue();
+        return v & 1 ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+    }
+    bool ok() const { return m_bOk; }
+
+private:
+    uint32_t bit() {
+        if (m_nBit >= m_vData.size() * 8) {
+            m_bOk = false;
+            return 0;
+        }
+        uint32_t b = (m_vData[m_nBit >> 3] >> (7 - (m_nBit & 7))) & 1;
+        m_nBit++;
+        return b;
+    }
+
+    std::vector<uint8_t> m_vData;
+    size_t m_nBit = 0;
+    bool m_bOk = true;
+};
+
+// H.264 Table E-1, HEVC Table E.1: aspect_ratio_idc 1..16
+const int s_aSar[17][2] = {
+    { 0, 0 }, { 1, 1 }, { 12, 11 }, { 10, 11 }, { 16, 11 }, { 40, 33 }, { 24, 11 }, { 20, 11 }, { 32, 11 },
+    { 80, 33 }, { 18, 11 }, { 15, 11 }, { 64, 33 }, { 160, 99 }, { 4, 3 }, { 3, 2 }, { 2, 1 },
+};
+
+void initInfo(int codecId, NvStreamInfo *pInfo)
+{
+    memset(pInfo, 0, sizeof(*pInfo));
+    pInfo->codecId = codecId;
+    pInfo->videoFormat = 5;
+    pInfo->colorPrimaries = 2;
+    pInfo->transferCharacteristics = 2;
+    pInfo->matrixCoefficients = 2;
+}
+
+/* The fields the H.264 and HEVC VUI share, up to chroma_loc_info */
+void parseVuiHead(BitReader &br, NvStreamInfo *pInfo)
+{
+    if (br.u(1)) {                      // aspect_ratio_info_present_flag
+        uint32_t idc = br.u(8);
+        if (idc == 255) {               // Extended_SAR
+            pInfo->nSarNum = (int)br.u(16);
+            pInfo->nSarDen = (int)br.u(16);
+        } else if (idc <= 16) {
+            pInfo->nSarNum = s_aSar[idc][0];
+            pInfo->nSarDen = s_aSar[idc][1];
+        }
+    }
+    if (br.u(1)) {                      // overscan_info_present_flag
+        br.u(1);
+    }
+    if (br.u(1)) {                      // video_signal_type_present_flag
+        pInfo->videoFormat = (int)br.u(3);
+        pInfo->bFullRange = br.u(1) != 0;
+        if (br.u(1)) {                  // colour_description_present_flag
+            pInfo->bColorDescription = true;
+            pInfo->colorPrimaries = (int)br.u(8);
+            pInfo->transferCharacteristics = (int)br.u(8);
+            pInfo->matrixCoefficients = (int)br.u(8);
+        }
+    }
+    if (br.u(1)) {                      // chroma_loc_info_present_flag
+        br.ue();
+        br.ue();
+    }
+}
+
+void setFrameRate(uint32_t nUnitsInTick, uint32_t nTimeScale, int nTicksPerFrame, NvStreamInfo *pInfo)
+{
+    uint64_t nDen = (uint64_t)nUnitsInTick * nTicksPerFrame;
+    if (!nDen || !nTimeScale) {
+        return;
+    }
+    // keep both in int, reducing by the common factor first
+    uint64_t a = nTimeScale, b = nDen;
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    uint64_t nNum = nTimeScale / a;
+    nDen /= a;
+    while (nNum > INT32_MAX || nDen > INT32_MAX) {
+        nNum >>= 1;
+        nDen >>= 1;
+    }
+    if (nNum && nDen) {
+        pInfo->nFrameRateNum = (int)nNum;
+        pInfo->nFrameRateDen = (int)nDen;
+    }
+}
+
+void skipScalingList(BitReader &br, int nSize)
+{
+    int nLast = 8, nNext = 8;
+    for (int i = 0; i < nSize && nNext; i++) {
+        nNext = (nLast + br.se() + 256) % 256;
+        nLast = nNext ? nNext : nLast;
+    }
+}
+
+bool parseH264Sps(BitReader &br, NvStreamInfo *pInfo)
+{
+    br.u(8);                            // forbidden_zero_bit, nal_ref_idc, nal_unit_type
+    pInfo->nProfile = (int)br.u(8);
+    br.u(8);                            // constraint_set flags
+    pInfo->nLevel = (int)br.u(8);
+    br.ue();                            // seq_parameter_set_id
+
+    int nChromaFormat = 1, nBitDepthLuma = 8, nBitDepthChroma = 8;
+    bool bSeparateColourPlane = false;
+    switch (pInfo->nProfile) {
+    case 100: case 110: case 122: case 244: case 44: case 83: case 86: case 118: case 128: case 138: case 139:
+    case 134: case 135:
+        nChromaFormat = (int)br.ue();
+        if (nChromaFormat == 3) {
+            bSeparateColourPlane = br.u(1) != 0;
+        }
+        nBitDepthLuma = (int)br.ue() + 8;
+        nBitDepthChroma = (int)br.ue() + 8;
+        br.u(1);                        // qpprime_y_zero_transform_bypass_flag
+        if (br.u(1)) {                  // seq_scaling_matrix_present_flag
+            for (int i = 0; i < (nChromaFormat != 3 ? 8 : 12); i++) {
+                if (br.u(1)) {
+                    skipScalingList(br, i < 6 ? 16 : 64);
+                }
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    if (nChromaFormat > 3 || nBitDepthLuma > 14 || nBitDepthChroma > 14) {
+        return false;
+    }
+
+    br.ue();                            // log2_max_frame_num_minus4
+    uint32_t pocType = br.ue();
+    if (pocType == 0) {
+        br.ue();                        // log2_max_pic_order_cnt_lsb_minus4
+    } else if (pocType == 1) {
+        br.u(1);                        // delta_pic_order_always_zero_flag
+        br.se();                        // offset_for_non_ref_pic
+        br.se();                        // offset_for_top_to_bottom_field
+        uint32_t nCycle = br.ue();
+        if (nCycle > 255) {
+            return false;
+        }
+        for (uint32_t i = 0; i < nCycle; i++) {
+            br.se();
+        }
+    }
+    br.ue();                            // max_num_ref_frames
+    br.u(1);                            // gaps_in_frame_num_value_allowed_flag
+    uint32_t nWidthMbs = br.ue() + 1;
+    uint32_t nHeightMapUnits = br.ue() + 1;
+    bool bFrameMbsOnly = br.u(1) != 0;
+    if (!bFrameMbsOnly) {
+        br.u(1);                        // mb_adaptive_frame_field_flag
+    }
+    br.u(1);                            // direct_8x8_inference_flag
+    if (nWidthMbs > 1024 || nHeightMapUnits > 1024) {
+        return false;
+    }
+
+    pInfo->nChromaFormat = nChromaFormat;
+    pInfo->nBitDepthLuma = nBitDepthLuma;
+    pInfo->nBitDepthChroma = nBitDepthChroma;
+    pInfo->bProgressive = bFrameMbsOnly;
+    pInfo->nCodedWidth = (int)nWidthMbs * 16;
+    pInfo->nCodedHeight = (int)nHeightMapUnits * 16 * (bFrameMbsOnly ? 1 : 2);
+
+    int nCropLeft = 0, nCropRight = 0, nCropTop = 0, nCropBottom = 0;
+    if (br.u(1)) {                      // frame_cropping_flag
+        nCropLeft = (int)br.ue();
+        nCropRight = (int)br.ue();
+        nCropTop = (int)br.ue();
+        nCropBottom = (int)br.ue();
+    }
+    // in chroma samples, and in field pairs for interlaced frames (7.4.2.1.1)
+    int nChromaArrayType = bSeparateColourPlane ? 0 : nChromaFormat;
+    int nCropUnitX = nChromaArrayType == 0 ? 1 : (nChromaArrayType == 3 ? 1 : 2);
+    int nCropUnitY = (nChromaArrayType == 1 ? 2 : 1) * (bFrameMbsOnly ? 1 : 2);
+    pInfo->nCropLeft = nCropLeft * nCropUnitX;
+    pInfo->nCropTop = nCropTop * nCropUnitY;
+    pInfo->nWidth = pInfo->nCodedWidth - (nCropLeft + nCropRight) * nCropUnitX;
+    pInfo->nHeight = pInfo->nCodedHeight - (nCropTop + nCropBottom) * nCropUnitY;
+    if (pInfo->nWidth <= 0 || pInfo->nHeight <= 0) {
+        return false;
+    }
+
+    if (br.u(1)) {                      // vui_parameters_present_flag
+        parseVuiHead(br, pInfo);
+        if (br.u(1)) {                  // timing_info_present_flag
+            uint32_t nUnitsInTick = br.u(32);
+            uint32_t nTimeScale = br.u(32);
+            // a frame is two field ticks
+            setFrameRate(nUnitsInTick, nTimeScale, 2, pInfo);
+        }
+    }
+    return br.ok();
+}
+
+void skipProfileTierLevel(BitReader &br, int nMaxSubLayersMinus1, NvStreamInfo *pInfo)
+{
+    br.u(2);                            // general_profile_space
+    br.u(1);                            // general_tier_flag
+    pInfo->nProfile = (int)br.u(5);
+    br.u(32);                           // general_profile_compatibility_flag[32]
+    pInfo->bProgressive = br.u(1) != 0; // general_progressive_source_flag
+    br.skip(47);                        // interlaced, non-packed, frame-only and the 43 + 1 bits after them
+    pInfo->nLevel = (int)br.u(8);
+    bool abProfile[8] = {}, abLevel[8] = {};
+    for (int i = 0; i < nMaxSubLayersMinus1; i++) {
+        abProfile[i] = br.u(1) != 0;
+        abLevel[i] = br.u(1) != 0;
+    }
+    if (nMaxSubLayersMinus1 > 0) {
+        for (int i = nMaxSubLayersMinus1; i < 8; i++) {
+            br.u(2);                    // reserved_zero_2bits
+        }
+    }
+    for (int i = 0; i < nMaxSubLayersMinus1; i++) {
+        if (abProfile[i]) {
+            br.skip(88);
+        }
+        if (abLevel[i]) {
+            br.u(8);
+        }
+    }
+}
+
+void skipHevcScalingListData(BitReader &br)
+{
+    for (int nSizeId = 0; nSizeId < 4; nSizeId++) {
+        for (int nMatrixId = 0; nMatrixId < 6; nMatrixId += nSizeId == 3 ? 3 : 1) {
+            if (!br.u(1)) {             // scaling_list_pred_mode_flag
+                br.ue();                // scaling_list_pred_matrix_id_delta
+                continue;
+            }
+            int nCoefs = std::min(64, 1 << (4 + (nSizeId << 1)));
+            if (nSizeId > 1) {
+                br.se();                // scaling_list_dc_coef_minus8
+            }
+            for (int i = 0; i < nCoefs; i++) {
+                br.se();
+            }
+        }
+    }
+}
+
+/* 7.3.7 st_ref_pic_set(), as it appears in the SPS; anDeltaPocs holds NumDeltaPocs of the sets before */
+bool skipShortTermRefPicSet(BitReader &br, int idx, std::vector<int> &anDeltaPocs)
+{
+    if (idx && br.u(1)) {               // inter_ref_pic_set_prediction_flag
+        br.u(1);                        // delta_rps_sign
+        br.ue();                        // abs_delta_rps_minus1
+        int nDeltaPocs = 0;
+        for (int j = 0; j <= anDeltaPocs[idx - 1]; j++) {
+            bool bUsed = br.u(1) != 0;  // used_by_curr_pic_flag
+            if (bUsed || br.u(1)) {     // use_delta_flag
+                nDeltaPocs++;
+            }
+        }
+        anDeltaPocs.push_back(nDeltaPocs);
+        return true;
+    }
+    uint32_t nNegative = br.ue();
+    uint32_t nPositive = br.ue();
+    if (nNegative > 16 || nPositive > 16) {
+        return false;
+    }
+    for (uint32_t i = 0; i < nNegative + nPositive; i++) {
+        br.ue();                        // delta_poc_s0/s1_minus1
+        br.u(1);                        // used_by_curr_pic_s0/s1_flag
+    }
+    anDeltaPocs.push_back((int)(nNegative + nPositive));
+    return true;
+}
+
+bool parseHevcSps(BitReader &br, NvStreamInfo *pInfo)
+{
+    br.u(16);                           // NAL unit header
+    br.u(4);                            // sps_video_parameter_set_id
+    int nMaxSubLayersMinus1 = (int)br.u(3);
+    br.u(1);                            // sps_temporal_id_nesting_flag
+    if (nMaxSubLayersMinus1 > 6) {
+        return false;
+    }
+    skipProfileTierLevel(br, nMaxSubLayersMinus1, pInfo);
+    br.ue();                            // sps_seq_parameter_set_id
+    int nChromaFormat = (int)br.ue();
+    bool bSeparateColourPlane = false;
+    if (nChromaFormat == 3) {
+        bSeparateColourPlane = br.u(1) != 0;
+    }
+    uint32_t nWidth = br.ue();
+    uint32_t nHeight = br.ue();
+    int nConfLeft = 0, nConfRight = 0, nConfTop = 0, nConfBottom = 0;
+    if (br.u(1)) {                      // conformance_window_flag
+        nConfLeft = (int)br.ue();
+        nConfRight = (int)br.ue();
+        nConfTop = (int)br.ue();
+        nConfBottom = (int)br.ue();
+    }
+    int nBitDepthLuma = (int)br.ue() + 8;
+    int nBitDepthChroma = (int)br.ue() + 8;
+    if (nChromaFormat > 3 || nBitDepthLuma > 16 || nBitDepthChroma > 16 || !nWidth || !nHeight ||
+        nWidth > 16888 || nHeight > 16888) {
+        return false;
+    }
+
+    pInfo->nChromaFormat = nChromaFormat;
+    pInfo->nBitDepthLuma = nBitDepthLuma;
+    pInfo->nBitDepthChroma = nBitDepthChroma;
+    pInfo->nCodedWidth = (int)nWidth;
+    pInfo->nCodedHeight = (int)nHeight;
+    // in chroma samples (7.4.3.2.1)
+    int nChromaArrayType = bSeparateColourPlane ? 0 : nChromaFormat;
+    int nSubWidthC = nChromaArrayType == 1 || nChromaArrayType == 2 ? 2 : 1;
+    int nSubHeightC = nChromaArrayType == 1 ? 2 : 1;
+    pInfo->nCropLeft = nConfLeft * nSubWidthC;
+    pInfo->nCropTop = nConfTop * nSubHeightC;
+    pInfo->nWidth = (int)nWidth - (nConfLeft + nConfRight) * nSubWidthC;
+    pInfo->nHeight = (int)nHeight - (nConfTop + nConfBottom) * nSubHeightC;
+    if (pInfo->nWidth <= 0 || pInfo->nHeight <= 0) {
+        return false;
+    }
+
+    // everything up to the VUI, to get at the frame rate and colour description
+    uint32_t nLog2MaxPocLsb = br.ue() + 4;
+    bool bSubLayerOrdering = br.u(1) != 0;
+    for (int i = bSubLayerOrdering ? 0 : nMaxSubLayersMinus1; i <= nMaxSubLayersMinus1; i++) {
+        br.ue();                        // sps_max_dec_pic_buffering_minus1
+        br.ue();                        // sps_max_num_reorder_pics
+        br.ue();                        // sps_max_latency_increase_plus1
+    }
+    br.ue();                            // log2_min_luma_coding_block_size_minus3
+    br.ue();                            // log2_diff_max_min_luma_coding_block_size
+    br.ue();                            // log2_min_luma_transform_block_size_minus2
+    br.ue();                            // log2_diff_max_min_luma_transform_block_size
+    br.ue();                            // max_transform_hierarchy_depth_inter
+    br.ue();                            // max_transform_hierarchy_depth_intra
+    if (br.u(1) && br.u(1)) {           // scaling_list_enabled_flag, sps_scaling_list_data_present_flag
+        skipHevcScalingListData(br);
+    }
+    br.u(1);                            // amp_enabled_flag
+    br.u(1);                            // sample_adaptive_offset_enabled_flag
+    if (br.u(1)) {                      // pcm_enabled_flag
+        br.u(4);
+        br.u(4);
+        br.ue();
+        br.ue();
+        br.u(1);
+    }
+    uint32_t nShortTermRefPicSets = br.ue();
+    if (nShortTermRefPicSets > 64 || nLog2MaxPocLsb > 16) {
+        return br.ok();
+    }
+    std::vector<int> anDeltaPocs;
+    for (uint32_t i = 0; i < nShortTermRefPicSets; i++) {
+        if (!skipShortTermRefPicSet(br, (int)i, anDeltaPocs)) {
+            return br.ok();
+        }
+    }
+    if (br.u(1)) {                      // long_term_ref_pics_present_flag
+        uint32_t nLongTerm = br.ue();
+        if (nLongTerm > 32) {
+            return br.ok();
+        }
+        for (uint32_t i = 0; i < nLongTerm; i++) {
+            br.u((int)nLog2MaxPocLsb);  // lt_ref_pic_poc_lsb_sps
+            br.u(1);                    // used_by_curr_pic_lt_sps_flag
+        }
+    }
+    br.u(1);                            // sps_temporal_mvp_enabled_flag
+    br.u(1);                            // strong_intra_smoothing_enabled_flag
+    if (!br.ok() || !br.u(1)) {         // vui_parameters_present_flag
+        return true;
+    }
+
+    NvStreamInfo vui = *pInfo;
+    parseVuiHead(br, &vui);
+    br.u(1);                            // neutral_chroma_indication_flag
+    br.u(1);                            // field_seq_flag
+    br.u(1);                            // frame_field_info_present_flag
+    if (br.u(1)) {                      // default_display_window_flag
+        br.ue();
+        br.ue();
+        br.ue();
+        br.ue();
+    }
+    if (br.u(1)) {                      // vui_timing_info_present_flag
+        uint32_t nUnitsInTick = br.u(32);
+        uint32_t nTimeScale = br.u(32);
+        setFrameRate(nUnitsInTick, nTimeScale, 1, &vui);
+    }
+    // the picture format is known already; a damaged VUI only loses the extras
+    if (br.ok()) {
+        *pInfo = vui;
+    }
+    return true;
+}
+
+}
+
+bool NvSpsParser::parseSps(int codecId, const uint8_t *pNal, size_t nBytes, NvStreamInfo *pInfo)
+{
+    if ((codecId != AV_CODEC_ID_H264 && codecId != AV_CODEC_ID_HEVC) || !nBytes) {
+        return false;
+    }
+    NvStreamInfo info;
+    initInfo(codecId, &info);
+    BitReader br(pNal, nBytes);
+    bool bOk = codecId == AV_CODEC_ID_H264 ? (pNal[0] & 0x1f) == 7 && parseH264Sps(br, &info)
+                                           : ((pNal[0] >> 1) & 0x3f) == 33 && parseHevcSps(br, &info);
+    if (bOk) {
+        *pInfo = info;
+    }
+    return bOk;
+}
+
+bool NvSpsParser::parseAnnexB(int codecId, const uint8_t *pData, size_t nBytes, NvStreamInfo *pInfo)
+{
+    const uint8_t *pEnd = pData + nBytes;
+    for (const uint8_t *p = NvFindStartCode(pData, pEnd); p < pEnd; ) {
+        const uint8_t *pNal = p + 3;
+        const uint8_t *q = NvFindStartCode(pNal, pEnd);
+        // up to the next start code, less the leading 0 of a 4-byte one
+        const uint8_t *pNalEnd = q < pEnd && q > pNal && q[-1] == 0 ? q - 1 : q;
+        if (pNal < pNalEnd && parseSps(codecId, pNal, (size_t)(pNalEnd - pNal), pInfo)) {
+            return true;
+        }
+        p = q;
+    }
+    return false;
+}
+
+bool NvSpsParser::parseExtradata(int codecId, const uint8_t *pExtradata, size_t nBytes, NvStreamInfo *pInfo)
+{
+    NvAnnexBConverter annexb;
+    if (annexb.init(codecId, pExtradata, nBytes)) {
+        const std::vector<uint8_t> &v = annexb.getParameterSets();
+        return parseAnnexB(codecId, v.data(), v.size(), pInfo);
+    }
+    return pExtradata && parseAnnexB(codecId, pExtradata, nBytes, pInfo);
+}
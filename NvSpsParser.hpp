@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+* @brief What the sequence parameter set of an H.264 or HEVC stream says about its pictures
+*/
+struct NvStreamInfo {
+    int codecId;                    // AVCodecID
+    int nProfile, nLevel;
+    int nCodedWidth, nCodedHeight;  // decoded size, whole macroblocks / minimum coding blocks
+    int nWidth, nHeight;            // displayed size, inside the cropping (conformance) window
+    int nCropLeft, nCropTop;
+    int nChromaFormat;              // chroma_format_idc: 0 monochrome, 1 4:2:0, 2 4:2:2, 3 4:4:4
+    int nBitDepthLuma, nBitDepthChroma;
+    bool bProgressive;              // H.264 frame_mbs_only_flag, HEVC general_progressive_source_flag
+    int nFrameRateNum, nFrameRateDen;   // VUI timing info, 0 without
+    int nSarNum, nSarDen;           // VUI sample aspect ratio, 0 without
+    int videoFormat;                // VUI video signal type, 5 (unspecified) without
+    bool bFullRange;
+    bool bColorDescription;         // the three below came from the VUI; 2 (unspecified) otherwise
+    int colorPrimaries, transferCharacteristics, matrixCoefficients;
+};
+
+/**
+* @brief H.264/HEVC sequence parameter set parser (exp-Golomb, cropping, VUI up to the timing info), to learn
+* the stream format without decoding, e.g. instead of avformat_find_stream_info()
+*/
+class NvSpsParser {
+public:
+    /**
+    *   @brief  One SPS NAL unit, NAL header first, emulation prevention bytes in place
+    */
+    static bool parseSps(int codecId, const uint8_t *pNal, size_t nBytes, NvStreamInfo *pInfo);
+    /**
+    *   @brief  The first SPS in an Annex-B buffer (start code separated NAL units)
+    */
+    static bool parseAnnexB(int codecId, const uint8_t *pData, size_t nBytes, NvStreamInfo *pInfo);
+    /**
+    *   @brief  The first SPS of container extradata, avcC/hvcC or Annex-B
+    */
+    static bool parseExtradata(int codecId, const uint8_t *pExtradata, size_t nBytes, NvStreamInfo *pInfo);
+};
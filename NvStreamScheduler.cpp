@@ -0,0 +1,282 @@
+#include "NvStreamScheduler.hpp"
+#include "SwCuvidBackend.hpp"
+#include "NvCudaContext.hpp"
+
+#define __I(fmt, args...) printf("" fmt, ## args)
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+NvCuvidCapacityModel::NvCuvidCapacityModel(uint64_t nMaxMBPerSec) : m_nMaxMBPerSec(nMaxMBPerSec)
+{
+    m_nGpu = NvCudaContextRegistry::getDeviceCount();
+    if (!m_nGpu) {
+        __E("No CUDA driver, NVDEC capacity is zero \n");
+    }
+}
+
+NvCuvidCapacityModel::~NvCuvidCapacityModel()
+{
+}
+
+bool NvCuvidCapacityModel::getDecoderCaps(int iGpu, CUVIDDECODECAPS *pCaps)
+{
+    if (iGpu < 0 || iGpu >= m_nGpu) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mtxCaps);
+    for (auto &entry : m_vCapsCache) {
+        if (entry.iGpu == iGpu &&
+            entry.caps.eCodecType == pCaps->eCodecType &&
+            entry.caps.eChromaFormat == pCaps->eChromaFormat &&
+            entry.caps.nBitDepthMinus8 == pCaps->nBitDepthMinus8) {
+            *pCaps = entry.caps;
+            return true;
+        }
+    }
+
+    CUcontext cuContext = NvCudaContextRegistry::get(iGpu);
+    if (!cuContext || cuCtxPushCurrent(cuContext) != CUDA_SUCCESS) {
+        return false;
+    }
+    CUresult result = cuvidGetDecoderCaps(pCaps);
+    cuCtxPopCurrent(NULL);
+    if (result != CUDA_SUCCESS) {
+        return false;
+    }
+
+    m_vCapsCache.push_back(CapsEntry{iGpu, *pCaps});
+    return true;
+}
+
+bool NvSimCapacityModel::getDecoderCaps(int iGpu, CUVIDDECODECAPS *pCaps)
+{
+    if (iGpu < 0 || iGpu >= (int)m_vGpu.size()) {
+        return false;
+    }
+    const SimGpu &gpu = m_vGpu[iGpu];
+    pCaps->bIsSupported = (int)pCaps->nBitDepthMinus8 <= gpu.nMaxBitDepthMinus8 &&
+                          (pCaps->eChromaFormat != cudaVideoChromaFormat_444 || gpu.bSupport444);
+    pCaps->nMaxWidth   = gpu.nMaxWidth;
+    pCaps->nMaxHeight  = gpu.nMaxHeight;
+    pCaps->nMaxMBCount = gpu.nMaxMBCount;
+    pCaps->nMinWidth   = 48;
+    pCaps->nMinHeight  = 16;
+    pCaps->nOutputFormatMask = 1 << cudaVideoSurfaceFormat_NV12;
+    return true;
+}
+
+NvStreamScheduler::NvStreamScheduler(NvCapacityModel *pModel, uint64_t nCpuMaxMBPerSec, int nCpuThreads)
+    : m_pModel(pModel), m_nCpuMaxMBPerSec(nCpuMaxMBPerSec), m_nCpuThreads(nCpuThreads)
+{
+    m_vGpuLoad.resize(m_pModel->getNumGpu(), 0);
+}
+
+NvStreamScheduler::~NvStreamScheduler()
+{
+    if (!m_mDecoderSession.empty()) {
+        __E("%d scheduled decoder(s) not destroyed \n", (int)m_mDecoderSession.size());
+    }
+    delete m_pModel;
+}
+
+/* Same per-picture checks NvDecoder::handleNvSequence() makes against the real caps */
+bool NvStreamScheduler::fitsGpu(int iGpu, const StreamDesc &desc)
+{
+    CUVIDDECODECAPS caps = {};
+    caps.eCodecType      = desc.eCodec;
+    caps.eChromaFormat   = desc.eChromaFormat;
+    caps.nBitDepthMinus8 = desc.nBitDepthMinus8;
+    if (!m_pModel->getDecoderCaps(iGpu, &caps) || !caps.bIsSupported) {
+        return false;
+    }
+    if ((unsigned)desc.nWidth > caps.nMaxWidth || (unsigned)desc.nHeight > caps.nMaxHeight) {
+        return false;
+    }
+    if ((unsigned)(((desc.nWidth + 15) >> 4) * ((desc.nHeight + 15) >> 4)) > caps.nMaxMBCount) {
+        return false;
+    }
+    return true;
+}
+
+int NvStreamScheduler::admitLocked(const StreamDesc &desc, int *pPlacement)
+{
+    uint64_t nMBPerSec = getMBPerSec(desc.nWidth, desc.nHeight, desc.fps);
+
+    // least-loaded GPU relative to its budget, among those that still have room for the stream
+    int placement = PLACE_CPU;
+    double fBestLoad = 0;
+    for (int i = 0; i < (int)m_vGpuLoad.size(); i++) {
+        uint64_t nBudget = m_pModel->getMaxMBPerSec(i, desc.eCodec);
+        if (!nBudget || m_vGpuLoad[i] + nMBPerSec > nBudget || !fitsGpu(i, desc)) {
+            continue;
+        }
+        double fLoad = (double)(m_vGpuLoad[i] + nMBPerSec) / nBudget;
+        if (placement == PLACE_CPU || fLoad < fBestLoad) {
+            placement = i;
+            fBestLoad = fLoad;
+        }
+    }
+
+    if (placement == PLACE_CPU && m_nCpuMaxMBPerSec && m_nCpuLoad + nMBPerSec > m_nCpuMaxMBPerSec) {
+        placement = PLACE_REJECTED;
+    }
+    if (pPlacement) {
+        *pPlacement = placement;
+    }
+    if (placement == PLACE_REJECTED) {
+        m_nRejected++;
+        return -1;
+    }
+
+    if (placement == PLACE_CPU) {
+        m_nCpuLoad += nMBPerSec;
+        m_nSpilled++;
+    } else {
+        m_vGpuLoad[placement] += nMBPerSec;
+    }
+    m_nAdmitted++;
+
+    Session session = {};
+    session.placement   = placement;
+    session.nMBPerFrame = ((desc.nWidth + 15) >> 4) * ((desc.nHeight + 15) >> 4);
+    session.nDeclaredMBPerSec = nMBPerSec;
+    session.nMBPerSec   = nMBPerSec;
+    int sessionId = m_nNextSessionId++;
+    m_mSession[sessionId] = session;
+    return sessionId;
+}
+
+int NvStreamScheduler::admit(const StreamDesc &desc, int *pPlacement)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return admitLocked(desc, pPlacement);
+}
+
+void NvStreamScheduler::releaseLocked(int sessionId)
+{
+    auto it = m_mSession.find(sessionId);
+    if (it == m_mSession.end()) {
+        return;
+    }
+    if (it->second.placement == PLACE_CPU) {
+        m_nCpuLoad -= it->second.nMBPerSec;
+    } else {
+        m_vGpuLoad[it->second.placement] -= it->second.nMBPerSec;
+    }
+    m_mSession.erase(it);
+}
+
+void NvStreamScheduler::release(int sessionId)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    releaseLocked(sessionId);
+}
+
+void NvStreamScheduler::reportFrames(int sessionId, int nFrames, double fSeconds)
+{
+    if (fSeconds <= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_mSession.find(sessionId);
+    if (it == m_mSession.end()) {
+        return;
+    }
+    Session &session = it->second;
+    uint64_t nMBPerSec = std::max((uint64_t)(session.nMBPerFrame * (nFrames / fSeconds)), session.nDeclaredMBPerSec);
+    uint64_t &load = session.placement == PLACE_CPU ? m_nCpuLoad : m_vGpuLoad[session.placement];
+    load = load - session.nMBPerSec + nMBPerSec;
+    session.nMBPerSec = nMBPerSec;
+}
+
+int NvStreamScheduler::getPlacement(int sessionId)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_mSession.find(sessionId);
+    return it == m_mSession.end() ? PLACE_REJECTED : it->second.placement;
+}
+
+uint64_t NvStreamScheduler::getLoadMBPerSec(int placement)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (placement == PLACE_CPU) {
+        return m_nCpuLoad;
+    }
+    if (placement < 0 || placement >= (int)m_vGpuLoad.size()) {
+        return 0;
+    }
+    return m_vGpuLoad[placement];
+}
+
+NvStreamScheduler::Stats NvStreamScheduler::getStats()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    Stats stats = {};
+    for (auto &it : m_mSession) {
+        if (it.second.placement == PLACE_CPU) {
+            stats.nCpuSessions++;
+        } else {
+            stats.nGpuSessions++;
+        }
+    }
+    stats.nAdmitted = m_nAdmitted;
+    stats.nSpilled  = m_nSpilled;
+    stats.nRejected = m_nRejected;
+    return stats;
+}
+
+NvDecoder *NvStreamScheduler::createDecoder(const StreamDesc &desc, Rect *pCropRect, Dim *pResizeDim)
+{
+    int placement = PLACE_REJECTED;
+    int sessionId = admit(desc, &placement);
+    if (sessionId < 0) {
+        __E("Stream %dx%d@%.2f rejected, no decode capacity left \n", desc.nWidth, desc.nHeight, desc.fps);
+        return NULL;
+    }
+
+    NvDecoder *pDecoder = NULL;
+    try {
+        if (placement == PLACE_CPU) {
+            pDecoder = new NvDecoder(new SwCuvidBackend(m_nCpuThreads), pCropRect, pResizeDim);
+        } else {
+            pDecoder = new NvDecoder((uint16_t)placement, pCropRect, pResizeDim);
+        }
+    } catch (...) {
+        release(sessionId);
+        throw;
+    }
+    __I("Stream %dx%d@%.2f placed on %s%d \n", desc.nWidth, desc.nHeight, desc.fps,
+        placement == PLACE_CPU ? "cpu" : "gpu", placement == PLACE_CPU ? 0 : placement);
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_mSession[sessionId].pDecoder = pDecoder;
+    m_mDecoderSession[pDecoder] = sessionId;
+    return pDecoder;
+}
+
+void NvStreamScheduler::destroyDecoder(NvDecoder *pDecoder)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_mDecoderSession.find(pDecoder);
+        if (it != m_mDecoderSession.end()) {
+            releaseLocked(it->second);
+            m_mDecoderSession.erase(it);
+        }
+    }
+    delete pDecoder;
+}
+
+void NvStreamScheduler::reportFrames(NvDecoder *pDecoder, int nFrames, double fSeconds)
+{
+    int sessionId = -1;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_mDecoderSession.find(pDecoder);
+        if (it == m_mDecoderSession.end()) {
+            return;
+        }
+        sessionId = it->second;
+    }
+    reportFrames(sessionId, nFrames, fSeconds);
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "NvDecoder.hpp"
+
+/**
+* @brief What the scheduler needs to know about a decode host: how many NVDEC-capable GPUs it has,
+* the per-picture limits cuvidGetDecoderCaps reports for each, and how many macroblocks per second
+* each GPU's decoders can sustain in total. The caps only bound a single picture, the MB/s budget is
+* what bounds the sum of all sessions on a GPU.
+*/
+class NvCapacityModel {
+public:
+    virtual ~NvCapacityModel() {}
+
+    virtual int getNumGpu() = 0;
+
+    /**
+    *   @brief  Fill pCaps (eCodecType, eChromaFormat and nBitDepthMinus8 set by the caller) for GPU iGpu.
+    *   @return false if the query itself failed; an unsupported format is bIsSupported == 0
+    */
+    virtual bool getDecoderCaps(int iGpu, CUVIDDECODECAPS *pCaps) = 0;
+
+    /**
+    *   @brief  Aggregate decode throughput budget of GPU iGpu for eCodec, in macroblocks per second
+    */
+    virtual uint64_t getMaxMBPerSec(int iGpu, cudaVideoCodec eCodec) = 0;
+};
+
+/**
+* @brief Capacity model of the GPUs in this host. Caps come from cuvidGetDecoderCaps on each device's
+* shared context (NvCudaContextRegistry) and are cached; NVDEC does not report throughput, so the MB/s budget is configured.
+*/
+class NvCuvidCapacityModel : public NvCapacityModel {
+public:
+    /**
+    *   @param  nMaxMBPerSec - per-GPU decode budget, the default is about sixteen 1080p30 streams
+    */
+    NvCuvidCapacityModel(uint64_t nMaxMBPerSec = 16ull * 8160 * 30);
+    ~NvCuvidCapacityModel();
+
+    int getNumGpu() { return m_nGpu; }
+    bool getDecoderCaps(int iGpu, CUVIDDECODECAPS *pCaps);
+    uint64_t getMaxMBPerSec(int iGpu, cudaVideoCodec eCodec) { return m_nMaxMBPerSec; }
+
+private:
+    // keyed by GPU, codec, chroma format and bit depth
+    struct CapsEntry {
+        int iGpu;
+        CUVIDDECODECAPS caps;
+    };
+
+    int m_nGpu = 0;
+    uint64_t m_nMaxMBPerSec = 0;
+    std::mutex m_mtxCaps;
+    std::vector<CapsEntry> m_vCapsCache;
+};
+
+/**
+* @brief Capacity model with made-up GPUs, so placement can be exercised without a GPU.
+* A simulated GPU reports the same limits for every codec; bit depth and 4:4:4 support are per GPU.
+*/
+class NvSimCapacityModel : public NvCapacityModel {
+public:
+    struct SimGpu {
+        unsigned int nMaxWidth, nMaxHeight, nMaxMBCount;
+        uint64_t nMaxMBPerSec;
+        int nMaxBitDepthMinus8;
+        bool bSupport444;
+    };
+
+    void addGpu(const SimGpu &gpu) { m_vGpu.push_back(gpu); }
+
+    int getNumGpu() { return (int)m_vGpu.size(); }
+    bool getDecoderCaps(int iGpu, CUVIDDECODECAPS *pCaps);
+    uint64_t getMaxMBPerSec(int iGpu, cudaVideoCodec eCodec) { return m_vGpu[iGpu].nMaxMBPerSec; }
+
+private:
+    std::vector<SimGpu> m_vGpu;
+};
+
+/**
+* @brief Places decode streams on the least-loaded GPU that can take them, and spills the rest to
+* libavcodec on the CPU. Load is the sum of the sessions' macroblocks per second: the rate declared at
+* admission, or the measured one while a session reports decoding faster. A slow or idle stretch never
+* frees the declared capacity, the stream is going to need it again.
+* Either way the caller gets an NvDecoder, so the output frame API does not depend on the placement.
+*/
+class NvStreamScheduler {
+public:
+    enum {
+        PLACE_REJECTED = -2,
+        PLACE_CPU      = -1,
+        // >= 0: GPU ordinal
+    };
+
+    struct StreamDesc {
+        cudaVideoCodec eCodec = cudaVideoCodec_H264;
+        cudaVideoChromaFormat eChromaFormat = cudaVideoChromaFormat_420;
+        int nBitDepthMinus8 = 0;
+        int nWidth = 0, nHeight = 0;
+        double fps = 30.0;
+    };
+
+    struct Stats {
+        int nGpuSessions, nCpuSessions;
+        uint64_t nAdmitted, nSpilled, nRejected;
+    };
+
+    /**
+    *   @param  pModel - capacity model, owned by the scheduler
+    *   @param  nCpuMaxMBPerSec - budget of the CPU path, 0 is unbounded
+    *   @param  nCpuThreads - libavcodec threads per CPU session, 0 lets libavcodec pick
+    */
+    NvStreamScheduler(NvCapacityModel *pModel, uint64_t nCpuMaxMBPerSec = 0, int nCpuThreads = 0);
+    ~NvStreamScheduler();
+
+    /**
+    *   @brief  Placement only: reserve capacity for a stream.
+    *   @return session id >= 0, or -1 when neither a GPU nor the CPU path has room. *pPlacement is set either way.
+    */
+    int admit(const StreamDesc &desc, int *pPlacement = NULL);
+    void release(int sessionId);
+
+    /**
+    *   @brief  Feed the measured rate of a session: nFrames decoded over fSeconds. The session then holds the
+    *   larger of that and its declared rate.
+    */
+    void reportFrames(int sessionId, int nFrames, double fSeconds);
+
+    int getPlacement(int sessionId);
+    uint64_t getLoadMBPerSec(int placement);
+    Stats getStats();
+
+    /**
+    *   @brief  Admit the stream and create its decoder on the chosen path.
+    *   @return NULL if rejected. The decoder must be handed back through destroyDecoder().
+    */
+    NvDecoder *createDecoder(const StreamDesc &desc, Rect *pCropRect = NULL, Dim *pResizeDim = NULL);
+    void destroyDecoder(NvDecoder *pDecoder);
+    void reportFrames(NvDecoder *pDecoder, int nFrames, double fSeconds);
+
+    static uint64_t getMBPerSec(int nWidth, int nHeight, double fps) {
+        return (uint64_t)(((nWidth + 15) >> 4) * ((nHeight + 15) >> 4) * fps);
+    }
+
+private:
+    struct Session {
+        int placement;
+        int nMBPerFrame;
+        uint64_t nDeclaredMBPerSec;     // at admission
+        uint64_t nMBPerSec;             // held now, see reportFrames()
+        NvDecoder *pDecoder;
+    };
+
+    bool fitsGpu(int iGpu, const StreamDesc &desc);
+    int admitLocked(const StreamDesc &desc, int *pPlacement);
+    void releaseLocked(int sessionId);
+
+    NvCapacityModel *m_pModel = NULL;
+    uint64_t m_nCpuMaxMBPerSec = 0;
+    int m_nCpuThreads = 0;
+
+    std::mutex m_mtx;
+    std::map<int, Session> m_mSession;
+    std::map<NvDecoder *, int> m_mDecoderSession;
+    std::vector<uint64_t> m_vGpuLoad;
+    uint64_t m_nCpuLoad = 0;
+    int m_nNextSessionId = 0;
+    uint64_t m_nAdmitted = 0, m_nSpilled = 0, m_nRejected = 0;
+};
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include "NvTrace.hpp"
+#include "NvMetrics.hpp"
+
+namespace {
+
+/* Seqlock slot: nSeq is 2 * i + 1 while the owner writes event i into it and 2 * i + 2 once it is complete.
+   The payload is atomic too so that a dump racing the owner reads stale values instead of undefined ones. */
+struct TraceSlot {
+    std::atomic<uint64_t> nSeq{0};
+    std::atomic<const char *> szName;
+    std::atomic<uint64_t> nBeginNs;
+    std::atomic<uint64_t> nEndNs;
+    std::atomic<int32_t> nStream;
+    std::atomic<int32_t> nPicture;
+    std::atomic<uint32_t> nThread;
+
+    /* Payload stores are release and loads acquire instead of relaxed plus fences: a reader that sees any part
+       of event i + nCapacity is then guaranteed to see the odd sequence stored before it, and TSan understands it. */
+    void write(uint64_t i, const NvTraceEvent &ev) {
+        nSeq.store(2 * i + 1, std::memory_order_relaxed);
+        szName.store(ev.szName, std::memory_order_release);
+        nBeginNs.store(ev.nBeginNs, std::memory_order_release);
+        nEndNs.store(ev.nEndNs, std::memory_order_release);
+        nStream.store(ev.nStream, std::memory_order_release);
+        nPicture.store(ev.nPicture, std::memory_order_release);
+        nThread.store(ev.nThread, std::memory_order_release);
+        nSeq.store(2 * i + 2, std::memory_order_release);
+    }
+    // false if the slot does not hold a complete event i
+    bool read(uint64_t i, NvTraceEvent *pEvent) const {
+        if (nSeq.load(std::memory_order_acquire) != 2 * i + 2) {
+            return false;
+        }
+        pEvent->szName   = szName.load(std::memory_order_acquire);
+        pEvent->nBeginNs = nBeginNs.load(std::memory_order_acquire);
+        pEvent->nEndNs   = nEndNs.load(std::memory_order_acquire);
+        pEvent->nStream  = nStream.load(std::memory_order_acquire);
+        pEvent->nPicture = nPicture.load(std::memory_order_acquire);
+        pEvent->nThread  = nThread.load(std::memory_order_acquire);
+        return nSeq.load(std::memory_order_relaxed) == 2 * i + 2;
+    }
+};
+
+struct TraceRing {
+    TraceSlot *pSlot;
+    size_t nCapacity;
+    std::atomic<uint64_t> nWritten{0};  // events ever written, the owner publishes with release
+    std::atomic<uint64_t> nBase{0};     // nWritten at start(), older events are not dumped
+
+    explicit TraceRing(size_t n) : pSlot(new TraceSlot[n]), nCapacity(n) {}
+};
+
+std::atomic<bool> s_bEnabled{false};
+std::atomic<size_t> s_nCapacity{65536};
+std::atomic<uint64_t> s_nStartNs{0};
+std::atomic<uint32_t> s_nNextThread{1};
+std::atomic<int> s_nNextStream{0};
+
+std::mutex s_mtxRings;
+std::vector<TraceRing *> s_vRing;       // never freed, events of finished threads stay dumpable
+std::vector<TraceRing *> s_vFreeRing;
+std::map<uint32_t, std::string> s_mThreadName;
+
+struct ThreadRing {
+    TraceRing *pRing = NULL;
+    uint32_t nThread = 0;
+
+    TraceRing *get() {
+        if (!pRing) {
+            std::lock_guard<std::mutex> lock(s_mtxRings);
+            if (!s_vFreeRing.empty()) {
+                pRing = s_vFreeRing.back();
+                s_vFreeRing.pop_back();
+            } else {
+                pRing = new TraceRing(std::max(s_nCapacity.load(std::memory_order_relaxed), (size_t)1));
+                s_vRing.push_back(pRing);
+            }
+        }
+        return pRing;
+    }
+    uint32_t getThread() {
+        if (!nThread) {
+            nThread = s_nNextThread.fetch_add(1, std::memory_order_relaxed);
+        }
+        return nThread;
+    }
+    ~ThreadRing() {
+        if (pRing) {
+            std::lock_guard<std::mutex> lock(s_mtxRings);
+            s_vFreeRing.push_back(pRing);
+        }
+    }
+};
+
+thread_local ThreadRing t_ring;
+
+void appendEscaped(std::ostringstream &os, const char *sz) {
+    for (; *sz; sz++) {
+        if (*sz == '"' || *sz == '\\') {
+            os << '\\';
+        }
+        if ((unsigned char)*sz >= 0x20) {
+            os << *sz;
+        }
+    }
+}
+
+}
+
+void NvTrace::start(size_t nEventsPerThread)
+{
+    std::lock_guard<std::mutex> lock(s_mtxRings);
+    s_nCapacity.store(nEventsPerThread, std::memory_order_relaxed);
+    for (TraceRing *pRing : s_vRing) {
+        pRing->nBase.store(pRing->nWritten.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+    s_nStartNs.store(NvMetrics::now(), std::memory_order_relaxed);
+    s_bEnabled.store(true, std::memory_order_release);
+}
+
+void NvTrace::stop()
+{
+    s_bEnabled.store(false, std::memory_order_release);
+}
+
+bool NvTrace::isEnabled()
+{
+    return s_bEnabled.load(std::memory_order_relaxed);
+}
+
+void NvTrace::record(const char *szName, uint64_t nBeginNs, uint64_t nEndNs, int nStream, int nPicture)
+{
+    if (!s_bEnabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    TraceRing *pRing = t_ring.get();
+    uint64_t i = pRing->nWritten.load(std::memory_order_relaxed);
+    NvTraceEvent ev;
+    ev.szName   = szName;
+    ev.nBeginNs = nBeginNs;
+    ev.nEndNs   = nEndNs;
+    ev.nStream  = nStream;
+    ev.nPicture = nPicture;
+    ev.nThread  = t_ring.getThread();
+    pRing->pSlot[i % pRing->nCapacity].write(i, ev);
+    pRing->nWritten.store(i + 1, std::memory_order_release);
+}
+
+void NvTrace::setThreadName(const char *szName)
+{
+    uint32_t nThread = t_ring.getThread();
+    std::lock_guard<std::mutex> lock(s_mtxRings);
+    s_mThreadName[nThread] = szName;
+}
+
+int NvTrace::newStreamId()
+{
+    return s_nNextStream.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string NvTrace::toChromeTrace()
+{
+    std::vector<NvTraceEvent> vEvent;
+    std::map<uint32_t, std::string> mThreadName;
+    uint64_t nDropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(s_mtxRings);
+        for (TraceRing *pRing : s_vRing) {
+            uint64_t nCapacity = pRing->nCapacity;
+            uint64_t nBase = pRing->nBase.load(std::memory_order_relaxed);
+            uint64_t nEnd = pRing->nWritten.load(std::memory_order_acquire);
+            uint64_t nFirst = std::max(nBase, nEnd > nCapacity ? nEnd - nCapacity : 0);
+            size_t nCopied = vEvent.size();
+            NvTraceEvent ev;
+            for (uint64_t i = nFirst; i < nEnd; i++) {
+                // the owner may have lapped the copy meanwhile; what it overwrote fails the sequence check
+                if (pRing->pSlot[i % nCapacity].read(i, &ev)) {
+                    vEvent.push_back(ev);
+                }
+            }
+            nDropped += (nEnd - nBase) - (vEvent.size() - nCopied);
+        }
+        mThreadName = s_mThreadName;
+    }
+
+    int64_t nStartNs = (int64_t)s_nStartNs.load(std::memory_order_relaxed);
+    std::ostringstream os;
+    os << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":" << nDropped << "},\"traceEvents\":[";
+    bool bFirst = true;
+    for (auto &it : mThreadName) {
+        os << (bFirst ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << it.first
+           << ",\"args\":{\"name\":\"";
+        appendEscaped(os, it.second.c_str());
+        os << "\"}}";
+        bFirst = false;
+    }
+    os.precision(3);
+    os << std::fixed;
+    for (const NvTraceEvent &ev : vEvent) {
+        os << (bFirst ? "" : ",") << "\n{\"name\":\"";
+        appendEscaped(os, ev.szName);
+        os << "\",\"cat\":\"nvdec\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ev.nThread
+           << ",\"ts\":" << ((int64_t)ev.nBeginNs - nStartNs) / 1000.0
+           << ",\"dur\":" << (ev.nEndNs - ev.nBeginNs) / 1000.0
+           << ",\"args\":{\"stream\":" << ev.nStream << ",\"picture\":" << ev.nPicture << "}}";
+        bFirst = false;
+    }
+    os << "\n]}\n";
+    return os.str();
+}
+
+bool NvTrace::writeChromeTrace(const char *szPath)
+{
+    FILE *fp = fopen(szPath, "wb");
+    if (!fp) {
+        return false;
+    }
+    std::string strTrace = toChromeTrace();
+    bool bOk = fwrite(strTrace.data(), 1, strTrace.size(), fp) == strTrace.size();
+    return fclose(fp) == 0 && bOk;
+}
+
+uint64_t NvTrace::getNumDropped()
+{
+    uint64_t nDropped = 0;
+    std::lock_guard<std::mutex> lock(s_mtxRings);
+    for (TraceRing *pRing : s_vRing) {
+        uint64_t nWritten = pRing->nWritten.load(std::memory_order_relaxed) - pRing->nBase.load(std::memory_order_relaxed);
+        nDropped += nWritten > pRing->nCapacity ? nWritten - pRing->nCapacity : 0;
+    }
+    return nDropped;
+}
+
+NvTraceScope::NvTraceScope(const char *szName, int nStream, int nPicture)
+    : m_szName(szName), m_nStream(nStream), m_nPicture(nPicture),
+      m_nStart(NvTrace::isEnabled() ? NvMetrics::now() : 0)
+{
+}
+
+void NvTraceScope::stop()
+{
+    if (m_nStart) {
+        NvTrace::record(m_szName, m_nStart, NvMetrics::now(), m_nStream, m_nPicture);
+        m_nStart = 0;
+    }
+}
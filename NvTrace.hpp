@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+/**
+* @brief One begin/end span. szName must outlive the trace (string literals, stage names).
+*/
+struct NvTraceEvent {
+    const char *szName;
+    uint64_t nBeginNs;      // NvMetrics::now() clock
+    uint64_t nEndNs;
+    int32_t nStream;        // -1 if not tied to a stream
+    int32_t nPicture;       // parser picture index, -1 if not tied to a picture
+    uint32_t nThread;       // NvTrace thread id, see setThreadName()
+};
+
+/**
+* @brief Optional timeline of the decode pipeline, dumped in the Chrome trace event format (chrome://tracing,
+* ui.perfetto.dev). Off by default. Each thread appends to a ring buffer of its own, so recording takes no
+* lock; when a ring is full the oldest events of that thread are overwritten and counted as dropped.
+*/
+class NvTrace {
+public:
+    /**
+    *   @brief  Discard what was recorded and start tracing. nEventsPerThread sizes the rings of threads
+    *   that record their first event from now on; rings that already exist keep their size.
+    */
+    static void start(size_t nEventsPerThread = 65536);
+    static void stop();
+    static bool isEnabled();
+
+    static void record(const char *szName, uint64_t nBeginNs, uint64_t nEndNs, int nStream = -1, int nPicture = -1);
+
+    /**
+    *   @brief  Label the calling thread in the dump, e.g. "demux" or "postproc 1"
+    */
+    static void setThreadName(const char *szName);
+
+    /**
+    *   @brief  Process-wide unique id to tag the events of one stream with
+    */
+    static int newStreamId();
+
+    /**
+    *   @brief  Events recorded since start() as Chrome trace JSON, timestamps relative to start().
+    *   May be called while tracing; events overwritten during the dump are left out.
+    */
+    static std::string toChromeTrace();
+    static bool writeChromeTrace(const char *szPath);
+
+    /**
+    *   @brief  Events lost to full rings since start()
+    */
+    static uint64_t getNumDropped();
+};
+
+/**
+* @brief Records one event spanning construction to stop() or destruction, if tracing was on at construction
+*/
+class NvTraceScope {
+public:
+    NvTraceScope(const char *szName, int nStream = -1, int nPicture = -1);
+    ~NvTraceScope() { stop(); }
+
+    void stop();
+
+private:
+    const char *m_szName;
+    int m_nStream;
+    int m_nPicture;
+    uint64_t m_nStart;
+};
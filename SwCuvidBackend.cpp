@@ -0,0 +1,447 @@
+#include "SwCuvidBackend.hpp"
+
+extern "C" {
+#include <libavutil/mem.h>
+}
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+// NVDEC hands out surfaces with a pitch aligned to at least 256 bytes; keep the same so pitch handling matches
+#define SW_SURFACE_PITCH_ALIGN 256
+
+static inline unsigned int alignUp(unsigned int n, unsigned int a) { return (n + a - 1) / a * a; }
+
+AVCodecID SwCuvidBackend::getAVCodecId(cudaVideoCodec eCodec)
+{
+    switch (eCodec) {
+    case cudaVideoCodec_MPEG1: return AV_CODEC_ID_MPEG1VIDEO;
+    case cudaVideoCodec_MPEG2: return AV_CODEC_ID_MPEG2VIDEO;
+    case cudaVideoCodec_MPEG4: return AV_CODEC_ID_MPEG4;
+    case cudaVideoCodec_VC1:   return AV_CODEC_ID_VC1;
+    case cudaVideoCodec_H264:  return AV_CODEC_ID_H264;
+    case cudaVideoCodec_JPEG:  return AV_CODEC_ID_MJPEG;
+    case cudaVideoCodec_HEVC:  return AV_CODEC_ID_HEVC;
+    case cudaVideoCodec_VP8:   return AV_CODEC_ID_VP8;
+    case cudaVideoCodec_VP9:   return AV_CODEC_ID_VP9;
+    default:                   return AV_CODEC_ID_NONE;
+    }
+}
+
+static AVPixelFormat getSurfacePixelFormat(cudaVideoSurfaceFormat eOutputFormat)
+{
+    switch (eOutputFormat) {
+    case cudaVideoSurfaceFormat_P016:         return AV_PIX_FMT_P016LE;
+    case cudaVideoSurfaceFormat_YUV444:       return AV_PIX_FMT_YUV444P;
+    case cudaVideoSurfaceFormat_YUV444_16Bit: return AV_PIX_FMT_YUV444P16LE;
+    default:                                  return AV_PIX_FMT_NV12;
+    }
+}
+
+SwCuvidBackend::~SwCuvidBackend()
+{
+    destroyDecoder((CUvideodecoder)this);
+    destroyVideoParser((CUvideoparser)this);
+}
+
+void SwCuvidBackend::setSkipPictures(bool bNonIntra, bool bNonRef)
+{
+    // libavcodec then never reconstructs them, which is where all the time goes
+    m_eSkipFrame = bNonIntra ? AVDISCARD_NONINTRA : (bNonRef ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+    if (m_avctx) {
+        m_avctx->skip_frame = m_eSkipFrame;
+    }
+}
+
+CUresult SwCuvidBackend::createVideoParser(CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams)
+{
+    if (m_avctx) {
+        // one parser per backend instance
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    const AVCodec *codec = avcodec_find_decoder(getAVCodecId(pParams->CodecType));
+    if (!codec) {
+        return CUDA_ERROR_NOT_SUPPORTED;
+    }
+    m_avctx = avcodec_alloc_context3(codec);
+    if (!m_avctx) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    m_avctx->thread_count = m_nThreads;
+    m_avctx->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (pParams->ulMaxDisplayDelay == 0) {
+        // low latency: frame threads hold a frame each and B-frame reordering is only added once seen
+        m_avctx->thread_type = FF_THREAD_SLICE;
+        m_avctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    }
+    // the parser callbacks carry the caller's timestamps through untouched
+    m_avctx->pkt_timebase = AVRational{1, 10000000};
+    m_avctx->skip_frame   = m_eSkipFrame;
+    if (avcodec_open2(m_avctx, codec, NULL) < 0) {
+        avcodec_free_context(&m_avctx);
+        return CUDA_ERROR_NOT_SUPPORTED;
+    }
+    m_pkt   = av_packet_alloc();
+    m_frame = av_frame_alloc();
+
+    m_parserParams = *pParams;
+    m_bVideoFormatValid = false;
+    m_iNextSurface = 0;
+    *pObj = (CUvideoparser)this;
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::destroyVideoParser(CUvideoparser obj)
+{
+    av_frame_free(&m_frame);
+    av_packet_free(&m_pkt);
+    avcodec_free_context(&m_avctx);
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::parseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket)
+{
+    if (!m_avctx) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    int e = 0;
+    if (pPacket->payload && pPacket->payload_size) {
+        // not refcounted: libavcodec takes its own padded copy
+        m_pkt->data = (uint8_t *)pPacket->payload;
+        m_pkt->size = (int)pPacket->payload_size;
+        m_pkt->pts  = (pPacket->flags & CUVID_PKT_TIMESTAMP) ? pPacket->timestamp : AV_NOPTS_VALUE;
+        e = avcodec_send_packet(m_avctx, m_pkt);
+        m_pkt->data = NULL;
+        m_pkt->size = 0;
+        if (e < 0) {
+            // like the cuvid parser, skip what cannot be parsed and keep going
+            char err[64] = {0};
+            av_strerror(e, err, sizeof(err));
+            __E("SwCuvidBackend: avcodec_send_packet: %s\n", err);
+        }
+    }
+    if (pPacket->flags & CUVID_PKT_ENDOFSTREAM) {
+        avcodec_send_packet(m_avctx, NULL);
+    }
+
+    while ((e = avcodec_receive_frame(m_avctx, m_frame)) >= 0) {
+        CUresult result = deliverFrame(m_frame);
+        av_frame_unref(m_frame);
+        if (result != CUDA_SUCCESS) {
+            return result;
+        }
+    }
+    if (e == AVERROR_EOF) {
+        // cuvid keeps accepting data after end of stream, so reopen the codec for the next packet
+        avcodec_flush_buffers(m_avctx);
+    }
+    return CUDA_SUCCESS;
+}
+
+void SwCuvidBackend::fillVideoFormat(AVFrame *pFrame, CUVIDEOFORMAT *pVideoFormat)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)pFrame->format);
+
+    *pVideoFormat = {};
+    pVideoFormat->codec = m_parserParams.CodecType;
+    pVideoFormat->frame_rate.numerator   = m_avctx->framerate.num > 0 ? m_avctx->framerate.num : 0;
+    pVideoFormat->frame_rate.denominator = m_avctx->framerate.num > 0 ? m_avctx->framerate.den : 0;
+    // libavcodec outputs whole frames, nothing is left for the deinterlacer
+    pVideoFormat->progressive_sequence   = 1;
+    pVideoFormat->bit_depth_luma_minus8   = desc ? desc->comp[0].depth - 8 : 0;
+    pVideoFormat->bit_depth_chroma_minus8 = pVideoFormat->bit_depth_luma_minus8;
+    // surfaces are only staging for post-processing, reference frames stay inside libavcodec
+    pVideoFormat->min_num_decode_surfaces = 2;
+
+    // frames come out already cropped, so the coded size is the display size rounded to chroma alignment
+    pVideoFormat->coded_width  = alignUp(pFrame->width, 2);
+    pVideoFormat->coded_height = alignUp(pFrame->height, 2);
+    pVideoFormat->display_area.left   = 0;
+    pVideoFormat->display_area.top    = 0;
+    pVideoFormat->display_area.right  = pFrame->width;
+    pVideoFormat->display_area.bottom = pFrame->height;
+
+    if (!desc || desc->nb_components < 3) {
+        pVideoFormat->chroma_format = cudaVideoChromaFormat_Monochrome;
+    } else if (desc->log2_chroma_w == 0 && desc->log2_chroma_h == 0) {
+        pVideoFormat->chroma_format = cudaVideoChromaFormat_444;
+    } else if (desc->log2_chroma_h == 0) {
+        pVideoFormat->chroma_format = cudaVideoChromaFormat_422;
+    } else {
+        pVideoFormat->chroma_format = cudaVideoChromaFormat_420;
+    }
+
+    pVideoFormat->bitrate = (unsigned int)m_avctx->bit_rate;
+    pVideoFormat->display_aspect_ratio.x = pFrame->width;
+    pVideoFormat->display_aspect_ratio.y = pFrame->height;
+    pVideoFormat->video_signal_description.video_format          = 5;
+    pVideoFormat->video_signal_description.video_full_range_flag = pFrame->color_range == AVCOL_RANGE_JPEG;
+    pVideoFormat->video_signal_description.color_primaries          = pFrame->color_primaries;
+    pVideoFormat->video_signal_description.transfer_characteristics = pFrame->color_trc;
+    pVideoFormat->video_signal_description.matrix_coefficients      = pFrame->colorspace;
+}
+
+/* Replay one decoded frame through the parser callbacks: sequence (on change), decode, display */
+CUresult SwCuvidBackend::deliverFrame(AVFrame *pFrame)
+{
+    CUVIDEOFORMAT videoFormat;
+    fillVideoFormat(pFrame, &videoFormat);
+
+    if (!m_bVideoFormatValid ||
+        videoFormat.coded_width             != m_videoFormat.coded_width ||
+        videoFormat.coded_height            != m_videoFormat.coded_height ||
+        videoFormat.chroma_format           != m_videoFormat.chroma_format ||
+        videoFormat.bit_depth_luma_minus8   != m_videoFormat.bit_depth_luma_minus8)
+    {
+        m_videoFormat = videoFormat;
+        m_bVideoFormatValid = true;
+        if (!m_parserParams.pfnSequenceCallback(m_parserParams.pUserData, &videoFormat)) {
+            return CUDA_ERROR_UNKNOWN;
+        }
+    }
+
+    if (m_vpSurface.empty()) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    CUVIDPICPARAMS picParams = {};
+    picParams.PicWidthInMbs    = (videoFormat.coded_width + 15) >> 4;
+    picParams.FrameHeightInMbs = (videoFormat.coded_height + 15) >> 4;
+    picParams.CurrPicIdx       = m_iNextSurface;
+    picParams.intra_pic_flag   = pFrame->pict_type == AV_PICTURE_TYPE_I;
+    picParams.ref_pic_flag     = pFrame->pict_type != AV_PICTURE_TYPE_B;
+    m_iNextSurface = (m_iNextSurface + 1) % (int)m_vpSurface.size();
+
+    m_pPendingFrame = pFrame;
+    int ret = m_parserParams.pfnDecodePicture(m_parserParams.pUserData, &picParams);
+    m_pPendingFrame = NULL;
+    if (!ret) {
+        return CUDA_ERROR_UNKNOWN;
+    }
+
+    CUVIDPARSERDISPINFO dispInfo = {};
+    dispInfo.picture_index     = picParams.CurrPicIdx;
+    dispInfo.progressive_frame = 1;
+    dispInfo.top_field_first   = 1;
+    dispInfo.timestamp         = pFrame->best_effort_timestamp != AV_NOPTS_VALUE ? pFrame->best_effort_timestamp
+                                                                                 : pFrame->pts;
+    if (!m_parserParams.pfnDisplayPicture(m_parserParams.pUserData, &dispInfo)) {
+        return CUDA_ERROR_UNKNOWN;
+    }
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::getDecoderCaps(CUVIDDECODECAPS *pdc)
+{
+    pdc->bIsSupported = getAVCodecId(pdc->eCodecType) != AV_CODEC_ID_NONE &&
+                        avcodec_find_decoder(getAVCodecId(pdc->eCodecType)) != NULL &&
+                        pdc->nBitDepthMinus8 <= 4;
+    pdc->nOutputFormatMask = (1U << cudaVideoSurfaceFormat_NV12) | (1U << cudaVideoSurfaceFormat_P016) |
+                             (1U << cudaVideoSurfaceFormat_YUV444) | (1U << cudaVideoSurfaceFormat_YUV444_16Bit);
+    pdc->nMaxWidth   = 8192;
+    pdc->nMaxHeight  = 8192;
+    pdc->nMaxMBCount = (8192 / 16) * (8192 / 16);
+    pdc->nMinWidth   = 16;
+    pdc->nMinHeight  = 16;
+    return CUDA_SUCCESS;
+}
+
+void SwCuvidBackend::allocSurfaces()
+{
+    freeSurfaces();
+
+    int nBPP = m_createInfo.bitDepthMinus8 ? 2 : 1;
+    m_nSurfacePitch = alignUp((unsigned int)m_createInfo.ulTargetWidth * nBPP, SW_SURFACE_PITCH_ALIGN);
+    switch (m_createInfo.OutputFormat) {
+    case cudaVideoSurfaceFormat_YUV444:
+    case cudaVideoSurfaceFormat_YUV444_16Bit:
+        m_nSurfaceRows = (int)m_createInfo.ulTargetHeight * 3;
+        break;
+    default:
+        m_nSurfaceRows = (int)m_createInfo.ulTargetHeight + ((int)m_createInfo.ulTargetHeight + 1) / 2;
+    }
+
+    for (unsigned long i = 0; i < m_createInfo.ulNumDecodeSurfaces; i++) {
+        m_vpSurface.push_back((uint8_t *)av_malloc((size_t)m_nSurfacePitch * m_nSurfaceRows));
+        m_vDecodeStatus.push_back(cuvidDecodeStatus_Invalid);
+    }
+    m_iNextSurface = 0;
+}
+
+void SwCuvidBackend::freeSurfaces()
+{
+    for (uint8_t *pSurface : m_vpSurface) {
+        av_free(pSurface);
+    }
+    m_vpSurface.clear();
+    m_vDecodeStatus.clear();
+}
+
+CUresult SwCuvidBackend::createDecoder(CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci)
+{
+    if (m_bDecoderCreated) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (!pdci->ulTargetWidth || !pdci->ulTargetHeight || !pdci->ulNumDecodeSurfaces) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    m_createInfo = *pdci;
+    allocSurfaces();
+    m_bDecoderCreated = true;
+    *phDecoder = (CUvideodecoder)this;
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::reconfigureDecoder(CUvideodecoder hDecoder, CUVIDRECONFIGUREDECODERINFO *pDecReconfigParams)
+{
+    if (!m_bDecoderCreated) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+    if (pDecReconfigParams->ulWidth > m_createInfo.ulMaxWidth ||
+        pDecReconfigParams->ulHeight > m_createInfo.ulMaxHeight) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    m_createInfo.ulWidth             = pDecReconfigParams->ulWidth;
+    m_createInfo.ulHeight            = pDecReconfigParams->ulHeight;
+    m_createInfo.ulTargetWidth       = pDecReconfigParams->ulTargetWidth;
+    m_createInfo.ulTargetHeight      = pDecReconfigParams->ulTargetHeight;
+    m_createInfo.ulNumDecodeSurfaces = pDecReconfigParams->ulNumDecodeSurfaces;
+    m_createInfo.display_area.left   = pDecReconfigParams->display_area.left;
+    m_createInfo.display_area.top    = pDecReconfigParams->display_area.top;
+    m_createInfo.display_area.right  = pDecReconfigParams->display_area.right;
+    m_createInfo.display_area.bottom = pDecReconfigParams->display_area.bottom;
+    allocSurfaces();
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::destroyDecoder(CUvideodecoder hDecoder)
+{
+    freeSurfaces();
+    sws_freeContext(m_sws);
+    m_sws = NULL;
+    m_bDecoderCreated = false;
+    return CUDA_SUCCESS;
+}
+
+/* Crop display_area out of the pending frame and scale it into surface CurrPicIdx */
+CUresult SwCuvidBackend::decodePicture(CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams)
+{
+    AVFrame *pFrame = m_pPendingFrame;
+    int iSurface = pPicParams->CurrPicIdx;
+    if (!pFrame || iSurface < 0 || iSurface >= (int)m_vpSurface.size()) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)pFrame->format);
+    int left   = m_createInfo.display_area.left;
+    int top    = m_createInfo.display_area.top;
+    int right  = m_createInfo.display_area.right  ? m_createInfo.display_area.right  : pFrame->width;
+    int bottom = m_createInfo.display_area.bottom ? m_createInfo.display_area.bottom : pFrame->height;
+    right  = std::min(right, pFrame->width);
+    bottom = std::min(bottom, pFrame->height);
+    if (right <= left || bottom <= top) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    const uint8_t *apSrc[4] = {};
+    int anSrcStride[4] = {};
+    for (int i = 0; i < 4 && pFrame->data[i]; i++) {
+        int nShiftW = (i == 1 || i == 2) ? desc->log2_chroma_w : 0;
+        int nShiftH = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        int nBytes  = (desc->comp[0].depth + 7) / 8;
+        apSrc[i] = pFrame->data[i] + (top >> nShiftH) * pFrame->linesize[i] + (left >> nShiftW) * nBytes;
+        anSrcStride[i] = pFrame->linesize[i];
+    }
+
+    int nTargetHeight = (int)m_createInfo.ulTargetHeight;
+    uint8_t *pSurface = m_vpSurface[iSurface];
+    uint8_t *apDst[4] = { pSurface, pSurface + (size_t)m_nSurfacePitch * nTargetHeight,
+                          pSurface + (size_t)m_nSurfacePitch * nTargetHeight * 2, NULL };
+    int anDstStride[4] = { (int)m_nSurfacePitch, (int)m_nSurfacePitch, (int)m_nSurfacePitch, 0 };
+
+    m_sws = sws_getCachedContext(m_sws,
+                                 right - left, bottom - top, (AVPixelFormat)pFrame->format,
+                                 (int)m_createInfo.ulTargetWidth, nTargetHeight,
+                                 getSurfacePixelFormat(m_createInfo.OutputFormat),
+                                 SWS_BILINEAR, NULL, NULL, NULL);
+    if (!m_sws) {
+        return CUDA_ERROR_NOT_SUPPORTED;
+    }
+    sws_scale(m_sws, apSrc, anSrcStride, 0, bottom - top, apDst, anDstStride);
+
+    m_vDecodeStatus[iSurface] = pFrame->decode_error_flags ? cuvidDecodeStatus_Error_Concealed
+                                                           : cuvidDecodeStatus_Success;
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::getDecodeStatus(CUvideodecoder hDecoder, int nPicIdx, CUVIDGETDECODESTATUS *pDecodeStatus)
+{
+    if (nPicIdx < 0 || nPicIdx >= (int)m_vDecodeStatus.size()) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pDecodeStatus->decodeStatus = m_vDecodeStatus[nPicIdx];
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::mapVideoFrame(CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr,
+                                       unsigned int *pPitch, CUVIDPROCPARAMS *pVPP)
+{
+    if (nPicIdx < 0 || nPicIdx >= (int)m_vpSurface.size()) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    *pDevPtr = (CUdeviceptr)m_vpSurface[nPicIdx];
+    *pPitch  = m_nSurfacePitch;
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::unmapVideoFrame(CUvideodecoder hDecoder, CUdeviceptr devPtr)
+{
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::memAlloc(CUdeviceptr *pDptr, size_t nBytes)
+{
+    void *p = av_malloc(nBytes);
+    if (!p) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    *pDptr = (CUdeviceptr)p;
+    return CUDA_SUCCESS;
+}
+
+CUresult SwCuvidBackend::memAllocPitch(CUdeviceptr *pDptr, size_t *pPitch, size_t nWidthInBytes, size_t nHeight,
+                                       unsigned int nElementSizeBytes)
+{
+    *pPitch = alignUp((unsigned int)nWidthInBytes, SW_SURFACE_PITCH_ALIGN);
+    return memAlloc(pDptr, *pPitch * nHeight);
+}
+
+CUresult SwCuvidBackend::memFree(CUdeviceptr dptr)
+{
+    av_free((void *)dptr);
+    return CUDA_SUCCESS;
+}
+
+/* Every "device" pointer of this backend is host memory, so both sides are plain row copies */
+CUresult SwCuvidBackend::memcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream stream)
+{
+    const uint8_t *pSrc = pCopy->srcMemoryType == CU_MEMORYTYPE_HOST ? (const uint8_t *)pCopy->srcHost
+                                                                     : (const uint8_t *)pCopy->srcDevice;
+    uint8_t *pDst = pCopy->dstMemoryType == CU_MEMORYTYPE_HOST ? (uint8_t *)pCopy->dstHost
+                                                               : (uint8_t *)pCopy->dstDevice;
+    if (!pSrc || !pDst) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pSrc += pCopy->srcY * pCopy->srcPitch + pCopy->srcXInBytes;
+    pDst += pCopy->dstY * pCopy->dstPitch + pCopy->dstXInBytes;
+
+    if (pCopy->srcPitch == pCopy->WidthInBytes && pCopy->dstPitch == pCopy->WidthInBytes) {
+        memcpy(pDst, pSrc, pCopy->WidthInBytes * pCopy->Height);
+        return CUDA_SUCCESS;
+    }
+    for (size_t y = 0; y < pCopy->Height; y++) {
+        memcpy(pDst + y * pCopy->dstPitch, pSrc + y * pCopy->srcPitch, pCopy->WidthInBytes);
+    }
+    return CUDA_SUCCESS;
+}
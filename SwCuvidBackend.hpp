@@ -0,0 +1,102 @@
+#pragma once
+
+#include "NvDecoderBackend.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+/**
+* @brief Software backend: libavcodec decodes, libswscale crops/resizes into NV12/P016/YUV444 surfaces that
+* live in host memory with the same layout NVDEC maps (pitch aligned, chroma at pitch * ulTargetHeight).
+* It emulates the cuvid parser: every decoded frame raises the sequence callback on a format change, then
+* the decode callback (which fills surface CurrPicIdx) and the display callback, in that order.
+* libavcodec already reorders, so display order equals output order and no display delay is added.
+* A parser created with ulMaxDisplayDelay 0 decodes with slice threads only and AV_CODEC_FLAG_LOW_DELAY,
+* so streams without B-frames are not held back for reordering.
+* One instance serves exactly one NvDecoder.
+*/
+class SwCuvidBackend : public NvDecoderBackend {
+public:
+    /**
+    *   @param  nThreads - libavcodec decode threads, 0 lets libavcodec pick
+    */
+    SwCuvidBackend(int nThreads = 0) : m_nThreads(nThreads) {}
+    ~SwCuvidBackend();
+
+    const char *getName() { return "libavcodec"; }
+    bool isHostSurface() { return true; }
+    void setSkipPictures(bool bNonIntra, bool bNonRef);
+
+    CUresult createVideoParser(CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams);
+    CUresult parseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket);
+    CUresult destroyVideoParser(CUvideoparser obj);
+
+    CUresult getDecoderCaps(CUVIDDECODECAPS *pdc);
+    CUresult createDecoder(CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci);
+    CUresult reconfigureDecoder(CUvideodecoder hDecoder, CUVIDRECONFIGUREDECODERINFO *pDecReconfigParams);
+    CUresult destroyDecoder(CUvideodecoder hDecoder);
+    CUresult decodePicture(CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams);
+    CUresult getDecodeStatus(CUvideodecoder hDecoder, int nPicIdx, CUVIDGETDECODESTATUS *pDecodeStatus);
+    CUresult mapVideoFrame(CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr,
+                           unsigned int *pPitch, CUVIDPROCPARAMS *pVPP);
+    CUresult unmapVideoFrame(CUvideodecoder hDecoder, CUdeviceptr devPtr);
+
+    CUresult ctxLockCreate(CUvideoctxlock *pLock, CUcontext ctx) { *pLock = NULL; return CUDA_SUCCESS; }
+    CUresult ctxLockDestroy(CUvideoctxlock lck) { return CUDA_SUCCESS; }
+    CUresult ctxPushCurrent(CUcontext ctx) { return CUDA_SUCCESS; }
+    CUresult ctxPopCurrent() { return CUDA_SUCCESS; }
+    CUresult ctxBind(CUcontext ctx) { return CUDA_SUCCESS; }
+    CUresult ctxUnbind() { return CUDA_SUCCESS; }
+
+    CUresult memAlloc(CUdeviceptr *pDptr, size_t nBytes);
+    CUresult memAllocPitch(CUdeviceptr *pDptr, size_t *pPitch, size_t nWidthInBytes, size_t nHeight,
+                           unsigned int nElementSizeBytes);
+    CUresult memFree(CUdeviceptr dptr);
+    CUresult memcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream stream);
+    // host memory is all there is, nothing to page-lock
+    CUresult memAllocHost(void **pp, size_t nBytes) { return memAlloc((CUdeviceptr *)pp, nBytes); }
+    CUresult memFreeHost(void *p) { return memFree((CUdeviceptr)p); }
+
+    // work is done synchronously on the calling thread, streams and events are null handles
+    CUresult streamCreate(CUstream *pStream, unsigned int flags) { *pStream = NULL; return CUDA_SUCCESS; }
+    CUresult streamDestroy(CUstream stream) { return CUDA_SUCCESS; }
+    CUresult streamSynchronize(CUstream stream) { return CUDA_SUCCESS; }
+    CUresult eventCreate(CUevent *pEvent, unsigned int flags) { *pEvent = NULL; return CUDA_SUCCESS; }
+    CUresult eventDestroy(CUevent event) { return CUDA_SUCCESS; }
+    CUresult eventRecord(CUevent event, CUstream stream) { return CUDA_SUCCESS; }
+    CUresult eventSynchronize(CUevent event) { return CUDA_SUCCESS; }
+    CUresult eventQuery(CUevent event) { return CUDA_SUCCESS; }
+
+    static AVCodecID getAVCodecId(cudaVideoCodec eCodec);
+
+private:
+    CUresult deliverFrame(AVFrame *pFrame);
+    void fillVideoFormat(AVFrame *pFrame, CUVIDEOFORMAT *pVideoFormat);
+    void allocSurfaces();
+    void freeSurfaces();
+
+    int m_nThreads = 0;
+
+    // parser
+    CUVIDPARSERPARAMS m_parserParams = {};
+    AVCodecContext *m_avctx = NULL;
+    AVPacket *m_pkt = NULL;
+    AVFrame *m_frame = NULL;
+    AVFrame *m_pPendingFrame = NULL; // frame pfnDecodePicture is being called for
+    AVDiscard m_eSkipFrame = AVDISCARD_DEFAULT;
+    CUVIDEOFORMAT m_videoFormat = {};
+    bool m_bVideoFormatValid = false;
+    int m_iNextSurface = 0;
+
+    // decoder
+    CUVIDDECODECREATEINFO m_createInfo = {};
+    bool m_bDecoderCreated = false;
+    std::vector<uint8_t *> m_vpSurface;
+    std::vector<cuvidDecodeStatus> m_vDecodeStatus;
+    unsigned int m_nSurfacePitch = 0;
+    int m_nSurfaceRows = 0;
+    SwsContext *m_sws = NULL;
+};
@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FFmpegDemuxer.hpp"
+#include "NvDecoder.hpp"
+#include "SwCuvidBackend.hpp"
+#include "NvMetrics.hpp"
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+/* Decode benchmark. Prints one JSON document (or writes it to -o) for regression tracking:
+*  per output format the open/session-init time, fps, per-frame latency percentiles and bytes moved
+*  per frame, then aggregate throughput for 1, 2, 4 ... N concurrent streams, each decoded on a thread
+*  of its own, and the NvMetrics stage histograms of the whole run.
+*  --backend sw decodes with libavcodec through SwCuvidBackend and --backend demux only demuxes, so the
+*  numbers can be tracked on hosts without a GPU.
+*/
+
+enum BenchBackend {
+    BENCH_NVDEC,
+    BENCH_SW,
+    BENCH_DEMUX,
+};
+
+struct BenchOptions {
+    std::string strInput;
+    std::string strOutput;
+    BenchBackend eBackend = BENCH_NVDEC;
+    int iGpu = 0;
+    int nMaxStreams = 4;
+    int nSwThreads = 1;
+    int nMaxFrames = 0;     // per stream, 0 decodes the whole input
+    int nPrefetch = 0;      // read-ahead ring depth in packets, 0 demuxes on the decode thread
+    bool bLowLatency = false;
+    bool bCheckPrepare = false; // decode cold and after prepareSession(), compare the output
+    std::vector<int> vFormat;
+};
+
+struct StreamResult {
+    double fOpenMs = 0;         // demuxer open, container probing included
+    double fSessionMs = 0;      // decoder construction and session creation
+    double fFirstFrameMs = 0;   // from the first packet to the first output frame
+    double fWallMs = 0;         // demux + decode of the whole stream
+    uint64_t nPackets = 0;
+    uint64_t nFrames = 0;
+    uint64_t nBitstreamBytes = 0;
+    uint64_t nOutputBytes = 0;
+    uint64_t nDemuxStalls = 0;      // demux() waited on an empty read-ahead ring
+    double fDemuxStallMs = 0;
+    std::vector<double> vLatencyMs; // per frame: packet submitted to frame returned
+};
+
+static const char *s_aszFormat[NvDecoder::IMAGE_FORMAT_MAX + 1] = {
+    "unchanged", "yuv", "y", "rgb", "bgr", "rgbi", "bgri", "nv12",
+};
+
+static const char *s_aszBackend[] = { "nvdec", "sw", "demux" };
+
+static double toMs(uint64_t nNs)
+{
+    return nNs / 1e6;
+}
+
+static double getPercentile(std::vector<double> v, double fPercentile)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(fPercentile / 100.0 * (v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static bool getCudaCodec(AVCodecID eCodec, cudaVideoCodec *peCodec)
+{
+    switch (eCodec) {
+    case AV_CODEC_ID_MPEG1VIDEO: *peCodec = cudaVideoCodec_MPEG1; return true;
+    case AV_CODEC_ID_MPEG2VIDEO: *peCodec = cudaVideoCodec_MPEG2; return true;
+    case AV_CODEC_ID_MPEG4:      *peCodec = cudaVideoCodec_MPEG4; return true;
+    case AV_CODEC_ID_VC1:        *peCodec = cudaVideoCodec_VC1;   return true;
+    case AV_CODEC_ID_H264:       *peCodec = cudaVideoCodec_H264;  return true;
+    case AV_CODEC_ID_HEVC:       *peCodec = cudaVideoCodec_HEVC;  return true;
+    case AV_CODEC_ID_VP8:        *peCodec = cudaVideoCodec_VP8;   return true;
+    case AV_CODEC_ID_VP9:        *peCodec = cudaVideoCodec_VP9;   return true;
+    case AV_CODEC_ID_MJPEG:      *peCodec = cudaVideoCodec_JPEG;  return true;
+    default:                     return false;
+    }
+}
+
+static void startPrefetch(const BenchOptions &opt, FFmpegDemuxer &demuxer)
+{
+    if (opt.nPrefetch) {
+        demuxer.startPrefetch(opt.nPrefetch);
+    }
+}
+
+static void getPrefetchStats(FFmpegDemuxer &demuxer, StreamResult *pResult)
+{
+    FFmpegDemuxer::PrefetchStats stats = demuxer.getPrefetchStats();
+    pResult->nDemuxStalls = stats.nConsumerStalls;
+    pResult->fDemuxStallMs = toMs(stats.nConsumerStallNs);
+}
+
+static void runDemux(const BenchOptions &opt, StreamResult *pResult)
+{
+    uint64_t nStart = NvMetrics::now();
+    FFmpegDemuxer demuxer(opt.strInput.c_str());
+    pResult->fOpenMs = toMs(NvMetrics::now() - nStart);
+
+    nStart = NvMetrics::now();
+    startPrefetch(opt, demuxer);
+    uint8_t *pVideo = NULL;
+    uint32_t nVideoBytes = 0;
+    while (!opt.nMaxFrames || pResult->nPackets < (uint64_t)opt.nMaxFrames) {
+        uint64_t nPacketStart = NvMetrics::now();
+        if (!demuxer.demux(&pVideo, &nVideoBytes) || !nVideoBytes) {
+            break;
+        }
+        pResult->vLatencyMs.push_back(toMs(NvMetrics::now() - nPacketStart));
+        pResult->nPackets++;
+        pResult->nFrames++;
+        pResult->nBitstreamBytes += nVideoBytes;
+    }
+    pResult->fWallMs = toMs(NvMetrics::now() - nStart);
+    getPrefetchStats(demuxer, pResult);
+}
+
+static void runDecode(const BenchOptions &opt, int format, StreamResult *pResult)
+{
+    uint64_t nStart = NvMetrics::now();
+    FFmpegDemuxer demuxer(opt.strInput.c_str());
+    pResult->fOpenMs = toMs(NvMetrics::now() - nStart);
+
+    cudaVideoCodec eCodec;
+    if (!getCudaCodec(demuxer.getVideoCodec(), &eCodec)) {
+        NVDEC_THROW_ERROR("Codec of the input is not supported", CUDA_ERROR_NOT_SUPPORTED);
+    }
+
+    nStart = NvMetrics::now();
+    std::unique_ptr<NvDecoder> pDecoder(opt.eBackend == BENCH_SW ? new NvDecoder(new SwCuvidBackend(opt.nSwThreads))
+                                                                 : new NvDecoder((uint16_t)opt.iGpu));
+    pDecoder->oformat = (NvDecoder::ImageFormat_t)format;
+    if (eCodec != cudaVideoCodec_H264) {
+        pDecoder->reset(eCodec);
+    }
+    pDecoder->setLowLatency(opt.bLowLatency);
+    NvStreamInfo info;
+    if (demuxer.getStreamInfo(&info)) {
+        pDecoder->prepareSession(eCodec, info);
+    } else {
+        pDecoder->prepareSession(eCodec, demuxer.getWidth(), demuxer.getHeight(),
+                                 cudaVideoChromaFormat_420, demuxer.getBitDepth() - 8);
+    }
+    pResult->fSessionMs = toMs(NvMetrics::now() - nStart);
+
+    // frames are declared after the decoder, so they go back to its pool before it is destroyed
+    std::vector<NvFrame> vFrame;
+    uint8_t *pVideo = NULL;
+    uint32_t nVideoBytes = 0;
+    bool bEnd = false;
+    nStart = NvMetrics::now();
+    startPrefetch(opt, demuxer);
+    while (!bEnd) {
+        int64_t pts = 0;
+        bEnd = !demuxer.demux(&pVideo, &nVideoBytes, &pts) || !nVideoBytes ||
+               (opt.nMaxFrames && pResult->nFrames >= (uint64_t)opt.nMaxFrames);
+        uint32_t flags = 0;
+        if (bEnd) {
+            pVideo = NULL;
+            nVideoBytes = 0;
+        } else {
+            flags = demuxer.isKeyFrame() ? NvDecoder::PKT_KEYFRAME : 0;
+            pResult->nPackets++;
+            pResult->nBitstreamBytes += nVideoBytes;
+        }
+
+        vFrame.clear();
+        pDecoder->decode(pVideo, nVideoBytes, vFrame, flags, pts);
+        uint64_t nNow = NvMetrics::now();
+        for (NvFrame &frame : vFrame) {
+            if (!pResult->nFrames) {
+                pResult->fFirstFrameMs = toMs(nNow - nStart);
+            }
+            if (frame.latencyNs()) {
+                pResult->vLatencyMs.push_back(toMs(frame.latencyNs()));
+            }
+            pResult->nFrames++;
+            pResult->nOutputBytes += frame.size();
+        }
+    }
+    pResult->fWallMs = toMs(NvMetrics::now() - nStart);
+    getPrefetchStats(demuxer, pResult);
+}
+
+/* Frame count and FNV-1a hash of every frame's bytes, decoding on a decoder whose session is either
+   created by the first sequence header (bPrepare false) or ahead of it by prepareSession() */
+static void decodeChecksum(const BenchOptions &opt, int format, bool bPrepare, uint64_t *pnFrames, uint64_t *pnHash)
+{
+    FFmpegDemuxer demuxer(opt.strInput.c_str());
+    cudaVideoCodec eCodec;
+    if (!getCudaCodec(demuxer.getVideoCodec(), &eCodec)) {
+        NVDEC_THROW_ERROR("Codec of the input is not supported", CUDA_ERROR_NOT_SUPPORTED);
+    }
+    std::unique_ptr<NvDecoder> pDecoder(opt.eBackend == BENCH_SW ? new NvDecoder(new SwCuvidBackend(opt.nSwThreads))
+                                                                 : new NvDecoder((uint16_t)opt.iGpu));
+    pDecoder->oformat = (NvDecoder::ImageFormat_t)format;
+    if (eCodec != cudaVideoCodec_H264) {
+        pDecoder->reset(eCodec);
+    }
+    pDecoder->setLowLatency(opt.bLowLatency);
+    NvStreamInfo info;
+    if (bPrepare && demuxer.getStreamInfo(&info)) {
+        pDecoder->prepareSession(eCodec, info);
+    } else if (bPrepare) {
+        pDecoder->prepareSession(eCodec, demuxer.getWidth(), demuxer.getHeight(),
+                                 cudaVideoChromaFormat_420, demuxer.getBitDepth() - 8);
+    }
+
+    *pnFrames = 0;
+    *pnHash = 14695981039346656037ull;
+    std::vector<NvFrame> vFrame;
+    uint8_t *pVideo = NULL;
+    uint32_t nVideoBytes = 0;
+    bool bEnd = false;
+    uint64_t nPackets = 0;
+    while (!bEnd) {
+        int64_t pts = 0;
+        bEnd = !demuxer.demux(&pVideo, &nVideoBytes, &pts) || !nVideoBytes ||
+               (opt.nMaxFrames && nPackets >= (uint64_t)opt.nMaxFrames);
+        uint32_t flags = 0;
+        if (bEnd) {
+            pVideo = NULL;
+            nVideoBytes = 0;
+        } else {
+            flags = demuxer.isKeyFrame() ? NvDecoder::PKT_KEYFRAME : 0;
+            nPackets++;
+        }
+        vFrame.clear();
+        pDecoder->decode(pVideo, nVideoBytes, vFrame, flags, pts);
+        for (NvFrame &frame : vFrame) {
+            const uint8_t *p = frame.data();
+            for (size_t i = 0; i < frame.size(); i++) {
+                *pnHash = (*pnHash ^ p[i]) * 1099511628211ull;
+            }
+            (*pnFrames)++;
+        }
+    }
+}
+
+/* A session created by prepareSession() must decode exactly like one created by the stream's own
+   sequence header, which catches e.g. a parser left with too small a DPB on B-frame streams */
+static bool checkPrepareSession(const BenchOptions &opt, std::ostringstream &os)
+{
+    uint64_t nColdFrames = 0, nColdHash = 0, nFrames = 0, nHash = 0;
+    try {
+        decodeChecksum(opt, opt.vFormat[0], false, &nColdFrames, &nColdHash);
+        decodeChecksum(opt, opt.vFormat[0], true, &nFrames, &nHash);
+    } catch (std::exception &e) {
+        __E("prepare check: %s\n", e.what());
+        return false;
+    }
+    bool bMatch = nFrames == nColdFrames && nHash == nColdHash;
+    os << ",\"prepare_check\":{\"format\":\"" << s_aszFormat[opt.vFormat[0]] << "\""
+       << ",\"frames_cold\":" << nColdFrames
+       << ",\"frames_prepared\":" << nFrames
+       << ",\"match\":" << (bMatch ? "true" : "false") << "}";
+    if (!bMatch) {
+        __E("prepare check: %llu frames cold, %llu after prepareSession(), checksums %s\n",
+            (unsigned long long)nColdFrames, (unsigned long long)nFrames, nHash == nColdHash ? "equal" : "differ");
+    }
+    return bMatch;
+}
+
+static void runStream(const BenchOptions &opt, int format, StreamResult *pResult, std::string *pError)
+{
+    try {
+        if (opt.eBackend == BENCH_DEMUX) {
+            runDemux(opt, pResult);
+        } else {
+            runDecode(opt, format, pResult);
+        }
+    } catch (std::exception &e) {
+        *pError = e.what();
+    }
+}
+
+/* nStreams concurrent streams, one thread each. Returns false and sets strError if any of them failed. */
+static bool runStreams(const BenchOptions &opt, int format, int nStreams, std::vector<StreamResult> &vResult,
+                       std::string &strError)
+{
+    vResult.assign(nStreams, StreamResult());
+    std::vector<std::string> vError(nStreams);
+    std::vector<std::thread> vThread;
+    for (int i = 0; i < nStreams; i++) {
+        vThread.emplace_back(runStream, std::cref(opt), format, &vResult[i], &vError[i]);
+    }
+    for (auto &thread : vThread) {
+        thread.join();
+    }
+    for (auto &error : vError) {
+        if (!error.empty()) {
+            strError = error;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void appendFormatJson(std::ostringstream &os, const char *szFormat, const StreamResult &r)
+{
+    double fFrames = (double)std::max(r.nFrames, (uint64_t)1);
+    os << "{\"format\":\"" << szFormat << "\""
+       << ",\"frames\":" << r.nFrames
+       << ",\"open_ms\":" << r.fOpenMs
+       << ",\"session_init_ms\":" << r.fSessionMs
+       << ",\"first_frame_ms\":" << r.fFirstFrameMs
+       << ",\"fps\":" << (r.fWallMs > 0 ? r.nFrames * 1000.0 / r.fWallMs : 0)
+       << ",\"latency_p50_ms\":" << getPercentile(r.vLatencyMs, 50)
+       << ",\"latency_p99_ms\":" << getPercentile(r.vLatencyMs, 99)
+       << ",\"bitstream_bytes_per_frame\":" << r.nBitstreamBytes / fFrames
+       << ",\"output_bytes_per_frame\":" << r.nOutputBytes / fFrames
+       << ",\"demux_stalls\":" << r.nDemuxStalls
+       << ",\"demux_stall_ms\":" << r.fDemuxStallMs
+       << "}";
+}
+
+static void appendScalingJson(std::ostringstream &os, int nStreams, const std::vector<StreamResult> &vResult)
+{
+    uint64_t nFrames = 0;
+    double fWallMs = 0;
+    std::vector<double> vLatencyMs;
+    for (auto &r : vResult) {
+        nFrames += r.nFrames;
+        fWallMs = std::max(fWallMs, r.fWallMs);
+        vLatencyMs.insert(vLatencyMs.end(), r.vLatencyMs.begin(), r.vLatencyMs.end());
+    }
+    double fFps = fWallMs > 0 ? nFrames * 1000.0 / fWallMs : 0;
+    os << "{\"streams\":" << nStreams
+       << ",\"threads\":" << nStreams
+       << ",\"fps\":" << fFps
+       << ",\"fps_per_stream\":" << fFps / nStreams
+       << ",\"latency_p50_ms\":" << getPercentile(vLatencyMs, 50)
+       << ",\"latency_p99_ms\":" << getPercentile(vLatencyMs, 99)
+       << "}";
+}
+
+static int parseFormat(const char *szFormat)
+{
+    for (int i = 0; i <= NvDecoder::IMAGE_FORMAT_MAX; i++) {
+        if (!strcmp(szFormat, s_aszFormat[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void showHelpAndExit(const char *szBadOption = NULL)
+{
+    if (szBadOption) {
+        __E("Error parsing \"%s\"\n", szBadOption);
+    }
+    __E("Options:\n"
+        "-i             Input file path\n"
+        "-o             Output JSON file path, stdout if omitted\n"
+        "--backend      nvdec (default), sw (libavcodec, no GPU needed) or demux (no decoding)\n"
+        "--gpu          Ordinal of GPU to use (nvdec)\n"
+        "--streams      Concurrent streams of the scaling curve go 1, 2, 4 ... up to this (default 4)\n"
+        "--threads      libavcodec decode threads per stream (sw, default 1)\n"
+        "--frames       Frames per stream, 0 (default) decodes the whole input\n"
+        "--low-latency  Decode in live mode, see NvDecoder::setLowLatency()\n"
+        "--prefetch     Demux on a read-ahead thread with a ring of this many packets, see\n"
+        "               FFmpegDemuxer::startPrefetch() (default 0: demux on the decode thread)\n"
+        "--format       Output format to measure, repeatable: unchanged, yuv, y, rgb, bgr, rgbi, bgri, nv12;\n"
+        "               all of them if omitted. The scaling curve uses the first.\n"
+        "--check-prepare  Decode the first format with and without NvDecoder::prepareSession() first and\n"
+        "               fail unless frame count and checksum match\n");
+    exit(szBadOption ? 1 : 0);
+}
+
+static void parseCommandLine(int argc, char **argv, BenchOptions &opt)
+{
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h")) {
+            showHelpAndExit();
+        }
+        if (!strcmp(argv[i], "--low-latency")) {
+            opt.bLowLatency = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--check-prepare")) {
+            opt.bCheckPrepare = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            showHelpAndExit(argv[i]);
+        }
+        if (!strcmp(argv[i], "-i")) {
+            opt.strInput = argv[++i];
+        } else if (!strcmp(argv[i], "-o")) {
+            opt.strOutput = argv[++i];
+        } else if (!strcmp(argv[i], "--backend")) {
+            i++;
+            if (!strcmp(argv[i], "nvdec")) {
+                opt.eBackend = BENCH_NVDEC;
+            } else if (!strcmp(argv[i], "sw")) {
+                opt.eBackend = BENCH_SW;
+            } else if (!strcmp(argv[i], "demux")) {
+                opt.eBackend = BENCH_DEMUX;
+            } else {
+                showHelpAndExit(argv[i]);
+            }
+        } else if (!strcmp(argv[i], "--gpu")) {
+            opt.iGpu = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--streams")) {
+            opt.nMaxStreams = std::max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--threads")) {
+            opt.nSwThreads = std::max(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "--frames")) {
+            opt.nMaxFrames = std::max(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "--prefetch")) {
+            opt.nPrefetch = std::max(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "--format")) {
+            int format = parseFormat(argv[++i]);
+            if (format < 0) {
+                showHelpAndExit(argv[i]);
+            }
+            opt.vFormat.push_back(format);
+        } else {
+            showHelpAndExit(argv[i]);
+        }
+    }
+    if (opt.strInput.empty()) {
+        showHelpAndExit();
+    }
+    if (opt.vFormat.empty()) {
+        for (int i = 0; i <= NvDecoder::IMAGE_FORMAT_MAX; i++) {
+            opt.vFormat.push_back(i);
+        }
+    }
+    if (opt.eBackend == BENCH_DEMUX) {
+        // nothing is decoded, the demuxed packets are the output
+        opt.vFormat.resize(1);
+    }
+}
+
+static int runBench(const BenchOptions &opt)
+{
+    std::ostringstream os;
+    os << "{\"input\":\"" << opt.strInput << "\""
+       << ",\"backend\":\"" << s_aszBackend[opt.eBackend] << "\""
+       << ",\"decoder_threads\":" << opt.nSwThreads
+       << ",\"low_latency\":" << (opt.bLowLatency ? "true" : "false")
+       << ",\"prefetch_packets\":" << opt.nPrefetch;
+    {
+        FFmpegDemuxer demuxer(opt.strInput.c_str());
+        os << ",\"codec\":\"" << avcodec_get_name(demuxer.getVideoCodec()) << "\""
+           << ",\"width\":" << demuxer.getWidth()
+           << ",\"height\":" << demuxer.getHeight()
+           << ",\"bit_depth\":" << demuxer.getBitDepth();
+    }
+    if (opt.bCheckPrepare && opt.eBackend != BENCH_DEMUX && !checkPrepareSession(opt, os)) {
+        return 1;
+    }
+
+    std::string strError;
+    std::vector<StreamResult> vResult;
+    os << ",\"formats\":[";
+    for (size_t i = 0; i < opt.vFormat.size(); i++) {
+        int format = opt.vFormat[i];
+        if (!runStreams(opt, format, 1, vResult, strError)) {
+            __E("%s: %s\n", s_aszFormat[format], strError.c_str());
+            return 1;
+        }
+        os << (i ? "," : "");
+        appendFormatJson(os, opt.eBackend == BENCH_DEMUX ? "packets" : s_aszFormat[format], vResult[0]);
+    }
+    os << "]";
+
+    os << ",\"scaling\":[";
+    for (int nStreams = 1; ; nStreams = std::min(nStreams * 2, opt.nMaxStreams)) {
+        if (!runStreams(opt, opt.vFormat[0], nStreams, vResult, strError)) {
+            __E("%d streams: %s\n", nStreams, strError.c_str());
+            return 1;
+        }
+        os << (nStreams > 1 ? "," : "");
+        appendScalingJson(os, nStreams, vResult);
+        if (nStreams == opt.nMaxStreams) {
+            break;
+        }
+    }
+    os << "]";
+
+    os << ",\"metrics\":" << NvMetrics::snapshot().toJson() << "}\n";
+
+    if (opt.strOutput.empty()) {
+        fputs(os.str().c_str(), stdout);
+        return 0;
+    }
+    FILE *fp = fopen(opt.strOutput.c_str(), "w");
+    if (!fp || fputs(os.str().c_str(), fp) < 0 || fclose(fp)) {
+        __E("Could not write %s\n", opt.strOutput.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions opt;
+    parseCommandLine(argc, argv, opt);
+    try {
+        CheckInputFile(opt.strInput.c_str());
+        return runBench(opt);
+    } catch (std::exception &e) {
+        __E("%s\n", e.what());
+        return 1;
+    }
+}
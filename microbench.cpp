@@ -0,0 +1,895 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+#include <libavcodec/bsf.h>
+#endif
+}
+
+#include "ColorSpace.hpp"
+#include "NvAnnexB.hpp"
+#include "NvAnnexBReader.hpp"
+#include "NvCopyPipeline.hpp"
+#include "NvCudaContext.hpp"
+#include "NvMetrics.hpp"
+#include "NvStreamScheduler.hpp"
+
+#define __E(fmt, args...) fprintf(stderr, "" fmt, ## args)
+
+/* Micro-benchmarks of single demux steps, without decoding. Prints one JSON document (or writes it to -o)
+*  like nvh264_bench, with per test the best and median of --passes runs over the same input.
+*  annexb: the video packets of an mp4/mkv/flv H.264 or HEVC input, read into memory once, converted to
+*  Annex-B by NvAnnexBConverter and by the h264_mp4toannexb / hevc_mp4toannexb bitstream filter. Every
+*  pass converts fresh copies of the packets, made outside the timed part.
+*  startcode: GB/s of every NvFindStartCode() implementation the CPU supports, over the input in memory.
+*  es: a raw .h264/.h265 stream split into access units by NvAnnexBReader and by libavformat (probing and
+*  its parser, as FFmpegDemuxer does it), each opened anew per pass.
+*  scheduler: no input and no GPU; NvStreamScheduler placing streams on NvSimCapacityModel GPUs, every
+*  placement and load checked against the expected one. Exits 1 on a mismatch.
+*  copy: no input and no GPU; NvCopyPipeline over NvCpuCopyEngine for 2 and 3 stages and several copy
+*  latencies, frames of changing sizes checked for submission order and contents. Exits 1 on a mismatch.
+*  colorspace: no input, GPU 0; every CPU twin in ColorSpace.hpp against its CUDA kernel on random surfaces
+*  of odd sizes and pitches, for each surface format, matrix, range, layout and depth, and pyramid levels
+*  down to 1x1. The outputs must match byte for byte, padding included. Exits 1 on a mismatch.
+*  deinterleave: no input, GPU 0; NV12/P016 -> I420 of 1080p and 2160p surfaces on the CPU (Nv12ToI420Cpu)
+*  against the kernel, alone and with the device-to-host copy a host frame needs. Outputs are compared once.
+*/
+
+struct MicroOptions {
+    std::string strInput;
+    std::string strOutput;
+    std::string strTest = "annexb";
+    int nPasses = 5;
+    int nMaxPackets = 0;    // 0 reads the whole input
+};
+
+struct PassResult {
+    std::vector<double> vMs;
+    uint64_t nOutputBytes = 0;
+    uint64_t nFailed = 0;
+};
+
+static double getMedian(std::vector<double> v)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+
+/* strExtra: more ",\"key\":value" fields */
+static void appendTestJson(std::ostringstream &os, const char *szName, const PassResult &r, uint64_t nPackets,
+                           uint64_t nBytes, const std::string &strExtra = "")
+{
+    double fBestMs = r.vMs.empty() ? 0 : *std::min_element(r.vMs.begin(), r.vMs.end());
+    os << "{\"test\":\"" << szName << "\""
+       << ",\"best_ms\":" << fBestMs
+       << ",\"median_ms\":" << getMedian(r.vMs)
+       << ",\"ns_per_packet\":" << (nPackets ? fBestMs * 1e6 / nPackets : 0)
+       << ",\"mb_per_s\":" << (fBestMs > 0 ? nBytes / 1e3 / fBestMs : 0)
+       << ",\"output_bytes\":" << r.nOutputBytes
+       << ",\"failed\":" << r.nFailed
+       << strExtra
+       << "}";
+}
+
+static void freePackets(std::vector<AVPacket *> &vPacket)
+{
+    for (AVPacket *p : vPacket) {
+        av_packet_free(&p);
+    }
+    vPacket.clear();
+}
+
+/* Packets with a buffer of their own each, as av_read_frame() returns them */
+static bool copyPackets(const std::vector<AVPacket *> &vSrc, std::vector<AVPacket *> &vDst)
+{
+    freePackets(vDst);
+    for (const AVPacket *pSrc : vSrc) {
+        AVPacket *p = av_packet_alloc();
+        if (!p || av_new_packet(p, pSrc->size) < 0) {
+            av_packet_free(&p);
+            return false;
+        }
+        memcpy(p->data, pSrc->data, (size_t)pSrc->size);
+        av_packet_copy_props(p, pSrc);
+        vDst.push_back(p);
+    }
+    return true;
+}
+
+static bool readFile(const char *szPath, std::vector<uint8_t> &vData)
+{
+    FILE *fp = fopen(szPath, "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t aBuf[1 << 16];
+    size_t n;
+    while ((n = fread(aBuf, 1, sizeof(aBuf), fp)) > 0) {
+        vData.insert(vData.end(), aBuf, aBuf + n);
+    }
+    bool bOk = !ferror(fp);
+    fclose(fp);
+    return bOk;
+}
+
+static bool runStartCode(const MicroOptions &opt, std::ostringstream &os)
+{
+    std::vector<uint8_t> vData;
+    if (!readFile(opt.strInput.c_str(), vData)) {
+        __E("Could not read %s\n", opt.strInput.c_str());
+        return false;
+    }
+    const uint8_t *pBegin = vData.data(), *pEnd = vData.data() + vData.size();
+
+    os << ",\"bytes\":" << vData.size() << ",\"tests\":[";
+    bool bFirst = true;
+    for (int e = NV_SCANNER_SCALAR; e < NV_SCANNER_COUNT; e++) {
+        NvStartCodeScanner eScanner = (NvStartCodeScanner)e;
+        if (!NvIsStartCodeScannerSupported(eScanner)) {
+            continue;
+        }
+        std::vector<double> vMs;
+        uint64_t nStartCodes = 0;
+        for (int iPass = 0; iPass < opt.nPasses; iPass++) {
+            nStartCodes = 0;
+            uint64_t nStart = NvMetrics::now();
+            for (const uint8_t *p = NvFindStartCodeWith(eScanner, pBegin, pEnd); p < pEnd;
+                 p = NvFindStartCodeWith(eScanner, p + 3, pEnd)) {
+                nStartCodes++;
+            }
+            vMs.push_back((NvMetrics::now() - nStart) / 1e6);
+        }
+        double fBestMs = *std::min_element(vMs.begin(), vMs.end());
+        os << (bFirst ? "" : ",")
+           << "{\"test\":\"startcode_" << NvGetStartCodeScannerName(eScanner) << "\""
+           << ",\"best_ms\":" << fBestMs
+           << ",\"median_ms\":" << getMedian(vMs)
+           << ",\"gb_per_s\":" << (fBestMs > 0 ? vData.size() / 1e6 / fBestMs : 0)
+           << ",\"start_codes\":" << nStartCodes
+           << "}";
+        bFirst = false;
+    }
+    os << "]";
+    return true;
+}
+
+static bool runElementaryStream(const MicroOptions &opt, std::ostringstream &os)
+{
+    PassResult reader, lavf;
+    std::vector<double> vReaderOpenMs, vLavfOpenMs;
+    uint64_t nBytes = 0, nReaderUnits = 0, nLavfPackets = 0;
+    for (int iPass = 0; iPass < opt.nPasses; iPass++) {
+        uint64_t nStart = NvMetrics::now();
+        NvAnnexBReader *pReader = NvAnnexBReader::open(opt.strInput.c_str());
+        if (!pReader) {
+            return false;
+        }
+        vReaderOpenMs.push_back((NvMetrics::now() - nStart) / 1e6);
+        nBytes = pReader->getSize();
+        nReaderUnits = 0;
+        reader.nOutputBytes = 0;
+        uint8_t *pVideo = NULL;
+        uint32_t nVideoBytes = 0;
+        nStart = NvMetrics::now();
+        while ((!opt.nMaxPackets || nReaderUnits < (uint64_t)opt.nMaxPackets) &&
+               pReader->demux(&pVideo, &nVideoBytes)) {
+            nReaderUnits++;
+            reader.nOutputBytes += nVideoBytes;
+        }
+        reader.vMs.push_back((NvMetrics::now() - nStart) / 1e6);
+        delete pReader;
+
+        nStart = NvMetrics::now();
+        AVFormatContext *av = NULL;
+        if (avformat_open_input(&av, opt.strInput.c_str(), NULL, NULL) < 0 ||
+            avformat_find_stream_info(av, NULL) < 0) {
+            __E("Could not open %s\n", opt.strInput.c_str());
+            avformat_close_input(&av);
+            return false;
+        }
+        int v_idx = av_find_best_stream(av, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        vLavfOpenMs.push_back((NvMetrics::now() - nStart) / 1e6);
+        nLavfPackets = 0;
+        lavf.nOutputBytes = 0;
+        AVPacket *pkt = av_packet_alloc();
+        nStart = NvMetrics::now();
+        while ((!opt.nMaxPackets || nLavfPackets < (uint64_t)opt.nMaxPackets) && av_read_frame(av, pkt) >= 0) {
+            if (pkt->stream_index == v_idx) {
+                nLavfPackets++;
+                lavf.nOutputBytes += (uint64_t)pkt->size;
+            }
+            av_packet_unref(pkt);
+        }
+        lavf.vMs.push_back((NvMetrics::now() - nStart) / 1e6);
+        av_packet_free(&pkt);
+        avformat_close_input(&av);
+    }
+
+    os << ",\"bytes\":" << nBytes << ",\"tests\":[";
+    std::ostringstream extra;
+    extra << ",\"open_ms\":" << *std::min_element(vReaderOpenMs.begin(), vReaderOpenMs.end())
+          << ",\"packets\":" << nReaderUnits;
+    appendTestJson(os, "es_reader", reader, nReaderUnits, nBytes, extra.str());
+    extra.str("");
+    extra << ",\"open_ms\":" << *std::min_element(vLavfOpenMs.begin(), vLavfOpenMs.end())
+          << ",\"packets\":" << nLavfPackets;
+    os << ",";
+    appendTestJson(os, "es_libavformat", lavf, nLavfPackets, nBytes, extra.str());
+    os << "]";
+    return true;
+}
+
+static bool runAnnexB(const MicroOptions &opt, std::ostringstream &os)
+{
+    AVFormatContext *av = NULL;
+    if (avformat_open_input(&av, opt.strInput.c_str(), NULL, NULL) < 0 || avformat_find_stream_info(av, NULL) < 0) {
+        __E("Could not open %s\n", opt.strInput.c_str());
+        avformat_close_input(&av);
+        return false;
+    }
+    int v_idx = av_find_best_stream(av, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    AVCodecParameters *par = v_idx >= 0 ? av->streams[v_idx]->codecpar : NULL;
+    NvAnnexBConverter annexb;
+    if (!par || !annexb.init(par->codec_id, par->extradata, par->extradata_size > 0 ? par->extradata_size : 0)) {
+        __E("%s: no length-prefixed H.264 or HEVC stream\n", opt.strInput.c_str());
+        avformat_close_input(&av);
+        return false;
+    }
+    const AVBitStreamFilter *bsf =
+        av_bsf_get_by_name(par->codec_id == AV_CODEC_ID_H264 ? "h264_mp4toannexb" : "hevc_mp4toannexb");
+    AVBSFContext *bsfc = NULL;
+    if (!bsf || av_bsf_alloc(bsf, &bsfc) < 0 || avcodec_parameters_copy(bsfc->par_in, par) < 0 ||
+        av_bsf_init(bsfc) < 0) {
+        __E("Could not set up the bitstream filter\n");
+        av_bsf_free(&bsfc);
+        avformat_close_input(&av);
+        return false;
+    }
+
+    std::vector<AVPacket *> vSrc;
+    uint64_t nBytes = 0;
+    AVPacket *pkt = av_packet_alloc();
+    while ((!opt.nMaxPackets || vSrc.size() < (size_t)opt.nMaxPackets) && av_read_frame(av, pkt) >= 0) {
+        if (pkt->stream_index == v_idx) {
+            nBytes += (uint64_t)pkt->size;
+            vSrc.push_back(av_packet_alloc());
+            av_packet_move_ref(vSrc.back(), pkt);
+        }
+        av_packet_unref(pkt);
+    }
+
+    PassResult inPlace, filter;
+    std::vector<AVPacket *> vPacket;
+    bool bOk = true;
+    for (int iPass = 0; bOk && iPass < opt.nPasses; iPass++) {
+        // the converter only handles 4-byte NAL lengths, FFmpegDemuxer keeps the filter for the others
+        if (annexb.isInPlace()) {
+            bOk = copyPackets(vSrc, vPacket);
+            uint64_t nStart = NvMetrics::now();
+            for (AVPacket *p : vPacket) {
+                if (!annexb.convert(p)) {
+                    inPlace.nFailed++;
+                }
+            }
+            inPlace.vMs.push_back((NvMetrics::now() - nStart) / 1e6);
+            inPlace.nOutputBytes = 0;
+            for (AVPacket *p : vPacket) {
+                inPlace.nOutputBytes += (uint64_t)p->size;
+            }
+        }
+
+        bOk = bOk && copyPackets(vSrc, vPacket);
+        av_bsf_flush(bsfc);
+        filter.nOutputBytes = 0;
+        uint64_t nStart = NvMetrics::now();
+        for (AVPacket *p : vPacket) {
+            if (av_bsf_send_packet(bsfc, p) < 0 || av_bsf_receive_packet(bsfc, pkt) < 0) {
+                filter.nFailed++;
+                continue;
+            }
+            filter.nOutputBytes += (uint64_t)pkt->size;
+            av_packet_unref(pkt);
+        }
+        filter.vMs.push_back((NvMetrics::now() - nStart) / 1e6);
+    }
+
+    os << ",\"codec\":\"" << avcodec_get_name(par->codec_id) << "\""
+       << ",\"nal_length_size\":" << annexb.getLengthSize()
+       << ",\"packets\":" << vSrc.size()
+       << ",\"bytes\":" << nBytes
+       << ",\"tests\":[";
+    if (annexb.isInPlace()) {
+        appendTestJson(os, "annexb_in_place", inPlace, vSrc.size(), nBytes);
+        os << ",";
+    }
+    appendTestJson(os, "annexb_bsf", filter, vSrc.size(), nBytes);
+    os << "]";
+
+    freePackets(vPacket);
+    freePackets(vSrc);
+    av_packet_free(&pkt);
+    av_bsf_free(&bsfc);
+    avformat_close_input(&av);
+    if (!bOk) {
+        __E("Out of memory copying packets\n");
+    }
+    return bOk;
+}
+
+/* One admission against the expected placement, failures are counted in *pnFailed */
+static int admitStream(NvStreamScheduler &scheduler, const char *szName, int nWidth, int nHeight, double fps,
+                       cudaVideoChromaFormat eChromaFormat, int nBitDepthMinus8, int nExpected, int *pnFailed)
+{
+    NvStreamScheduler::StreamDesc desc;
+    desc.eCodec          = cudaVideoCodec_HEVC;
+    desc.eChromaFormat   = eChromaFormat;
+    desc.nBitDepthMinus8 = nBitDepthMinus8;
+    desc.nWidth          = nWidth;
+    desc.nHeight         = nHeight;
+    desc.fps             = fps;
+    int placement = NvStreamScheduler::PLACE_REJECTED;
+    int sessionId = scheduler.admit(desc, &placement);
+    if (placement != nExpected || (sessionId < 0) != (nExpected == NvStreamScheduler::PLACE_REJECTED)) {
+        __E("scheduler: %s placed on %d, expected %d\n", szName, placement, nExpected);
+        (*pnFailed)++;
+    }
+    return sessionId;
+}
+
+static void checkLoad(NvStreamScheduler &scheduler, int placement, uint64_t nExpected, int *pnFailed)
+{
+    uint64_t nLoad = scheduler.getLoadMBPerSec(placement);
+    if (nLoad != nExpected) {
+        __E("scheduler: load of %d is %llu MB/s, expected %llu\n", placement, (unsigned long long)nLoad,
+            (unsigned long long)nExpected);
+        (*pnFailed)++;
+    }
+}
+
+static bool runScheduler(const MicroOptions &opt, std::ostringstream &os)
+{
+    const int CPU = NvStreamScheduler::PLACE_CPU, REJECTED = NvStreamScheduler::PLACE_REJECTED;
+    const uint64_t n1080p30 = NvStreamScheduler::getMBPerSec(1920, 1080, 30);
+
+    // gpu 0: 8-bit/10-bit 4:2:0 up to 4K, three 1080p30 streams; gpu 1: 12-bit and 4:4:4 up to 8K, two
+    NvSimCapacityModel *pModel = new NvSimCapacityModel();
+    pModel->addGpu({4096, 4096, 65536, 3 * n1080p30, 2, false});
+    pModel->addGpu({8192, 8192, 262144, 2 * n1080p30, 4, true});
+    NvStreamScheduler scheduler(pModel, 2 * n1080p30);
+
+    int nFailed = 0;
+    uint64_t nStart = NvMetrics::now();
+    // least loaded relative to the budget: 1/3 against 1/2, then 2/3 against 1/2, then 2/3 against 1
+    int a = admitStream(scheduler, "1080p30 a", 1920, 1080, 30, cudaVideoChromaFormat_420, 0, 0, &nFailed);
+    int b = admitStream(scheduler, "1080p30 b", 1920, 1080, 30, cudaVideoChromaFormat_420, 0, 1, &nFailed);
+    admitStream(scheduler, "1080p30 c", 1920, 1080, 30, cudaVideoChromaFormat_420, 2, 0, &nFailed);
+    // only gpu 1 decodes 4:4:4, and a budget filled exactly still admits
+    admitStream(scheduler, "444 1080p30", 1920, 1080, 30, cudaVideoChromaFormat_444, 0, 1, &nFailed);
+    checkLoad(scheduler, 0, 2 * n1080p30, &nFailed);
+    checkLoad(scheduler, 1, 2 * n1080p30, &nFailed);
+    // gpu 0 has one slot left; the 12-bit stream only fits gpu 1's caps, which is full
+    admitStream(scheduler, "1080p30 d", 1920, 1080, 30, cudaVideoChromaFormat_420, 0, 0, &nFailed);
+    int e = admitStream(scheduler, "12-bit 1080p30", 1920, 1080, 30, cudaVideoChromaFormat_420, 4, CPU, &nFailed);
+    // 8K is over gpu 0's size and gpu 1's budget, and over the CPU's budget as well
+    admitStream(scheduler, "8K30", 7680, 4320, 30, cudaVideoChromaFormat_420, 0, REJECTED, &nFailed);
+    admitStream(scheduler, "1080p30 f", 1920, 1080, 30, cudaVideoChromaFormat_420, 0, CPU, &nFailed);
+    admitStream(scheduler, "1080p30 g", 1920, 1080, 30, cudaVideoChromaFormat_420, 0, REJECTED, &nFailed);
+    checkLoad(scheduler, CPU, 2 * n1080p30, &nFailed);
+
+    // a released session frees its GPU; a measured rate below the declared one frees nothing, one above holds more
+    scheduler.release(a);
+    admitStream(scheduler, "1080p30 h", 1920, 1080, 30, cudaVideoChromaFormat_420, 0, 0, &nFailed);
+    scheduler.reportFrames(b, 15, 1.0);
+    checkLoad(scheduler, 1, 2 * n1080p30, &nFailed);
+    admitStream(scheduler, "1080p15", 1920, 1080, 15, cudaVideoChromaFormat_420, 0, REJECTED, &nFailed);
+    scheduler.reportFrames(b, 60, 1.0);
+    checkLoad(scheduler, 1, 3 * n1080p30, &nFailed);
+    scheduler.reportFrames(b, 0, 1.0);
+    checkLoad(scheduler, 1, 2 * n1080p30, &nFailed);
+    scheduler.release(e);
+    checkLoad(scheduler, CPU, n1080p30, &nFailed);
+    admitStream(scheduler, "1080p15 b", 1920, 1080, 15, cudaVideoChromaFormat_420, 0, CPU, &nFailed);
+    checkLoad(scheduler, CPU, n1080p30 + n1080p30 / 2, &nFailed);
+
+    NvStreamScheduler::Stats stats = scheduler.getStats();
+    if (stats.nGpuSessions != 5 || stats.nCpuSessions != 2 || stats.nAdmitted != 9 || stats.nSpilled != 3 ||
+        stats.nRejected != 3) {
+        __E("scheduler: stats %d gpu %d cpu sessions, %llu admitted %llu spilled %llu rejected\n",
+            stats.nGpuSessions, stats.nCpuSessions, (unsigned long long)stats.nAdmitted,
+            (unsigned long long)stats.nSpilled, (unsigned long long)stats.nRejected);
+        nFailed++;
+    }
+    double fMs = (NvMetrics::now() - nStart) / 1e6;
+
+    os << ",\"tests\":[{\"test\":\"scheduler_sim\""
+       << ",\"ms\":" << fMs
+       << ",\"failed\":" << nFailed
+       << "}]";
+    return nFailed == 0;
+}
+
+static uint8_t getCopyPattern(int iFrame, size_t i)
+{
+    return (uint8_t)(iFrame * 131 + i * 7 + (i >> 8));
+}
+
+/* Sizes go up and down, so stages are regrown while others are in flight */
+static size_t getCopySize(int iFrame, int *pnPitch, int *pnRows)
+{
+    *pnPitch = 256 + 64 * (iFrame % 5);
+    *pnRows = 32 + 16 * ((iFrame * 3) % 7);
+    return (size_t)*pnPitch * *pnRows;
+}
+
+/* nFrames through one pipeline, polled after every submit as NvDecoder does; returns the failures */
+static int runCopyCase(int nStages, int nLatency, int nFrames, double *pfMs)
+{
+    NvFramePool pool([](size_t *pnBytes, size_t *) { return new uint8_t[*pnBytes]; }, [](uint8_t *p) { delete[] p; });
+    std::vector<NvFrame> vDone;
+    NvCpuCopyEngine *pEngine = new NvCpuCopyEngine(nLatency);
+    NvCopyPipeline pipeline(pEngine, nStages);
+
+    int nFailed = 0;
+    uint64_t nStart = NvMetrics::now();
+    for (int i = 0; i < nFrames; i++) {
+        int nPitch, nRows;
+        size_t nBytes = getCopySize(i, &nPitch, &nRows);
+        NvCopyPipeline::Stage *pStage = pipeline.acquireStage(nBytes, vDone);
+        for (size_t j = 0; j < nBytes; j++) {
+            pStage->pData[j] = getCopyPattern(i, j);
+        }
+        NvFrame frame = pool.acquire(nBytes);
+        frame.setTimestamp(i);
+        pipeline.submit(pStage, std::move(frame), nPitch, nRows);
+        if (pipeline.getNumInFlight() > nStages) {
+            __E("copy: %d copies in flight with %d stages\n", pipeline.getNumInFlight(), nStages);
+            nFailed++;
+        }
+        pipeline.poll(vDone);
+    }
+    pipeline.flush(vDone);
+    *pfMs = (NvMetrics::now() - nStart) / 1e6;
+
+    if ((int)vDone.size() != nFrames || pEngine->getNumCopies() != (uint64_t)nFrames) {
+        __E("copy: %d frames out, %llu copies, %d submitted\n", (int)vDone.size(),
+            (unsigned long long)pEngine->getNumCopies(), nFrames);
+        nFailed++;
+    }
+    for (int i = 0; i < (int)vDone.size(); i++) {
+        if (vDone[i].timestamp() != i) {
+            __E("copy: frame %d out as %lld, stages %d latency %d\n", i, (long long)vDone[i].timestamp(), nStages,
+                nLatency);
+            nFailed++;
+            continue;
+        }
+        int nPitch, nRows;
+        size_t nBytes = getCopySize(i, &nPitch, &nRows);
+        for (size_t j = 0; j < nBytes; j++) {
+            if (vDone[i].data()[j] != getCopyPattern(i, j)) {
+                __E("copy: frame %d differs at byte %zu, stages %d latency %d\n", i, j, nStages, nLatency);
+                nFailed++;
+                break;
+            }
+        }
+    }
+    return nFailed;
+}
+
+static bool runCopy(const MicroOptions &opt, std::ostringstream &os)
+{
+    const int nFrames = 64;
+    int nFailed = 0;
+    os << ",\"tests\":[";
+    bool bFirst = true;
+    for (int nStages = 2; nStages <= 3; nStages++) {
+        // 0: every copy is done when first polled; higher: copies pile up until a stage has to be waited for
+        for (int nLatency : {0, 1, 4}) {
+            double fMs = 0;
+            int nCaseFailed = runCopyCase(nStages, nLatency, nFrames, &fMs);
+            os << (bFirst ? "" : ",")
+               << "{\"test\":\"copy_cpu\""
+               << ",\"stages\":" << nStages
+               << ",\"latency\":" << nLatency
+               << ",\"frames\":" << nFrames
+               << ",\"ms\":" << fMs
+               << ",\"failed\":" << nCaseFailed
+               << "}";
+            bFirst = false;
+            nFailed += nCaseFailed;
+        }
+    }
+    os << "]";
+    return nFailed == 0;
+}
+
+/**
+* @brief One CPU twin against its kernel: the same source on both sides and destinations prefilled alike,
+* so bytes a side must not write are compared as well. Buffers are sized once for the largest case, a case
+* prefills and compares the first nBytes: its rows of output, three planes at most, and one row past them.
+*/
+struct TwinBuffers {
+    std::vector<uint8_t> vSrc, vCpu, vGpu;
+    CUdeviceptr dSrc = 0, dDst = 0;
+    int nCases = 0, nFailed = 0;
+
+    TwinBuffers(size_t nSrcBytes, size_t nDstBytes) : vSrc(nSrcBytes), vCpu(nDstBytes), vGpu(nDstBytes) {
+        if (cuMemAlloc(&dSrc, nSrcBytes) != CUDA_SUCCESS || cuMemAlloc(&dDst, nDstBytes) != CUDA_SUCCESS) {
+            dDst = 0;
+        }
+    }
+    ~TwinBuffers() {
+        if (dSrc) cuMemFree(dSrc);
+        if (dDst) cuMemFree(dDst);
+    }
+
+    void randomize(std::mt19937 &rng) {
+        for (uint8_t &b : vSrc) {
+            b = (uint8_t)rng();
+        }
+        upload();
+    }
+    void upload() { cuMemcpyHtoD(dSrc, vSrc.data(), vSrc.size()); }
+    void prefill(size_t nBytes) {
+        std::fill(vCpu.begin(), vCpu.begin() + nBytes, 0xcd);
+        cuMemsetD8(dDst, 0xcd, nBytes);
+    }
+    const uint8_t *gpuSrc(size_t nOffset = 0) { return (const uint8_t *)dSrc + nOffset; }
+    uint8_t *gpuDst() { return (uint8_t *)dDst; }
+
+    /* After both sides ran: the kernel's output against the CPU's */
+    void compare(const std::string &strCase, size_t nBytes) {
+        nCases++;
+        CUresult e = cuCtxSynchronize();
+        if (e == CUDA_SUCCESS) {
+            e = cuMemcpyDtoH(vGpu.data(), dDst, nBytes);
+        }
+        if (e != CUDA_SUCCESS) {
+            __E("colorspace: %s: CUDA error %d\n", strCase.c_str(), (int)e);
+            nFailed++;
+            return;
+        }
+        auto it = std::mismatch(vCpu.begin(), vCpu.begin() + nBytes, vGpu.begin());
+        if (it.first != vCpu.begin() + nBytes) {
+            __E("colorspace: %s differs at byte %lld, cpu %d gpu %d\n", strCase.c_str(),
+                (long long)(it.first - vCpu.begin()), *it.first, *it.second);
+            nFailed++;
+        }
+    }
+};
+
+static bool runColorSpace(const MicroOptions &opt, std::ostringstream &os)
+{
+    CUcontext ctx = NvCudaContextRegistry::get(0);
+    if (!ctx || cuCtxPushCurrent(ctx) != CUDA_SUCCESS) {
+        __E("colorspace: needs a CUDA device\n");
+        return false;
+    }
+
+    // w x h; surface pitches are padded past the even width by nPad samples, odd for 8-bit surfaces
+    struct Size { int w, h, nPad; };
+    const Size aSize[] = { {64, 32, 0}, {97, 53, 3}, {1, 1, 1}, {322, 181, 17} };
+    const int aMatrix[] = { ColorSpaceStandard_BT709, ColorSpaceStandard_FCC, ColorSpaceStandard_BT601,
+                            ColorSpaceStandard_SMPTE240M, ColorSpaceStandard_BT2020 };
+    const YuvFormat aFormat[] = { YUV_NV12, YUV_P016, YUV_444, YUV_444P16 };
+    const char *aszFormat[] = { "nv12", "p016", "444", "444p16" };
+    const char *aszDepth[] = { "8u", "16u", "16f" };
+    // three full-size planes of 16-bit samples, and four 16-bit channels of output, at the largest pitch
+    const size_t nMaxPitch = 2 * (340 + 17) * 4;
+    TwinBuffers buf(nMaxPitch * 181 * 3, nMaxPitch * 181 * 3);
+    if (!buf.dDst) {
+        __E("colorspace: out of device memory\n");
+        cuCtxPopCurrent(NULL);
+        return false;
+    }
+    std::mt19937 rng(1);
+
+    uint64_t nStart = NvMetrics::now();
+    char szCase[128];
+    for (const Size &size : aSize) {
+        int w = size.w, h = size.h;
+        for (int f = 0; f < 4; f++) {
+            YuvFormat eFormat = aFormat[f];
+            int nBPP = IsYuv16(eFormat) ? 2 : 1;
+            int nSrcPitch = (((w + 1) & ~1) + size.nPad) * nBPP;
+            // U and V (or the UV plane) follow at whole planes, see NvDecoder::convertFrame()
+            const uint8_t *pY = buf.vSrc.data();
+            const uint8_t *pU = pY + (size_t)nSrcPitch * h;
+            const uint8_t *pV = eFormat == YUV_444 || eFormat == YUV_444P16 ? pU + (size_t)nSrcPitch * h : NULL;
+            const uint8_t *dpY = buf.gpuSrc(), *dpU = buf.gpuSrc(pU - pY);
+            const uint8_t *dpV = pV ? buf.gpuSrc(pV - pY) : NULL;
+            buf.randomize(rng);
+
+            for (int iMatrix : aMatrix) {
+                for (int bFullRange = 0; bFullRange < 2; bFullRange++) {
+                    YuvToRgbCoeff coeff = GetYuvToRgbCoeff(iMatrix, bFullRange, nBPP == 2 ? 16 : 8);
+                    for (int l = RGB_PLANAR; l <= BGRA_INTERLEAVED; l++) {
+                        RgbLayout eLayout = (RgbLayout)l;
+                        if (eFormat == YUV_NV12) {
+                            int nDstPitch = w * RgbChannels(eLayout) + size.nPad;
+                            size_t nBytes = (size_t)nDstPitch * (3 * h + 1);
+                            snprintf(szCase, sizeof(szCase), "Nv12ToRgb %dx%d matrix %d full %d layout %d", w, h,
+                                     iMatrix, bFullRange, l);
+                            buf.prefill(nBytes);
+                            Nv12ToRgbCpu(pY, pU, nSrcPitch, buf.vCpu.data(), nDstPitch, w, h, eLayout, coeff);
+                            Nv12ToRgb(dpY, dpU, nSrcPitch, buf.gpuDst(), nDstPitch, w, h, eLayout, coeff);
+                            buf.compare(szCase, nBytes);
+                        }
+                        for (int d = RGB_8U; d <= RGB_16F; d++) {
+                            RgbDepth eDepth = (RgbDepth)d;
+                            int nDstPitch = (w * RgbChannels(eLayout) + size.nPad) * RgbSampleSize(eDepth);
+                            size_t nBytes = (size_t)nDstPitch * (3 * h + 1);
+                            snprintf(szCase, sizeof(szCase), "YuvToRgb %s %dx%d matrix %d full %d layout %d %s",
+                                     aszFormat[f], w, h, iMatrix, bFullRange, l, aszDepth[d]);
+                            buf.prefill(nBytes);
+                            YuvToRgbCpu(eFormat, pY, pU, pV, nSrcPitch, buf.vCpu.data(), nDstPitch, w, h, eLayout,
+                                        eDepth, coeff);
+                            YuvToRgb(eFormat, dpY, dpU, dpV, nSrcPitch, buf.gpuDst(), nDstPitch, w, h, eLayout,
+                                     eDepth, coeff);
+                            buf.compare(szCase, nBytes);
+                        }
+                    }
+                }
+            }
+
+            // down to a third and up to twice the size, odd both ways
+            const Dim aDim[] = { {(w + 2) / 3, (h + 2) / 3}, {2 * w + 1, 2 * h - 1}, {w, h} };
+            for (const Dim &dim : aDim) {
+                if (dim.w > 340 || dim.h > 181 || dim.h < 1) {
+                    continue;
+                }
+                int nDstPitch = (((dim.w + 1) & ~1) + size.nPad) * nBPP;
+                size_t nBytes = (size_t)nDstPitch * (3 * dim.h + 1);
+                snprintf(szCase, sizeof(szCase), "ResizeYuv %s %dx%d to %dx%d", aszFormat[f], w, h, dim.w, dim.h);
+                buf.prefill(nBytes);
+                ResizeYuvCpu(eFormat, pY, pU, pV, nSrcPitch, w, h, buf.vCpu.data(), nDstPitch, dim.w, dim.h);
+                ResizeYuv(eFormat, dpY, dpU, dpV, nSrcPitch, w, h, buf.gpuDst(), nDstPitch, dim.w, dim.h);
+                buf.compare(szCase, nBytes);
+            }
+
+            if (eFormat == YUV_NV12 || eFormat == YUV_P016) {
+                // whole chroma pairs per I420 row, see Nv12ToI420()
+                int nDstPitch = (((w + 1) & ~1) + 2 * size.nPad) * nBPP;
+                size_t nBytes = (size_t)nDstPitch * (3 * h + 1);
+                snprintf(szCase, sizeof(szCase), "Nv12ToI420 %s %dx%d", aszFormat[f], w, h);
+                buf.prefill(nBytes);
+                Nv12ToI420Cpu(pY, pU, nSrcPitch, buf.vCpu.data(), nDstPitch, w, h, nBPP);
+                Nv12ToI420(dpY, dpU, nSrcPitch, buf.gpuDst(), nDstPitch, w, h, nBPP);
+                buf.compare(szCase, nBytes);
+            }
+        }
+
+        // pyramid levels as NvDecoder::buildPyramid() makes them: each from the one before, to 1x1 at most
+        for (int nSampleBytes = 1; nSampleBytes <= 2; nSampleBytes++) {
+            for (int nChannels = 1; nChannels <= 3; nChannels++) {
+                buf.randomize(rng);
+                int nSrcWidth = w, nSrcHeight = h;
+                int nSrcPitch = (w * nChannels + size.nPad) * nSampleBytes;
+                for (int i = 1; i < NV_FRAME_MAX_LEVELS && (nSrcWidth > 1 || nSrcHeight > 1); i++) {
+                    int nDstWidth = (nSrcWidth + 1) / 2, nDstHeight = (nSrcHeight + 1) / 2;
+                    int nDstPitch = (nDstWidth * nChannels + size.nPad) * nSampleBytes;
+                    size_t nBytes = (size_t)nDstPitch * (nDstHeight + 1);
+                    snprintf(szCase, sizeof(szCase), "Downsample2x %dx%d x%d %d-byte level %d", w, h, nChannels,
+                             nSampleBytes, i);
+                    buf.prefill(nBytes);
+                    Downsample2xCpu(buf.vSrc.data(), nSrcPitch, nSrcWidth, nSrcHeight, buf.vCpu.data(), nDstPitch,
+                                    nDstWidth, nDstHeight, nChannels, nSampleBytes);
+                    Downsample2x(buf.gpuSrc(), nSrcPitch, nSrcWidth, nSrcHeight, buf.gpuDst(), nDstPitch,
+                                 nDstWidth, nDstHeight, nChannels, nSampleBytes);
+                    buf.compare(szCase, nBytes);
+                    // the next level is made from this one
+                    std::copy(buf.vCpu.begin(), buf.vCpu.begin() + (size_t)nDstPitch * nDstHeight, buf.vSrc.begin());
+                    buf.upload();
+                    nSrcWidth = nDstWidth;
+                    nSrcHeight = nDstHeight;
+                    nSrcPitch = nDstPitch;
+                }
+            }
+        }
+    }
+    double fMs = (NvMetrics::now() - nStart) / 1e6;
+    cuCtxPopCurrent(NULL);
+
+    os << ",\"tests\":[{\"test\":\"colorspace_twins\""
+       << ",\"ms\":" << fMs
+       << ",\"cases\":" << buf.nCases
+       << ",\"failed\":" << buf.nFailed
+       << "}]";
+    return buf.nFailed == 0;
+}
+
+/* strExtra: more ",\"key\":value" fields */
+static void appendTimingJson(std::ostringstream &os, const char *szName, const std::vector<double> &vMs,
+                             uint64_t nBytes, const std::string &strExtra)
+{
+    double fBestMs = *std::min_element(vMs.begin(), vMs.end());
+    os << "{\"test\":\"" << szName << "\""
+       << ",\"best_ms\":" << fBestMs
+       << ",\"median_ms\":" << getMedian(vMs)
+       << ",\"gb_per_s\":" << (fBestMs > 0 ? nBytes / 1e6 / fBestMs : 0)
+       << strExtra
+       << "}";
+}
+
+static bool runDeinterleave(const MicroOptions &opt, std::ostringstream &os)
+{
+    CUcontext ctx = NvCudaContextRegistry::get(0);
+    if (!ctx || cuCtxPushCurrent(ctx) != CUDA_SUCCESS) {
+        __E("deinterleave: needs a CUDA device\n");
+        return false;
+    }
+
+    struct Size { int w, h; };
+    const Size aSize[] = { {1920, 1080}, {3840, 2160} };
+    std::mt19937 rng(1);
+    bool bOk = true;
+    os << ",\"tests\":[";
+    bool bFirst = true;
+    for (const Size &size : aSize) {
+        for (int nBPP = 1; bOk && nBPP <= 2; nBPP++) {
+            int w = size.w, h = size.h;
+            // decoder surfaces are pitched, I420 frames are packed
+            int nSrcPitch = (w * nBPP + 255) & ~255;
+            int nDstPitch = w * nBPP;
+            size_t nSrcBytes = (size_t)nSrcPitch * (h + (h + 1) / 2);
+            size_t nDstBytes = (size_t)nDstPitch * (h + (h + 1) / 2);
+            std::vector<uint8_t> vSrc(nSrcBytes), vCpu(nDstBytes), vGpu(nDstBytes);
+            for (uint8_t &b : vSrc) {
+                b = (uint8_t)rng();
+            }
+            CUdeviceptr dSrc = 0, dDst = 0;
+            if (cuMemAlloc(&dSrc, nSrcBytes) != CUDA_SUCCESS || cuMemAlloc(&dDst, nDstBytes) != CUDA_SUCCESS ||
+                cuMemcpyHtoD(dSrc, vSrc.data(), nSrcBytes) != CUDA_SUCCESS) {
+                __E("deinterleave: out of device memory\n");
+                bOk = false;
+            }
+            const uint8_t *pUV = vSrc.data() + (size_t)nSrcPitch * h;
+            const uint8_t *dpY = (const uint8_t *)dSrc, *dpUV = dpY + (size_t)nSrcPitch * h;
+
+            std::vector<double> vCpuMs, vGpuMs, vGpuCopyMs;
+            // the first pass also loads the module and touches the pages, it is not timed
+            for (int iPass = -1; bOk && iPass < opt.nPasses; iPass++) {
+                uint64_t nStart = NvMetrics::now();
+                Nv12ToI420Cpu(vSrc.data(), pUV, nSrcPitch, vCpu.data(), nDstPitch, w, h, nBPP);
+                double fCpuMs = (NvMetrics::now() - nStart) / 1e6;
+
+                nStart = NvMetrics::now();
+                Nv12ToI420(dpY, dpUV, nSrcPitch, (uint8_t *)dDst, nDstPitch, w, h, nBPP);
+                bOk = cuCtxSynchronize() == CUDA_SUCCESS;
+                double fGpuMs = (NvMetrics::now() - nStart) / 1e6;
+
+                nStart = NvMetrics::now();
+                Nv12ToI420(dpY, dpUV, nSrcPitch, (uint8_t *)dDst, nDstPitch, w, h, nBPP);
+                bOk = bOk && cuMemcpyDtoH(vGpu.data(), dDst, nDstBytes) == CUDA_SUCCESS;
+                double fGpuCopyMs = (NvMetrics::now() - nStart) / 1e6;
+                if (iPass >= 0) {
+                    vCpuMs.push_back(fCpuMs);
+                    vGpuMs.push_back(fGpuMs);
+                    vGpuCopyMs.push_back(fGpuCopyMs);
+                }
+            }
+            if (dSrc) cuMemFree(dSrc);
+            if (dDst) cuMemFree(dDst);
+            if (!bOk) {
+                __E("deinterleave: CUDA error\n");
+                break;
+            }
+            bool bMatch = vCpu == vGpu;
+            if (!bMatch) {
+                __E("deinterleave: %dx%d %d-byte CPU and GPU outputs differ\n", w, h, nBPP);
+                bOk = false;
+            }
+
+            std::ostringstream extra;
+            extra << ",\"width\":" << w << ",\"height\":" << h << ",\"bpp\":" << nBPP
+                  << ",\"match\":" << (bMatch ? "true" : "false");
+            os << (bFirst ? "" : ",");
+            appendTimingJson(os, "deinterleave_cpu", vCpuMs, nDstBytes, extra.str());
+            os << ",";
+            appendTimingJson(os, "deinterleave_gpu", vGpuMs, nDstBytes, extra.str());
+            os << ",";
+            appendTimingJson(os, "deinterleave_gpu_d2h", vGpuCopyMs, nDstBytes, extra.str());
+            bFirst = false;
+        }
+    }
+    os << "]";
+    cuCtxPopCurrent(NULL);
+    return bOk;
+}
+
+static void showHelpAndExit(const char *szBadOption = NULL)
+{
+    if (szBadOption) {
+        __E("Error parsing \"%s\"\n", szBadOption);
+    }
+    __E("Options:\n"
+        "-i             Input file path\n"
+        "-o             Output JSON file path, stdout if omitted\n"
+        "--test         annexb (default): in-place Annex-B conversion against the mp4toannexb filter\n"
+        "               startcode: start code scanner throughput (GB/s) of each SIMD implementation\n"
+        "               es: raw .h264/.h265 access unit splitting, NvAnnexBReader against libavformat\n"
+        "               scheduler: stream placement on simulated GPUs, checked; needs no -i\n"
+        "               copy: staged frame copies through the CPU copy engine, checked; needs no -i\n"
+        "               colorspace: CPU conversions byte-exact against the CUDA kernels; needs no -i\n"
+        "               deinterleave: NV12 -> I420 on the CPU against the GPU kernel (and D2H); needs no -i\n"
+        "--passes       Runs per test, the best and the median are reported (default 5)\n"
+        "--packets      Video packets to read, 0 (default) reads the whole input\n");
+    exit(szBadOption ? 1 : 0);
+}
+
+static void parseCommandLine(int argc, char **argv, MicroOptions &opt)
+{
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h")) {
+            showHelpAndExit();
+        }
+        if (i + 1 >= argc) {
+            showHelpAndExit(argv[i]);
+        }
+        if (!strcmp(argv[i], "-i")) {
+            opt.strInput = argv[++i];
+        } else if (!strcmp(argv[i], "-o")) {
+            opt.strOutput = argv[++i];
+        } else if (!strcmp(argv[i], "--test")) {
+            opt.strTest = argv[++i];
+            if (opt.strTest != "annexb" && opt.strTest != "startcode" && opt.strTest != "es" &&
+                opt.strTest != "scheduler" && opt.strTest != "copy" && opt.strTest != "colorspace" &&
+                opt.strTest != "deinterleave") {
+                showHelpAndExit(argv[i]);
+            }
+        } else if (!strcmp(argv[i], "--passes")) {
+            opt.nPasses = std::max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--packets")) {
+            opt.nMaxPackets = std::max(atoi(argv[++i]), 0);
+        } else {
+            showHelpAndExit(argv[i]);
+        }
+    }
+    if (opt.strInput.empty() && (opt.strTest == "annexb" || opt.strTest == "startcode" || opt.strTest == "es")) {
+        showHelpAndExit();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    MicroOptions opt;
+    parseCommandLine(argc, argv, opt);
+
+    std::ostringstream os;
+    os << "{\"input\":\"" << opt.strInput << "\""
+       << ",\"test\":\"" << opt.strTest << "\""
+       << ",\"passes\":" << opt.nPasses;
+    bool bOk = opt.strTest == "startcode"    ? runStartCode(opt, os)
+             : opt.strTest == "es"           ? runElementaryStream(opt, os)
+             : opt.strTest == "scheduler"    ? runScheduler(opt, os)
+             : opt.strTest == "copy"         ? runCopy(opt, os)
+             : opt.strTest == "colorspace"   ? runColorSpace(opt, os)
+             : opt.strTest == "deinterleave" ? runDeinterleave(opt, os)
+                                             : runAnnexB(opt, os);
+    if (!bOk) {
+        return 1;
+    }
+    os << "}\n";
+
+    if (opt.strOutput.empty()) {
+        fputs(os.str().c_str(), stdout);
+        return 0;
+    }
+    FILE *fp = fopen(opt.strOutput.c_str(), "w");
+    if (!fp || fputs(os.str().c_str(), fp) < 0 || fclose(fp)) {
+        __E("Could not write %s\n", opt.strOutput.c_str());
+        return 1;
+    }
+    return 0;
+}